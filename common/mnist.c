@@ -0,0 +1,1022 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_model.h"
+#include "../include/mnist_backend.h"
+#include "../include/mnist_pipeline.h"
+#include "../include/mnist_stream.h"
+#include "../include/mnist_sampler.h"
+#include "../include/mnist_checkpoint.h"
+#include "../include/mnist_mlp.h"
+#include "../include/mnist_optimizer.h"
+#include "../include/mnist_serve.h"
+#include "../include/mnist_numa.h"
+#include "../include/mnist_arena.h"
+#include "../include/mnist_records.h"
+#include "../include/mnist_perf.h"
+#include "../include/mnist_convergence.h"
+#include "../include/mnist_tune.h"
+
+#define STEPS 100
+#define PIPELINE_BATCH_SIZE 1000
+#define PIPELINE_SLOTS 8
+#define STREAM_WINDOW_IMAGES 4096
+#define STREAM_BUFFERS 2
+#define SERVE_MAX_BATCH 32
+#define SERVE_BUDGET_US 1000
+
+/**
+ * Print the split of pages between the NUMA nodes of the threads that work on
+ * them and the other nodes, summed over all processes.
+ */
+void print_locality(const char * name, mnist_numa_locality_t * locality, mnist_backend_t * backend)
+{
+    uint64_t pages;
+
+    backend->reduce(backend, locality, 3, MNIST_BACKEND_UINT64, MNIST_BACKEND_SUM);
+    pages = locality->local + locality->remote;
+
+    if (backend->rank == 0) {
+        printf("%s Pages: %lu local (%.1f%%), %lu remote (%.1f%%), %lu not placed\n", name, (unsigned long) locality->local,
+            pages > 0 ? 100.0 * locality->local / pages : 0.0, (unsigned long) locality->remote, pages > 0 ? 100.0 * locality->remote / pages : 0.0,
+            (unsigned long) locality->unknown);
+    }
+}
+
+/**
+ * The network as the server runs it: the softmax network is laid out as a
+ * multi-layer perceptron without hidden layers, so both take the batched
+ * kernels, and in bf16 those that read the bf16 working copy.
+ */
+typedef struct serve_model_t_ {
+    mnist_mlp_t mlp;
+    float * parameters;
+    uint16_t * weights;
+} serve_model_t;
+
+void serve_infer(void * context, const uint8_t * images, uint32_t count, float * probabilities, void * workspace)
+{
+    serve_model_t * serving = context;
+
+    if (NULL != serving->weights) {
+        mnist_mlp_probabilities_bf16(&serving->mlp, serving->weights, images, count, probabilities, workspace);
+    } else {
+        mnist_mlp_probabilities(&serving->mlp, serving->parameters, images, count, probabilities, workspace);
+    }
+}
+
+/**
+ * Serve the network until stdin is closed or the server is interrupted, then
+ * report the latency and throughput. The report goes to stderr, as stdout
+ * may carry the replies.
+ */
+int serve(mnist_model_t * model, mnist_serve_config_t * config)
+{
+    serve_model_t serving = { .parameters = model->parameters, .weights = model->weights };
+    mnist_serve_stats_t stats;
+    int i, result;
+
+    if (NULL != model->parameters) {
+        serving.mlp = model->mlp;
+    } else {
+        mnist_mlp_init(&serving.mlp, MNIST_IMAGE_SIZE, "", MNIST_LABELS);
+        serving.parameters = malloc(serving.mlp.parameters * sizeof(float));
+
+        if (NULL == serving.parameters) {
+            fprintf(stderr, "Could not allocate memory for a network of %lu parameters\n", (unsigned long) serving.mlp.parameters);
+            return -1;
+        }
+
+        for (i = 0; i < MNIST_LABELS; i++) {
+            memcpy(serving.parameters + (size_t) i * MNIST_IMAGE_SIZE, model->network.W[i], MNIST_IMAGE_SIZE * sizeof(float));
+            serving.parameters[(size_t) MNIST_LABELS * MNIST_IMAGE_SIZE + i] = model->network.b[i];
+        }
+    }
+
+    config->image_size = MNIST_IMAGE_SIZE;
+    config->labels = MNIST_LABELS;
+    config->workspace_bytes = mnist_mlp_workspace_size(&serving.mlp) * sizeof(float);
+    config->infer = serve_infer;
+    config->context = &serving;
+
+    fprintf(stderr, "Serving %s on %s with %d workers, batches of up to %u within %.0f us\n", NULL != model->parameters ? "a multi-layer perceptron" : "a softmax network",
+        NULL != config->socket_path ? config->socket_path : "stdin", config->workers, config->max_batch, config->budget * 1e6);
+
+    result = mnist_serve_run(config, &stats);
+
+    if (0 == result) {
+        fprintf(stderr, "Requests Served: %lu from %lu clients in %lu batches (%.2f per batch)\n", (unsigned long) stats.requests, (unsigned long) stats.clients,
+            (unsigned long) stats.batches, stats.batches > 0 ? (double) stats.requests / stats.batches : 0.0);
+        fprintf(stderr, "Throughput: %.1f requests/second\n", stats.elapsed > 0.0 ? stats.requests / stats.elapsed : 0.0);
+        fprintf(stderr, "Latency p50: %.1f us, p99: %.1f us, max: %.1f us, mean: %.1f us\n", stats.p50 * 1e6, stats.p99 * 1e6, stats.max * 1e6, stats.mean * 1e6);
+    }
+
+    if (NULL == model->parameters) {
+        free(serving.parameters);
+    }
+
+    return result;
+}
+
+/**
+ * Describe the run in the first record, so that results can be told apart
+ * without the command lines that produced them.
+ */
+void record_run(mnist_records_t * records, mnist_model_t * model, const char * hidden, const char * input, uint32_t train_size, uint32_t batch_size, int first_step, int steps)
+{
+    mnist_records_begin(records, "run");
+    mnist_records_int(records, "version", MNIST_RECORDS_VERSION);
+    mnist_records_string(records, "backend", model->backend->name);
+    mnist_records_int(records, "processes", model->backend->size);
+    mnist_records_int(records, "threads", omp_get_max_threads());
+    mnist_records_int(records, "width", MNIST_IMAGE_WIDTH);
+    mnist_records_int(records, "height", MNIST_IMAGE_HEIGHT);
+    mnist_records_string(records, "input", input);
+    mnist_records_int(records, "train_images", train_size);
+    mnist_records_string(records, "model", NULL != hidden ? hidden : "softmax");
+    mnist_records_string(records, "precision", NULL != model->weights ? "bf16" : "fp32");
+    mnist_records_string(records, "optimizer", mnist_optimizer_name(&model->optimizer->config));
+    mnist_records_int(records, "batch_size", batch_size);
+    mnist_records_int(records, "first_step", first_step);
+    mnist_records_int(records, "steps", steps);
+    mnist_records_end(records);
+}
+
+/**
+ * The options of the driver, grouped as in the README.
+ */
+void print_usage(FILE * stream, const char * program)
+{
+    fprintf(stream, "Usage: %s [options]\n"
+        "  --backend %s\n"
+        "  --steps N  --train-images N  --seed N  --records PATH  --perf\n"
+        "  --batch-size N  --block N\n"
+        "  --optimizer sgd|momentum|nesterov|adam  --lr R  --min-lr R  --momentum M  --schedule constant|cosine  --warmup N\n"
+        "  --target-accuracy A  --time-budget SECONDS  --validate-every N  --validation-images N\n"
+        "  --hidden SIZES  --bf16  --tile N\n"
+        "  --mmap  --mmap-populate  --chunked  --stream  --window N  --buffers N  --no-io-uring\n"
+        "  --pipeline  --producers N  --shift N  --rotate DEGREES\n"
+        "  --checkpoint PATH  --checkpoint-every N  --resume PATH  --eval PATH\n"
+        "  --serve PATH  --socket PATH  --serve-batch N  --serve-budget US  --serve-workers N  --no-pin\n"
+        "  --numa  --hugepages  --work-stealing  --steal-grain N  --reduction allreduce|reduce-scatter  --bucket N\n"
+        "  --autotune  --tune-steps N  --tune-profile PATH  --no-tune\n"
+        "  --help\n", program, mnist_backend_names());
+}
+
+/**
+ * What the autotuner's probes train on: steps of the run as configured, on a
+ * training set held in memory.
+ */
+typedef struct tune_probe_t_ {
+    mnist_model_t * model;
+    mnist_dataset_t * dataset;
+    mnist_dataset_t * shard;
+    mnist_sampler_t * sampler;
+    mnist_dataset_t * batch;
+    uint32_t batch_size;
+    uint32_t batches;
+    uint32_t train_size;
+    int chunked;
+} tune_probe_t;
+
+float tune_step(void * context, int step)
+{
+    tune_probe_t * probe = context;
+
+    if (probe->batch_size > 0) {
+        return mnist_model_minibatch_epoch(probe->model, probe->shard, probe->sampler, step, probe->batch_size, probe->batches, probe->batch);
+    } else if (probe->chunked) {
+        return mnist_model_shard_step(probe->model, probe->dataset, probe->train_size);
+    }
+
+    return mnist_model_training_step(probe->model, probe->dataset);
+}
+
+int main(int argc, char *argv[])
+{
+    mnist_dataset_t *train_dataset = NULL, *test_dataset = NULL, batch = { 0 }, validation = { 0 };
+    mnist_backend_t *backend;
+    mnist_arena_t *arena;
+    mnist_arena_stats_t arena_stats;
+    mnist_records_t *records = NULL;
+    mnist_pipeline_t *pipeline = NULL;
+    mnist_pipeline_config_t pipeline_config = {
+        .image_path = TRAIN_BASE_IMAGES_FILE,
+        .label_path = TRAIN_LABELS_FILE,
+        .out_width = MNIST_IMAGE_WIDTH,
+        .out_height = MNIST_IMAGE_HEIGHT,
+        .batch_size = PIPELINE_BATCH_SIZE,
+        .slots = PIPELINE_SLOTS,
+        .producers = 2
+    };
+    mnist_pipeline_stats_t pipeline_stats;
+    mnist_stream_t *train_stream = NULL, *test_stream = NULL;
+    mnist_stream_config_t stream_config = {
+        .image_path = TRAIN_IMAGES_FILE,
+        .label_path = TRAIN_LABELS_FILE,
+        .width = MNIST_IMAGE_WIDTH,
+        .height = MNIST_IMAGE_HEIGHT,
+        .window_images = STREAM_WINDOW_IMAGES,
+        .buffers = STREAM_BUFFERS,
+        .use_io_uring = 1
+    };
+    mnist_stream_stats_t stream_stats;
+    mnist_sampler_t *sampler = NULL;
+    mnist_dataset_t shard;
+    uint32_t batch_size = 0, block_size = MNIST_SAMPLER_BLOCK_SIZE, batches = 0;
+    uint64_t seed = 0;
+    mnist_checkpointer_t *checkpointer = NULL;
+    mnist_checkpoint_state_t checkpoint = { 0 };
+    mnist_checkpoint_stats_t checkpoint_stats;
+    const char *checkpoint_path = NULL, *resume_path = NULL, *eval_path = NULL, *serve_path = NULL, *records_path = NULL;
+    mnist_serve_config_t serve_config = {
+        .max_batch = SERVE_MAX_BATCH,
+        .budget = SERVE_BUDGET_US * 1e-6,
+        .workers = omp_get_max_threads(),
+        .pin = 1
+    };
+    int loaded = 0, steps = STEPS, first_step = 0, checkpoint_every = MNIST_CHECKPOINT_EVERY;
+    mnist_model_t *model;
+    const char *hidden = NULL;
+    uint16_t *weights;
+    int use_bf16 = 0, use_numa = 0, numa_nodes = 0, use_hugepages = 0, use_perf = 0, have_perf;
+    mnist_numa_locality_t dataset_locality = { 0 }, gradient_locality = { 0 };
+    uint64_t numa_moved = 0;
+    mnist_optimizer_config_t optimizer_config;
+    mnist_convergence_config_t convergence_config;
+    mnist_convergence_t *convergence = NULL;
+    mnist_tune_config_t tune_config;
+    mnist_tune_settings_t tune_settings, tune_profile;
+    mnist_tune_result_t tune_result;
+    char tune_key[MNIST_TUNE_KEY], tune_text[MNIST_TUNE_KEY];
+    int have_profile = 0;
+    uint64_t updates_per_step;
+    float loss, accuracy, master_accuracy = 0.0f;
+    uint32_t train_size = 0, train_images = 0;
+    int i, rank, size, stop = 0;
+    int map_flags = 0, use_pipeline = 0, use_chunked = 0, use_stream = 0;
+    double start, end, total_time = 0.0, train_time, elapsed;
+
+    // --backend chooses how a step is spread: over one thread (serial), all
+    // the threads of this process (threads), or the threads of every MPI
+    // process (mpi_openmp). It is chosen before MPI sees the arguments
+    backend = mnist_backend_create(mnist_backend_option(argc, argv), &argc, &argv);
+
+    if (NULL == backend) {
+        exit(EXIT_FAILURE);
+    }
+
+    rank = backend->rank;
+    size = backend->size;
+
+    mnist_optimizer_config_init(&optimizer_config);
+    mnist_convergence_config_init(&convergence_config);
+    mnist_tune_config_init(&tune_config);
+
+    for (i = 1; i < argc; i++) {
+        // --optimizer, --lr, --min-lr, --momentum, --schedule and --warmup
+        if (mnist_optimizer_option(&optimizer_config, argc, argv, &i)) {
+            continue;
+        }
+
+        // --target-accuracy, --time-budget, --validate-every and
+        // --validation-images
+        if (mnist_convergence_option(&convergence_config, argc, argv, &i)) {
+            continue;
+        }
+
+        // --autotune, --no-tune, --tune-profile, --tune-steps, --tile,
+        // --work-stealing, --steal-grain, --reduction and --bucket
+        if (mnist_tune_option(&tune_config, argc, argv, &i)) {
+            continue;
+        }
+
+        if (0 == strcmp(argv[i], "--backend") && i + 1 < argc) {
+            i++;
+        } else if (0 == strcmp(argv[i], "--mmap")) {
+            map_flags |= MNIST_MAP_SEQUENTIAL | MNIST_MAP_WILLNEED;
+        } else if (0 == strcmp(argv[i], "--mmap-populate")) {
+            map_flags |= MNIST_MAP_SEQUENTIAL | MNIST_MAP_POPULATE;
+        } else if (0 == strcmp(argv[i], "--chunked")) {
+            use_chunked = 1;
+        } else if (0 == strcmp(argv[i], "--stream")) {
+            use_stream = 1;
+        } else if (0 == strcmp(argv[i], "--window") && i + 1 < argc) {
+            stream_config.window_images = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--buffers") && i + 1 < argc) {
+            stream_config.buffers = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--no-io-uring")) {
+            stream_config.use_io_uring = 0;
+        } else if (0 == strcmp(argv[i], "--pipeline")) {
+            use_pipeline = 1;
+        } else if (0 == strcmp(argv[i], "--producers") && i + 1 < argc) {
+            pipeline_config.producers = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--shift") && i + 1 < argc) {
+            pipeline_config.max_shift = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--rotate") && i + 1 < argc) {
+            pipeline_config.max_rotation = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--batch-size") && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--block") && i + 1 < argc) {
+            block_size = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--checkpoint-every") && i + 1 < argc) {
+            checkpoint_every = atoi(argv[++i]);
+
+            if (checkpoint_every < 1) {
+                if (rank == 0) {
+                    fprintf(stderr, "--checkpoint-every needs at least 1 step, not %s\n", argv[i]);
+                }
+
+                backend->abort(backend, EXIT_FAILURE);
+            }
+        } else if (0 == strcmp(argv[i], "--resume") && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--eval") && i + 1 < argc) {
+            eval_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--serve") && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--socket") && i + 1 < argc) {
+            serve_config.socket_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--serve-batch") && i + 1 < argc) {
+            serve_config.max_batch = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--serve-budget") && i + 1 < argc) {
+            serve_config.budget = atof(argv[++i]) * 1e-6;
+        } else if (0 == strcmp(argv[i], "--serve-workers") && i + 1 < argc) {
+            serve_config.workers = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--no-pin")) {
+            serve_config.pin = 0;
+        } else if (0 == strcmp(argv[i], "--hidden") && i + 1 < argc) {
+            hidden = argv[++i];
+        } else if (0 == strcmp(argv[i], "--bf16")) {
+            use_bf16 = 1;
+        } else if (0 == strcmp(argv[i], "--numa")) {
+            use_numa = 1;
+        } else if (0 == strcmp(argv[i], "--hugepages")) {
+            use_hugepages = 1;
+        } else if (0 == strcmp(argv[i], "--steps") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--train-images") && i + 1 < argc) {
+            train_images = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--records") && i + 1 < argc) {
+            records_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--perf")) {
+            use_perf = 1;
+        } else if (0 == strcmp(argv[i], "--help")) {
+            if (rank == 0) {
+                print_usage(stdout, argv[0]);
+            }
+
+            mnist_backend_free(backend);
+
+            return 0;
+        } else {
+            // An option this driver does not know, or one without its value
+            if (rank == 0) {
+                fprintf(stderr, "Unknown option %s%s\n", argv[i], i + 1 == argc && 0 == strncmp(argv[i], "--", 2) ? " or missing value" : "");
+                print_usage(stderr, argv[0]);
+            }
+
+            // Every process stops at the same option; let the root finish
+            backend->barrier(backend);
+            backend->abort(backend, EXIT_FAILURE);
+        }
+    }
+
+    // The settings that only change how fast the run trains come from the
+    // command line, then from the profile --autotune wrote for this machine
+    // and run, which the root reads, then from the defaults
+    mnist_tune_key(tune_key, sizeof(tune_key), backend, hidden, use_bf16);
+
+    if (tune_config.load && !tune_config.autotune && rank == 0) {
+        have_profile = mnist_tune_load(tune_config.profile, tune_key, &tune_profile);
+    }
+
+    backend->broadcast(backend, &have_profile, sizeof(int));
+
+    if (have_profile) {
+        backend->broadcast(backend, &tune_profile, sizeof(mnist_tune_settings_t));
+    }
+
+    mnist_tune_resolve(&tune_config, have_profile ? &tune_profile : NULL, &tune_settings);
+    omp_set_num_threads(tune_settings.threads);
+
+    // --numa pins the threads to the cores of the process node by node before
+    // anything is allocated, so that what they first touch is placed on
+    // their nodes
+    if (use_numa) {
+        numa_nodes = mnist_numa_pin_threads();
+    }
+
+    // The mixed precision kernels are those of the multi-layer perceptron
+    if (use_bf16 && NULL == hidden) {
+        if (rank == 0) {
+            fprintf(stderr, "--bf16 needs --hidden\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // Threads steal the images of the softmax network's loop; the kernels of
+    // the multi-layer perceptron split the rows of every tile instead
+    if (tune_settings.stealing && (!backend->parallel || NULL != hidden)) {
+        if (rank == 0) {
+            fprintf(stderr, "--work-stealing needs the softmax network on the threads or mpi_openmp backend\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // The probes train on the threads of every process, from memory
+    if (tune_config.autotune && (!backend->parallel || use_pipeline || use_stream || NULL != eval_path || NULL != serve_path)) {
+        if (rank == 0) {
+            fprintf(stderr, "--autotune needs the threads or mpi_openmp backend and a training set in memory, without --pipeline, --stream, --eval or --serve\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // The server answers requests from a single process
+    if (NULL != serve_path && size > 1) {
+        if (rank == 0) {
+            fprintf(stderr, "--serve runs on a single process\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // Everything that lives for the whole run is carved from one arena, so
+    // the training steps allocate nothing; --hugepages backs it with 2 MB
+    // pages
+    arena = mnist_arena_create(use_hugepages);
+
+    if (NULL == arena) {
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // --hidden trains a multi-layer perceptron with hidden layers of the
+    // given sizes instead of the single softmax layer
+    model = mnist_model_create(hidden, use_bf16, &optimizer_config, backend, arena);
+
+    if (NULL == model || 0 != mnist_tune_apply(&tune_settings, model)) {
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    if (have_profile && rank == 0) {
+        mnist_tune_describe(&tune_settings, model, tune_text, sizeof(tune_text));
+        // Replies of the server may be on stdout
+        fprintf(NULL != serve_path ? stderr : stdout, "Tuned Settings: %s, from %s\n", tune_text, tune_config.profile);
+    }
+
+    // --serve answers inference requests with the network of a checkpoint,
+    // without reading any dataset
+    if (NULL != serve_path) {
+        if (0 != mnist_checkpoint_load(serve_path, &checkpoint, mnist_model_parameters(model), mnist_model_parameter_bytes(model), NULL, 0) ||
+            checkpoint.model_hash != mnist_model_hash(model)) {
+            fprintf(stderr, "Could not serve a network of this shape from %s\n", serve_path);
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        mnist_model_round_weights(model);
+
+        if (0 != serve(model, &serve_config)) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        mnist_model_free(model);
+        mnist_arena_free(arena);
+        mnist_backend_free(backend);
+
+        return 0;
+    }
+
+    // --resume restores the network, the sampling and the state of the random
+    // streams before the datasets are opened, so the pipeline continues the
+    // same augmentation. The root reads the checkpoint and shares it, so it
+    // can be resumed with any number of processes
+    if (NULL != resume_path || NULL != eval_path) {
+        if (rank == 0) {
+            // Evaluation needs no optimizer state, so any optimizer may read it
+            if (NULL != eval_path) {
+                loaded = 0 == mnist_checkpoint_load(eval_path, &checkpoint, mnist_model_parameters(model), mnist_model_parameter_bytes(model), NULL, 0);
+            } else {
+                loaded = 0 == mnist_checkpoint_load(resume_path, &checkpoint, mnist_model_parameters(model), mnist_model_parameter_bytes(model), model->optimizer->state,
+                    model->optimizer->state_bytes);
+            }
+
+            if (loaded && checkpoint.model_hash != mnist_model_hash(model)) {
+                fprintf(stderr, "Checkpoint %s holds a network of another shape\n", NULL != eval_path ? eval_path : resume_path);
+                loaded = 0;
+            }
+        }
+
+        backend->broadcast(backend, &loaded, sizeof(int));
+
+        if (!loaded) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        backend->broadcast(backend, &checkpoint, sizeof(mnist_checkpoint_state_t));
+
+        if (NULL != resume_path) {
+            backend->broadcast(backend, model->optimizer->state, model->optimizer->state_bytes);
+        }
+    }
+
+    if (NULL != resume_path && NULL == eval_path) {
+        first_step = checkpoint.step;
+        seed = checkpoint.seed;
+        batch_size = checkpoint.batch_size;
+        block_size = checkpoint.block_size;
+
+        if (rank == 0 && backend->distributed) {
+            printf("Resuming from step %d of %s on %d processes\n", first_step, resume_path, size);
+        } else if (rank == 0) {
+            printf("Resuming from step %d of %s\n", first_step, resume_path);
+        }
+    }
+
+    // Mini-batches are sampled from a dataset held (or mapped) in memory
+    if (batch_size > 0 && (use_pipeline || use_stream)) {
+        if (rank == 0) {
+            fprintf(stderr, "--batch-size cannot be combined with --pipeline or --stream\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // --train-images trains on the first images of such a dataset only, which
+    // every process holds whole
+    if (train_images > 0 && (use_pipeline || use_stream || use_chunked)) {
+        if (rank == 0) {
+            fprintf(stderr, "--train-images cannot be combined with --pipeline, --stream or --chunked\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // Validation draws its images from a test set held in memory
+    if (mnist_convergence_enabled(&convergence_config) && use_stream) {
+        if (rank == 0) {
+            fprintf(stderr, "--target-accuracy and --time-budget cannot be combined with --stream\n");
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // With --pipeline every process upscales only its own shard of the
+    // original training images while training. --eval does not need them
+    if (NULL != eval_path) {
+        train_size = 0;
+    } else if (use_pipeline) {
+        pipeline_config.shard = rank;
+        pipeline_config.shards = size;
+        pipeline_config.seed = seed;
+        pipeline_config.first_epoch = first_step;
+        pipeline = mnist_pipeline_create(&pipeline_config);
+
+        if (NULL == pipeline) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        train_size = mnist_pipeline_size(pipeline);
+        backend->allreduce(backend, &train_size, 1, MNIST_BACKEND_UINT32, MNIST_BACKEND_SUM);
+    } else if (use_stream) {
+        // --stream only holds a few windows of the process's shard in memory
+        stream_config.shard = rank;
+        stream_config.shards = size;
+        train_stream = mnist_stream_open(&stream_config);
+
+        if (NULL == train_stream) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        train_size = mnist_stream_size(train_stream);
+        backend->allreduce(backend, &train_size, 1, MNIST_BACKEND_UINT32, MNIST_BACKEND_SUM);
+    } else if (use_chunked) {
+        // Every process reads and decompresses only its own chunks
+        train_dataset = mnist_get_chunked_dataset(TRAIN_CHUNKED_FILE, rank, size, arena);
+
+        if (NULL == train_dataset) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        train_size = train_dataset->size;
+        backend->allreduce(backend, &train_size, 1, MNIST_BACKEND_UINT32, MNIST_BACKEND_SUM);
+    } else {
+        // --mmap maps the dataset files instead of reading them into private
+        // memory, so ranks sharing a node also share the page cache.
+        // --mmap-populate also prefaults every page before training
+        train_dataset = map_flags ? mnist_map_dataset(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, map_flags) : mnist_get_dataset(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, arena);
+
+        if (NULL == train_dataset) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        train_size = train_dataset->size;
+    }
+
+    if (train_images > 0 && NULL != train_dataset && train_images < train_size) {
+        train_dataset->size = train_size = train_images;
+    }
+
+    if (use_stream) {
+        // Only the root evaluates the network
+        if (rank == 0) {
+            stream_config.image_path = TEST_IMAGES_FILE;
+            stream_config.label_path = TEST_LABELS_FILE;
+            stream_config.shard = 0;
+            stream_config.shards = 1;
+            test_stream = mnist_stream_open(&stream_config);
+        }
+    } else if (use_chunked) {
+        test_dataset = mnist_get_chunked_dataset(TEST_CHUNKED_FILE, 0, 1, arena);
+    } else if (map_flags) {
+        test_dataset = mnist_map_dataset(TEST_IMAGES_FILE, TEST_LABELS_FILE, map_flags);
+    } else {
+        test_dataset = mnist_get_dataset(TEST_IMAGES_FILE, TEST_LABELS_FILE, arena);
+    }
+
+    if (use_stream ? (rank == 0 && NULL == test_stream) : (NULL == test_dataset || (!use_pipeline && NULL == eval_path && NULL == train_dataset))) {
+        backend->abort(backend, EXIT_FAILURE);
+    }
+
+    // --eval only evaluates the network saved in a checkpoint, on the root
+    if (NULL != eval_path) {
+        if (rank == 0) {
+            mnist_model_round_weights(model);
+            start = omp_get_wtime();
+            accuracy = use_stream ? mnist_model_stream_accuracy(model, test_stream) : mnist_model_accuracy(model, test_dataset);
+            printf("Checkpoint Step: %lu\n", (unsigned long) checkpoint.step);
+            printf("Final Accuracy: %.6f\n", accuracy);
+            printf("Total Duration: %.6f seconds\n", omp_get_wtime() - start);
+
+            if (use_stream) {
+                mnist_stream_close(test_stream);
+            }
+        }
+
+        if (!use_stream) {
+            mnist_free_dataset(test_dataset);
+        }
+
+        mnist_model_free(model);
+        mnist_arena_free(arena);
+        mnist_backend_free(backend);
+
+        return 0;
+    }
+
+    if (NULL != resume_path && checkpoint.data_hash != mnist_checkpoint_hash(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, train_size, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT)) {
+        if (rank == 0) {
+            fprintf(stderr, "Checkpoint %s was trained on different data\n", resume_path);
+        }
+
+        backend->abort(backend, EXIT_FAILURE);
+    }
+    // Every thread reads its slice of the training images, but the slices of
+    // this process's shard are what the threads train on, so move those
+    if (use_numa && NULL != train_dataset) {
+        uint32_t first = use_chunked ? 0 : rank * (train_dataset->size / size);
+        uint32_t count = use_chunked || rank == size - 1 ? train_dataset->size - first : train_dataset->size / size;
+
+        numa_moved = mnist_numa_place(train_dataset->images + first, count, sizeof(mnist_image_t));
+        mnist_numa_locality(train_dataset->images + first, count, sizeof(mnist_image_t), &dataset_locality);
+    }
+
+    // --batch-size trains on shuffled mini-batches instead of the full batch.
+    // Every process samples its own shard with its own random stream, so no
+    // generator state is shared between processes
+    if (batch_size > 0) {
+        shard = *train_dataset;
+
+        if (!use_chunked) {
+            shard.images = &train_dataset->images[rank * (train_dataset->size / size)];
+            shard.labels = &train_dataset->labels[rank * (train_dataset->size / size)];
+            shard.size = rank == size - 1 ? train_dataset->size - rank * (train_dataset->size / size) : train_dataset->size / size;
+        }
+
+        sampler = mnist_sampler_create(shard.size, block_size, seed, rank);
+        batch.images = mnist_arena_alloc(arena, batch_size * sizeof(mnist_image_t));
+        batch.labels = mnist_arena_alloc(arena, batch_size);
+
+        if (NULL == sampler || NULL == batch.images || NULL == batch.labels) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        batches = (shard.size + batch_size - 1) / batch_size;
+        backend->allreduce(backend, &batches, 1, MNIST_BACKEND_UINT32, MNIST_BACKEND_MAX);
+    }
+
+    if (NULL == resume_path) {
+        mnist_model_random_weights(model, seed);
+    }
+
+    backend->broadcast(backend, mnist_model_parameters(model), mnist_model_parameter_bytes(model));
+    mnist_model_round_weights(model);
+
+    // The schedule spans every update of the run; the updates so far place a
+    // resumed run on it
+    updates_per_step = batch_size > 0 ? batches : 1;
+    model->optimizer->config.warmup *= updates_per_step;
+    model->optimizer->config.total = (uint64_t) steps * updates_per_step;
+    model->optimizer->updates = (uint64_t) first_step * updates_per_step;
+
+    // --autotune times a few steps of the run under candidate settings and
+    // saves the fastest in the profile instead of training
+    if (tune_config.autotune) {
+        tune_probe_t probe = { model, train_dataset, &shard, sampler, &batch, batch_size, batches, train_size, use_chunked };
+
+        if (0 != mnist_tune_run(&tune_config, model, tune_step, &probe, &tune_result)) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        if (rank == 0) {
+            mnist_tune_describe(&tune_result.best, model, tune_text, sizeof(tune_text));
+            printf("\nAutotuned Settings: %s\n", tune_text);
+            printf("Autotuned Step Time: %.6f seconds, %.6f with the defaults (%.2fx), after %d probes\n", tune_result.time, tune_result.default_time,
+                tune_result.time > 0.0 ? tune_result.default_time / tune_result.time : 0.0, tune_result.probes);
+
+            if (0 != mnist_tune_save(tune_config.profile, tune_key, &tune_result.best, tune_result.time)) {
+                backend->abort(backend, EXIT_FAILURE);
+            }
+
+            printf("Profile Written: %s\n", tune_config.profile);
+        }
+
+        mnist_sampler_free(sampler);
+        mnist_free_dataset(train_dataset);
+        mnist_free_dataset(test_dataset);
+        mnist_model_free(model);
+        mnist_arena_free(arena);
+        mnist_backend_free(backend);
+
+        return 0;
+    }
+
+    // --checkpoint has the root write the network every few steps from a
+    // background thread; the network is the same on every process
+    if (NULL != checkpoint_path && rank == 0) {
+        checkpointer = mnist_checkpointer_create(checkpoint_path, mnist_model_parameter_bytes(model), model->optimizer->state_bytes);
+
+        if (NULL == checkpointer) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        checkpoint.seed = seed;
+        checkpoint.model_hash = mnist_model_hash(model);
+        checkpoint.data_hash = mnist_checkpoint_hash(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, train_size, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT);
+        checkpoint.width = MNIST_IMAGE_WIDTH;
+        checkpoint.height = MNIST_IMAGE_HEIGHT;
+        checkpoint.batch_size = batch_size;
+        checkpoint.block_size = block_size;
+        checkpoint.learning_rate = model->optimizer->config.learning_rate;
+    }
+
+    // --perf counts cycles, instructions, cache misses and floating point
+    // operations of every thread in each phase of a step. Either every
+    // process counts or none does, and only what all of them can count
+    model->perf = use_perf ? mnist_perf_create() : NULL;
+
+    if (use_perf) {
+        have_perf = NULL != model->perf;
+        backend->allreduce(backend, &have_perf, 1, MNIST_BACKEND_INT, MNIST_BACKEND_MIN);
+
+        if (!have_perf) {
+            mnist_perf_free(model->perf);
+            model->perf = NULL;
+        } else {
+            backend->allreduce(backend, model->perf->available, MNIST_PERF_EVENTS, MNIST_BACKEND_INT, MNIST_BACKEND_MIN);
+        }
+    }
+
+    // --target-accuracy and --time-budget train until the network reaches the
+    // accuracy on a random subset of the test set, or until the time is up,
+    // for at most --steps steps. The network is the same on every process, so
+    // the root validates it every few steps and tells the others when to stop
+    if (mnist_convergence_enabled(&convergence_config) && rank == 0) {
+        convergence_config.seed = seed;
+        validation.size = mnist_convergence_subset(&convergence_config, (uint8_t *) test_dataset->images, test_dataset->labels, test_dataset->size,
+            sizeof(mnist_image_t), (uint8_t **) &validation.images, &validation.labels, arena);
+        convergence = mnist_convergence_create(&convergence_config, steps - first_step, arena);
+
+        if (0 == validation.size || NULL == convergence) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+    }
+
+    // --records also has the root write the configuration, every step and the
+    // results as JSON lines, to a file or to the standard output for "-"
+    if (NULL != records_path && rank == 0) {
+        records = mnist_records_open(records_path);
+
+        if (NULL == records) {
+            backend->abort(backend, EXIT_FAILURE);
+        }
+
+        record_run(records, model, hidden, use_pipeline ? "pipeline" : use_stream ? "stream" : use_chunked ? "chunked" : map_flags ? "mmap" : "memory",
+            train_size, batch_size, first_step, steps);
+    }
+
+    if (rank == 0 )
+        printf("Step\tIteration Time (s)\tAverage Loss\n");
+
+    mnist_convergence_start(convergence);
+
+    for (i = first_step; i < steps; i++) {
+        if (rank == 0) {
+            start = omp_get_wtime();
+        }
+
+        mnist_perf_reset(model->perf);
+        mnist_steal_reset(model->steal);
+
+        if (use_pipeline) {
+            loss = mnist_model_pipeline_step(model, pipeline, train_size);
+        } else if (use_stream) {
+            loss = mnist_model_stream_step(model, train_stream, train_size);
+        } else if (batch_size > 0) {
+            loss = mnist_model_minibatch_epoch(model, &shard, sampler, i, batch_size, batches, &batch);
+        } else if (use_chunked) {
+            loss = mnist_model_shard_step(model, train_dataset, train_size);
+        } else {
+            loss = mnist_model_training_step(model, train_dataset);
+        }
+
+        if (NULL != checkpointer && ((i + 1) % checkpoint_every == 0 || i + 1 == steps)) {
+            checkpoint.step = i + 1;
+            mnist_checkpointer_save(checkpointer, &checkpoint, mnist_model_parameters(model), model->optimizer->state, i + 1 == steps);
+        }
+
+        backend->barrier(backend);
+
+        // The counts of a step are summed over all processes
+        if (NULL != model->perf) {
+            backend->reduce(backend, model->perf->counts, MNIST_PERF_PHASES * MNIST_PERF_EVENTS, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_SUM);
+        }
+
+        if (NULL != model->steal) {
+            backend->reduce(backend, &model->steal->step, MNIST_STEAL_STATS, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_SUM);
+        }
+
+        if (rank == 0) {
+            end = omp_get_wtime();
+            double iteration_time = end - start;
+            total_time += iteration_time;
+
+            printf("%04d\t%.6f\t\t%.2f\t", i, iteration_time, loss / train_size);
+            mnist_perf_print(model->perf, train_size);
+            printf("\n");
+
+            mnist_records_begin(records, "step");
+            mnist_records_int(records, "step", i);
+            mnist_records_double(records, "time", iteration_time);
+            mnist_records_double(records, "loss", loss / train_size);
+            mnist_perf_record(model->perf, records);
+            mnist_steal_record(model->steal, records);
+            mnist_records_end(records);
+
+            if (mnist_convergence_due(convergence, i)) {
+                elapsed = mnist_convergence_elapsed(convergence);
+                mnist_convergence_update(convergence, i, elapsed, mnist_model_accuracy(model, &validation), records);
+            }
+
+            stop = mnist_convergence_done(convergence);
+        }
+
+        if (mnist_convergence_enabled(&convergence_config)) {
+            backend->broadcast(backend, &stop, sizeof(int));
+        }
+
+        // A run that stops early still ends with a checkpoint of its network
+        if (stop) {
+            if (NULL != checkpointer && i + 1 != steps) {
+                checkpoint.step = i + 1;
+                mnist_checkpointer_save(checkpointer, &checkpoint, mnist_model_parameters(model), model->optimizer->state, 1);
+            }
+
+            steps = i + 1;
+            break;
+        }
+    }
+
+    // The steals and idle time of the run are summed over all processes
+    if (NULL != model->steal) {
+        backend->reduce(backend, &model->steal->run, MNIST_STEAL_STATS, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_SUM);
+    }
+
+    if (rank == 0) {
+        train_time = total_time;
+        start = omp_get_wtime();
+        accuracy = use_stream ? mnist_model_stream_accuracy(model, test_stream) : mnist_model_accuracy(model, test_dataset);
+        end = omp_get_wtime();
+        double iteration_time = end - start;
+        total_time += iteration_time;
+        printf("\nFinal Accuracy: %.6f\n", accuracy);
+
+        // Compare the bf16 kernels with fp32 inference on the same master
+        // parameters
+        if (use_bf16) {
+            weights = model->weights;
+            model->weights = NULL;
+            master_accuracy = use_stream ? mnist_model_stream_accuracy(model, test_stream) : mnist_model_accuracy(model, test_dataset);
+            model->weights = weights;
+            printf("FP32 Master Accuracy: %.6f\n", master_accuracy);
+        }
+
+        printf("Total Duration: %.6f seconds\n", total_time);
+        printf("Mean Iteration Time: %.6f seconds\n", total_time / (steps > first_step ? steps - first_step : 1));
+        mnist_convergence_print(convergence, validation.size);
+
+        mnist_records_begin(records, "summary");
+        mnist_records_double(records, "accuracy", accuracy);
+
+        if (use_bf16) {
+            mnist_records_double(records, "fp32_accuracy", master_accuracy);
+        }
+
+        mnist_records_double(records, "total_duration", total_time);
+        mnist_records_double(records, "mean_iteration_time", total_time / (steps > first_step ? steps - first_step : 1));
+        mnist_records_double(records, "train_time", train_time);
+        mnist_records_double(records, "images_per_second", train_time > 0.0 ? (double) train_size * (steps - first_step) / train_time : 0.0);
+        mnist_convergence_record(convergence, records);
+        mnist_records_end(records);
+        mnist_records_close(records);
+
+        mnist_arena_stats(arena, &arena_stats);
+        printf("Arena: %.1f MB in %lu buffers%s, %.1f MB on huge pages\n", arena_stats.used / 1048576.0, (unsigned long) arena_stats.buffers,
+            backend->distributed ? " on the root" : "", arena_stats.huge / 1048576.0);
+        mnist_steal_print(model->steal);
+    }
+
+    // The split of the pages the threads work on between their own NUMA node
+    // and the others
+    if (use_numa) {
+        mnist_model_gradient_locality(model, &gradient_locality);
+        backend->allreduce(backend, &numa_moved, 1, MNIST_BACKEND_UINT64, MNIST_BACKEND_SUM);
+
+        if (rank == 0) {
+            printf("NUMA Nodes: %d, threads of the root pinned over %d (%lu dataset pages moved)\n", mnist_numa_nodes(), numa_nodes, (unsigned long) numa_moved);
+        }
+
+        print_locality("Dataset", &dataset_locality, backend);
+        print_locality("Gradient", &gradient_locality, backend);
+    }
+
+    if (NULL != checkpointer) {
+        // Training only waited for the snapshot copies, and for the last write
+        mnist_checkpointer_stats(checkpointer, &checkpoint_stats);
+        printf("Checkpoints Written: %lu to %s (%lu skipped while writing, %lu failed)\n", (unsigned long) checkpoint_stats.written, checkpoint_path,
+            (unsigned long) checkpoint_stats.skipped, (unsigned long) checkpoint_stats.failed);
+        printf("Checkpoint Snapshot Time: %.6f seconds, %.6f seconds writing in the background\n", checkpoint_stats.snapshot_time, checkpoint_stats.write_time);
+        mnist_checkpointer_free(checkpointer);
+    }
+
+    if (use_pipeline) {
+        // The slowest process decides whether the producers kept up
+        mnist_pipeline_stats(pipeline, &pipeline_stats);
+        backend->allreduce(backend, &pipeline_stats.consumer_wait, 1, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_MAX);
+
+        if (rank == 0) {
+            printf("Pipeline Stall Time: %.6f seconds (%.1f%%)\n", pipeline_stats.consumer_wait, 100.0 * pipeline_stats.consumer_wait / total_time);
+            printf("Pipeline Producer Time: %.6f seconds busy, %.6f seconds blocked on a full ring\n", pipeline_stats.produce_time, pipeline_stats.producer_wait);
+            printf("Pipeline Producers Kept Up: %s\n", pipeline_stats.consumer_wait < 0.05 * total_time ? "yes" : "no");
+        }
+
+        mnist_pipeline_free(pipeline);
+    } else if (use_stream) {
+        // The process that waited longest on its reads bounds the step time
+        mnist_stream_stats(train_stream, &stream_stats);
+        backend->allreduce(backend, &stream_stats.stall_time, 1, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_MAX);
+        backend->allreduce(backend, &stream_stats.bytes_read, 1, MNIST_BACKEND_UINT64, MNIST_BACKEND_SUM);
+
+        if (rank == 0) {
+            printf("Stream I/O Stall Time: %.6f seconds (%.1f%%)\n", stream_stats.stall_time, 100.0 * stream_stats.stall_time / total_time);
+            printf("Stream Bytes Read: %lu with %s\n", (unsigned long) stream_stats.bytes_read, stream_stats.io_uring ? "io_uring" : "a pread thread");
+            mnist_stream_close(test_stream);
+        }
+
+        mnist_stream_close(train_stream);
+    } else {
+        mnist_sampler_free(sampler);
+        mnist_free_dataset(train_dataset);
+    }
+
+    if (NULL != test_dataset) {
+        mnist_free_dataset(test_dataset);
+    }
+
+    mnist_model_free(model);
+    mnist_arena_free(arena);
+    mnist_backend_free(backend);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../include/mnist_arena.h"
+
+#define ALIGN_UP(x, alignment) (((x) + (alignment) - 1) & ~((size_t) (alignment) - 1))
+
+/**
+ * Reserve the address space of an arena without committing any memory, so
+ * that the reservation costs nothing until buffers are handed out. The
+ * start is aligned to a huge page, and the reservation shrinks until the
+ * address space limit allows it.
+ */
+mnist_arena_t * mnist_arena_create(int huge)
+{
+    mnist_arena_t * arena = calloc(1, sizeof(mnist_arena_t));
+    size_t reserve;
+    uint8_t * mapping = MAP_FAILED, * base;
+
+    if (NULL == arena) {
+        fprintf(stderr, "Could not allocate memory for an arena\n");
+        return NULL;
+    }
+
+    for (reserve = MNIST_ARENA_RESERVE; reserve >= 16 * MNIST_ARENA_HUGE_PAGE; reserve /= 2) {
+        mapping = mmap(NULL, reserve + MNIST_ARENA_HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (MAP_FAILED != mapping) {
+            break;
+        }
+    }
+
+    if (MAP_FAILED == mapping) {
+        fprintf(stderr, "Could not reserve address space for an arena\n");
+        free(arena);
+        return NULL;
+    }
+
+    // Trim the reservation to a range of whole huge pages
+    base = (uint8_t *) ALIGN_UP((uintptr_t) mapping, MNIST_ARENA_HUGE_PAGE);
+
+    if (base > mapping) {
+        munmap(mapping, base - mapping);
+    }
+
+    munmap(base + reserve, mapping + MNIST_ARENA_HUGE_PAGE - base);
+
+    arena->base = base;
+    arena->reserved = reserve;
+    arena->huge = huge;
+    pthread_mutex_init(&arena->lock, NULL);
+
+    return arena;
+}
+
+/**
+ * Hand out a zeroed buffer of bytes, aligned to MNIST_ARENA_ALIGNMENT, or to
+ * a huge page when it spans one or more of them on huge pages. The memory is
+ * not touched, so its pages are placed on the NUMA node of the thread that
+ * first writes them. Returns NULL when the arena is full or the memory
+ * cannot be committed.
+ */
+void * mnist_arena_alloc(mnist_arena_t * arena, size_t bytes)
+{
+    const size_t alignment = arena->huge && bytes >= MNIST_ARENA_HUGE_PAGE ? MNIST_ARENA_HUGE_PAGE : MNIST_ARENA_ALIGNMENT;
+    size_t offset, end, commit;
+    void * buffer = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+
+    offset = ALIGN_UP(arena->used, alignment);
+    end = ALIGN_UP(offset + (bytes > 0 ? bytes : 1), MNIST_ARENA_ALIGNMENT);
+
+    if (end > arena->reserved) {
+        fprintf(stderr, "Arena of %lu MB is full\n", (unsigned long) (arena->reserved >> 20));
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+
+    // Commit whole huge pages, so that they can be backed by huge pages
+    if (end > arena->committed) {
+        commit = ALIGN_UP(end, MNIST_ARENA_HUGE_PAGE);
+
+        if (0 != mprotect(arena->base + arena->committed, commit - arena->committed, PROT_READ | PROT_WRITE)) {
+            fprintf(stderr, "Could not commit %lu bytes of an arena\n", (unsigned long) (commit - arena->committed));
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+
+        if (arena->huge) {
+            madvise(arena->base + arena->committed, commit - arena->committed, MADV_HUGEPAGE);
+        }
+
+        arena->committed = commit;
+    }
+
+    buffer = arena->base + offset;
+    arena->used = end;
+    arena->buffers++;
+
+    pthread_mutex_unlock(&arena->lock);
+
+    return buffer;
+}
+
+/**
+ * Usage of an arena. The bytes on huge pages are summed from the
+ * AnonHugePages lines of /proc/self/smaps for the committed range.
+ */
+void mnist_arena_stats(mnist_arena_t * arena, mnist_arena_stats_t * stats)
+{
+    char line[256];
+    unsigned long start, end, kb;
+    int inside = 0;
+    FILE * smaps;
+
+    pthread_mutex_lock(&arena->lock);
+    stats->buffers = arena->buffers;
+    stats->used = arena->used;
+    stats->committed = arena->committed;
+    stats->huge = 0;
+    pthread_mutex_unlock(&arena->lock);
+
+    smaps = fopen("/proc/self/smaps", "r");
+
+    if (NULL == smaps) {
+        return;
+    }
+
+    while (NULL != fgets(line, sizeof(line), smaps)) {
+        if (2 == sscanf(line, "%lx-%lx ", &start, &end)) {
+            inside = start < (uintptr_t) arena->base + stats->committed && end > (uintptr_t) arena->base;
+        } else if (inside && 1 == sscanf(line, "AnonHugePages: %lu kB", &kb)) {
+            stats->huge += (size_t) kb << 10;
+        }
+    }
+
+    fclose(smaps);
+}
+
+/**
+ * Release an arena and every buffer handed out from it.
+ */
+void mnist_arena_free(mnist_arena_t * arena)
+{
+    if (NULL == arena) {
+        return;
+    }
+
+    munmap(arena->base, arena->reserved);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef MNIST_WITH_MPI
+#include <mpi.h>
+#endif
+
+#include "../include/mnist_backend.h"
+#include "../include/mnist_mlp.h"
+
+/**
+ * A single process has nothing to combine.
+ */
+static void local_allreduce(mnist_backend_t * backend, void * data, size_t count, mnist_backend_type_t type, mnist_backend_op_t op)
+{
+    (void) backend;
+    (void) data;
+    (void) count;
+    (void) type;
+    (void) op;
+}
+
+static void local_broadcast(mnist_backend_t * backend, void * data, size_t bytes)
+{
+    (void) backend;
+    (void) data;
+    (void) bytes;
+}
+
+static void local_barrier(mnist_backend_t * backend)
+{
+    (void) backend;
+}
+
+static void local_abort(mnist_backend_t * backend, int status)
+{
+    (void) backend;
+    exit(status);
+}
+
+static void local_finalize(mnist_backend_t * backend)
+{
+    (void) backend;
+}
+
+#ifdef MNIST_WITH_MPI
+/**
+ * MPI reduction of bf16 gradient messages, summed in fp32.
+ */
+static void bf16_sum(void * in, void * inout, int * length, MPI_Datatype * type)
+{
+    (void) type;
+    mnist_mlp_add_bf16(in, inout, *length);
+}
+
+typedef struct mpi_context_t_ {
+    MPI_Op bf16_sum;
+} mpi_context_t;
+
+static MPI_Datatype mpi_type(mnist_backend_type_t type)
+{
+    switch (type) {
+        case MNIST_BACKEND_INT: return MPI_INT;
+        case MNIST_BACKEND_UINT32: return MPI_UINT32_T;
+        case MNIST_BACKEND_UINT64: return MPI_UINT64_T;
+        case MNIST_BACKEND_FLOAT: return MPI_FLOAT;
+        case MNIST_BACKEND_DOUBLE: return MPI_DOUBLE;
+        default: return MPI_UINT16_T;
+    }
+}
+
+static MPI_Op mpi_op(mnist_backend_t * backend, mnist_backend_type_t type, mnist_backend_op_t op)
+{
+    if (MNIST_BACKEND_BF16 == type) {
+        return ((mpi_context_t *) backend->context)->bf16_sum;
+    }
+
+    switch (op) {
+        case MNIST_BACKEND_MIN: return MPI_MIN;
+        case MNIST_BACKEND_MAX: return MPI_MAX;
+        default: return MPI_SUM;
+    }
+}
+
+static size_t type_size(mnist_backend_type_t type)
+{
+    switch (type) {
+        case MNIST_BACKEND_UINT64: return sizeof(uint64_t);
+        case MNIST_BACKEND_DOUBLE: return sizeof(double);
+        case MNIST_BACKEND_BF16: return sizeof(uint16_t);
+        default: return sizeof(uint32_t);
+    }
+}
+
+/**
+ * Combine into every process's data, in collectives of at most bucket
+ * elements. With the reduce-scatter strategy every process sums one block of
+ * each bucket and gathers the others' sums; the elements that do not divide
+ * into blocks are allreduced.
+ */
+static void mpi_allreduce(mnist_backend_t * backend, void * data, size_t count, mnist_backend_type_t type, mnist_backend_op_t op)
+{
+    const size_t element = type_size(type), bucket = 0 == backend->bucket || backend->bucket > count ? count : backend->bucket;
+    const MPI_Datatype datatype = mpi_type(type);
+    const MPI_Op reduction = mpi_op(backend, type, op);
+    uint8_t * values;
+    size_t first, n, block;
+
+    if (0 == count) {
+        MPI_Allreduce(MPI_IN_PLACE, data, 0, datatype, reduction, MPI_COMM_WORLD);
+        return;
+    }
+
+    for (first = 0; first < count; first += n) {
+        n = count - first < bucket ? count - first : bucket;
+        values = (uint8_t *) data + first * element;
+        block = MNIST_BACKEND_REDUCE_SCATTER == backend->strategy ? n / backend->size : 0;
+
+        if (block > 0) {
+            // The block a process summed is left at the front of the bucket
+            MPI_Reduce_scatter_block(MPI_IN_PLACE, values, block, datatype, reduction, MPI_COMM_WORLD);
+            memmove(values + backend->rank * block * element, values, block * element);
+            MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, values, block, datatype, MPI_COMM_WORLD);
+        }
+
+        if (block * backend->size < n) {
+            MPI_Allreduce(MPI_IN_PLACE, values + block * backend->size * element, n - block * backend->size, datatype, reduction, MPI_COMM_WORLD);
+        }
+    }
+}
+
+/**
+ * Combine into the root's data; the others keep theirs.
+ */
+static void mpi_reduce(mnist_backend_t * backend, void * data, size_t count, mnist_backend_type_t type, mnist_backend_op_t op)
+{
+    MPI_Reduce(0 == backend->rank ? MPI_IN_PLACE : data, data, count, mpi_type(type), mpi_op(backend, type, op), 0, MPI_COMM_WORLD);
+}
+
+static void mpi_broadcast(mnist_backend_t * backend, void * data, size_t bytes)
+{
+    (void) backend;
+    MPI_Bcast(data, bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+static void mpi_barrier(mnist_backend_t * backend)
+{
+    (void) backend;
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+static void mpi_abort(mnist_backend_t * backend, int status)
+{
+    (void) backend;
+    MPI_Abort(MPI_COMM_WORLD, status);
+    exit(status);
+}
+
+static void mpi_finalize(mnist_backend_t * backend)
+{
+    mpi_context_t * context = backend->context;
+
+    MPI_Op_free(&context->bf16_sum);
+    MPI_Finalize();
+}
+#endif
+
+/**
+ * The backend of this build when --backend does not choose one: the
+ * processes of an MPI build share the work, others run on one thread.
+ */
+const char * mnist_backend_default(void)
+{
+#ifdef MNIST_WITH_MPI
+    return "mpi_openmp";
+#else
+    return "serial";
+#endif
+}
+
+const char * mnist_backend_names(void)
+{
+#ifdef MNIST_WITH_MPI
+    return "serial, threads or mpi_openmp";
+#else
+    return "serial or threads";
+#endif
+}
+
+const char * mnist_backend_strategy_name(mnist_backend_strategy_t strategy)
+{
+    return MNIST_BACKEND_REDUCE_SCATTER == strategy ? "reduce-scatter" : "allreduce";
+}
+
+/**
+ * The strategy of the given name, or -1, after saying why, for none.
+ */
+int mnist_backend_strategy_parse(const char * name)
+{
+    if (0 == strcmp(name, "allreduce")) {
+        return MNIST_BACKEND_ALLREDUCE;
+    } else if (0 == strcmp(name, "reduce-scatter")) {
+        return MNIST_BACKEND_REDUCE_SCATTER;
+    }
+
+    fprintf(stderr, "Unknown reduction %s, expected allreduce or reduce-scatter\n", name);
+
+    return -1;
+}
+
+/**
+ * The value of --backend, which is needed before MPI may see the arguments,
+ * or the default.
+ */
+const char * mnist_backend_option(int argc, char * argv[])
+{
+    int i;
+
+    for (i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], "--backend")) {
+            return argv[i + 1];
+        }
+    }
+
+    return mnist_backend_default();
+}
+
+/**
+ * Create the backend of the given name, initializing MPI for mpi_openmp.
+ * Returns NULL, after saying why, for a backend this build does not have.
+ */
+mnist_backend_t * mnist_backend_create(const char * name, int * argc, char *** argv)
+{
+    mnist_backend_t * backend;
+
+    if (0 != strcmp(name, "serial") && 0 != strcmp(name, "threads")
+#ifdef MNIST_WITH_MPI
+        && 0 != strcmp(name, "mpi_openmp")
+#endif
+        ) {
+        fprintf(stderr, "Unknown backend %s, expected %s\n", name, mnist_backend_names());
+        return NULL;
+    }
+
+    backend = calloc(1, sizeof(mnist_backend_t));
+
+    if (NULL == backend) {
+        fprintf(stderr, "Could not allocate memory for the backend\n");
+        return NULL;
+    }
+
+    backend->name = name;
+    backend->size = 1;
+    backend->parallel = 0 != strcmp(name, "serial");
+    backend->allreduce = local_allreduce;
+    backend->reduce = local_allreduce;
+    backend->broadcast = local_broadcast;
+    backend->barrier = local_barrier;
+    backend->abort = local_abort;
+    backend->finalize = local_finalize;
+
+#ifdef MNIST_WITH_MPI
+    if (0 == strcmp(name, "mpi_openmp")) {
+        mpi_context_t * context = calloc(1, sizeof(mpi_context_t));
+        int provided;
+
+        if (NULL == context) {
+            fprintf(stderr, "Could not allocate memory for the backend\n");
+            free(backend);
+            return NULL;
+        }
+
+        // Only the master thread of every process communicates
+        MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+        MPI_Comm_rank(MPI_COMM_WORLD, &backend->rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &backend->size);
+        MPI_Op_create(bf16_sum, 1, &context->bf16_sum);
+
+        backend->distributed = 1;
+        backend->allreduce = mpi_allreduce;
+        backend->reduce = mpi_reduce;
+        backend->broadcast = mpi_broadcast;
+        backend->barrier = mpi_barrier;
+        backend->abort = mpi_abort;
+        backend->finalize = mpi_finalize;
+        backend->context = context;
+    }
+#else
+    (void) argc;
+    (void) argv;
+#endif
+
+    return backend;
+}
+
+/**
+ * Finalize the backend, e.g. MPI, and release it.
+ */
+void mnist_backend_free(mnist_backend_t * backend)
+{
+    if (NULL == backend) {
+        return;
+    }
+
+    backend->finalize(backend);
+    free(backend->context);
+    free(backend);
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include "../include/mnist_checkpoint.h"
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+struct mnist_checkpointer_t_ {
+    char * path;
+    char * temporary_path;
+    size_t parameter_bytes;
+    size_t optimizer_bytes;
+
+    // Snapshot the writer works from, owned by the writer while pending
+    mnist_checkpoint_header_t header;
+    uint8_t * snapshot;
+
+    pthread_mutex_t lock;
+    pthread_cond_t requested;
+    pthread_cond_t finished;
+    pthread_t thread;
+    int started;
+    int pending;
+    int stop;
+
+    mnist_checkpoint_stats_t stats;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t length)
+{
+    const uint8_t * bytes = data;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * Hash of the data configuration a network is trained on, to refuse resuming
+ * a checkpoint on different data.
+ */
+uint64_t mnist_checkpoint_hash(const char * image_path, const char * label_path, uint32_t size, int width, int height)
+{
+    uint64_t hash = FNV_OFFSET;
+    int32_t dimensions[2] = { width, height };
+
+    hash = fnv1a(hash, image_path, strlen(image_path) + 1);
+    hash = fnv1a(hash, label_path, strlen(label_path) + 1);
+    hash = fnv1a(hash, &size, sizeof(size));
+
+    return fnv1a(hash, dimensions, sizeof(dimensions));
+}
+
+/**
+ * Write all of a buffer, retrying short writes.
+ */
+static int write_all(int fd, const void * data, size_t length)
+{
+    const uint8_t * bytes = data;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, bytes, length);
+
+        if (written <= 0) {
+            return 0;
+        }
+
+        bytes += written;
+        length -= written;
+    }
+
+    return 1;
+}
+
+/**
+ * Write the snapshot to a temporary file and rename it over the checkpoint,
+ * so a job killed mid-write still leaves the previous checkpoint intact.
+ */
+static int write_snapshot(mnist_checkpointer_t * checkpointer)
+{
+    int fd, ok;
+
+    checkpointer->header.checksum = fnv1a(FNV_OFFSET, checkpointer->snapshot, checkpointer->parameter_bytes + checkpointer->optimizer_bytes);
+    fd = open(checkpointer->temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file: %s\n", checkpointer->temporary_path);
+        return 0;
+    }
+
+    ok = write_all(fd, &checkpointer->header, sizeof(mnist_checkpoint_header_t)) &&
+         write_all(fd, checkpointer->snapshot, checkpointer->parameter_bytes + checkpointer->optimizer_bytes) &&
+         0 == fsync(fd);
+    ok = 0 == close(fd) && ok;
+
+    if (!ok || 0 != rename(checkpointer->temporary_path, checkpointer->path)) {
+        fprintf(stderr, "Could not write checkpoint: %s\n", checkpointer->path);
+        unlink(checkpointer->temporary_path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void * writer_main(void * argument)
+{
+    mnist_checkpointer_t * checkpointer = argument;
+    double start_time;
+    int ok;
+
+    pthread_mutex_lock(&checkpointer->lock);
+
+    for (;;) {
+        while (!checkpointer->pending && !checkpointer->stop) {
+            pthread_cond_wait(&checkpointer->requested, &checkpointer->lock);
+        }
+
+        // A pending snapshot is still written when stopping
+        if (!checkpointer->pending) {
+            break;
+        }
+
+        pthread_mutex_unlock(&checkpointer->lock);
+
+        start_time = omp_get_wtime();
+        ok = write_snapshot(checkpointer);
+
+        pthread_mutex_lock(&checkpointer->lock);
+        checkpointer->stats.write_time += omp_get_wtime() - start_time;
+        checkpointer->stats.written += ok;
+        checkpointer->stats.failed += !ok;
+        checkpointer->pending = 0;
+        pthread_cond_broadcast(&checkpointer->finished);
+    }
+
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    return NULL;
+}
+
+/**
+ * Start a background writer for checkpoints of parameter_bytes of parameters
+ * and optimizer_bytes of optimizer state.
+ */
+mnist_checkpointer_t * mnist_checkpointer_create(const char * path, size_t parameter_bytes, size_t optimizer_bytes)
+{
+    mnist_checkpointer_t * checkpointer = calloc(1, sizeof(mnist_checkpointer_t));
+
+    if (NULL == checkpointer) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&checkpointer->lock, NULL);
+    pthread_cond_init(&checkpointer->requested, NULL);
+    pthread_cond_init(&checkpointer->finished, NULL);
+
+    checkpointer->parameter_bytes = parameter_bytes;
+    checkpointer->optimizer_bytes = optimizer_bytes;
+    checkpointer->path = strdup(path);
+    checkpointer->temporary_path = malloc(strlen(path) + sizeof(".tmp"));
+    checkpointer->snapshot = malloc(parameter_bytes + optimizer_bytes);
+
+    if (NULL == checkpointer->path || NULL == checkpointer->temporary_path || NULL == checkpointer->snapshot) {
+        fprintf(stderr, "Could not allocate memory for checkpoint snapshots\n");
+        mnist_checkpointer_free(checkpointer);
+        return NULL;
+    }
+
+    sprintf(checkpointer->temporary_path, "%s.tmp", path);
+
+    if (0 != pthread_create(&checkpointer->thread, NULL, writer_main, checkpointer)) {
+        fprintf(stderr, "Could not start checkpoint writer thread\n");
+        mnist_checkpointer_free(checkpointer);
+        return NULL;
+    }
+
+    checkpointer->started = 1;
+
+    return checkpointer;
+}
+
+/**
+ * Copy the state into the snapshot and hand it to the writer. Training only
+ * pays for the copy: if the previous checkpoint is still being written the new
+ * one is skipped. With wait set, e.g. for the last checkpoint, it instead waits
+ * for the previous one and then for this one to reach the disk. Returns 0 when
+ * the checkpoint is queued.
+ */
+int mnist_checkpointer_save(mnist_checkpointer_t * checkpointer, const mnist_checkpoint_state_t * state, const void * parameters, const void * optimizer, int wait)
+{
+    double start_time = omp_get_wtime();
+    mnist_checkpoint_header_t * header = &checkpointer->header;
+
+    pthread_mutex_lock(&checkpointer->lock);
+
+    while (wait && checkpointer->pending) {
+        pthread_cond_wait(&checkpointer->finished, &checkpointer->lock);
+    }
+
+    if (checkpointer->pending) {
+        checkpointer->stats.skipped++;
+        pthread_mutex_unlock(&checkpointer->lock);
+        return 1;
+    }
+
+    memcpy(checkpointer->snapshot, parameters, checkpointer->parameter_bytes);
+
+    if (checkpointer->optimizer_bytes > 0) {
+        memcpy(checkpointer->snapshot + checkpointer->parameter_bytes, optimizer, checkpointer->optimizer_bytes);
+    }
+
+    header->magic_number = MNIST_CHECKPOINT_MAGIC;
+    header->version = MNIST_CHECKPOINT_VERSION;
+    header->state = *state;
+    header->parameter_bytes = checkpointer->parameter_bytes;
+    header->optimizer_bytes = checkpointer->optimizer_bytes;
+
+    checkpointer->pending = 1;
+    checkpointer->stats.snapshot_time += omp_get_wtime() - start_time;
+    pthread_cond_signal(&checkpointer->requested);
+
+    while (wait && checkpointer->pending) {
+        pthread_cond_wait(&checkpointer->finished, &checkpointer->lock);
+    }
+
+    pthread_mutex_unlock(&checkpointer->lock);
+
+    return 0;
+}
+
+void mnist_checkpointer_stats(mnist_checkpointer_t * checkpointer, mnist_checkpoint_stats_t * stats)
+{
+    pthread_mutex_lock(&checkpointer->lock);
+    *stats = checkpointer->stats;
+    pthread_mutex_unlock(&checkpointer->lock);
+}
+
+/**
+ * Finish writing any pending checkpoint and stop the writer.
+ */
+void mnist_checkpointer_free(mnist_checkpointer_t * checkpointer)
+{
+    if (NULL == checkpointer) {
+        return;
+    }
+
+    if (checkpointer->started) {
+        pthread_mutex_lock(&checkpointer->lock);
+        checkpointer->stop = 1;
+        pthread_cond_signal(&checkpointer->requested);
+        pthread_mutex_unlock(&checkpointer->lock);
+        pthread_join(checkpointer->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&checkpointer->lock);
+    pthread_cond_destroy(&checkpointer->requested);
+    pthread_cond_destroy(&checkpointer->finished);
+    free(checkpointer->path);
+    free(checkpointer->temporary_path);
+    free(checkpointer->snapshot);
+    free(checkpointer);
+}
+
+/**
+ * Read a checkpoint, checking that its parameters and optimizer state have the
+ * expected sizes and are intact. optimizer may be NULL to ignore the optimizer
+ * state, e.g. for evaluation. Returns 0 on success.
+ */
+int mnist_checkpoint_load(const char * path, mnist_checkpoint_state_t * state, void * parameters, size_t parameter_bytes, void * optimizer, size_t optimizer_bytes)
+{
+    mnist_checkpoint_header_t header;
+    uint8_t * payload;
+    FILE * stream;
+    size_t length;
+    int ok;
+
+    stream = fopen(path, "rb");
+
+    if (NULL == stream) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        return -1;
+    }
+
+    if (1 != fread(&header, sizeof(mnist_checkpoint_header_t), 1, stream) ||
+        MNIST_CHECKPOINT_MAGIC != header.magic_number || MNIST_CHECKPOINT_VERSION != header.version) {
+        fprintf(stderr, "Invalid header read from checkpoint: %s\n", path);
+        fclose(stream);
+        return -1;
+    }
+
+    if (header.parameter_bytes != parameter_bytes || (NULL != optimizer && header.optimizer_bytes != optimizer_bytes)) {
+        fprintf(stderr, "Checkpoint %s holds a network of %lu bytes for %ux%u images, expected %lu bytes\n",
+            path, (unsigned long) header.parameter_bytes, header.state.width, header.state.height, (unsigned long) parameter_bytes);
+        fclose(stream);
+        return -1;
+    }
+
+    length = header.parameter_bytes + header.optimizer_bytes;
+    payload = malloc(length + 1);
+
+    if (NULL == payload) {
+        fprintf(stderr, "Could not allocate memory for checkpoint: %s\n", path);
+        fclose(stream);
+        return -1;
+    }
+
+    ok = length == fread(payload, 1, length, stream) && header.checksum == fnv1a(FNV_OFFSET, payload, length);
+    fclose(stream);
+
+    if (!ok) {
+        fprintf(stderr, "Checkpoint is truncated or corrupt: %s\n", path);
+        free(payload);
+        return -1;
+    }
+
+    memcpy(parameters, payload, parameter_bytes);
+
+    if (NULL != optimizer && optimizer_bytes > 0) {
+        memcpy(optimizer, payload + parameter_bytes, optimizer_bytes);
+    }
+
+    *state = header.state;
+    free(payload);
+
+    return 0;
+}
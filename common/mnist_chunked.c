@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "../include/mnist_chunked.h"
+
+// Longest sequences a single token can describe
+#define MAX_RUN 129
+#define MAX_NIBBLES 64
+#define MAX_LITERAL 64
+
+/**
+ * Convert from the little endian format of the container if we're on a big
+ * endian machine.
+ */
+static uint32_t le_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+static uint64_t le_uint64(uint64_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(in);
+#else
+    return in;
+#endif
+}
+
+/**
+ * Read exactly length bytes at offset, retrying on short reads.
+ */
+static int read_exact(int fd, void * buffer, size_t length, off_t offset)
+{
+    uint8_t * cursor = buffer;
+    ssize_t bytes;
+
+    while (length > 0) {
+        bytes = pread(fd, cursor, length, offset);
+
+        if (bytes <= 0) {
+            return 0;
+        }
+
+        cursor += bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+
+    return 1;
+}
+
+static inline int is_small(uint8_t residual)
+{
+    return (uint8_t) (residual + 8) < 16;
+}
+
+static inline int run_starts(const uint8_t * residuals, size_t i, size_t length)
+{
+    return i + 2 < length && residuals[i] == residuals[i + 1] && residuals[i] == residuals[i + 2];
+}
+
+// Nibble tokens only pay off from four small residuals, which also bounds the
+// encoded size: every token other than a literal saves at least one byte
+static inline int small_starts(const uint8_t * residuals, size_t i, size_t length)
+{
+    return i + 3 < length && is_small(residuals[i]) && is_small(residuals[i + 1]) && is_small(residuals[i + 2]) && is_small(residuals[i + 3]);
+}
+
+/**
+ * Encode count images of width x height into out, which must hold at least
+ * MNIST_CHUNKED_BOUND(count * width * height) bytes. Every pixel is replaced
+ * by its residual against the gradient prediction left + up - up_left (zero
+ * outside the image), which is exactly zero on the background and close to
+ * zero on smooth upscaled strokes. The residuals are packed into tokens:
+ *
+ *   c <  64   c + 1 literal residual bytes follow
+ *   c < 128   c - 63 residuals in [-8, 7] follow, two per byte (low nibble first)
+ *   c >= 128  one residual byte follows, repeated c - 126 times
+ *
+ * scratch must hold count * width * height bytes. Returns the encoded length.
+ */
+size_t mnist_chunked_encode(const uint8_t * images, int width, int height, uint32_t count, uint8_t * out, uint8_t * scratch)
+{
+    const size_t image_size = (size_t) width * height, length = image_size * count;
+    size_t i, j, o = 0;
+    uint32_t n;
+    int x, y;
+
+    for (n = 0; n < count; n++) {
+        const uint8_t * image = images + n * image_size;
+        uint8_t * residual = scratch + n * image_size;
+
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                uint8_t left = x > 0 ? image[y * width + x - 1] : 0;
+                uint8_t up = y > 0 ? image[(y - 1) * width + x] : 0;
+                uint8_t up_left = x > 0 && y > 0 ? image[(y - 1) * width + x - 1] : 0;
+
+                residual[y * width + x] = image[y * width + x] - left - up + up_left;
+            }
+        }
+    }
+
+    for (i = 0; i < length; i = j) {
+        for (j = i + 1; j < length && j - i < MAX_RUN && scratch[j] == scratch[i]; j++);
+
+        if (j - i >= 3) {
+            out[o++] = j - i + 126;
+            out[o++] = scratch[i];
+        } else if (small_starts(scratch, i, length)) {
+            for (j = i + 1; j < length && j - i < MAX_NIBBLES && is_small(scratch[j]) && !run_starts(scratch, j, length); j++);
+
+            out[o++] = j - i + 63;
+
+            for (n = 0; n < j - i; n += 2) {
+                uint8_t high = (i + n + 1 < j) ? scratch[i + n + 1] : 0;
+
+                out[o++] = (scratch[i + n] & 0x0F) | (high << 4);
+            }
+        } else {
+            for (j = i + 1; j < length && j - i < MAX_LITERAL && !small_starts(scratch, j, length) && !run_starts(scratch, j, length); j++);
+
+            out[o++] = j - i - 1;
+            memcpy(out + o, scratch + i, j - i);
+            o += j - i;
+        }
+    }
+
+    return o;
+}
+
+/**
+ * Decode a chunk of count images written by mnist_chunked_encode. Returns 0
+ * on success, -1 if the payload is corrupt.
+ */
+int mnist_chunked_decode(const uint8_t * in, size_t length, int width, int height, uint32_t count, uint8_t * images)
+{
+    const size_t image_size = (size_t) width * height, out_length = image_size * count;
+    size_t i = 0, o = 0, n, k;
+    uint32_t image;
+    uint8_t c;
+    int x, y;
+
+    while (i < length) {
+        c = in[i++];
+
+        if (c < 64) {
+            n = (size_t) c + 1;
+
+            if (i + n > length || o + n > out_length) {
+                return -1;
+            }
+
+            memcpy(images + o, in + i, n);
+            i += n;
+        } else if (c < 128) {
+            n = (size_t) c - 63;
+
+            if (i + (n + 1) / 2 > length || o + n > out_length) {
+                return -1;
+            }
+
+            // Sign extend every nibble back to a byte
+            for (k = 0; k + 1 < n; k += 2) {
+                images[o + k] = ((in[i + k / 2] & 0x0F) ^ 0x08) - 0x08;
+                images[o + k + 1] = ((in[i + k / 2] >> 4) ^ 0x08) - 0x08;
+            }
+
+            if (k < n) {
+                images[o + k] = ((in[i + k / 2] & 0x0F) ^ 0x08) - 0x08;
+            }
+
+            i += (n + 1) / 2;
+        } else {
+            n = (size_t) c - 126;
+
+            if (i >= length || o + n > out_length) {
+                return -1;
+            }
+
+            memset(images + o, in[i++], n);
+        }
+
+        o += n;
+    }
+
+    if (o != out_length) {
+        return -1;
+    }
+
+    // The residual is the second order difference of the image, so the
+    // pixels come back from a running sum along each row (giving the
+    // difference to the row above) followed by a vector add of that row
+    for (image = 0; image < count; image++) {
+        uint8_t * pixels = images + image * image_size;
+
+        for (y = 0; y < height; y++) {
+            uint8_t * row = pixels + y * width;
+
+            for (x = 1; x < width; x++) {
+                row[x] += row[x - 1];
+            }
+
+            if (y > 0) {
+                const uint8_t * above = row - width;
+
+                #pragma omp simd
+                for (x = 0; x < width; x++) {
+                    row[x] += above[x];
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Open a container and read its header, chunk index and labels. The chunk
+ * payloads are only read by mnist_chunked_read.
+ */
+mnist_chunked_file_t * mnist_chunked_open(const char * path)
+{
+    mnist_chunked_file_t * file;
+    mnist_chunked_header_t * header;
+    struct stat st;
+    uint64_t index_size;
+    uint32_t i;
+
+    file = calloc(1, sizeof(mnist_chunked_file_t));
+
+    if (NULL == file) {
+        return NULL;
+    }
+
+    header = &file->header;
+    file->fd = open(path, O_RDONLY);
+
+    if (file->fd < 0) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        free(file);
+        return NULL;
+    }
+
+    if (0 != fstat(file->fd, &st) || !read_exact(file->fd, header, sizeof(mnist_chunked_header_t), 0)) {
+        fprintf(stderr, "Could not read header from chunked file: %s\n", path);
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    header->magic_number = le_uint32(header->magic_number);
+    header->version = le_uint32(header->version);
+    header->codec = le_uint32(header->codec);
+    header->number_of_images = le_uint32(header->number_of_images);
+    header->number_of_rows = le_uint32(header->number_of_rows);
+    header->number_of_columns = le_uint32(header->number_of_columns);
+    header->images_per_chunk = le_uint32(header->images_per_chunk);
+    header->number_of_chunks = le_uint32(header->number_of_chunks);
+
+    if (MNIST_CHUNKED_MAGIC != header->magic_number || MNIST_CHUNKED_VERSION != header->version || MNIST_CODEC_GRADIENT_RLE != header->codec ||
+        0 == header->images_per_chunk ||
+        header->number_of_chunks != (header->number_of_images + header->images_per_chunk - 1) / header->images_per_chunk) {
+        fprintf(stderr, "Invalid header read from chunked file: %s\n", path);
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    index_size = ((uint64_t) header->number_of_chunks + 1) * sizeof(uint64_t);
+    file->offsets = malloc(index_size);
+    file->labels = malloc(header->number_of_images);
+
+    if (NULL == file->offsets || NULL == file->labels) {
+        fprintf(stderr, "Could not allocated memory for the index of %s\n", path);
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    if (!read_exact(file->fd, file->offsets, index_size, sizeof(mnist_chunked_header_t)) ||
+        !read_exact(file->fd, file->labels, header->number_of_images, sizeof(mnist_chunked_header_t) + index_size)) {
+        fprintf(stderr, "Could not read the index of chunked file: %s\n", path);
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    for (i = 0; i <= header->number_of_chunks; i++) {
+        file->offsets[i] = le_uint64(file->offsets[i]);
+
+        if ((i > 0 && file->offsets[i] < file->offsets[i - 1]) || file->offsets[i] > (uint64_t) st.st_size) {
+            fprintf(stderr, "Invalid chunk index in chunked file: %s\n", path);
+            mnist_chunked_close(file);
+            return NULL;
+        }
+    }
+
+    return file;
+}
+
+void mnist_chunked_close(mnist_chunked_file_t * file)
+{
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+
+    free(file->offsets);
+    free(file->labels);
+    free(file);
+}
+
+/**
+ * Split the chunks into shards contiguous ranges that differ by at most one
+ * chunk, and return the range of shard.
+ */
+void mnist_chunked_shard(const mnist_chunked_file_t * file, int shard, int shards, uint32_t * first_chunk, uint32_t * chunks)
+{
+    const uint64_t total = file->header.number_of_chunks;
+
+    *first_chunk = total * shard / shards;
+    *chunks = total * (shard + 1) / shards - *first_chunk;
+}
+
+/**
+ * Number of images stored in a range of chunks.
+ */
+uint32_t mnist_chunked_images(const mnist_chunked_file_t * file, uint32_t first_chunk, uint32_t chunks)
+{
+    const uint64_t first = (uint64_t) first_chunk * file->header.images_per_chunk;
+    uint64_t last = (uint64_t) (first_chunk + chunks) * file->header.images_per_chunk;
+
+    if (last > file->header.number_of_images) {
+        last = file->header.number_of_images;
+    }
+
+    return last > first ? last - first : 0;
+}
+
+/**
+ * Read a range of chunks with a single read and decode them in parallel into
+ * images (mnist_chunked_images * rows * columns bytes) and labels. Returns 0
+ * on success.
+ */
+int mnist_chunked_read(mnist_chunked_file_t * file, uint32_t first_chunk, uint32_t chunks, uint8_t * images, uint8_t * labels)
+{
+    const size_t image_size = (size_t) file->header.number_of_rows * file->header.number_of_columns;
+    const uint32_t per_chunk = file->header.images_per_chunk;
+    const uint64_t begin = file->offsets[first_chunk], end = file->offsets[first_chunk + chunks];
+    uint8_t * compressed;
+    double start_time;
+    int failed = 0;
+
+    if (first_chunk + chunks > file->header.number_of_chunks) {
+        fprintf(stderr, "Chunk range %u+%u past the end of the file (%u chunks)\n", first_chunk, chunks, file->header.number_of_chunks);
+        return -1;
+    }
+
+    compressed = malloc(end - begin + 1);
+
+    if (NULL == compressed) {
+        fprintf(stderr, "Could not allocated memory for %u chunks\n", chunks);
+        return -1;
+    }
+
+    start_time = omp_get_wtime();
+
+    if (!read_exact(file->fd, compressed, end - begin, begin)) {
+        fprintf(stderr, "Could not read %u chunks\n", chunks);
+        free(compressed);
+        return -1;
+    }
+
+    file->read_time = omp_get_wtime() - start_time;
+    file->compressed_bytes = end - begin;
+
+    start_time = omp_get_wtime();
+
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+    for (uint32_t c = 0; c < chunks; c++) {
+        const uint32_t chunk = first_chunk + c;
+
+        failed |= mnist_chunked_decode(compressed + (file->offsets[chunk] - begin), file->offsets[chunk + 1] - file->offsets[chunk],
+            file->header.number_of_columns, file->header.number_of_rows, mnist_chunked_images(file, chunk, 1), images + (size_t) c * per_chunk * image_size);
+    }
+
+    file->decode_time = omp_get_wtime() - start_time;
+
+    free(compressed);
+
+    if (failed) {
+        fprintf(stderr, "Corrupt chunk in range %u+%u\n", first_chunk, chunks);
+        return -1;
+    }
+
+    memcpy(labels, file->labels + (size_t) first_chunk * per_chunk, mnist_chunked_images(file, first_chunk, chunks));
+
+    return 0;
+}
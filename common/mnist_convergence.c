@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_convergence.h"
+#include "../include/mnist_sampler.h"
+
+// Random stream of the choice of the validation images, apart from those of
+// the samplers, which are keyed by rank
+#define VALIDATION_STREAM 0x76616C6964ULL
+
+void mnist_convergence_config_init(mnist_convergence_config_t * config)
+{
+    memset(config, 0, sizeof(mnist_convergence_config_t));
+    config->every = MNIST_CONVERGENCE_EVERY;
+    config->images = MNIST_CONVERGENCE_IMAGES;
+}
+
+/**
+ * Parse --target-accuracy, --time-budget, --validate-every and
+ * --validation-images at argv[*i], moving *i past the value. Returns 0 when
+ * the argument is none of them.
+ */
+int mnist_convergence_option(mnist_convergence_config_t * config, int argc, char * argv[], int * i)
+{
+    const char * value = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (NULL == value) {
+        return 0;
+    }
+
+    if (0 == strcmp(argv[*i], "--target-accuracy")) {
+        config->target = atof(value);
+
+        if (config->target <= 0.0 || config->target > 1.0) {
+            fprintf(stderr, "Target accuracy %s is not in (0, 1]\n", value);
+            exit(EXIT_FAILURE);
+        }
+    } else if (0 == strcmp(argv[*i], "--time-budget")) {
+        config->budget = atof(value);
+    } else if (0 == strcmp(argv[*i], "--validate-every")) {
+        config->every = atoi(value) > 0 ? atoi(value) : 1;
+    } else if (0 == strcmp(argv[*i], "--validation-images")) {
+        config->images = strtoul(value, NULL, 10);
+    } else {
+        return 0;
+    }
+
+    (*i)++;
+
+    return 1;
+}
+
+/**
+ * Time to accuracy runs train towards a target, or for a budget of time.
+ */
+int mnist_convergence_enabled(const mnist_convergence_config_t * config)
+{
+    return config->target > 0.0 || config->budget > 0.0;
+}
+
+static int compare_indices(const void * a, const void * b)
+{
+    const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Gather config->images distinct images, chosen at random by the seed, out of
+ * the size images of a test set into buffers carved from the arena, in the
+ * order they have in the test set. The same seed validates on the same images
+ * in every run and on every backend. With no more images asked for than the
+ * test set holds, the subset is the test set itself. Returns the images of
+ * the subset, or 0 when the buffers could not be allocated.
+ */
+uint32_t mnist_convergence_subset(const mnist_convergence_config_t * config, const uint8_t * images, const uint8_t * labels, uint32_t size, size_t image_size,
+    uint8_t ** subset_images, uint8_t ** subset_labels, mnist_arena_t * arena)
+{
+    const uint32_t count = config->images;
+    uint32_t * order, i, j, swap;
+
+    if (0 == count || count >= size) {
+        *subset_images = (uint8_t *) images;
+        *subset_labels = (uint8_t *) labels;
+        return size;
+    }
+
+    order = malloc(size * sizeof(uint32_t));
+    *subset_images = mnist_arena_alloc(arena, (size_t) count * image_size);
+    *subset_labels = mnist_arena_alloc(arena, count);
+
+    if (NULL == order || NULL == *subset_images || NULL == *subset_labels) {
+        fprintf(stderr, "Could not allocate memory for %u validation images\n", count);
+        free(order);
+        return 0;
+    }
+
+    for (i = 0; i < size; i++) {
+        order[i] = i;
+    }
+
+    // The first count entries of a partial Fisher-Yates shuffle
+    for (i = 0; i < count; i++) {
+        j = i + (uint32_t) (((mnist_random(config->seed, VALIDATION_STREAM, 0, i) >> 32) * (size - i)) >> 32);
+        swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    qsort(order, count, sizeof(uint32_t), compare_indices);
+    mnist_sampler_gather(order, count, images, labels, image_size, *subset_images, *subset_labels, 1);
+    free(order);
+
+    return count;
+}
+
+/**
+ * Create the tracker of a run of at most steps steps, with room for the
+ * validations of all of them, so that validating allocates nothing.
+ */
+mnist_convergence_t * mnist_convergence_create(const mnist_convergence_config_t * config, int steps, mnist_arena_t * arena)
+{
+    mnist_convergence_t * convergence = mnist_arena_alloc(arena, sizeof(mnist_convergence_t));
+
+    if (NULL == convergence) {
+        return NULL;
+    }
+
+    convergence->config = *config;
+    convergence->capacity = (steps > 0 ? steps : 0) / config->every + 1;
+    convergence->points = mnist_arena_alloc(arena, convergence->capacity * sizeof(mnist_convergence_point_t));
+    convergence->reached = -1;
+    convergence->best = -1;
+
+    if (NULL == convergence->points) {
+        return NULL;
+    }
+
+    return convergence;
+}
+
+/**
+ * Start the clock, right before the first step.
+ */
+void mnist_convergence_start(mnist_convergence_t * convergence)
+{
+    if (NULL != convergence) {
+        convergence->start = omp_get_wtime();
+    }
+}
+
+double mnist_convergence_elapsed(const mnist_convergence_t * convergence)
+{
+    return NULL == convergence ? 0.0 : omp_get_wtime() - convergence->start;
+}
+
+/**
+ * Whether to validate after the step of index step.
+ */
+int mnist_convergence_due(const mnist_convergence_t * convergence, int step)
+{
+    return NULL != convergence && 0 == (step + 1) % convergence->config.every;
+}
+
+/**
+ * Add the accuracy validated after the step of index step, elapsed seconds
+ * after the start, to the curve, and print and record it. Everything since
+ * elapsed counts as validation time. Returns 1 when the target is reached.
+ */
+int mnist_convergence_update(mnist_convergence_t * convergence, int step, double elapsed, double accuracy, mnist_records_t * records)
+{
+    mnist_convergence_point_t * point;
+
+    if (NULL == convergence) {
+        return 0;
+    }
+
+    convergence->validation_time += mnist_convergence_elapsed(convergence) - elapsed;
+
+    if (convergence->count < convergence->capacity) {
+        point = &convergence->points[convergence->count];
+        point->steps = step + 1;
+        point->time = elapsed;
+        point->accuracy = accuracy;
+
+        if (convergence->best < 0 || accuracy > convergence->points[convergence->best].accuracy) {
+            convergence->best = convergence->count;
+        }
+
+        if (convergence->reached < 0 && convergence->config.target > 0.0 && accuracy >= convergence->config.target) {
+            convergence->reached = convergence->count;
+        }
+
+        convergence->count++;
+    }
+
+    printf("Validation Accuracy: %.6f after %d steps, %.6f seconds\n", accuracy, step + 1, elapsed);
+
+    mnist_records_begin(records, "validation");
+    mnist_records_int(records, "step", step);
+    mnist_records_double(records, "time", elapsed);
+    mnist_records_double(records, "accuracy", accuracy);
+    mnist_records_end(records);
+
+    return convergence->reached >= 0;
+}
+
+/**
+ * Whether training is over: the target was reached, or the budget spent.
+ */
+int mnist_convergence_done(const mnist_convergence_t * convergence)
+{
+    if (NULL == convergence) {
+        return 0;
+    }
+
+    return convergence->reached >= 0 || (convergence->config.budget > 0.0 && mnist_convergence_elapsed(convergence) >= convergence->config.budget);
+}
+
+/**
+ * Print the time and the steps to the target accuracy, or the best accuracy
+ * of a run that did not reach it, and the cost of validating on images
+ * images.
+ */
+void mnist_convergence_print(const mnist_convergence_t * convergence, uint32_t images)
+{
+    const mnist_convergence_point_t * point;
+
+    if (NULL == convergence) {
+        return;
+    }
+
+    if (convergence->reached >= 0) {
+        point = &convergence->points[convergence->reached];
+        printf("Time To Accuracy: %.6f seconds to %.6f\n", point->time, convergence->config.target);
+        printf("Steps To Accuracy: %d\n", point->steps);
+    } else if (convergence->config.target > 0.0) {
+        printf("Time To Accuracy: target %.6f not reached\n", convergence->config.target);
+    }
+
+    if (convergence->best >= 0) {
+        point = &convergence->points[convergence->best];
+        printf("Best Validation Accuracy: %.6f after %d steps, %.6f seconds\n", point->accuracy, point->steps, point->time);
+    }
+
+    printf("Validation Time: %.6f seconds in %u validations of %u images\n", convergence->validation_time, convergence->count, images);
+}
+
+/**
+ * Add the target, whether it was reached and when to the open record.
+ */
+void mnist_convergence_record(const mnist_convergence_t * convergence, mnist_records_t * records)
+{
+    const mnist_convergence_point_t * point;
+
+    if (NULL == convergence) {
+        return;
+    }
+
+    mnist_records_double(records, "target_accuracy", convergence->config.target);
+    mnist_records_double(records, "time_budget", convergence->config.budget);
+    mnist_records_int(records, "reached", convergence->reached >= 0);
+
+    if (convergence->reached >= 0) {
+        point = &convergence->points[convergence->reached];
+        mnist_records_double(records, "time_to_accuracy", point->time);
+        mnist_records_int(records, "steps_to_accuracy", point->steps);
+    }
+
+    if (convergence->best >= 0) {
+        mnist_records_double(records, "best_accuracy", convergence->points[convergence->best].accuracy);
+    }
+
+    mnist_records_int(records, "validations", convergence->count);
+    mnist_records_double(records, "validation_time", convergence->validation_time);
+}
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_chunked.h"
+#include "../include/mnist_numa.h"
+
+/**
+ * Convert from the big endian format in the dataset if we're on a little endian
+ * machine.
+ */
+uint32_t map_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (
+        ((in & 0xFF000000) >> 24) |
+        ((in & 0x00FF0000) >>  8) |
+        ((in & 0x0000FF00) <<  8) |
+        ((in & 0x000000FF) << 24)
+    );
+#else
+    return in;
+#endif
+}
+
+/**
+ * Convert a label file header to host byte order and validate it.
+ */
+static int check_label_header(const char * path, mnist_label_file_header_t * header)
+{
+    header->magic_number = map_uint32(header->magic_number);
+    header->number_of_labels = map_uint32(header->number_of_labels);
+
+    if (MNIST_LABEL_MAGIC != header->magic_number) {
+        fprintf(stderr, "Invalid header read from label file: %s (%08X not %08X)\n", path, header->magic_number, MNIST_LABEL_MAGIC);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Convert an image file header to host byte order and validate it.
+ */
+static int check_image_header(const char * path, mnist_image_file_header_t * header)
+{
+    header->magic_number = map_uint32(header->magic_number);
+    header->number_of_images = map_uint32(header->number_of_images);
+    header->number_of_rows = map_uint32(header->number_of_rows);
+    header->number_of_columns = map_uint32(header->number_of_columns);
+
+    if (MNIST_IMAGE_MAGIC != header->magic_number) {
+        fprintf(stderr, "Invalid header read from image file: %s (%08X not %08X)\n", path, header->magic_number, MNIST_IMAGE_MAGIC);
+        return 0;
+    }
+
+    if (MNIST_IMAGE_WIDTH != header->number_of_rows) {
+        fprintf(stderr, "Invalid number of image rows in image file %s (%d not %d)\n", path, header->number_of_rows, MNIST_IMAGE_WIDTH);
+    }
+
+    if (MNIST_IMAGE_HEIGHT != header->number_of_columns) {
+        fprintf(stderr, "Invalid number of image columns in image file %s (%d not %d)\n", path, header->number_of_columns, MNIST_IMAGE_HEIGHT);
+    }
+
+    return 1;
+}
+
+/**
+ * Read labels from file, into a buffer of arena when it is not NULL.
+ * 
+ * File format: http://yann.lecun.com/exdb/mnist/
+ */
+uint8_t * get_labels(const char * path, uint32_t * number_of_labels, mnist_arena_t * arena)
+{
+    FILE * stream;
+    mnist_label_file_header_t header;
+    uint8_t * labels;
+
+    stream = fopen(path, "rb");
+
+    if (NULL == stream) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        return NULL;
+    }
+
+    if (1 != fread(&header, sizeof(mnist_label_file_header_t), 1, stream)) {
+        fprintf(stderr, "Could not read label file header from: %s\n", path);
+        fclose(stream);
+        return NULL;
+    }
+
+    if (!check_label_header(path, &header)) {
+        fclose(stream);
+        return NULL;
+    }
+
+    *number_of_labels = header.number_of_labels;
+
+    labels = NULL != arena ? mnist_arena_alloc(arena, *number_of_labels * sizeof(uint8_t)) : malloc(*number_of_labels * sizeof(uint8_t));
+
+    if (labels == NULL) {
+        fprintf(stderr, "Could not allocated memory for %d labels\n", *number_of_labels);
+        fclose(stream);
+        return NULL;
+    }
+
+    if (*number_of_labels != fread(labels, 1, *number_of_labels, stream)) {
+        fprintf(stderr, "Could not read %d labels from: %s\n", *number_of_labels, path);
+
+        if (NULL == arena) {
+            free(labels);
+        }
+
+        fclose(stream);
+        return NULL;
+    }
+
+    fclose(stream);
+
+    return labels;
+}
+
+/**
+ * Read images from file.
+ * 
+ * File format: http://yann.lecun.com/exdb/mnist/
+ *
+ * The OpenMP threads read the images in parallel into fresh pages, of arena
+ * when it is not NULL, each the slice of images it gets in static loops over
+ * them, so that every slice is placed on the NUMA node of the thread that
+ * trains on it.
+ */
+mnist_image_t * get_images(const char * path, uint32_t * number_of_images, mnist_arena_t * arena)
+{
+    FILE * stream;
+    mnist_image_file_header_t header;
+    mnist_image_t * images;
+
+    stream = fopen(path, "rb");
+
+    if (NULL == stream) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        return NULL;
+    }
+
+    if (1 != fread(&header, sizeof(mnist_image_file_header_t), 1, stream)) {
+        fprintf(stderr, "Could not read image file header from: %s\n", path);
+        fclose(stream);
+        return NULL;
+    }
+
+    if (!check_image_header(path, &header)) {
+        fclose(stream);
+        return NULL;
+    }
+
+    *number_of_images = header.number_of_images;
+    images = NULL != arena ? mnist_arena_alloc(arena, (size_t) *number_of_images * sizeof(mnist_image_t)) : mnist_numa_alloc((size_t) *number_of_images * sizeof(mnist_image_t));
+
+    if (images == NULL) {
+        fprintf(stderr, "Could not allocated memory for %d images\n", *number_of_images);
+        fclose(stream);
+        return NULL;
+    }
+
+    if (0 != mnist_numa_read(fileno(stream), sizeof(mnist_image_file_header_t), images, *number_of_images, sizeof(mnist_image_t))) {
+        fprintf(stderr, "Could not read %d images from: %s\n", *number_of_images, path);
+
+        if (NULL == arena) {
+            mnist_numa_free(images, (size_t) *number_of_images * sizeof(mnist_image_t));
+        }
+
+        fclose(stream);
+        return NULL;
+    }
+
+    fclose(stream);
+
+    return images;
+}
+
+/**
+ * Read a dataset from IDX files, into buffers of arena when it is not NULL.
+ */
+mnist_dataset_t * mnist_get_dataset(const char * image_path, const char * label_path, mnist_arena_t * arena)
+{
+    mnist_dataset_t * dataset;
+    uint32_t number_of_images, number_of_labels;
+
+    dataset = calloc(1, sizeof(mnist_dataset_t));
+
+    if (NULL == dataset) {
+        return NULL;
+    }
+
+    dataset->arena = arena;
+    dataset->images = get_images(image_path, &number_of_images, arena);
+
+    if (NULL == dataset->images) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    // Freed like a mapping of the file
+    if (NULL == arena) {
+        dataset->image_mapping = dataset->images;
+        dataset->image_mapping_size = (size_t) number_of_images * sizeof(mnist_image_t);
+    }
+
+    dataset->labels = get_labels(label_path, &number_of_labels, arena);
+
+    if (NULL == dataset->labels) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    if (number_of_images != number_of_labels) {
+        fprintf(stderr, "Number of images does not match number of labels (%d != %d)\n", number_of_images, number_of_labels);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    dataset->size = number_of_images;
+
+    return dataset;
+}
+
+/**
+ * Load shard (of shards) of a chunked container written by
+ * data/idx_to_chunked, which holds both the images and the labels. Only the
+ * chunks of that shard are read from disk, and they are decompressed in
+ * parallel, into buffers of arena when it is not NULL.
+ */
+mnist_dataset_t * mnist_get_chunked_dataset(const char * path, int shard, int shards, mnist_arena_t * arena)
+{
+    mnist_chunked_file_t * file;
+    mnist_dataset_t * dataset;
+    uint32_t first_chunk, chunks;
+
+    file = mnist_chunked_open(path);
+
+    if (NULL == file) {
+        return NULL;
+    }
+
+    if (MNIST_IMAGE_HEIGHT != file->header.number_of_rows || MNIST_IMAGE_WIDTH != file->header.number_of_columns) {
+        fprintf(stderr, "Invalid image dimensions in chunked file %s (%ux%u not %dx%d)\n", path, file->header.number_of_columns, file->header.number_of_rows, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT);
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    dataset = calloc(1, sizeof(mnist_dataset_t));
+
+    if (NULL == dataset) {
+        mnist_chunked_close(file);
+        return NULL;
+    }
+
+    mnist_chunked_shard(file, shard, shards, &first_chunk, &chunks);
+    dataset->size = mnist_chunked_images(file, first_chunk, chunks);
+    dataset->arena = arena;
+
+    if (NULL != arena) {
+        dataset->images = mnist_arena_alloc(arena, (size_t) dataset->size * sizeof(mnist_image_t));
+        dataset->labels = mnist_arena_alloc(arena, dataset->size);
+    } else {
+        dataset->images = malloc((size_t) dataset->size * sizeof(mnist_image_t) + 1);
+        dataset->labels = malloc(dataset->size + 1);
+    }
+
+    if (NULL == dataset->images || NULL == dataset->labels) {
+        fprintf(stderr, "Could not allocated memory for %u images\n", dataset->size);
+        mnist_chunked_close(file);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    if (0 != mnist_chunked_read(file, first_chunk, chunks, (uint8_t *) dataset->images, dataset->labels)) {
+        mnist_chunked_close(file);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    printf("Read %u images from %s: %lu bytes (%.2fx smaller) in %.6f seconds, decompressed in %.6f seconds\n",
+        dataset->size, path, (unsigned long) file->compressed_bytes,
+        (double) dataset->size * MNIST_IMAGE_SIZE / (file->compressed_bytes > 0 ? file->compressed_bytes : 1),
+        file->read_time, file->decode_time);
+
+    mnist_chunked_close(file);
+
+    return dataset;
+}
+
+/**
+ * Map a whole file read-only and apply the madvise() hints requested in flags.
+ * The mapping is shared, so every process on a node that maps the same file
+ * is served from the same page cache pages.
+ */
+static void * map_file(const char * path, size_t header_size, int flags, size_t * length)
+{
+    struct stat st;
+    void * mapping;
+    int fd, mmap_flags = MAP_SHARED;
+
+    fd = open(path, O_RDONLY);
+
+    if (-1 == fd) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        return NULL;
+    }
+
+    if (-1 == fstat(fd, &st) || (size_t) st.st_size < header_size) {
+        fprintf(stderr, "Could not read file header from: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+#ifdef MAP_POPULATE
+    if (flags & MNIST_MAP_POPULATE) {
+        mmap_flags |= MAP_POPULATE;
+    }
+#endif
+
+    mapping = mmap(NULL, st.st_size, PROT_READ, mmap_flags, fd, 0);
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (MAP_FAILED == mapping) {
+        fprintf(stderr, "Could not map file: %s\n", path);
+        return NULL;
+    }
+
+    // The hints are advisory, so failures are not fatal
+    if (flags & MNIST_MAP_SEQUENTIAL) {
+        madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (flags & MNIST_MAP_WILLNEED) {
+        madvise(mapping, st.st_size, MADV_WILLNEED);
+    }
+
+    *length = st.st_size;
+
+    return mapping;
+}
+
+/**
+ * Build a dataset whose images and labels point directly into the mapped IDX
+ * files, just past their headers. Nothing is copied: pages are faulted in as
+ * the training loop touches them, unless MNIST_MAP_POPULATE is set.
+ */
+mnist_dataset_t * mnist_map_dataset(const char * image_path, const char * label_path, int flags)
+{
+    mnist_dataset_t * dataset;
+    mnist_image_file_header_t image_header;
+    mnist_label_file_header_t label_header;
+
+    dataset = calloc(1, sizeof(mnist_dataset_t));
+
+    if (NULL == dataset) {
+        return NULL;
+    }
+
+    dataset->image_mapping = map_file(image_path, sizeof(mnist_image_file_header_t), flags, &dataset->image_mapping_size);
+
+    if (NULL == dataset->image_mapping) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    memcpy(&image_header, dataset->image_mapping, sizeof(mnist_image_file_header_t));
+
+    if (!check_image_header(image_path, &image_header)) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    if (dataset->image_mapping_size < sizeof(mnist_image_file_header_t) + (size_t) image_header.number_of_images * sizeof(mnist_image_t)) {
+        fprintf(stderr, "Could not read %d images from: %s\n", image_header.number_of_images, image_path);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    dataset->label_mapping = map_file(label_path, sizeof(mnist_label_file_header_t), flags, &dataset->label_mapping_size);
+
+    if (NULL == dataset->label_mapping) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    memcpy(&label_header, dataset->label_mapping, sizeof(mnist_label_file_header_t));
+
+    if (!check_label_header(label_path, &label_header)) {
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    if (dataset->label_mapping_size < sizeof(mnist_label_file_header_t) + (size_t) label_header.number_of_labels) {
+        fprintf(stderr, "Could not read %d labels from: %s\n", label_header.number_of_labels, label_path);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    if (image_header.number_of_images != label_header.number_of_labels) {
+        fprintf(stderr, "Number of images does not match number of labels (%d != %d)\n", image_header.number_of_images, label_header.number_of_labels);
+        mnist_free_dataset(dataset);
+        return NULL;
+    }
+
+    dataset->images = (mnist_image_t *) ((uint8_t *) dataset->image_mapping + sizeof(mnist_image_file_header_t));
+    dataset->labels = (uint8_t *) dataset->label_mapping + sizeof(mnist_label_file_header_t);
+    dataset->size = image_header.number_of_images;
+
+    return dataset;
+}
+
+/**
+ * Free all the memory allocated in a dataset. This should not be used on a
+ * batched dataset as the memory is allocated to the parent.
+ */
+void mnist_free_dataset(mnist_dataset_t * dataset)
+{
+    // The buffers of an arena are released with it
+    if (NULL != dataset->arena) {
+        free(dataset);
+        return;
+    }
+
+    if (NULL != dataset->image_mapping) {
+        munmap(dataset->image_mapping, dataset->image_mapping_size);
+    } else {
+        free(dataset->images);
+    }
+
+    if (NULL != dataset->label_mapping) {
+        munmap(dataset->label_mapping, dataset->label_mapping_size);
+    } else {
+        free(dataset->labels);
+    }
+
+    free(dataset);
+}
+
+/**
+ * Fills the batch dataset with a subset of the parent dataset.
+ */
+int mnist_batch(mnist_dataset_t * dataset, mnist_dataset_t * batch, int size, int number)
+{
+    int start_offset;
+
+    start_offset = size * number;
+
+    if (start_offset >= dataset->size) {
+        return 0;
+    }
+
+    batch->images = &dataset->images[start_offset];
+    batch->labels = &dataset->labels[start_offset];
+    batch->size = size;
+
+    if (start_offset + batch->size > dataset->size) {
+        batch->size = dataset->size - start_offset;
+    }
+
+    return 1;
+}
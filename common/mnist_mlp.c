@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_mlp.h"
+#include "../include/mnist_sampler.h"
+
+// The AVX-512 BF16 dot products are compiled for x86-64 and used when the CPU
+// running the kernels supports them
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 10)
+#include <immintrin.h>
+#define MNIST_MLP_AVX512_BF16
+#endif
+
+// Convert a pixel value from 0-255 to one from 0 to 1
+#define PIXEL_SCALE(x) (((float) (x)) / 255.0f)
+
+/**
+ * Set up the layout of an MLP from a comma separated list of hidden layer
+ * sizes, e.g. "256,256". An empty list gives the single softmax layer.
+ * Returns 0 on success.
+ */
+int mnist_mlp_init(mnist_mlp_t * mlp, int inputs, const char * hidden, int outputs)
+{
+    const char * next = hidden;
+    char * end;
+    long size;
+    int l;
+
+    memset(mlp, 0, sizeof(mnist_mlp_t));
+    mlp->sizes[0] = inputs;
+    mlp->tile = MNIST_MLP_TILE;
+
+    while (NULL != next && '\0' != *next) {
+        size = strtol(next, &end, 10);
+
+        if (end == next || size <= 0 || mlp->layers == MNIST_MLP_MAX_HIDDEN || (',' != *end && '\0' != *end)) {
+            fprintf(stderr, "Invalid hidden layer sizes: %s (up to %d comma separated sizes)\n", hidden, MNIST_MLP_MAX_HIDDEN);
+            return -1;
+        }
+
+        mlp->sizes[++mlp->layers] = size;
+        next = ',' == *end ? end + 1 : end;
+    }
+
+    mlp->sizes[++mlp->layers] = outputs;
+
+    for (l = 0; l < mlp->layers; l++) {
+        mlp->offsets[l] = mlp->parameters;
+        mlp->parameters += (size_t) mlp->sizes[l + 1] * (mlp->sizes[l] + 1);
+    }
+
+    for (l = 0; l <= mlp->layers; l++) {
+        mlp->activations += mlp->sizes[l];
+        mlp->max_size = mlp->sizes[l] > mlp->max_size ? mlp->sizes[l] : mlp->max_size;
+    }
+
+    return 0;
+}
+
+/**
+ * FNV-1a hash of the layer sizes, to tell apart checkpoints of different
+ * networks.
+ */
+uint64_t mnist_mlp_hash(const mnist_mlp_t * mlp)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    int l;
+
+    for (l = 0; l <= mlp->layers; l++) {
+        hash = (hash ^ (uint32_t) mlp->sizes[l]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * He initialisation: weights uniform in +-sqrt(6 / inputs), biases zero. The
+ * weights come from the counter-based generator, so every process draws the
+ * same network from the same seed, on one thread or (parallel set) all.
+ */
+void mnist_mlp_random_parameters(const mnist_mlp_t * mlp, float * parameters, uint64_t seed, int parallel)
+{
+    int l;
+
+    for (l = 0; l < mlp->layers; l++) {
+        size_t weights = (size_t) mlp->sizes[l + 1] * mlp->sizes[l], i;
+        float limit = sqrtf(6.0f / mlp->sizes[l]);
+        float * W = parameters + mlp->offsets[l];
+
+        #pragma omp parallel for schedule(static) if (parallel)
+        for (i = 0; i < weights; i++) {
+            W[i] = limit * ((float) (mnist_random(seed, l, 0, i) >> 40) / (float) (1 << 23) - 1.0f);
+        }
+
+        memset(W + weights, 0, mlp->sizes[l + 1] * sizeof(float));
+    }
+}
+
+/**
+ * Floats of workspace the kernels need: the activations and two deltas of a
+ * tile of images, and a value per image.
+ */
+size_t mnist_mlp_workspace_size(const mnist_mlp_t * mlp)
+{
+    return (size_t) MNIST_MLP_TILE * (mlp->activations + 2 * mlp->max_size + 1);
+}
+
+#pragma omp declare target
+
+/**
+ * bf16 keeps the sign, the 8 exponent bits and the top 7 mantissa bits of an
+ * fp32 value, so widening it is a shift.
+ */
+static inline float bf16_to_float(uint16_t value)
+{
+    uint32_t bits = (uint32_t) value << 16;
+    float result;
+
+    memcpy(&result, &bits, sizeof(result));
+
+    return result;
+}
+
+static inline uint16_t float_to_bf16(float value)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    // Keep NaNs quiet instead of rounding them to infinity
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+        return (bits >> 16) | 0x40;
+    }
+
+    return (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+}
+
+#pragma omp end declare target
+
+/**
+ * Round fp32 values to bf16, to nearest even, e.g. the parameters to the
+ * working copy the mixed precision kernels read; on all threads when
+ * parallel is set.
+ */
+void mnist_mlp_round_bf16(const float * values, uint16_t * bf16, size_t count, int parallel)
+{
+    size_t i;
+
+    #pragma omp parallel for simd schedule(static) if (parallel)
+    for (i = 0; i < count; i++) {
+        bf16[i] = float_to_bf16(values[i]);
+    }
+}
+
+void mnist_mlp_widen_bf16(const uint16_t * bf16, float * values, size_t count, int parallel)
+{
+    size_t i;
+
+    #pragma omp parallel for simd schedule(static) if (parallel)
+    for (i = 0; i < count; i++) {
+        values[i] = bf16_to_float(bf16[i]);
+    }
+}
+
+/**
+ * Add bf16 values into others, rounding every sum once, e.g. to reduce bf16
+ * gradient messages.
+ */
+void mnist_mlp_add_bf16(const uint16_t * in, uint16_t * inout, size_t count)
+{
+    size_t i;
+
+    #pragma omp simd
+    for (i = 0; i < count; i++) {
+        inout[i] = float_to_bf16(bf16_to_float(in[i]) + bf16_to_float(inout[i]));
+    }
+}
+
+#pragma omp declare target
+
+/**
+ * The dot products of a weight row with the inputs of the n images of a tile.
+ * Four images share every load of the weight row.
+ */
+static void dot_rows(const float * w, const float * x, int inputs, uint32_t n, float * sums)
+{
+    uint32_t s = 0;
+    int i;
+
+    for (; s + 4 <= n; s += 4) {
+        const float * x0 = x + (size_t) s * inputs, * x1 = x0 + inputs, * x2 = x1 + inputs, * x3 = x2 + inputs;
+        float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+
+        #pragma omp simd reduction(+:sum0, sum1, sum2, sum3)
+        for (i = 0; i < inputs; i++) {
+            sum0 += w[i] * x0[i];
+            sum1 += w[i] * x1[i];
+            sum2 += w[i] * x2[i];
+            sum3 += w[i] * x3[i];
+        }
+
+        sums[s] = sum0;
+        sums[s + 1] = sum1;
+        sums[s + 2] = sum2;
+        sums[s + 3] = sum3;
+    }
+
+    for (; s < n; s++) {
+        const float * xs = x + (size_t) s * inputs;
+        float sum = 0.0f;
+
+        #pragma omp simd reduction(+:sum)
+        for (i = 0; i < inputs; i++) {
+            sum += w[i] * xs[i];
+        }
+
+        sums[s] = sum;
+    }
+}
+
+#ifdef MNIST_MLP_AVX512_BF16
+/**
+ * dot_rows_bf16 with the AVX-512 BF16 dot product instruction, which
+ * multiplies pairs of bf16 values and accumulates them in fp32.
+ */
+__attribute__((target("avx512f,avx512bw,avx512bf16")))
+static void dot_rows_avx512_bf16(const uint16_t * w, const uint16_t * x, int inputs, uint32_t n, float * sums)
+{
+    const __mmask32 tail = (__mmask32) ((1ULL << (inputs % 32)) - 1);
+    uint32_t s = 0;
+    int i;
+
+    for (; s + 4 <= n; s += 4) {
+        const uint16_t * x0 = x + (size_t) s * inputs, * x1 = x0 + inputs, * x2 = x1 + inputs, * x3 = x2 + inputs;
+        __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps(), sum2 = _mm512_setzero_ps(), sum3 = _mm512_setzero_ps();
+        __m512bh wv;
+
+        for (i = 0; i + 32 <= inputs; i += 32) {
+            wv = (__m512bh) _mm512_loadu_si512(w + i);
+            sum0 = _mm512_dpbf16_ps(sum0, wv, (__m512bh) _mm512_loadu_si512(x0 + i));
+            sum1 = _mm512_dpbf16_ps(sum1, wv, (__m512bh) _mm512_loadu_si512(x1 + i));
+            sum2 = _mm512_dpbf16_ps(sum2, wv, (__m512bh) _mm512_loadu_si512(x2 + i));
+            sum3 = _mm512_dpbf16_ps(sum3, wv, (__m512bh) _mm512_loadu_si512(x3 + i));
+        }
+
+        if (i < inputs) {
+            wv = (__m512bh) _mm512_maskz_loadu_epi16(tail, w + i);
+            sum0 = _mm512_dpbf16_ps(sum0, wv, (__m512bh) _mm512_maskz_loadu_epi16(tail, x0 + i));
+            sum1 = _mm512_dpbf16_ps(sum1, wv, (__m512bh) _mm512_maskz_loadu_epi16(tail, x1 + i));
+            sum2 = _mm512_dpbf16_ps(sum2, wv, (__m512bh) _mm512_maskz_loadu_epi16(tail, x2 + i));
+            sum3 = _mm512_dpbf16_ps(sum3, wv, (__m512bh) _mm512_maskz_loadu_epi16(tail, x3 + i));
+        }
+
+        sums[s] = _mm512_reduce_add_ps(sum0);
+        sums[s + 1] = _mm512_reduce_add_ps(sum1);
+        sums[s + 2] = _mm512_reduce_add_ps(sum2);
+        sums[s + 3] = _mm512_reduce_add_ps(sum3);
+    }
+
+    for (; s < n; s++) {
+        const uint16_t * xs = x + (size_t) s * inputs;
+        __m512 sum = _mm512_setzero_ps();
+
+        for (i = 0; i + 32 <= inputs; i += 32) {
+            sum = _mm512_dpbf16_ps(sum, (__m512bh) _mm512_loadu_si512(w + i), (__m512bh) _mm512_loadu_si512(xs + i));
+        }
+
+        if (i < inputs) {
+            sum = _mm512_dpbf16_ps(sum, (__m512bh) _mm512_maskz_loadu_epi16(tail, w + i), (__m512bh) _mm512_maskz_loadu_epi16(tail, xs + i));
+        }
+
+        sums[s] = _mm512_reduce_add_ps(sum);
+    }
+}
+#endif
+
+/**
+ * dot_rows for bf16 weights and inputs, accumulated in fp32. Without AVX-512
+ * BF16 the values are widened to fp32, which is exact.
+ */
+static void dot_rows_bf16(const uint16_t * w, const uint16_t * x, int inputs, uint32_t n, float * sums)
+{
+    uint32_t s = 0;
+    int i;
+
+#ifdef MNIST_MLP_AVX512_BF16
+    if (__builtin_cpu_supports("avx512bf16")) {
+        dot_rows_avx512_bf16(w, x, inputs, n, sums);
+        return;
+    }
+#endif
+
+    for (; s + 4 <= n; s += 4) {
+        const uint16_t * x0 = x + (size_t) s * inputs, * x1 = x0 + inputs, * x2 = x1 + inputs, * x3 = x2 + inputs;
+        float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+
+        #pragma omp simd reduction(+:sum0, sum1, sum2, sum3)
+        for (i = 0; i < inputs; i++) {
+            const float wi = bf16_to_float(w[i]);
+
+            sum0 += wi * bf16_to_float(x0[i]);
+            sum1 += wi * bf16_to_float(x1[i]);
+            sum2 += wi * bf16_to_float(x2[i]);
+            sum3 += wi * bf16_to_float(x3[i]);
+        }
+
+        sums[s] = sum0;
+        sums[s + 1] = sum1;
+        sums[s + 2] = sum2;
+        sums[s + 3] = sum3;
+    }
+
+    for (; s < n; s++) {
+        const uint16_t * xs = x + (size_t) s * inputs;
+        float sum = 0.0f;
+
+        #pragma omp simd reduction(+:sum)
+        for (i = 0; i < inputs; i++) {
+            sum += bf16_to_float(w[i]) * bf16_to_float(xs[i]);
+        }
+
+        sums[s] = sum;
+    }
+}
+
+/**
+ * Forward propagate a tile of n images whose scaled pixels are in the first
+ * activations. Hidden layers apply ReLU; the output layer writes logits. With
+ * bf16 set the parameters and activations are bf16, and only the logits are
+ * kept in fp32 for the softmax.
+ *
+ * The kernels below use orphaned worksharing loops: called by a whole team
+ * they split the work between its threads, called outside a parallel region
+ * a single thread runs every iteration.
+ */
+static void forward(const mnist_mlp_t * mlp, const void * parameters, int bf16, uint32_t n, void * activations, float * logits)
+{
+    const size_t element = bf16 ? sizeof(uint16_t) : sizeof(float);
+    uint8_t * in = activations, * out;
+    int l;
+
+    for (l = 0; l < mlp->layers; l++) {
+        const int inputs = mlp->sizes[l], outputs = mlp->sizes[l + 1];
+        const int last = l == mlp->layers - 1;
+        const size_t weights = mlp->offsets[l], biases = weights + (size_t) outputs * inputs;
+        int o;
+
+        out = last ? (uint8_t *) logits : in + (size_t) n * inputs * element;
+
+        #pragma omp for schedule(static)
+        for (o = 0; o < outputs; o++) {
+            float sums[MNIST_MLP_TILE], b, value;
+            uint32_t s;
+
+            if (bf16) {
+                const uint16_t * W = parameters;
+
+                dot_rows_bf16(W + weights + (size_t) o * inputs, (const uint16_t *) in, inputs, n, sums);
+                b = bf16_to_float(W[biases + o]);
+            } else {
+                const float * W = parameters;
+
+                dot_rows(W + weights + (size_t) o * inputs, (const float *) in, inputs, n, sums);
+                b = W[biases + o];
+            }
+
+            for (s = 0; s < n; s++) {
+                value = sums[s] + b;
+
+                if (last) {
+                    logits[(size_t) s * outputs + o] = value;
+                } else if (bf16) {
+                    ((uint16_t *) out)[(size_t) s * outputs + o] = float_to_bf16(value < 0.0f ? 0.0f : value);
+                } else {
+                    ((float *) out)[(size_t) s * outputs + o] = value < 0.0f ? 0.0f : value;
+                }
+            }
+        }
+
+        in = out;
+    }
+}
+
+/**
+ * Scale the pixels of a tile of images into the input activations.
+ */
+static void load_tile(const mnist_mlp_t * mlp, const uint8_t * images, uint32_t n, int bf16, void * activations)
+{
+    const int inputs = mlp->sizes[0];
+    uint32_t s;
+    int i;
+
+    #pragma omp for schedule(static)
+    for (s = 0; s < n; s++) {
+        const uint8_t * image = images + (size_t) s * inputs;
+
+        if (bf16) {
+            uint16_t * x = (uint16_t *) activations + (size_t) s * inputs;
+
+            #pragma omp simd
+            for (i = 0; i < inputs; i++) {
+                x[i] = float_to_bf16(PIXEL_SCALE(image[i]));
+            }
+        } else {
+            float * x = (float *) activations + (size_t) s * inputs;
+
+            #pragma omp simd
+            for (i = 0; i < inputs; i++) {
+                x[i] = PIXEL_SCALE(image[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Forward and back propagate every tile of a batch, adding into the fp32
+ * gradient. Every thread returns the loss of the whole batch.
+ */
+static float accumulate(const mnist_mlp_t * mlp, const void * parameters, int bf16, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    const int layers = mlp->layers, labels_count = mlp->sizes[layers];
+    const size_t element = bf16 ? sizeof(uint16_t) : sizeof(float);
+    float * delta = workspace + (size_t) MNIST_MLP_TILE * mlp->activations;
+    float * next_delta = delta + (size_t) MNIST_MLP_TILE * mlp->max_size;
+    float * losses = next_delta + (size_t) MNIST_MLP_TILE * mlp->max_size;
+    float total_loss = 0.0f;
+    uint32_t first, n, s;
+    int l;
+
+    for (first = 0; first < count; first += n) {
+        uint8_t * layer_activations[MNIST_MLP_MAX_HIDDEN + 1];
+
+        n = count - first < (uint32_t) mlp->tile ? count - first : (uint32_t) mlp->tile;
+
+        for (l = 0, layer_activations[0] = (uint8_t *) workspace; l < layers - 1; l++) {
+            layer_activations[l + 1] = layer_activations[l] + (size_t) n * mlp->sizes[l] * element;
+        }
+
+        load_tile(mlp, images + (size_t) first * mlp->sizes[0], n, bf16, workspace);
+        forward(mlp, parameters, bf16, n, workspace, delta);
+
+        // Softmax and cross entropy over the logits in place; the output
+        // delta is the softmax minus the one hot label
+        #pragma omp for schedule(static)
+        for (s = 0; s < n; s++) {
+            float * d = delta + (size_t) s * labels_count;
+            float max = d[0], sum = 0.0f;
+            int o;
+
+            for (o = 1; o < labels_count; o++) {
+                max = d[o] > max ? d[o] : max;
+            }
+
+            for (o = 0; o < labels_count; o++) {
+                d[o] = expf(d[o] - max);
+                sum += d[o];
+            }
+
+            for (o = 0; o < labels_count; o++) {
+                d[o] /= sum;
+            }
+
+            losses[s] = 0.0f - logf(d[labels[first + s]]);
+            d[labels[first + s]] -= 1.0f;
+        }
+
+        for (l = layers - 1; l >= 0; l--) {
+            const int inputs = mlp->sizes[l], outputs = mlp->sizes[l + 1];
+            const size_t weights = mlp->offsets[l];
+            const uint8_t * x = layer_activations[l];
+            float * W_grad = gradient + weights, * b_grad = W_grad + (size_t) outputs * inputs, * swap;
+            int o, i;
+
+            // Weight gradient: rows are split between threads, so no two
+            // threads write the same element
+            #pragma omp for schedule(static)
+            for (o = 0; o < outputs; o++) {
+                float * g = W_grad + (size_t) o * inputs;
+
+                for (s = 0; s < n; s++) {
+                    const float d = delta[(size_t) s * outputs + o];
+
+                    if (0.0f == d) {
+                        continue;
+                    }
+
+                    if (bf16) {
+                        const uint16_t * xs = (const uint16_t *) x + (size_t) s * inputs;
+
+                        #pragma omp simd
+                        for (i = 0; i < inputs; i++) {
+                            g[i] += d * bf16_to_float(xs[i]);
+                        }
+                    } else {
+                        const float * xs = (const float *) x + (size_t) s * inputs;
+
+                        #pragma omp simd
+                        for (i = 0; i < inputs; i++) {
+                            g[i] += d * xs[i];
+                        }
+                    }
+
+                    b_grad[o] += d;
+                }
+            }
+
+            if (0 == l) {
+                break;
+            }
+
+            // Propagate the delta through the weights and the ReLU
+            #pragma omp for schedule(static)
+            for (s = 0; s < n; s++) {
+                const float * d = delta + (size_t) s * outputs;
+                float * nd = next_delta + (size_t) s * inputs;
+
+                memset(nd, 0, inputs * sizeof(float));
+
+                for (o = 0; o < outputs; o++) {
+                    const float ds = d[o];
+
+                    if (0.0f == ds) {
+                        continue;
+                    }
+
+                    if (bf16) {
+                        const uint16_t * w = (const uint16_t *) parameters + weights + (size_t) o * inputs;
+
+                        #pragma omp simd
+                        for (i = 0; i < inputs; i++) {
+                            nd[i] += ds * bf16_to_float(w[i]);
+                        }
+                    } else {
+                        const float * w = (const float *) parameters + weights + (size_t) o * inputs;
+
+                        #pragma omp simd
+                        for (i = 0; i < inputs; i++) {
+                            nd[i] += ds * w[i];
+                        }
+                    }
+                }
+
+                // ReLU outputs are never negative, so a zero bf16 or fp32
+                // pattern is exactly an inactive neuron
+                if (bf16) {
+                    const uint16_t * xs = (const uint16_t *) x + (size_t) s * inputs;
+
+                    #pragma omp simd
+                    for (i = 0; i < inputs; i++) {
+                        nd[i] = 0 != xs[i] ? nd[i] : 0.0f;
+                    }
+                } else {
+                    const float * xs = (const float *) x + (size_t) s * inputs;
+
+                    #pragma omp simd
+                    for (i = 0; i < inputs; i++) {
+                        nd[i] = xs[i] > 0.0f ? nd[i] : 0.0f;
+                    }
+                }
+            }
+
+            swap = delta;
+            delta = next_delta;
+            next_delta = swap;
+        }
+
+        // The worksharing loops end with barriers, so every thread sees all
+        // the losses of the tile
+        for (s = 0; s < n; s++) {
+            total_loss += losses[s];
+        }
+
+        #pragma omp barrier
+    }
+
+    return total_loss;
+}
+
+/**
+ * The whole team forward and back propagates a batch.
+ */
+static float accumulate_parallel(const mnist_mlp_t * mlp, const void * parameters, int bf16, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    float total_loss = 0.0f;
+
+    #pragma omp parallel
+    {
+        float thread_loss = accumulate(mlp, parameters, bf16, images, labels, count, gradient, workspace);
+
+        #pragma omp single
+        total_loss = thread_loss;
+    }
+
+    return total_loss;
+}
+
+/**
+ * Accumulate the gradient and loss contributions of a batch of images.
+ */
+float mnist_mlp_accumulate(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    return accumulate(mlp, parameters, 0, images, labels, count, gradient, workspace);
+}
+
+/**
+ * Accumulate a batch using all OpenMP threads. The threads share the tiles:
+ * each kernel splits its rows between them, so the gradient needs no private
+ * copies however large the network is.
+ */
+float mnist_mlp_accumulate_parallel(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    return accumulate_parallel(mlp, parameters, 0, images, labels, count, gradient, workspace);
+}
+
+/**
+ * mnist_mlp_accumulate with the bf16 working copy of the parameters. The
+ * activations are bf16 too; the logits, deltas and gradient stay fp32.
+ */
+float mnist_mlp_accumulate_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    return accumulate(mlp, weights, 1, images, labels, count, gradient, workspace);
+}
+
+float mnist_mlp_accumulate_bf16_parallel(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace)
+{
+    return accumulate_parallel(mlp, weights, 1, images, labels, count, gradient, workspace);
+}
+
+#pragma omp end declare target
+
+/**
+ * Zero the gradient, every row of weights and its bias by the thread that
+ * accumulates into them in the parallel kernels. The rows are first touched,
+ * and so placed, on the NUMA node of that thread when the gradient is fresh
+ * memory. Called by the whole team, or outside a parallel region.
+ */
+void mnist_mlp_zero_gradient(const mnist_mlp_t * mlp, float * gradient)
+{
+    int l, o;
+
+    for (l = 0; l < mlp->layers; l++) {
+        const int inputs = mlp->sizes[l], outputs = mlp->sizes[l + 1];
+        float * W_grad = gradient + mlp->offsets[l], * b_grad = W_grad + (size_t) outputs * inputs;
+
+        #pragma omp for schedule(static)
+        for (o = 0; o < outputs; o++) {
+            memset(W_grad + (size_t) o * inputs, 0, inputs * sizeof(float));
+            b_grad[o] = 0.0f;
+        }
+    }
+}
+
+static uint32_t count_correct(const mnist_mlp_t * mlp, const void * parameters, int bf16, const uint8_t * images, const uint8_t * labels, uint32_t count, float * workspace)
+{
+    const int labels_count = mlp->sizes[mlp->layers];
+    float * logits = workspace + (size_t) MNIST_MLP_TILE * mlp->activations;
+    uint32_t first, n, s, correct = 0;
+    int o, predict;
+
+    for (first = 0; first < count; first += n) {
+        n = count - first < (uint32_t) mlp->tile ? count - first : (uint32_t) mlp->tile;
+
+        load_tile(mlp, images + (size_t) first * mlp->sizes[0], n, bf16, workspace);
+        forward(mlp, parameters, bf16, n, workspace, logits);
+
+        for (s = 0; s < n; s++) {
+            for (o = 1, predict = 0; o < labels_count; o++) {
+                if (logits[s * labels_count + predict] < logits[s * labels_count + o]) {
+                    predict = o;
+                }
+            }
+
+            correct += predict == labels[first + s];
+        }
+    }
+
+    return correct;
+}
+
+/**
+ * Count the images that the network classifies correctly.
+ */
+uint32_t mnist_mlp_count_correct(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * workspace)
+{
+    return count_correct(mlp, parameters, 0, images, labels, count, workspace);
+}
+
+uint32_t mnist_mlp_count_correct_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * workspace)
+{
+    return count_correct(mlp, weights, 1, images, labels, count, workspace);
+}
+
+static void probabilities(const mnist_mlp_t * mlp, const void * parameters, int bf16, const uint8_t * images, uint32_t count, float * probabilities, float * workspace)
+{
+    const int labels_count = mlp->sizes[mlp->layers];
+    float * logits = workspace + (size_t) MNIST_MLP_TILE * mlp->activations;
+    float max, sum;
+    uint32_t first, n, s;
+    int o;
+
+    for (first = 0; first < count; first += n) {
+        n = count - first < (uint32_t) mlp->tile ? count - first : (uint32_t) mlp->tile;
+
+        load_tile(mlp, images + (size_t) first * mlp->sizes[0], n, bf16, workspace);
+        forward(mlp, parameters, bf16, n, workspace, logits);
+
+        for (s = 0; s < n; s++) {
+            const float * z = logits + (size_t) s * labels_count;
+            float * p = probabilities + (size_t) (first + s) * labels_count;
+
+            for (o = 1, max = z[0]; o < labels_count; o++) {
+                max = z[o] > max ? z[o] : max;
+            }
+
+            for (o = 0, sum = 0.0f; o < labels_count; o++) {
+                p[o] = expf(z[o] - max);
+                sum += p[o];
+            }
+
+            for (o = 0; o < labels_count; o++) {
+                p[o] /= sum;
+            }
+        }
+    }
+}
+
+/**
+ * Class probabilities of a batch of images, labels floats per image.
+ */
+void mnist_mlp_probabilities(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, uint32_t count, float * probabilities_out, float * workspace)
+{
+    probabilities(mlp, parameters, 0, images, count, probabilities_out, workspace);
+}
+
+void mnist_mlp_probabilities_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, uint32_t count, float * probabilities_out, float * workspace)
+{
+    probabilities(mlp, weights, 1, images, count, probabilities_out, workspace);
+}
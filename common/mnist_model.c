@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_model.h"
+
+/**
+ * Create the softmax network, or with hidden the multi-layer perceptron with
+ * hidden layers of those sizes. Returns NULL, after saying why, when it does
+ * not fit in the arena.
+ */
+mnist_model_t * mnist_model_create(const char * hidden, int bf16, const mnist_optimizer_config_t * optimizer, mnist_backend_t * backend, mnist_arena_t * arena)
+{
+    mnist_model_t * model = mnist_arena_alloc(arena, sizeof(mnist_model_t));
+
+    if (NULL == model) {
+        return NULL;
+    }
+
+    model->backend = backend;
+
+    if (NULL == hidden) {
+        model->optimizer = mnist_optimizer_create(optimizer, mnist_model_parameter_bytes(model) / sizeof(float), arena);
+
+        return NULL == model->optimizer ? NULL : model;
+    }
+
+    if (0 != mnist_mlp_init(&model->mlp, MNIST_IMAGE_SIZE, hidden, MNIST_LABELS)) {
+        return NULL;
+    }
+
+    // The gradient is left untouched until the threads zero their rows
+    model->parameters = mnist_arena_alloc(arena, model->mlp.parameters * sizeof(float));
+    model->mlp_gradient = mnist_arena_alloc(arena, model->mlp.parameters * sizeof(float));
+    model->workspace = mnist_arena_alloc(arena, mnist_mlp_workspace_size(&model->mlp) * sizeof(float));
+
+    if (bf16) {
+        model->weights = mnist_arena_alloc(arena, model->mlp.parameters * sizeof(uint16_t));
+        model->message = backend->distributed ? mnist_arena_alloc(arena, model->mlp.parameters * sizeof(uint16_t)) : NULL;
+    }
+
+    if (NULL == model->parameters || NULL == model->mlp_gradient || NULL == model->workspace ||
+        (bf16 && (NULL == model->weights || (backend->distributed && NULL == model->message)))) {
+        fprintf(stderr, "Could not allocate memory for a network of %lu parameters\n", (unsigned long) model->mlp.parameters);
+        return NULL;
+    }
+
+    model->optimizer = mnist_optimizer_create(optimizer, model->mlp.parameters, arena);
+
+    return NULL == model->optimizer ? NULL : model;
+}
+
+/**
+ * The buffers of the model are released with the arena.
+ */
+void mnist_model_free(mnist_model_t * model)
+{
+    mnist_optimizer_free(model->optimizer);
+    mnist_perf_free(model->perf);
+    mnist_steal_free(model->steal);
+}
+
+/**
+ * The parameters as saved in checkpoints and broadcast between processes.
+ */
+void * mnist_model_parameters(mnist_model_t * model)
+{
+    return NULL != model->parameters ? (void *) model->parameters : (void *) &model->network;
+}
+
+size_t mnist_model_parameter_bytes(mnist_model_t * model)
+{
+    return NULL != model->parameters ? model->mlp.parameters * sizeof(float) : sizeof(neural_network_t);
+}
+
+/**
+ * The gradient, laid out like the parameters.
+ */
+float * mnist_model_gradient(mnist_model_t * model)
+{
+    return NULL != model->parameters ? model->mlp_gradient : (float *) &model->gradient;
+}
+
+/**
+ * Identifies the shape of the network in checkpoints, zero for softmax.
+ */
+uint64_t mnist_model_hash(mnist_model_t * model)
+{
+    return NULL != model->parameters ? mnist_mlp_hash(&model->mlp) : 0;
+}
+
+/**
+ * Refresh the bf16 working copy after the master parameters changed.
+ */
+void mnist_model_round_weights(mnist_model_t * model)
+{
+    if (NULL != model->weights) {
+        mnist_mlp_round_bf16(model->parameters, model->weights, model->mlp.parameters, model->backend->parallel);
+    }
+}
+
+/**
+ * Initialize the master parameters; the working copy is rounded once they
+ * are the same on every process.
+ */
+void mnist_model_random_weights(mnist_model_t * model, uint64_t seed)
+{
+    if (NULL != model->parameters) {
+        mnist_mlp_random_parameters(&model->mlp, model->parameters, seed, model->backend->parallel);
+    } else {
+        neural_network_random_weights(&model->network);
+    }
+}
+
+void mnist_model_zero_gradient(mnist_model_t * model)
+{
+    // On all threads, the rows of the gradient are zeroed by the threads that
+    // accumulate into them, and so placed on their NUMA nodes
+    if (NULL != model->parameters && model->backend->parallel) {
+        #pragma omp parallel
+        mnist_mlp_zero_gradient(&model->mlp, model->mlp_gradient);
+    } else if (NULL != model->parameters) {
+        memset(model->mlp_gradient, 0, model->mlp.parameters * sizeof(float));
+    } else {
+        memset(&model->gradient, 0, sizeof(neural_network_gradient_t));
+    }
+}
+
+/**
+ * Accumulate the gradient and loss contributions of every image in a batch,
+ * on one thread or on all of them.
+ */
+float mnist_model_accumulate(mnist_model_t * model, mnist_dataset_t * batch)
+{
+    const int parallel = model->backend->parallel;
+    float loss;
+
+    mnist_perf_begin(model->perf, MNIST_PERF_GRADIENT);
+
+    if (NULL != model->weights) {
+        loss = (parallel ? mnist_mlp_accumulate_bf16_parallel : mnist_mlp_accumulate_bf16)(&model->mlp, model->weights, (uint8_t *) batch->images, batch->labels,
+            batch->size, model->mlp_gradient, model->workspace);
+    } else if (NULL != model->parameters) {
+        loss = (parallel ? mnist_mlp_accumulate_parallel : mnist_mlp_accumulate)(&model->mlp, model->parameters, (uint8_t *) batch->images, batch->labels,
+            batch->size, model->mlp_gradient, model->workspace);
+    } else {
+        loss = parallel ? neural_network_accumulate_parallel(batch, &model->network, &model->gradient, model->steal) :
+            neural_network_accumulate(batch, &model->network, &model->gradient);
+    }
+
+    mnist_perf_end(model->perf);
+
+    return loss;
+}
+
+/**
+ * Update the parameters with the optimizer from the gradient summed over size
+ * training examples.
+ */
+void mnist_model_apply_gradient(mnist_model_t * model, uint32_t size)
+{
+    mnist_perf_begin(model->perf, MNIST_PERF_UPDATE);
+    mnist_optimizer_step(model->optimizer, mnist_model_parameters(model), mnist_model_gradient(model), size, model->backend->parallel);
+    mnist_model_round_weights(model);
+    mnist_perf_end(model->perf);
+}
+
+/**
+ * Sum the gradients of all processes.
+ */
+void mnist_model_reduce_gradient(mnist_model_t * model)
+{
+    mnist_backend_t * backend = model->backend;
+    const size_t count = mnist_model_parameter_bytes(model) / sizeof(float);
+
+    // In bf16 the gradient message is half the size
+    if (NULL != model->message) {
+        mnist_mlp_round_bf16(model->mlp_gradient, model->message, count, backend->parallel);
+        backend->allreduce(backend, model->message, count, MNIST_BACKEND_BF16, MNIST_BACKEND_SUM);
+        mnist_mlp_widen_bf16(model->message, model->mlp_gradient, count, backend->parallel);
+    } else {
+        backend->allreduce(backend, mnist_model_gradient(model), count, MNIST_BACKEND_FLOAT, MNIST_BACKEND_SUM);
+    }
+}
+
+/**
+ * Sum the local gradients and losses of all processes and update the
+ * parameters over size training examples. Returns the global loss.
+ */
+float mnist_model_update(mnist_model_t * model, float local_loss, uint32_t size)
+{
+    mnist_backend_t * backend = model->backend;
+
+    if (backend->distributed) {
+        mnist_perf_begin(model->perf, MNIST_PERF_REDUCE);
+        backend->allreduce(backend, &local_loss, 1, MNIST_BACKEND_FLOAT, MNIST_BACKEND_SUM);
+        mnist_model_reduce_gradient(model);
+        mnist_perf_end(model->perf);
+    }
+
+    mnist_model_apply_gradient(model, size);
+
+    return local_loss;
+}
+
+/**
+ * Count the pages of the gradient that every thread accumulates into on its
+ * own NUMA node, and elsewhere: the private gradients of the softmax
+ * network, or the rows of the multi-layer perceptron's gradient that each
+ * thread owns in the kernels.
+ */
+void mnist_model_gradient_locality(mnist_model_t * model, mnist_numa_locality_t * locality)
+{
+    if (NULL == model->parameters) {
+        neural_network_gradient_locality(locality);
+        return;
+    }
+
+    #pragma omp parallel
+    {
+        mnist_numa_locality_t mine = { 0 };
+        int l, o;
+
+        for (l = 0; l < model->mlp.layers; l++) {
+            const int inputs = model->mlp.sizes[l], outputs = model->mlp.sizes[l + 1];
+
+            #pragma omp for schedule(static) nowait
+            for (o = 0; o < outputs; o++) {
+                mnist_numa_page_locality(model->mlp_gradient + model->mlp.offsets[l] + (size_t) o * inputs, inputs * sizeof(float), -1, &mine);
+            }
+        }
+
+        #pragma omp critical
+        {
+            locality->local += mine.local;
+            locality->remote += mine.remote;
+            locality->unknown += mine.unknown;
+        }
+    }
+}
+
+/**
+ * Count the images of a dataset that a neural network classifies correctly.
+ */
+int mnist_model_count_correct(mnist_model_t * model, mnist_dataset_t * dataset)
+{
+    neural_network_t * network = &model->network;
+    float activations[MNIST_LABELS], max_activation;
+    int i, j, correct, predict;
+
+    if (NULL != model->weights) {
+        return mnist_mlp_count_correct_bf16(&model->mlp, model->weights, (uint8_t *) dataset->images, dataset->labels, dataset->size, model->workspace);
+    } else if (NULL != model->parameters) {
+        return mnist_mlp_count_correct(&model->mlp, model->parameters, (uint8_t *) dataset->images, dataset->labels, dataset->size, model->workspace);
+    }
+
+    // Loop through the dataset
+    for (i = 0, correct = 0; i < dataset->size; i++) {
+        // Calculate the activations for each image using the neural network
+        neural_network_hypothesis(&dataset->images[i], network, activations);
+
+        // Set predict to the index of the greatest activation
+        for (j = 0, predict = 0, max_activation = activations[0]; j < MNIST_LABELS; j++) {
+            if (max_activation < activations[j]) {
+                max_activation = activations[j];
+                predict = j;
+            }
+        }
+
+        // Increment the correct count if we predicted the right label
+        if (predict == dataset->labels[i]) {
+            correct++;
+        }
+    }
+
+    return correct;
+}
+
+/**
+ * Calculate the accuracy of the predictions of a neural network on a dataset.
+ */
+float mnist_model_accuracy(mnist_model_t * model, mnist_dataset_t * dataset)
+{
+    // Return the percentage we predicted correctly as the accuracy
+    return ((float) mnist_model_count_correct(model, dataset)) / ((float) dataset->size);
+}
+
+/**
+ * Calculate the accuracy of a neural network over one epoch of a stream.
+ */
+float mnist_model_stream_accuracy(mnist_model_t * model, mnist_stream_t * stream)
+{
+    mnist_stream_window_t window;
+    mnist_dataset_t batch;
+    uint32_t i;
+    int correct = 0;
+
+    for (i = 0; i < mnist_stream_windows(stream); i++) {
+        if (0 != mnist_stream_next(stream, &window)) {
+            model->backend->abort(model->backend, EXIT_FAILURE);
+        }
+
+        batch.images = (mnist_image_t *) window.images;
+        batch.labels = window.labels;
+        batch.size = window.size;
+
+        correct += mnist_model_count_correct(model, &batch);
+    }
+
+    return ((float) correct) / ((float) mnist_stream_size(stream));
+}
+
+/**
+ * Run one step of gradient descent where every process only holds its own
+ * shard of the training set, then update the neural network on all processes.
+ */
+float mnist_model_shard_step(mnist_model_t * model, mnist_dataset_t * shard, uint32_t train_size)
+{
+    float local_loss;
+
+    mnist_model_zero_gradient(model);
+
+    local_loss = mnist_model_accumulate(model, shard);
+
+    return mnist_model_update(model, local_loss, train_size);
+}
+
+/**
+ * Run one step of gradient descent where every process accumulates the
+ * gradient over an epoch of windows of its own shard streamed from disk, then
+ * update the neural network on all processes.
+ */
+float mnist_model_stream_step(mnist_model_t * model, mnist_stream_t * stream, uint32_t train_size)
+{
+    mnist_stream_window_t window;
+    mnist_dataset_t batch;
+    float local_loss = 0.0f;
+    uint32_t i;
+
+    mnist_model_zero_gradient(model);
+
+    for (i = 0; i < mnist_stream_windows(stream); i++) {
+        if (0 != mnist_stream_next(stream, &window)) {
+            model->backend->abort(model->backend, EXIT_FAILURE);
+        }
+
+        batch.images = (mnist_image_t *) window.images;
+        batch.labels = window.labels;
+        batch.size = window.size;
+
+        local_loss += mnist_model_accumulate(model, &batch);
+    }
+
+    return mnist_model_update(model, local_loss, train_size);
+}
+
+/**
+ * Run one step of gradient descent where every process accumulates the
+ * gradient over an epoch of its own shard streamed from the pipeline, then
+ * update the neural network on all processes.
+ */
+float mnist_model_pipeline_step(mnist_model_t * model, mnist_pipeline_t * pipeline, uint32_t train_size)
+{
+    mnist_pipeline_batch_t slot;
+    mnist_dataset_t batch;
+    float local_loss = 0.0f;
+    uint32_t i;
+
+    mnist_model_zero_gradient(model);
+
+    for (i = 0; i < mnist_pipeline_batches(pipeline); i++) {
+        mnist_pipeline_next(pipeline, &slot);
+
+        batch.images = (mnist_image_t *) slot.images;
+        batch.labels = slot.labels;
+        batch.size = slot.size;
+
+        local_loss += mnist_model_accumulate(model, &batch);
+
+        mnist_pipeline_release(pipeline, &slot);
+    }
+
+    return mnist_model_update(model, local_loss, train_size);
+}
+
+/**
+ * Run one epoch of mini-batch gradient descent where every process samples
+ * its batches from its own shard in the block shuffled order of its sampler,
+ * updating the neural network on all processes after every batch. All
+ * processes run the same number of batches, the last ones possibly empty.
+ * The images of every batch are gathered into the buffers of batch, which
+ * hold batch_size images.
+ */
+float mnist_model_minibatch_epoch(mnist_model_t * model, mnist_dataset_t * shard, mnist_sampler_t * sampler, uint64_t epoch, uint32_t batch_size, uint32_t batches, mnist_dataset_t * batch)
+{
+    mnist_backend_t * backend = model->backend;
+    const uint32_t * order = mnist_sampler_epoch(sampler, epoch, backend->parallel);
+    float loss = 0.0f, local_loss;
+    uint32_t i, first, global_size;
+
+    for (i = 0; i < batches; i++) {
+        first = i * batch_size;
+        batch->size = first >= shard->size ? 0 : (shard->size - first < batch_size ? shard->size - first : batch_size);
+        mnist_sampler_gather(order + first, batch->size, (uint8_t *) shard->images, shard->labels, sizeof(mnist_image_t), (uint8_t *) batch->images, batch->labels, backend->parallel);
+
+        mnist_model_zero_gradient(model);
+        local_loss = mnist_model_accumulate(model, batch);
+
+        // The shards may differ in size, so the global batch is counted
+        global_size = batch->size;
+        backend->allreduce(backend, &global_size, 1, MNIST_BACKEND_UINT32, MNIST_BACKEND_SUM);
+        loss += mnist_model_update(model, local_loss, global_size);
+    }
+
+    return loss;
+}
+
+/**
+ * Run one step of gradient descent where every process accumulates the
+ * gradient over its slice of the whole training set, then update the neural
+ * network on all processes.
+ */
+float mnist_model_training_step(mnist_model_t * model, mnist_dataset_t * dataset)
+{
+    const int rank = model->backend->rank, size = model->backend->size;
+    mnist_dataset_t shard;
+
+    shard.images = &dataset->images[rank * (dataset->size / size)];
+    shard.labels = &dataset->labels[rank * (dataset->size / size)];
+    shard.size = rank == size - 1 ? dataset->size - rank * (dataset->size / size) : dataset->size / size;
+
+    return mnist_model_shard_step(model, &shard, dataset->size);
+}
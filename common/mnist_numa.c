@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+#include "../include/mnist_numa.h"
+
+// move_pages() flag to migrate pages mapped only by this process
+#define MOVE_PAGES_MOVE (1 << 1)
+
+/**
+ * The topology is read from sysfs and pages are queried and moved through the
+ * raw system calls, so that libnuma is not required. Without sysfs every CPU
+ * is taken to be on node 0.
+ */
+static int cpu_node[MNIST_NUMA_MAX_CPUS];
+static int node_count = 1;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static void read_topology(void)
+{
+    char path[300], list[4096], * next, * end;
+    struct dirent * entry;
+    DIR * nodes;
+    FILE * file;
+    long first, last, cpu;
+    int node;
+
+    memset(cpu_node, 0, sizeof(cpu_node));
+    nodes = opendir("/sys/devices/system/node");
+
+    if (NULL == nodes) {
+        return;
+    }
+
+    while (NULL != (entry = readdir(nodes))) {
+        if (1 != sscanf(entry->d_name, "node%d", &node)) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        file = fopen(path, "r");
+
+        if (NULL == file) {
+            continue;
+        }
+
+        // A list of ranges such as 0-23,48-71
+        if (NULL != fgets(list, sizeof(list), file)) {
+            for (next = list; '\0' != *next && '\n' != *next; next = ',' == *end ? end + 1 : end) {
+                first = last = strtol(next, &end, 10);
+
+                if (end == next) {
+                    break;
+                } else if ('-' == *end) {
+                    last = strtol(end + 1, &end, 10);
+                }
+
+                for (cpu = first; cpu <= last && cpu < MNIST_NUMA_MAX_CPUS; cpu++) {
+                    cpu_node[cpu] = node;
+                }
+            }
+        }
+
+        fclose(file);
+        node_count = node + 1 > node_count ? node + 1 : node_count;
+    }
+
+    closedir(nodes);
+}
+
+/**
+ * Number of NUMA nodes of the machine.
+ */
+int mnist_numa_nodes(void)
+{
+    pthread_once(&topology_once, read_topology);
+
+    return node_count;
+}
+
+/**
+ * NUMA node of the CPU the calling thread runs on.
+ */
+int mnist_numa_node(void)
+{
+    unsigned cpu = 0, node = 0;
+
+    if (0 == syscall(SYS_getcpu, &cpu, &node, NULL)) {
+        return node;
+    }
+
+    pthread_once(&topology_once, read_topology);
+    cpu = sched_getcpu();
+
+    return cpu < MNIST_NUMA_MAX_CPUS ? cpu_node[cpu] : 0;
+}
+
+/**
+ * Pin every OpenMP thread to one of the CPUs the process may run on, ordered
+ * node by node, so that the contiguous slices of static worksharing loops
+ * fall on the threads of one node at a time. Returns the number of nodes the
+ * threads span.
+ */
+int mnist_numa_pin_threads(void)
+{
+    int cpus[MNIST_NUMA_MAX_CPUS], spanned[MNIST_NUMA_MAX_CPUS] = { 0 };
+    cpu_set_t allowed;
+    int count = 0, node, cpu, nodes = 0;
+
+    pthread_once(&topology_once, read_topology);
+
+    if (0 != sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+        return 0;
+    }
+
+    for (node = 0; node < node_count; node++) {
+        for (cpu = 0; cpu < MNIST_NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && cpu_node[cpu] == node) {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+
+    if (0 == count) {
+        return 0;
+    }
+
+    #pragma omp parallel
+    {
+        const int chosen = cpus[(size_t) omp_get_thread_num() * count / omp_get_num_threads()];
+        cpu_set_t mine;
+
+        CPU_ZERO(&mine);
+        CPU_SET(chosen, &mine);
+        sched_setaffinity(0, sizeof(cpu_set_t), &mine);
+
+        #pragma omp critical
+        spanned[cpu_node[chosen]] = 1;
+    }
+
+    for (node = 0; node < node_count; node++) {
+        nodes += spanned[node];
+    }
+
+    return nodes;
+}
+
+/**
+ * Page aligned memory whose pages are not placed until first touched, so
+ * they land on the node of the thread that first writes them.
+ */
+void * mnist_numa_alloc(size_t bytes)
+{
+    void * memory = mmap(NULL, bytes > 0 ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return MAP_FAILED == memory ? NULL : memory;
+}
+
+void mnist_numa_free(void * memory, size_t bytes)
+{
+    if (NULL != memory) {
+        munmap(memory, bytes > 0 ? bytes : 1);
+    }
+}
+
+/**
+ * The slice of [0, count) that the calling thread gets in a static
+ * worksharing loop of count iterations: the same slice for every such loop of
+ * the same team, which is what ties the placement of data to the threads
+ * working on it.
+ */
+static void static_slice(size_t count, size_t * first, size_t * last)
+{
+    size_t i, lo = count, hi = 0;
+
+    #pragma omp for schedule(static) nowait
+    for (i = 0; i < count; i++) {
+        lo = i < lo ? i : lo;
+        hi = i + 1;
+    }
+
+    *first = lo < hi ? lo : 0;
+    *last = lo < hi ? hi : 0;
+}
+
+/**
+ * Read count elements from offset of a file into destination, every thread
+ * reading the slice it gets in static loops over the elements. Into memory
+ * from mnist_numa_alloc, each slice is first touched, and so placed, on the
+ * node of its thread. Returns 0 on success.
+ */
+int mnist_numa_read(int fd, off_t offset, void * destination, size_t count, size_t element)
+{
+    int failed = 0;
+
+    #pragma omp parallel reduction(|:failed)
+    {
+        size_t first, last, remaining;
+        uint8_t * next;
+        off_t position;
+        ssize_t bytes;
+
+        static_slice(count, &first, &last);
+
+        next = (uint8_t *) destination + first * element;
+        position = offset + (off_t) (first * element);
+        remaining = (last - first) * element;
+
+        while (remaining > 0 && !failed) {
+            bytes = pread(fd, next, remaining, position);
+
+            if (bytes < 0 && EINTR == errno) {
+                continue;
+            }
+
+            failed = bytes <= 0;
+            next += bytes > 0 ? bytes : 0;
+            position += bytes > 0 ? bytes : 0;
+            remaining -= bytes > 0 ? bytes : 0;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * Node of every page of [memory, memory + bytes) into status, which holds one
+ * int per page; pages the kernel would not place (or move) get a negative
+ * errno. With node >= 0 the pages are moved there first. Returns the number
+ * of pages.
+ */
+static size_t query_pages(const void * memory, size_t bytes, int node, int * status)
+{
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t start = (uintptr_t) memory & ~(page - 1), end = ((uintptr_t) memory + bytes + page - 1) & ~(page - 1);
+    const size_t count = bytes > 0 ? (end - start) / page : 0;
+    void ** pages = malloc(count * sizeof(void *) + 1);
+    int * nodes = node >= 0 ? malloc(count * sizeof(int) + 1) : NULL;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        status[i] = -ENOENT;
+    }
+
+    if (NULL != pages && (node < 0 || NULL != nodes)) {
+        for (i = 0; i < count; i++) {
+            pages[i] = (void *) (start + i * page);
+
+            if (NULL != nodes) {
+                nodes[i] = node;
+            }
+        }
+
+        syscall(SYS_move_pages, 0, count, pages, nodes, status, NULL != nodes ? MOVE_PAGES_MOVE : 0);
+    }
+
+    free(pages);
+    free(nodes);
+
+    return count;
+}
+
+static size_t page_count(const void * memory, size_t bytes)
+{
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    return bytes > 0 ? ((((uintptr_t) memory + bytes + page - 1) & ~(page - 1)) - ((uintptr_t) memory & ~(page - 1))) / page : 0;
+}
+
+/**
+ * Move the pages of every thread's static slice of count elements at base to
+ * the node of that thread, for data that was loaded by one thread or is
+ * worked on in other slices than it was read in. Returns the number of pages
+ * moved.
+ */
+uint64_t mnist_numa_place(void * base, size_t count, size_t element)
+{
+    uint64_t moved = 0;
+
+    if (mnist_numa_nodes() < 2) {
+        return 0;
+    }
+
+    #pragma omp parallel reduction(+:moved)
+    {
+        const int node = mnist_numa_node();
+        size_t first, last, pages, i;
+        int * status;
+
+        static_slice(count, &first, &last);
+        pages = page_count((uint8_t *) base + first * element, (last - first) * element);
+        status = malloc(pages * sizeof(int) + 1);
+
+        if (NULL != status && pages > 0) {
+            query_pages((uint8_t *) base + first * element, (last - first) * element, -1, status);
+
+            for (i = 0; i < pages; i++) {
+                moved += status[i] >= 0 && status[i] != node;
+            }
+
+            if (moved > 0) {
+                query_pages((uint8_t *) base + first * element, (last - first) * element, node, status);
+            }
+        }
+
+        free(status);
+    }
+
+    return moved;
+}
+
+/**
+ * Count the pages of [memory, memory + bytes) on node, the node of the
+ * calling thread when negative, and elsewhere.
+ */
+void mnist_numa_page_locality(const void * memory, size_t bytes, int node, mnist_numa_locality_t * locality)
+{
+    const size_t pages = page_count(memory, bytes);
+    int * status = malloc(pages * sizeof(int) + 1);
+    size_t i;
+
+    node = node < 0 ? mnist_numa_node() : node;
+
+    if (NULL == status) {
+        locality->unknown += pages;
+        return;
+    }
+
+    query_pages(memory, bytes, -1, status);
+
+    for (i = 0; i < pages; i++) {
+        if (status[i] < 0) {
+            locality->unknown++;
+        } else if (status[i] == node) {
+            locality->local++;
+        } else {
+            locality->remote++;
+        }
+    }
+
+    free(status);
+}
+
+/**
+ * Count the pages of every thread's static slice of count elements at base
+ * that are on the node of that thread, and elsewhere: the split between local
+ * and remote accesses of loops that work on the elements in static slices.
+ */
+void mnist_numa_locality(const void * base, size_t count, size_t element, mnist_numa_locality_t * locality)
+{
+    uint64_t local = 0, remote = 0, unknown = 0;
+
+    #pragma omp parallel reduction(+:local, remote, unknown)
+    {
+        mnist_numa_locality_t mine = { 0 };
+        size_t first, last;
+
+        static_slice(count, &first, &last);
+        mnist_numa_page_locality((const uint8_t *) base + first * element, (last - first) * element, -1, &mine);
+
+        local = mine.local;
+        remote = mine.remote;
+        unknown = mine.unknown;
+    }
+
+    locality->local += local;
+    locality->remote += remote;
+    locality->unknown += unknown;
+}
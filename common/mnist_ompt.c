@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <omp-tools.h>
+
+/**
+ * OMPT tool reporting where the threads of every OpenMP parallel region
+ * spend their time: working, waiting in barriers, waiting to enter and
+ * running critical sections, running explicit tasks and waiting for them.
+ * Built as a shared library and named by OMP_TOOL_LIBRARIES, it needs an
+ * OpenMP runtime that implements OMPT, such as LLVM's libomp; GCC's libgomp
+ * does not, so binaries built with gcc run with libomp preloaded in its
+ * place. A summary of the imbalance of every region is printed to the
+ * standard error when the runtime shuts down.
+ */
+
+#define MNIST_OMPT_REGIONS 128
+#define MNIST_OMPT_MAX_THREADS 512
+#define MNIST_OMPT_NESTING 8
+
+// Marks the data of explicit tasks, whose time the tool measures
+#define EXPLICIT_TASK 1
+
+/**
+ * Every parallel construct, by the address it is called from, with the time
+ * of every thread of its teams summed over its instances. The first holds
+ * what happens outside any parallel region, such as taskwaits of the initial
+ * thread.
+ */
+typedef struct region_t_ {
+    const void * codeptr;
+    uint64_t instances;
+    uint64_t wall;                                  // Of the encountering thread, ns
+    uint64_t end;                                   // Of the last instance, ns
+    uint64_t tasks_created;
+    unsigned int threads;                           // Largest team
+    uint64_t work[MNIST_OMPT_MAX_THREADS];          // Per thread number, ns
+    uint64_t barrier[MNIST_OMPT_MAX_THREADS];
+    uint64_t critical_wait[MNIST_OMPT_MAX_THREADS];
+    uint64_t critical_hold[MNIST_OMPT_MAX_THREADS];
+    uint64_t tasks[MNIST_OMPT_MAX_THREADS];
+    uint64_t taskwait[MNIST_OMPT_MAX_THREADS];
+} region_t;
+
+/**
+ * An implicit task a thread is running, or its time outside any parallel
+ * region at the bottom of the stack.
+ */
+typedef struct frame_t_ {
+    region_t * region;
+    unsigned int index;
+    uint64_t begin;
+    uint64_t barrier;
+    uint64_t critical_wait;
+    uint64_t critical_hold;
+    uint64_t tasks;
+    uint64_t taskwait;
+} frame_t;
+
+typedef struct thread_t_ {
+    int depth;                                      // Frames above the bottom one
+    frame_t frames[MNIST_OMPT_NESTING + 1];
+    uint64_t parallel_begin[MNIST_OMPT_NESTING];    // Of the regions this thread started
+    int parallel_depth;
+    uint64_t wait_begin;
+    uint64_t tasks_in_wait;                         // Explicit tasks run while waiting
+    uint64_t critical_begin;
+    uint64_t acquired;
+    uint64_t task_begin;                            // 0 outside explicit tasks
+} thread_t;
+
+static region_t regions[MNIST_OMPT_REGIONS];
+static int region_count = 1;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread thread_t thread;
+static ompt_set_callback_t set_callback;
+
+static uint64_t now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static void add(uint64_t * counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * The region of a parallel construct, added on its first instance. Regions
+ * past MNIST_OMPT_REGIONS share the last one.
+ */
+static region_t * find_region(const void * codeptr)
+{
+    region_t * region = NULL;
+    int r;
+
+    pthread_mutex_lock(&regions_lock);
+
+    for (r = 1; r < region_count && NULL == region; r++) {
+        if (regions[r].codeptr == codeptr) {
+            region = &regions[r];
+        }
+    }
+
+    if (NULL == region) {
+        region = &regions[region_count < MNIST_OMPT_REGIONS ? region_count++ : MNIST_OMPT_REGIONS - 1];
+        region->codeptr = codeptr;
+    }
+
+    pthread_mutex_unlock(&regions_lock);
+
+    return region;
+}
+
+static frame_t * current_frame(void)
+{
+    return &thread.frames[thread.depth];
+}
+
+/**
+ * The time now, or if the frame's instance of its region already ended, the
+ * time it did. Workers report the end of the barrier closing a region only
+ * when they are woken for the next one, so their idle time in between is
+ * left out.
+ */
+static uint64_t frame_now(const frame_t * frame)
+{
+    const uint64_t time = now();
+    const uint64_t end = __atomic_load_n(&frame->region->end, __ATOMIC_RELAXED);
+
+    return end > frame->begin && end < time ? end : time;
+}
+
+/**
+ * Add time outside any parallel region straight to the first region, as the
+ * bottom frame never finishes.
+ */
+static void charge(uint64_t * frame_counter, uint64_t * region_counter, uint64_t value)
+{
+    if (0 == thread.depth) {
+        add(region_counter, value);
+    } else {
+        *frame_counter += value;
+    }
+}
+
+/**
+ * Add a finished frame's time to its region: whatever the thread did not
+ * spend waiting or running explicit tasks was work.
+ */
+static void account(frame_t * frame, uint64_t end)
+{
+    region_t * region = frame->region;
+    const unsigned int index = frame->index < MNIST_OMPT_MAX_THREADS ? frame->index : MNIST_OMPT_MAX_THREADS - 1;
+    const uint64_t waits = frame->barrier + frame->critical_wait + frame->tasks + frame->taskwait;
+    const uint64_t elapsed = end - frame->begin;
+
+    add(&region->work[index], elapsed > waits ? elapsed - waits : 0);
+    add(&region->barrier[index], frame->barrier);
+    add(&region->critical_wait[index], frame->critical_wait);
+    add(&region->critical_hold[index], frame->critical_hold);
+    add(&region->tasks[index], frame->tasks);
+    add(&region->taskwait[index], frame->taskwait);
+}
+
+static void on_thread_begin(ompt_thread_t type, ompt_data_t * thread_data)
+{
+    (void) type;
+    (void) thread_data;
+
+    memset(&thread, 0, sizeof(thread));
+    thread.frames[0].region = &regions[0];
+}
+
+static void on_parallel_begin(ompt_data_t * encountering_task_data, const ompt_frame_t * encountering_task_frame, ompt_data_t * parallel_data,
+    unsigned int requested_parallelism, int flags, const void * codeptr_ra)
+{
+    region_t * region = find_region(codeptr_ra);
+
+    (void) encountering_task_data;
+    (void) encountering_task_frame;
+    (void) requested_parallelism;
+    (void) flags;
+
+    parallel_data->ptr = region;
+    add(&region->instances, 1);
+
+    if (thread.parallel_depth < MNIST_OMPT_NESTING) {
+        thread.parallel_begin[thread.parallel_depth] = now();
+    }
+
+    thread.parallel_depth++;
+}
+
+static void on_parallel_end(ompt_data_t * parallel_data, ompt_data_t * encountering_task_data, int flags, const void * codeptr_ra)
+{
+    (void) encountering_task_data;
+    (void) flags;
+    (void) codeptr_ra;
+
+    const uint64_t time = now();
+    region_t * region = parallel_data->ptr;
+
+    thread.parallel_depth--;
+
+    if (NULL == region) {
+        return;
+    }
+
+    __atomic_store_n(&region->end, time, __ATOMIC_RELAXED);
+
+    if (thread.parallel_depth >= 0 && thread.parallel_depth < MNIST_OMPT_NESTING) {
+        add(&region->wall, time - thread.parallel_begin[thread.parallel_depth]);
+    }
+}
+
+static void on_implicit_task(ompt_scope_endpoint_t endpoint, ompt_data_t * parallel_data, ompt_data_t * task_data, unsigned int actual_parallelism,
+    unsigned int index, int flags)
+{
+    region_t * region;
+    frame_t * frame;
+
+    (void) task_data;
+
+    if (flags & ompt_task_initial) {
+        return;
+    }
+
+    if (ompt_scope_begin == endpoint) {
+        region = NULL != parallel_data && NULL != parallel_data->ptr ? parallel_data->ptr : &regions[0];
+
+        if (thread.depth >= MNIST_OMPT_NESTING) {
+            thread.depth++;
+            return;
+        }
+
+        if (actual_parallelism > __atomic_load_n(&region->threads, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&region->threads, actual_parallelism, __ATOMIC_RELAXED);
+        }
+
+        frame = &thread.frames[++thread.depth];
+        memset(frame, 0, sizeof(frame_t));
+        frame->region = region;
+        frame->index = index;
+        frame->begin = now();
+    } else if (thread.depth > 0) {
+        if (thread.depth <= MNIST_OMPT_NESTING) {
+            account(current_frame(), frame_now(current_frame()));
+        }
+
+        thread.depth--;
+    }
+}
+
+static void on_sync_region_wait(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint, ompt_data_t * parallel_data, ompt_data_t * task_data,
+    const void * codeptr_ra)
+{
+    frame_t * frame = current_frame();
+    uint64_t wait;
+
+    (void) parallel_data;
+    (void) task_data;
+    (void) codeptr_ra;
+
+    if (thread.depth > MNIST_OMPT_NESTING) {
+        return;
+    }
+
+    if (ompt_scope_begin == endpoint) {
+        thread.wait_begin = now();
+        thread.tasks_in_wait = 0;
+        return;
+    }
+
+    // Explicit tasks the thread ran while it waited are counted as tasks
+    wait = 0 == thread.depth ? now() : frame_now(frame);
+    wait = wait > thread.wait_begin + thread.tasks_in_wait ? wait - thread.wait_begin - thread.tasks_in_wait : 0;
+
+    if (ompt_sync_region_taskwait == kind || ompt_sync_region_taskgroup == kind) {
+        charge(&frame->taskwait, &regions[0].taskwait[0], wait);
+    } else {
+        charge(&frame->barrier, &regions[0].barrier[0], wait);
+    }
+}
+
+static void on_mutex_acquire(ompt_mutex_t kind, unsigned int hint, unsigned int impl, ompt_wait_id_t wait_id, const void * codeptr_ra)
+{
+    (void) hint;
+    (void) impl;
+    (void) wait_id;
+    (void) codeptr_ra;
+
+    if (ompt_mutex_critical == kind) {
+        thread.critical_begin = now();
+    }
+}
+
+static void on_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void * codeptr_ra)
+{
+    (void) wait_id;
+    (void) codeptr_ra;
+
+    if (ompt_mutex_critical == kind && thread.depth <= MNIST_OMPT_NESTING) {
+        thread.acquired = now();
+        charge(&current_frame()->critical_wait, &regions[0].critical_wait[0], thread.acquired - thread.critical_begin);
+    }
+}
+
+static void on_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void * codeptr_ra)
+{
+    (void) wait_id;
+    (void) codeptr_ra;
+
+    if (ompt_mutex_critical == kind && thread.depth <= MNIST_OMPT_NESTING) {
+        charge(&current_frame()->critical_hold, &regions[0].critical_hold[0], now() - thread.acquired);
+    }
+}
+
+static void on_task_create(ompt_data_t * encountering_task_data, const ompt_frame_t * encountering_task_frame, ompt_data_t * new_task_data,
+    int flags, int has_dependences, const void * codeptr_ra)
+{
+    (void) encountering_task_data;
+    (void) encountering_task_frame;
+    (void) has_dependences;
+    (void) codeptr_ra;
+
+    if (flags & (ompt_task_explicit | ompt_task_target)) {
+        new_task_data->value = EXPLICIT_TASK;
+
+        if (thread.depth <= MNIST_OMPT_NESTING) {
+            add(&current_frame()->region->tasks_created, 1);
+        }
+    }
+}
+
+/**
+ * Time from switching to an explicit task until the thread switches back to
+ * an implicit one, whichever explicit tasks it runs in between.
+ */
+static void on_task_schedule(ompt_data_t * prior_task_data, ompt_task_status_t prior_task_status, ompt_data_t * next_task_data)
+{
+    const int next_explicit = NULL != next_task_data && EXPLICIT_TASK == next_task_data->value;
+    uint64_t elapsed;
+
+    (void) prior_task_data;
+    (void) prior_task_status;
+
+    if (next_explicit && 0 == thread.task_begin) {
+        thread.task_begin = now();
+    } else if (!next_explicit && 0 != thread.task_begin) {
+        elapsed = now() - thread.task_begin;
+        thread.task_begin = 0;
+        thread.tasks_in_wait += elapsed;
+
+        if (thread.depth <= MNIST_OMPT_NESTING) {
+            charge(&current_frame()->tasks, &regions[0].tasks[0], elapsed);
+        }
+    }
+}
+
+static uint64_t sum(const uint64_t * values, unsigned int count)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        total += values[i];
+    }
+
+    return total;
+}
+
+/**
+ * Where a region is: the symbol of its caller when the binary exports it,
+ * otherwise the offset in its module, for addr2line.
+ */
+static void describe(const region_t * region, char * text, size_t size)
+{
+    Dl_info info;
+    const char * module;
+
+    if (NULL == region->codeptr) {
+        snprintf(text, size, "outside parallel regions");
+    } else if (0 != dladdr(region->codeptr, &info) && NULL != info.dli_fname) {
+        module = strrchr(info.dli_fname, '/');
+        module = NULL != module ? module + 1 : info.dli_fname;
+
+        if (NULL != info.dli_sname) {
+            snprintf(text, size, "%s (%s+0x%lx)", info.dli_sname, module, (unsigned long) ((const char *) region->codeptr - (const char *) info.dli_fbase));
+        } else {
+            snprintf(text, size, "%s+0x%lx", module, (unsigned long) ((const char *) region->codeptr - (const char *) info.dli_fbase));
+        }
+    } else {
+        snprintf(text, size, "%p", region->codeptr);
+    }
+}
+
+static int compare_regions(const void * a, const void * b)
+{
+    const region_t * x = *(region_t * const *) a, * y = *(region_t * const *) b;
+    const uint64_t tx = sum(x->work, MNIST_OMPT_MAX_THREADS) + sum(x->barrier, MNIST_OMPT_MAX_THREADS);
+    const uint64_t ty = sum(y->work, MNIST_OMPT_MAX_THREADS) + sum(y->barrier, MNIST_OMPT_MAX_THREADS);
+
+    return (ty > tx) - (ty < tx);
+}
+
+/**
+ * Per region, slowest first: its instances and largest team, the wall time
+ * of the encountering thread, the mean and largest work of a thread, the
+ * imbalance (the share of the region's time the threads with less work spent
+ * waiting for the one with the most), and the time all threads spent in
+ * barriers, waiting for and inside critical sections, in explicit tasks and
+ * in taskwaits.
+ */
+static void print_summary(void)
+{
+    region_t * sorted[MNIST_OMPT_REGIONS];
+    const char * rank = getenv("OMPI_COMM_WORLD_RANK");
+    char location[256];
+    double mean, max, total;
+    unsigned int threads, t;
+    int r, count = 0;
+
+    if (NULL == rank) {
+        rank = getenv("PMI_RANK");
+    }
+
+    for (r = 0; r < region_count; r++) {
+        if (regions[r].instances > 0 || sum(regions[r].taskwait, MNIST_OMPT_MAX_THREADS) + sum(regions[r].tasks, MNIST_OMPT_MAX_THREADS) > 0) {
+            sorted[count++] = &regions[r];
+        }
+    }
+
+    qsort(sorted, count, sizeof(region_t *), compare_regions);
+
+    fprintf(stderr, "\nOpenMP regions of process %d%s%s (seconds over all threads)\n", (int) getpid(), NULL != rank ? ", rank " : "", NULL != rank ? rank : "");
+    fprintf(stderr, "%-40s%10s%8s%10s%10s%10s%10s%10s%10s%10s%10s%10s\n", "region", "instances", "threads", "wall", "work", "max work", "imbalance",
+        "barrier", "crit wait", "critical", "tasks", "taskwait");
+
+    for (r = 0; r < count; r++) {
+        const region_t * region = sorted[r];
+
+        threads = region->threads > 0 ? (region->threads < MNIST_OMPT_MAX_THREADS ? region->threads : MNIST_OMPT_MAX_THREADS) : 1;
+
+        for (t = 0, max = 0.0; t < threads; t++) {
+            max = region->work[t] > max ? region->work[t] : max;
+        }
+
+        total = sum(region->work, MNIST_OMPT_MAX_THREADS);
+        mean = total / threads;
+        describe(region, location, sizeof(location));
+
+        fprintf(stderr, "%-40s%10lu%8u%10.3f%10.3f%10.3f%9.1f%%%10.3f%10.3f%10.3f%10.3f%10.3f\n", location, (unsigned long) region->instances, threads,
+            region->wall / 1e9, total / 1e9, max / 1e9, max > 0.0 ? 100.0 * (max - mean) / max : 0.0,
+            sum(region->barrier, MNIST_OMPT_MAX_THREADS) / 1e9, sum(region->critical_wait, MNIST_OMPT_MAX_THREADS) / 1e9,
+            sum(region->critical_hold, MNIST_OMPT_MAX_THREADS) / 1e9, sum(region->tasks, MNIST_OMPT_MAX_THREADS) / 1e9,
+            sum(region->taskwait, MNIST_OMPT_MAX_THREADS) / 1e9);
+    }
+
+    if (region_count == MNIST_OMPT_REGIONS) {
+        fprintf(stderr, "More than %d regions, the last row holds the rest\n", MNIST_OMPT_REGIONS - 1);
+    }
+}
+
+static void register_callback(ompt_callbacks_t event, ompt_callback_t callback, const char * name)
+{
+    const ompt_set_result_t result = set_callback(event, callback);
+
+    if (ompt_set_always != result && ompt_set_sometimes != result && ompt_set_sometimes_paired != result) {
+        fprintf(stderr, "The OpenMP runtime does not report %s, which is left out\n", name);
+    }
+}
+
+static int initialize(ompt_function_lookup_t lookup, int initial_device_num, ompt_data_t * tool_data)
+{
+    (void) initial_device_num;
+    (void) tool_data;
+
+    set_callback = (ompt_set_callback_t) lookup("ompt_set_callback");
+
+    if (NULL == set_callback) {
+        return 0;
+    }
+
+    // The initial thread starts before the tool
+    on_thread_begin(ompt_thread_initial, NULL);
+
+    register_callback(ompt_callback_thread_begin, (ompt_callback_t) on_thread_begin, "threads");
+    register_callback(ompt_callback_parallel_begin, (ompt_callback_t) on_parallel_begin, "parallel regions");
+    register_callback(ompt_callback_parallel_end, (ompt_callback_t) on_parallel_end, "parallel regions");
+    register_callback(ompt_callback_implicit_task, (ompt_callback_t) on_implicit_task, "implicit tasks");
+    register_callback(ompt_callback_sync_region_wait, (ompt_callback_t) on_sync_region_wait, "barrier waits");
+    register_callback(ompt_callback_mutex_acquire, (ompt_callback_t) on_mutex_acquire, "critical sections");
+    register_callback(ompt_callback_mutex_acquired, (ompt_callback_t) on_mutex_acquired, "critical sections");
+    register_callback(ompt_callback_mutex_released, (ompt_callback_t) on_mutex_released, "critical sections");
+    register_callback(ompt_callback_task_create, (ompt_callback_t) on_task_create, "tasks");
+    register_callback(ompt_callback_task_schedule, (ompt_callback_t) on_task_schedule, "tasks");
+
+    return 1;
+}
+
+static void finalize(ompt_data_t * tool_data)
+{
+    (void) tool_data;
+
+    print_summary();
+}
+
+ompt_start_tool_result_t * ompt_start_tool(unsigned int omp_version, const char * runtime_version)
+{
+    static ompt_start_tool_result_t result = { initialize, finalize, { 0 } };
+
+    (void) omp_version;
+    (void) runtime_version;
+
+    return &result;
+}
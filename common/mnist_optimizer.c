@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_optimizer.h"
+
+static const char * optimizer_names[] = { "sgd", "momentum", "nesterov", "adam" };
+
+// Learning rates of the optimizers when --lr is not given. Momentum takes
+// steps about 1 / (1 - momentum) times longer than plain gradient descent
+static const float default_learning_rates[] = { 0.5f, 0.05f, 0.05f, 0.001f };
+
+/**
+ * Plain gradient descent with the learning rate the trainers always used.
+ */
+void mnist_optimizer_config_init(mnist_optimizer_config_t * config)
+{
+    memset(config, 0, sizeof(mnist_optimizer_config_t));
+    config->type = MNIST_OPTIMIZER_SGD;
+    config->schedule = MNIST_SCHEDULE_CONSTANT;
+    config->momentum = 0.9f;
+    config->beta1 = 0.9f;
+    config->beta2 = 0.999f;
+    config->epsilon = 1e-8f;
+}
+
+/**
+ * Parse the optimizer command line option at argv[*i], if it is one, and
+ * advance *i past its value. Returns 1 when the option was consumed.
+ */
+int mnist_optimizer_option(mnist_optimizer_config_t * config, int argc, char * argv[], int * i)
+{
+    const char * value = *i + 1 < argc ? argv[*i + 1] : NULL;
+    int type;
+
+    if (NULL == value) {
+        return 0;
+    }
+
+    if (0 == strcmp(argv[*i], "--optimizer")) {
+        for (type = MNIST_OPTIMIZER_SGD; type <= MNIST_OPTIMIZER_ADAM && 0 != strcmp(value, optimizer_names[type]); type++);
+
+        if (type > MNIST_OPTIMIZER_ADAM) {
+            fprintf(stderr, "Unknown optimizer %s, expected sgd, momentum, nesterov or adam\n", value);
+            exit(EXIT_FAILURE);
+        }
+
+        config->type = type;
+    } else if (0 == strcmp(argv[*i], "--lr")) {
+        config->learning_rate = atof(value);
+    } else if (0 == strcmp(argv[*i], "--min-lr")) {
+        config->min_learning_rate = atof(value);
+    } else if (0 == strcmp(argv[*i], "--momentum")) {
+        config->momentum = atof(value);
+    } else if (0 == strcmp(argv[*i], "--schedule")) {
+        if (0 == strcmp(value, "cosine")) {
+            config->schedule = MNIST_SCHEDULE_COSINE;
+        } else if (0 == strcmp(value, "constant")) {
+            config->schedule = MNIST_SCHEDULE_CONSTANT;
+        } else {
+            fprintf(stderr, "Unknown learning rate schedule %s, expected constant or cosine\n", value);
+            exit(EXIT_FAILURE);
+        }
+    } else if (0 == strcmp(argv[*i], "--warmup")) {
+        config->warmup = strtoull(value, NULL, 10);
+    } else {
+        return 0;
+    }
+
+    (*i)++;
+
+    return 1;
+}
+
+const char * mnist_optimizer_name(const mnist_optimizer_config_t * config)
+{
+    return optimizer_names[config->type];
+}
+
+/**
+ * Create an optimizer for count parameters, with its state in arena when it
+ * is not NULL.
+ */
+mnist_optimizer_t * mnist_optimizer_create(const mnist_optimizer_config_t * config, size_t count, mnist_arena_t * arena)
+{
+    mnist_optimizer_t * optimizer = calloc(1, sizeof(mnist_optimizer_t));
+    size_t moments = MNIST_OPTIMIZER_ADAM == config->type ? 2 : (MNIST_OPTIMIZER_SGD == config->type ? 0 : 1);
+
+    if (NULL == optimizer) {
+        fprintf(stderr, "Could not allocate memory for optimizer\n");
+        return NULL;
+    }
+
+    optimizer->config = *config;
+    optimizer->count = count;
+    optimizer->state_bytes = moments * count * sizeof(float);
+    optimizer->arena = arena;
+
+    // The state is allocated even when empty, so that a checkpoint loaded
+    // with it must have an empty optimizer section too
+    optimizer->state = NULL != arena ? mnist_arena_alloc(arena, (moments * count + 1) * sizeof(float)) : calloc(moments * count + 1, sizeof(float));
+
+    if (optimizer->config.learning_rate <= 0.0f) {
+        optimizer->config.learning_rate = default_learning_rates[config->type];
+    }
+
+    if (NULL == optimizer->state) {
+        fprintf(stderr, "Could not allocate memory for the optimizer state of %lu parameters\n", (unsigned long) count);
+        mnist_optimizer_free(optimizer);
+        return NULL;
+    }
+
+    return optimizer;
+}
+
+/**
+ * Learning rate of the next update: a linear warmup to the peak learning
+ * rate, then constant or a cosine decay to the minimum by the last update.
+ */
+float mnist_optimizer_learning_rate(const mnist_optimizer_t * optimizer)
+{
+    const mnist_optimizer_config_t * config = &optimizer->config;
+    double progress;
+
+    if (optimizer->updates < config->warmup) {
+        return config->learning_rate * (float) (optimizer->updates + 1) / (float) config->warmup;
+    }
+
+    if (MNIST_SCHEDULE_CONSTANT == config->schedule || config->total <= config->warmup) {
+        return config->learning_rate;
+    }
+
+    progress = (double) (optimizer->updates - config->warmup) / (double) (config->total - config->warmup);
+    progress = progress > 1.0 ? 1.0 : progress;
+
+    return config->min_learning_rate + 0.5f * (config->learning_rate - config->min_learning_rate) * (float) (1.0 + cos(M_PI * progress));
+}
+
+/**
+ * Apply one update from a gradient summed over size training examples. Every
+ * optimizer is a single pass over the parameters, the gradient and its state,
+ * vectorized and, when parallel is set, split between the threads; the
+ * per-update factors (learning rate, averaging, Adam's bias corrections) are
+ * computed once beforehand.
+ */
+void mnist_optimizer_step(mnist_optimizer_t * optimizer, float * parameters, const float * gradient, uint32_t size, int parallel)
+{
+    const mnist_optimizer_config_t * config = &optimizer->config;
+    const float learning_rate = mnist_optimizer_learning_rate(optimizer);
+    const float scale = 1.0f / ((float) size);
+    const float mu = config->momentum, beta1 = config->beta1, beta2 = config->beta2, epsilon = config->epsilon;
+    const size_t count = optimizer->count;
+    float * m = optimizer->state, * v = optimizer->state + count;
+    float step_size, correction2;
+    size_t i;
+
+    optimizer->updates++;
+
+    switch (config->type) {
+    case MNIST_OPTIMIZER_SGD:
+        step_size = learning_rate * scale;
+
+        #pragma omp parallel for simd schedule(static) if (parallel)
+        for (i = 0; i < count; i++) {
+            parameters[i] -= step_size * gradient[i];
+        }
+
+        break;
+
+    case MNIST_OPTIMIZER_MOMENTUM:
+        #pragma omp parallel for simd schedule(static) if (parallel)
+        for (i = 0; i < count; i++) {
+            m[i] = mu * m[i] + scale * gradient[i];
+            parameters[i] -= learning_rate * m[i];
+        }
+
+        break;
+
+    case MNIST_OPTIMIZER_NESTEROV:
+        // Look ahead along the updated velocity
+        #pragma omp parallel for simd schedule(static) if (parallel)
+        for (i = 0; i < count; i++) {
+            const float g = scale * gradient[i];
+
+            m[i] = mu * m[i] + g;
+            parameters[i] -= learning_rate * (g + mu * m[i]);
+        }
+
+        break;
+
+    case MNIST_OPTIMIZER_ADAM:
+        step_size = learning_rate / (1.0f - powf(beta1, (float) optimizer->updates));
+        correction2 = 1.0f / (1.0f - powf(beta2, (float) optimizer->updates));
+
+        #pragma omp parallel for simd schedule(static) if (parallel)
+        for (i = 0; i < count; i++) {
+            const float g = scale * gradient[i];
+
+            m[i] = beta1 * m[i] + (1.0f - beta1) * g;
+            v[i] = beta2 * v[i] + (1.0f - beta2) * g * g;
+            parameters[i] -= step_size * m[i] / (sqrtf(v[i] * correction2) + epsilon);
+        }
+
+        break;
+    }
+}
+
+void mnist_optimizer_free(mnist_optimizer_t * optimizer)
+{
+    if (NULL == optimizer) {
+        return;
+    }
+
+    if (NULL == optimizer->arena) {
+        free(optimizer->state);
+    }
+
+    free(optimizer);
+}
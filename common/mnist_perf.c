@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+
+#include "../include/mnist_perf.h"
+
+static const char * event_names[MNIST_PERF_EVENTS] = { "cycles", "instructions", "llc_references", "llc_misses", "fp_ops" };
+static const char * phase_names[MNIST_PERF_PHASES] = { "gradient", "reduce", "update" };
+
+/**
+ * The counters behind the events. The last four count the single precision
+ * FP_ARITH_INST_RETIRED instructions of 1, 4, 8 and 16 lanes (fused
+ * multiply-adds count twice), and are weighted by their lanes into
+ * MNIST_PERF_FP_OPS.
+ */
+typedef struct counter_t_ {
+    uint32_t type;
+    uint64_t config;
+    mnist_perf_event_t event;
+    double weight;
+} counter_t;
+
+static const counter_t counters[MNIST_PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, MNIST_PERF_CYCLES, 1.0 },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, MNIST_PERF_INSTRUCTIONS, 1.0 },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, MNIST_PERF_LLC_REFERENCES, 1.0 },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, MNIST_PERF_LLC_MISSES, 1.0 },
+    { PERF_TYPE_RAW, 0x02C7, MNIST_PERF_FP_OPS, 1.0 },
+    { PERF_TYPE_RAW, 0x08C7, MNIST_PERF_FP_OPS, 4.0 },
+    { PERF_TYPE_RAW, 0x20C7, MNIST_PERF_FP_OPS, 8.0 },
+    { PERF_TYPE_RAW, 0x80C7, MNIST_PERF_FP_OPS, 16.0 }
+};
+
+/**
+ * The raw event codes are those of Intel cores since Skylake; elsewhere they
+ * would count something else.
+ */
+static int raw_events_supported(void)
+{
+#if defined(__x86_64__)
+    return __builtin_cpu_is("intel");
+#else
+    return 0;
+#endif
+}
+
+static int open_counter(const counter_t * counter)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->type;
+    attr.config = counter->config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // The calling thread, on whatever CPU it runs
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Open the counters on every OpenMP thread. Returns NULL, after saying why,
+ * when not even one event can be counted, as in containers without access to
+ * the performance monitoring unit; training then runs without counters.
+ */
+mnist_perf_t * mnist_perf_create(void)
+{
+    mnist_perf_t * perf = calloc(1, sizeof(mnist_perf_t));
+    const int raw = raw_events_supported();
+    int opened[MNIST_PERF_COUNTERS] = { 0 }, error = 0, any = 0, e, c, t;
+
+    if (NULL == perf) {
+        fprintf(stderr, "Could not allocate memory for performance counters\n");
+        return NULL;
+    }
+
+    perf->threads = omp_get_max_threads() < MNIST_PERF_MAX_THREADS ? omp_get_max_threads() : MNIST_PERF_MAX_THREADS;
+    perf->phase = -1;
+
+    for (t = 0; t < MNIST_PERF_MAX_THREADS; t++) {
+        for (c = 0; c < MNIST_PERF_COUNTERS; c++) {
+            perf->fds[t][c] = -1;
+        }
+    }
+
+    #pragma omp parallel num_threads(perf->threads) private(c)
+    {
+        const int thread = omp_get_thread_num();
+
+        for (c = 0; c < MNIST_PERF_COUNTERS; c++) {
+            if (PERF_TYPE_RAW == counters[c].type && !raw) {
+                continue;
+            }
+
+            perf->fds[thread][c] = open_counter(&counters[c]);
+
+            #pragma omp critical
+            {
+                if (perf->fds[thread][c] >= 0) {
+                    opened[c]++;
+                } else {
+                    error = errno;
+                }
+            }
+        }
+    }
+
+    // An event counts when all of its counters opened on every thread
+    for (e = 0; e < MNIST_PERF_EVENTS; e++) {
+        perf->available[e] = 1;
+
+        for (c = 0; c < MNIST_PERF_COUNTERS; c++) {
+            if (counters[c].event == (mnist_perf_event_t) e && opened[c] < perf->threads) {
+                perf->available[e] = 0;
+            }
+        }
+
+        any |= perf->available[e];
+    }
+
+    if (!any) {
+        fprintf(stderr, "Performance counters are unavailable (%s), training without them\n", 0 != error ? strerror(error) : "no events");
+        mnist_perf_free(perf);
+        return NULL;
+    }
+
+    return perf;
+}
+
+/**
+ * Totals of every event over all threads so far, scaled up by the share of
+ * the time each counter was running when the kernel multiplexed them.
+ */
+static void read_totals(mnist_perf_t * perf, double totals[MNIST_PERF_EVENTS])
+{
+    uint64_t values[3];
+    int t, c;
+
+    memset(totals, 0, MNIST_PERF_EVENTS * sizeof(double));
+
+    for (t = 0; t < perf->threads; t++) {
+        for (c = 0; c < MNIST_PERF_COUNTERS; c++) {
+            if (perf->fds[t][c] < 0 || !perf->available[counters[c].event]) {
+                continue;
+            }
+
+            if (sizeof(values) == read(perf->fds[t][c], values, sizeof(values)) && values[2] > 0) {
+                totals[counters[c].event] += counters[c].weight * values[0] * ((double) values[1] / values[2]);
+            }
+        }
+    }
+}
+
+/**
+ * Start counting a phase, from the calling thread between parallel regions.
+ */
+void mnist_perf_begin(mnist_perf_t * perf, mnist_perf_phase_t phase)
+{
+    if (NULL == perf) {
+        return;
+    }
+
+    read_totals(perf, perf->start);
+    perf->phase = phase;
+}
+
+void mnist_perf_end(mnist_perf_t * perf)
+{
+    double totals[MNIST_PERF_EVENTS];
+    int e;
+
+    if (NULL == perf || perf->phase < 0) {
+        return;
+    }
+
+    read_totals(perf, totals);
+
+    for (e = 0; e < MNIST_PERF_EVENTS; e++) {
+        perf->counts[perf->phase][e] += totals[e] - perf->start[e];
+    }
+
+    perf->runs[perf->phase]++;
+
+    perf->phase = -1;
+}
+
+/**
+ * Clear the counts of every phase, at the start of a step.
+ */
+void mnist_perf_reset(mnist_perf_t * perf)
+{
+    if (NULL != perf) {
+        memset(perf->counts, 0, sizeof(perf->counts));
+        memset(perf->runs, 0, sizeof(perf->runs));
+    }
+}
+
+/**
+ * Append the instructions per cycle, the share of last level cache references
+ * that missed, and the instructions and floating point operations per image
+ * of every phase that ran since the reset to the current output line.
+ */
+void mnist_perf_print(mnist_perf_t * perf, uint64_t images)
+{
+    const double per = images > 0 ? (double) images : 1.0;
+    const char * separator = "";
+    int p;
+
+    if (NULL == perf) {
+        return;
+    }
+
+    for (p = 0; p < MNIST_PERF_PHASES; p++) {
+        const double * counts = perf->counts[p];
+
+        if (0 == perf->runs[p]) {
+            continue;
+        }
+
+        printf("%s%s", separator, phase_names[p]);
+        separator = "\t";
+
+        if (perf->available[MNIST_PERF_CYCLES] && perf->available[MNIST_PERF_INSTRUCTIONS]) {
+            printf(" IPC %.2f", counts[MNIST_PERF_CYCLES] > 0.0 ? counts[MNIST_PERF_INSTRUCTIONS] / counts[MNIST_PERF_CYCLES] : 0.0);
+        }
+
+        if (perf->available[MNIST_PERF_LLC_REFERENCES] && perf->available[MNIST_PERF_LLC_MISSES]) {
+            printf(" LLC miss %.1f%%", counts[MNIST_PERF_LLC_REFERENCES] > 0.0 ? 100.0 * counts[MNIST_PERF_LLC_MISSES] / counts[MNIST_PERF_LLC_REFERENCES] : 0.0);
+        }
+
+        if (perf->available[MNIST_PERF_INSTRUCTIONS]) {
+            printf(" %.3g ins/image", counts[MNIST_PERF_INSTRUCTIONS] / per);
+        }
+
+        if (perf->available[MNIST_PERF_LLC_MISSES]) {
+            printf(" %.3g misses/image", counts[MNIST_PERF_LLC_MISSES] / per);
+        }
+
+        if (perf->available[MNIST_PERF_FP_OPS]) {
+            printf(" %.3g flop/image", counts[MNIST_PERF_FP_OPS] / per);
+        }
+    }
+}
+
+/**
+ * Add the counts of every phase that ran to the open record, as
+ * <phase>_<event>.
+ */
+void mnist_perf_record(mnist_perf_t * perf, mnist_records_t * records)
+{
+    char name[64];
+    int p, e;
+
+    if (NULL == perf) {
+        return;
+    }
+
+    for (p = 0; p < MNIST_PERF_PHASES; p++) {
+        for (e = 0; e < MNIST_PERF_EVENTS; e++) {
+            if (perf->available[e] && perf->runs[p] > 0) {
+                snprintf(name, sizeof(name), "%s_%s", phase_names[p], event_names[e]);
+                mnist_records_double(records, name, perf->counts[p][e]);
+            }
+        }
+    }
+}
+
+void mnist_perf_free(mnist_perf_t * perf)
+{
+    int t, c;
+
+    if (NULL == perf) {
+        return;
+    }
+
+    for (t = 0; t < MNIST_PERF_MAX_THREADS; t++) {
+        for (c = 0; c < MNIST_PERF_COUNTERS; c++) {
+            if (perf->fds[t][c] >= 0) {
+                close(perf->fds[t][c]);
+            }
+        }
+    }
+
+    free(perf);
+}
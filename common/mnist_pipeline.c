@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_resample.h"
+#include "../include/mnist_pipeline.h"
+
+struct mnist_pipeline_t_ {
+    mnist_pipeline_config_t config;
+    uint8_t * base_images;
+    uint8_t * base_labels;
+    int base_width;
+    int base_height;
+    uint32_t batches;
+    size_t out_size;
+    mnist_resampler_t * resampler;
+
+    // Resampling scratch and an upscaled image of every producer thread
+    size_t scratch_size;
+    uint8_t * scratch;
+    uint8_t * upscaled;
+
+    // Ring of batches: sequence number s lives in slot s % slots
+    uint8_t * slot_images;
+    uint8_t * slot_labels;
+    uint32_t * slot_size;
+    uint64_t * slot_sequence;
+    int * slot_ready;
+
+    pthread_mutex_t lock;
+    pthread_cond_t produced;
+    pthread_cond_t consumed;
+    uint64_t next_claim;
+    uint64_t next_consume;
+    uint64_t released;
+    int stop;
+    int started;
+    int claimed;  // Producers that took their scratch buffers
+    pthread_t * threads;
+
+    mnist_pipeline_stats_t stats;
+};
+
+static uint32_t swap_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+/**
+ * SplitMix64 finaliser, used as a counter based generator: the augmentation
+ * of an image depends only on the seed, the epoch and the image index, not on
+ * which producer generates it.
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+/**
+ * Read the [first, first + count) range of a base (un-upscaled) IDX image
+ * file and the matching labels.
+ */
+static int read_base_dataset(mnist_pipeline_t * pipeline)
+{
+    mnist_image_file_header_t image_header;
+    mnist_label_file_header_t label_header;
+    FILE * images, * labels;
+    uint32_t available;
+    size_t image_size;
+    int ok = 0;
+
+    images = fopen(pipeline->config.image_path, "rb");
+    labels = fopen(pipeline->config.label_path, "rb");
+
+    if (NULL == images || NULL == labels) {
+        fprintf(stderr, "Could not open file: %s\n", NULL == images ? pipeline->config.image_path : pipeline->config.label_path);
+        goto done;
+    }
+
+    if (1 != fread(&image_header, sizeof(mnist_image_file_header_t), 1, images) || MNIST_IMAGE_MAGIC != swap_uint32(image_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from image file: %s\n", pipeline->config.image_path);
+        goto done;
+    }
+
+    if (1 != fread(&label_header, sizeof(mnist_label_file_header_t), 1, labels) || MNIST_LABEL_MAGIC != swap_uint32(label_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from label file: %s\n", pipeline->config.label_path);
+        goto done;
+    }
+
+    available = swap_uint32(image_header.number_of_images);
+
+    if (available != swap_uint32(label_header.number_of_labels) || pipeline->config.first >= available) {
+        fprintf(stderr, "Invalid image range %u of %u in %s\n", pipeline->config.first, available, pipeline->config.image_path);
+        goto done;
+    }
+
+    if (0 == pipeline->config.count || pipeline->config.count > available - pipeline->config.first) {
+        pipeline->config.count = available - pipeline->config.first;
+    }
+
+    // Keep only this shard of the range, the last shard takes the remainder
+    if (pipeline->config.shards > 1) {
+        uint32_t shard_size = pipeline->config.count / pipeline->config.shards;
+
+        pipeline->config.first += pipeline->config.shard * shard_size;
+        pipeline->config.count = (pipeline->config.shard == pipeline->config.shards - 1) ?
+            pipeline->config.count - pipeline->config.shard * shard_size : shard_size;
+    }
+
+    if (0 == pipeline->config.count) {
+        fprintf(stderr, "Invalid image range %u of %u in %s\n", pipeline->config.first, available, pipeline->config.image_path);
+        goto done;
+    }
+
+    pipeline->base_height = swap_uint32(image_header.number_of_rows);
+    pipeline->base_width = swap_uint32(image_header.number_of_columns);
+    image_size = (size_t) pipeline->base_width * pipeline->base_height;
+
+    pipeline->base_images = malloc(pipeline->config.count * image_size);
+    pipeline->base_labels = malloc(pipeline->config.count);
+
+    if (NULL == pipeline->base_images || NULL == pipeline->base_labels) {
+        fprintf(stderr, "Could not allocated memory for %u images\n", pipeline->config.count);
+        goto done;
+    }
+
+    if (0 != fseek(images, pipeline->config.first * image_size, SEEK_CUR) ||
+        0 != fseek(labels, pipeline->config.first, SEEK_CUR) ||
+        pipeline->config.count != fread(pipeline->base_images, image_size, pipeline->config.count, images) ||
+        pipeline->config.count != fread(pipeline->base_labels, 1, pipeline->config.count, labels)) {
+        fprintf(stderr, "Could not read %u images from: %s\n", pipeline->config.count, pipeline->config.image_path);
+        goto done;
+    }
+
+    ok = 1;
+
+done:
+    if (NULL != images) {
+        fclose(images);
+    }
+
+    if (NULL != labels) {
+        fclose(labels);
+    }
+
+    return ok;
+}
+
+/**
+ * Rotate by angle (radians) about the centre and translate by (dx, dy),
+ * sampling the source bilinearly and filling uncovered pixels with zero.
+ */
+static void augment(const uint8_t * in, uint8_t * out, int width, int height, int dx, int dy, float angle)
+{
+    const float c = cosf(angle), s = sinf(angle);
+    const float cx = 0.5f * (width - 1), cy = 0.5f * (height - 1);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            // Inverse map the output pixel back into the source image
+            float u = x - cx - dx, v = y - cy - dy;
+            float sx = c * u + s * v + cx, sy = -s * u + c * v + cy;
+            int x0 = (int) floorf(sx), y0 = (int) floorf(sy);
+            float fx = sx - x0, fy = sy - y0, p00, p01, p10, p11;
+
+            if (x0 < -1 || y0 < -1 || x0 >= width || y0 >= height) {
+                out[y * width + x] = 0;
+                continue;
+            }
+
+            p00 = (x0 >= 0 && y0 >= 0) ? in[y0 * width + x0] : 0;
+            p01 = (x0 + 1 < width && y0 >= 0) ? in[y0 * width + x0 + 1] : 0;
+            p10 = (x0 >= 0 && y0 + 1 < height) ? in[(y0 + 1) * width + x0] : 0;
+            p11 = (x0 + 1 < width && y0 + 1 < height) ? in[(y0 + 1) * width + x0 + 1] : 0;
+
+            out[y * width + x] = (uint8_t) (0.5f + (1 - fy) * ((1 - fx) * p00 + fx * p01) + fy * ((1 - fx) * p10 + fx * p11));
+        }
+    }
+}
+
+/**
+ * Generate batch number sequence into its ring slot.
+ */
+static void produce(mnist_pipeline_t * pipeline, uint64_t sequence, void * scratch, uint8_t * upscaled)
+{
+    const mnist_pipeline_config_t * config = &pipeline->config;
+    const int slot = sequence % config->slots;
+    const uint64_t epoch = pipeline->config.first_epoch + sequence / pipeline->batches;
+    const uint32_t first = (sequence % pipeline->batches) * config->batch_size;
+    const size_t base_size = (size_t) pipeline->base_width * pipeline->base_height;
+    const int augmenting = config->max_shift > 0 || config->max_rotation > 0.0f;
+    uint8_t * images = pipeline->slot_images + (size_t) slot * config->batch_size * pipeline->out_size;
+    uint32_t i, size;
+
+    size = config->count - first < (uint32_t) config->batch_size ? config->count - first : (uint32_t) config->batch_size;
+
+    for (i = 0; i < size; i++) {
+        uint8_t * out = images + i * pipeline->out_size;
+
+        mnist_resample(pipeline->resampler, pipeline->base_images + (first + i) * base_size, augmenting ? upscaled : out, scratch);
+
+        if (augmenting) {
+            uint64_t r = mix64(config->seed ^ mix64((epoch << 32) ^ (config->first + first + i)));
+            int dx = 0, dy = 0;
+            float angle = 0.0f;
+
+            if (config->max_shift > 0) {
+                dx = (int) (r % (2 * config->max_shift + 1)) - config->max_shift;
+                dy = (int) ((r >> 16) % (2 * config->max_shift + 1)) - config->max_shift;
+            }
+
+            if (config->max_rotation > 0.0f) {
+                angle = ((float) ((r >> 32) & 0xFFFFFF) / 0xFFFFFF * 2.0f - 1.0f) * config->max_rotation * (float) M_PI / 180.0f;
+            }
+
+            augment(upscaled, out, config->out_width, config->out_height, dx, dy, angle);
+        }
+    }
+
+    memcpy(pipeline->slot_labels + (size_t) slot * config->batch_size, pipeline->base_labels + first, size);
+    pipeline->slot_size[slot] = size;
+}
+
+static void * producer_main(void * argument)
+{
+    mnist_pipeline_t * pipeline = argument;
+    void * scratch;
+    uint8_t * upscaled;
+    uint64_t sequence;
+    double start;
+    int producer;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    producer = pipeline->claimed++;
+    scratch = pipeline->scratch + producer * pipeline->scratch_size;
+    upscaled = pipeline->upscaled + producer * pipeline->out_size;
+
+    while (!pipeline->stop) {
+        sequence = pipeline->next_claim++;
+
+        // Wait until the consumer has released the batch that last used the slot
+        start = omp_get_wtime();
+
+        while (!pipeline->stop && sequence >= pipeline->released + pipeline->config.slots) {
+            pthread_cond_wait(&pipeline->consumed, &pipeline->lock);
+        }
+
+        pipeline->stats.producer_wait += omp_get_wtime() - start;
+
+        if (pipeline->stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&pipeline->lock);
+
+        start = omp_get_wtime();
+        produce(pipeline, sequence, scratch, upscaled);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->stats.produce_time += omp_get_wtime() - start;
+        pipeline->slot_sequence[sequence % pipeline->config.slots] = sequence;
+        pipeline->slot_ready[sequence % pipeline->config.slots] = 1;
+        pthread_cond_broadcast(&pipeline->produced);
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+/**
+ * Load the base images and start the producer threads. Producers upscale
+ * (and optionally shift/rotate) images into a bounded ring of batches, so
+ * memory use is fixed by slots * batch_size whatever the output resolution.
+ * The stream repeats the range epoch after epoch, with fresh augmentation
+ * each time.
+ */
+mnist_pipeline_t * mnist_pipeline_create(const mnist_pipeline_config_t * config)
+{
+    mnist_pipeline_t * pipeline;
+    int i;
+
+    if (config->batch_size <= 0 || config->slots <= 0 || config->producers <= 0) {
+        return NULL;
+    }
+
+    pipeline = calloc(1, sizeof(mnist_pipeline_t));
+
+    if (NULL == pipeline) {
+        return NULL;
+    }
+
+    pipeline->config = *config;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->produced, NULL);
+    pthread_cond_init(&pipeline->consumed, NULL);
+
+    if (!read_base_dataset(pipeline)) {
+        mnist_pipeline_free(pipeline);
+        return NULL;
+    }
+
+    pipeline->resampler = mnist_resampler_create(pipeline->base_width, pipeline->base_height, config->out_width, config->out_height, MNIST_FILTER_BICUBIC);
+
+    if (NULL == pipeline->resampler) {
+        mnist_pipeline_free(pipeline);
+        return NULL;
+    }
+
+    pipeline->out_size = (size_t) config->out_width * config->out_height;
+    pipeline->batches = (pipeline->config.count + config->batch_size - 1) / config->batch_size;
+    pipeline->slot_images = malloc((size_t) config->slots * config->batch_size * pipeline->out_size);
+    pipeline->slot_labels = malloc((size_t) config->slots * config->batch_size);
+    pipeline->slot_size = calloc(config->slots, sizeof(uint32_t));
+    pipeline->slot_sequence = calloc(config->slots, sizeof(uint64_t));
+    pipeline->slot_ready = calloc(config->slots, sizeof(int));
+    pipeline->threads = calloc(config->producers, sizeof(pthread_t));
+
+    if (NULL == pipeline->slot_images || NULL == pipeline->slot_labels || NULL == pipeline->slot_size ||
+        NULL == pipeline->slot_sequence || NULL == pipeline->slot_ready || NULL == pipeline->threads) {
+        fprintf(stderr, "Could not allocated memory for %d batches\n", config->slots);
+        mnist_pipeline_free(pipeline);
+        return NULL;
+    }
+
+    // The producers cannot report a failed allocation from their threads, so
+    // their buffers are allocated here, each scratch padded to whole cache
+    // lines so the next one stays aligned for its accumulators
+    pipeline->scratch_size = (mnist_resample_scratch_size(pipeline->resampler) + 63) & ~(size_t) 63;
+    pipeline->scratch = malloc((size_t) config->producers * pipeline->scratch_size);
+    pipeline->upscaled = malloc((size_t) config->producers * pipeline->out_size);
+
+    if (NULL == pipeline->scratch || NULL == pipeline->upscaled) {
+        fprintf(stderr, "Could not allocate memory for the buffers of %d producers\n", config->producers);
+        mnist_pipeline_free(pipeline);
+        return NULL;
+    }
+
+    for (i = 0; i < config->producers; i++) {
+        if (0 == pthread_create(&pipeline->threads[i], NULL, producer_main, pipeline)) {
+            pipeline->started++;
+        }
+    }
+
+    if (0 == pipeline->started) {
+        fprintf(stderr, "Could not start pipeline producer threads\n");
+        mnist_pipeline_free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/**
+ * Number of images in one epoch of the stream.
+ */
+uint32_t mnist_pipeline_size(const mnist_pipeline_t * pipeline)
+{
+    return pipeline->config.count;
+}
+
+/**
+ * Number of batches in one epoch of the stream.
+ */
+uint32_t mnist_pipeline_batches(const mnist_pipeline_t * pipeline)
+{
+    return pipeline->batches;
+}
+
+/**
+ * Block until the next batch in sequence is ready. Batches must be released
+ * in the order they were taken.
+ */
+void mnist_pipeline_next(mnist_pipeline_t * pipeline, mnist_pipeline_batch_t * batch)
+{
+    uint64_t sequence;
+    int slot;
+    double start;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    sequence = pipeline->next_consume++;
+    slot = sequence % pipeline->config.slots;
+    start = omp_get_wtime();
+
+    while (!(pipeline->slot_ready[slot] && pipeline->slot_sequence[slot] == sequence)) {
+        pthread_cond_wait(&pipeline->produced, &pipeline->lock);
+    }
+
+    pipeline->stats.consumer_wait += omp_get_wtime() - start;
+    pipeline->stats.batches++;
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    batch->images = pipeline->slot_images + (size_t) slot * pipeline->config.batch_size * pipeline->out_size;
+    batch->labels = pipeline->slot_labels + (size_t) slot * pipeline->config.batch_size;
+    batch->size = pipeline->slot_size[slot];
+    batch->sequence = sequence;
+}
+
+/**
+ * Hand a consumed batch's slot back to the producers.
+ */
+void mnist_pipeline_release(mnist_pipeline_t * pipeline, mnist_pipeline_batch_t * batch)
+{
+    pthread_mutex_lock(&pipeline->lock);
+
+    pipeline->slot_ready[batch->sequence % pipeline->config.slots] = 0;
+    pipeline->released++;
+    pthread_cond_broadcast(&pipeline->consumed);
+
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void mnist_pipeline_stats(mnist_pipeline_t * pipeline, mnist_pipeline_stats_t * stats)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    *stats = pipeline->stats;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/**
+ * Stop the producers and free the pipeline.
+ */
+void mnist_pipeline_free(mnist_pipeline_t * pipeline)
+{
+    int i;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->consumed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (i = 0; i < pipeline->started; i++) {
+        pthread_join(pipeline->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->produced);
+    pthread_cond_destroy(&pipeline->consumed);
+
+    if (NULL != pipeline->resampler) {
+        mnist_resampler_free(pipeline->resampler);
+    }
+
+    free(pipeline->base_images);
+    free(pipeline->base_labels);
+    free(pipeline->slot_images);
+    free(pipeline->slot_labels);
+    free(pipeline->slot_size);
+    free(pipeline->slot_sequence);
+    free(pipeline->slot_ready);
+    free(pipeline->threads);
+    free(pipeline->scratch);
+    free(pipeline->upscaled);
+    free(pipeline);
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/mnist_records.h"
+
+struct mnist_records_t_ {
+    FILE * file;
+    int owned;      // Closed with the stream, unlike stdout
+    int fields;     // Fields of the open record so far
+};
+
+/**
+ * Open a stream of records to a file, truncating it, or to the standard
+ * output for "-". Returns NULL if the file cannot be created.
+ */
+mnist_records_t * mnist_records_open(const char * path)
+{
+    mnist_records_t * records = calloc(1, sizeof(mnist_records_t));
+
+    if (NULL == records) {
+        fprintf(stderr, "Could not allocate memory for a record stream\n");
+        return NULL;
+    }
+
+    if (0 == strcmp(path, "-")) {
+        records->file = stdout;
+    } else {
+        records->file = fopen(path, "w");
+        records->owned = 1;
+    }
+
+    if (NULL == records->file) {
+        fprintf(stderr, "Could not open %s for records\n", path);
+        free(records);
+        return NULL;
+    }
+
+    return records;
+}
+
+static void key(mnist_records_t * records, const char * name)
+{
+    fprintf(records->file, "%s\"%s\": ", records->fields++ > 0 ? ", " : "", name);
+}
+
+/**
+ * Start a record of the given type, which is its first field.
+ */
+void mnist_records_begin(mnist_records_t * records, const char * type)
+{
+    if (NULL == records) {
+        return;
+    }
+
+    fputc('{', records->file);
+    records->fields = 0;
+    mnist_records_string(records, "record", type);
+}
+
+void mnist_records_string(mnist_records_t * records, const char * name, const char * value)
+{
+    const char * c;
+
+    if (NULL == records) {
+        return;
+    }
+
+    key(records, name);
+
+    if (NULL == value) {
+        fputs("null", records->file);
+        return;
+    }
+
+    fputc('"', records->file);
+
+    for (c = value; '\0' != *c; c++) {
+        if ('"' == *c || '\\' == *c) {
+            fprintf(records->file, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(records->file, "\\u%04x", (unsigned char) *c);
+        } else {
+            fputc(*c, records->file);
+        }
+    }
+
+    fputc('"', records->file);
+}
+
+void mnist_records_int(mnist_records_t * records, const char * name, int64_t value)
+{
+    if (NULL == records) {
+        return;
+    }
+
+    key(records, name);
+    fprintf(records->file, "%lld", (long long) value);
+}
+
+/**
+ * A number with enough digits to round trip, or null where JSON has no
+ * number, as for a diverged loss.
+ */
+void mnist_records_double(mnist_records_t * records, const char * name, double value)
+{
+    if (NULL == records) {
+        return;
+    }
+
+    key(records, name);
+
+    if (isfinite(value)) {
+        fprintf(records->file, "%.17g", value);
+    } else {
+        fputs("null", records->file);
+    }
+}
+
+/**
+ * Finish a record, flushing it so that a run cut short keeps every step it
+ * completed.
+ */
+void mnist_records_end(mnist_records_t * records)
+{
+    if (NULL == records) {
+        return;
+    }
+
+    fputs("}\n", records->file);
+    fflush(records->file);
+}
+
+void mnist_records_close(mnist_records_t * records)
+{
+    if (NULL == records) {
+        return;
+    }
+
+    if (records->owned) {
+        fclose(records->file);
+    } else {
+        fflush(records->file);
+    }
+
+    free(records);
+}
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/mnist_resample.h"
+
+// Fixed point precision of the coefficients, leaving room for 8 bit pixels
+// and the sign. This matches Pillow so the results are bit compatible.
+#define PRECISION_BITS (32 - 8 - 2)
+
+// Scratch layout: the transposed input, the horizontally resampled image and
+// one accumulator line, each starting on a 64 byte boundary
+#define ALIGN64(x) (((x) + 63) & ~63)
+#define TMP_OFFSET(r) ALIGN64((r)->in_width * (r)->in_height)
+#define ACC_OFFSET(r) (TMP_OFFSET(r) + ALIGN64((r)->in_height * (r)->out_width))
+#define ACC_LENGTH(r) ((r)->out_width > (r)->in_height ? (r)->out_width : (r)->in_height)
+
+/**
+ * Bicubic convolution kernel with a = -0.5 (Keys), as used by Pillow.
+ */
+static double bicubic_filter(double x)
+{
+    const double a = -0.5;
+
+    if (x < 0.0) {
+        x = -x;
+    }
+
+    if (x < 1.0) {
+        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1;
+    }
+
+    if (x < 2.0) {
+        return (((x - 5) * x + 8) * x - 4) * a;
+    }
+
+    return 0.0;
+}
+
+/**
+ * Triangle kernel for bilinear interpolation.
+ */
+static double bilinear_filter(double x)
+{
+    if (x < 0.0) {
+        x = -x;
+    }
+
+    if (x < 1.0) {
+        return 1.0 - x;
+    }
+
+    return 0.0;
+}
+
+/**
+ * Round a fixed point accumulator to 8 bits, saturating. Written branch free
+ * so the loops calling it vectorise.
+ */
+static inline uint8_t clip8(int32_t in)
+{
+    in >>= PRECISION_BITS;
+    in = in < 0 ? 0 : in;
+
+    return (uint8_t) (in > 255 ? 255 : in);
+}
+
+/**
+ * Compute the taps of a one dimensional resampling from in_size to out_size.
+ * Both arrays are laid out tap major (index[tap * out_size + x]) so that the
+ * passes can stream over x for a fixed tap. Unused taps get a zero weight and
+ * a valid source index. Returns the number of taps, or -1 on failure.
+ */
+static int precompute_coeffs(int in_size, int out_size, mnist_filter_t filter, int32_t ** index_out, int32_t ** coeffs_out)
+{
+    double (* kernel)(double);
+    double support, scale, filterscale, center, ww, ss;
+    double * weights;
+    int32_t * index, * coeffs;
+    int taps, x, t, xmin, xmax;
+
+    kernel = (MNIST_FILTER_BICUBIC == filter) ? bicubic_filter : bilinear_filter;
+    support = (MNIST_FILTER_BICUBIC == filter) ? 2.0 : 1.0;
+
+    filterscale = scale = (double) in_size / out_size;
+
+    if (filterscale < 1.0) {
+        filterscale = 1.0;
+    }
+
+    support *= filterscale;
+    taps = (int) ceil(support) * 2 + 1;
+
+    weights = malloc(taps * sizeof(double));
+    index = malloc((size_t) taps * out_size * sizeof(int32_t));
+    coeffs = malloc((size_t) taps * out_size * sizeof(int32_t));
+
+    if (NULL == weights || NULL == index || NULL == coeffs) {
+        free(weights);
+        free(index);
+        free(coeffs);
+        return -1;
+    }
+
+    for (x = 0; x < out_size; x++) {
+        center = (x + 0.5) * scale;
+        ss = 1.0 / filterscale;
+        ww = 0.0;
+
+        xmin = (int) (center - support + 0.5);
+
+        if (xmin < 0) {
+            xmin = 0;
+        }
+
+        xmax = (int) (center + support + 0.5);
+
+        if (xmax > in_size) {
+            xmax = in_size;
+        }
+
+        xmax -= xmin;
+
+        for (t = 0; t < xmax; t++) {
+            weights[t] = kernel((t + xmin - center + 0.5) * ss);
+            ww += weights[t];
+        }
+
+        for (t = 0; t < taps; t++) {
+            double w = (t < xmax && ww != 0.0) ? weights[t] / ww : 0.0;
+
+            // Round half away from zero, like Pillow's normalize_coeffs_8bpc
+            coeffs[t * out_size + x] = (int32_t) (w < 0 ? -0.5 + w * (1 << PRECISION_BITS) : 0.5 + w * (1 << PRECISION_BITS));
+            index[t * out_size + x] = (t < xmax) ? xmin + t : xmin;
+        }
+    }
+
+    free(weights);
+
+    *index_out = index;
+    *coeffs_out = coeffs;
+
+    return taps;
+}
+
+/**
+ * Prepare the kernels to resample in_width x in_height images to
+ * out_width x out_height. An axis whose size does not change is passed
+ * through untouched, as Pillow does.
+ */
+mnist_resampler_t * mnist_resampler_create(int in_width, int in_height, int out_width, int out_height, mnist_filter_t filter)
+{
+    mnist_resampler_t * resampler;
+
+    if (in_width <= 0 || in_height <= 0 || out_width <= 0 || out_height <= 0) {
+        return NULL;
+    }
+
+    resampler = calloc(1, sizeof(mnist_resampler_t));
+
+    if (NULL == resampler) {
+        return NULL;
+    }
+
+    resampler->in_width = in_width;
+    resampler->in_height = in_height;
+    resampler->out_width = out_width;
+    resampler->out_height = out_height;
+
+    if (in_width != out_width) {
+        resampler->h_taps = precompute_coeffs(in_width, out_width, filter, &resampler->h_index, &resampler->h_coeffs);
+    }
+
+    if (in_height != out_height) {
+        resampler->v_taps = precompute_coeffs(in_height, out_height, filter, &resampler->v_index, &resampler->v_coeffs);
+    }
+
+    if (resampler->h_taps < 0 || resampler->v_taps < 0) {
+        mnist_resampler_free(resampler);
+        return NULL;
+    }
+
+    return resampler;
+}
+
+void mnist_resampler_free(mnist_resampler_t * resampler)
+{
+    free(resampler->h_index);
+    free(resampler->h_coeffs);
+    free(resampler->v_index);
+    free(resampler->v_coeffs);
+    free(resampler);
+}
+
+/**
+ * Bytes of scratch memory mnist_resample needs per concurrent call.
+ */
+int mnist_resample_scratch_size(const mnist_resampler_t * resampler)
+{
+    return ACC_OFFSET(resampler) + ACC_LENGTH(resampler) * sizeof(int32_t);
+}
+
+/**
+ * Resample one image. The horizontal pass runs first into the scratch image,
+ * then the vertical pass writes the output, both rounding to 8 bits like
+ * Pillow. Each tap of either pass is a multiply-accumulate of a whole
+ * contiguous line by one weight, so the loops over pixels vectorise without
+ * gathers.
+ */
+void mnist_resample(const mnist_resampler_t * resampler, const uint8_t * in, uint8_t * out, void * scratch)
+{
+    const int in_width = resampler->in_width, in_height = resampler->in_height, out_width = resampler->out_width;
+    const uint8_t * rows;
+    uint8_t * transposed = scratch;
+    uint8_t * tmp = transposed + TMP_OFFSET(resampler);
+    int32_t * acc = (int32_t *) (transposed + ACC_OFFSET(resampler));
+    int x, y, t;
+
+    if (resampler->h_taps > 0) {
+        // Work on the transposed input so that every tap of the horizontal
+        // pass is a multiply-accumulate of a contiguous column
+        for (y = 0; y < in_height; y++) {
+            for (x = 0; x < in_width; x++) {
+                transposed[x * in_height + y] = in[y * in_width + x];
+            }
+        }
+
+        for (x = 0; x < out_width; x++) {
+            for (y = 0; y < in_height; y++) {
+                acc[y] = 1 << (PRECISION_BITS - 1);
+            }
+
+            for (t = 0; t < resampler->h_taps; t++) {
+                const int32_t k = resampler->h_coeffs[t * out_width + x];
+                const uint8_t * column = transposed + resampler->h_index[t * out_width + x] * in_height;
+
+                #pragma omp simd
+                for (y = 0; y < in_height; y++) {
+                    acc[y] += k * column[y];
+                }
+            }
+
+            for (y = 0; y < in_height; y++) {
+                tmp[y * out_width + x] = clip8(acc[y]);
+            }
+        }
+
+        rows = tmp;
+    } else {
+        rows = in;
+    }
+
+    if (0 == resampler->v_taps) {
+        memcpy(out, rows, resampler->out_height * out_width);
+        return;
+    }
+
+    for (y = 0; y < resampler->out_height; y++) {
+        for (x = 0; x < out_width; x++) {
+            acc[x] = 1 << (PRECISION_BITS - 1);
+        }
+
+        for (t = 0; t < resampler->v_taps; t++) {
+            const int32_t k = resampler->v_coeffs[t * resampler->out_height + y];
+            const uint8_t * row = rows + resampler->v_index[t * resampler->out_height + y] * out_width;
+
+            #pragma omp simd
+            for (x = 0; x < out_width; x++) {
+                acc[x] += k * row[x];
+            }
+        }
+
+        #pragma omp simd
+        for (x = 0; x < out_width; x++) {
+            out[y * out_width + x] = clip8(acc[x]);
+        }
+    }
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_sampler.h"
+
+/**
+ * SplitMix64 finalizer, a bijective mix of all 64 bits.
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+/**
+ * Counter-based random number: the counter-th value of the stream selected by
+ * seed, stream and epoch. Any value can be computed directly, in any order and
+ * on any thread or rank, without generator state.
+ */
+uint64_t mnist_random(uint64_t seed, uint64_t stream, uint64_t epoch, uint64_t counter)
+{
+    return mix64(mix64(mix64(mix64(seed) ^ stream) ^ epoch) ^ counter);
+}
+
+/**
+ * Uniform integer in [0, n) from the upper 32 bits of a random value.
+ */
+static uint32_t bounded(uint64_t random, uint32_t n)
+{
+    return (uint32_t) (((random >> 32) * n) >> 32);
+}
+
+mnist_sampler_t * mnist_sampler_create(uint32_t size, uint32_t block_size, uint64_t seed, uint64_t stream)
+{
+    mnist_sampler_t * sampler;
+    uint32_t blocks;
+
+    if (0 == block_size) {
+        block_size = MNIST_SAMPLER_BLOCK_SIZE;
+    }
+
+    blocks = (size + block_size - 1) / block_size;
+    sampler = calloc(1, sizeof(mnist_sampler_t));
+
+    if (NULL == sampler) {
+        fprintf(stderr, "Could not allocate memory for sampler\n");
+        return NULL;
+    }
+
+    sampler->size = size;
+    sampler->block_size = block_size;
+    sampler->seed = seed;
+    sampler->stream = stream;
+    sampler->blocks = malloc((blocks + 1) * sizeof(uint32_t));
+    sampler->order = malloc((size + 1) * sizeof(uint32_t));
+
+    if (NULL == sampler->blocks || NULL == sampler->order) {
+        fprintf(stderr, "Could not allocate memory for the order of %u images\n", size);
+        mnist_sampler_free(sampler);
+        return NULL;
+    }
+
+    return sampler;
+}
+
+/**
+ * Shuffle the order for an epoch and return it. The block permutation uses
+ * counters below 2^32 and block b shuffles its images with counters in
+ * (b + 1) << 32, so the blocks are independent and, when parallel is set,
+ * shuffled on all threads.
+ */
+const uint32_t * mnist_sampler_epoch(mnist_sampler_t * sampler, uint64_t epoch, int parallel)
+{
+    uint32_t blocks = (sampler->size + sampler->block_size - 1) / sampler->block_size;
+    uint32_t missing = blocks * sampler->block_size - sampler->size;
+    uint32_t i, j, swap, short_position = blocks;
+    int64_t b;
+
+    for (i = 0; i < blocks; i++) {
+        sampler->blocks[i] = i;
+    }
+
+    // Fisher-Yates over the blocks
+    for (i = blocks; i > 1; i--) {
+        j = bounded(mnist_random(sampler->seed, sampler->stream, epoch, i), i);
+        swap = sampler->blocks[i - 1];
+        sampler->blocks[i - 1] = sampler->blocks[j];
+        sampler->blocks[j] = swap;
+    }
+
+    // Only the last block can be short; the blocks placed after it move up
+    // by the images it is missing
+    for (i = 0; i < blocks; i++) {
+        if (sampler->blocks[i] == blocks - 1) {
+            short_position = i;
+        }
+    }
+
+    #pragma omp parallel for private(i, j, swap) schedule(static) if (parallel)
+    for (b = 0; b < blocks; b++) {
+        uint32_t block = sampler->blocks[b];
+        uint32_t first = block * sampler->block_size;
+        uint32_t count = block == blocks - 1 ? sampler->block_size - missing : sampler->block_size;
+        uint32_t * order = sampler->order + b * sampler->block_size - (b > short_position ? missing : 0);
+
+        for (i = 0; i < count; i++) {
+            order[i] = first + i;
+        }
+
+        for (i = count; i > 1; i--) {
+            j = bounded(mnist_random(sampler->seed, sampler->stream, epoch, ((uint64_t) (block + 1) << 32) | i), i);
+            swap = order[i - 1];
+            order[i - 1] = order[j];
+            order[j] = swap;
+        }
+    }
+
+    return sampler->order;
+}
+
+/**
+ * Copy the images and labels at the given indices into a contiguous batch, on
+ * all threads when parallel is set.
+ */
+void mnist_sampler_gather(const uint32_t * order, uint32_t count, const uint8_t * images, const uint8_t * labels, size_t image_size, uint8_t * batch_images, uint8_t * batch_labels,
+    int parallel)
+{
+    int64_t i;
+
+    #pragma omp parallel for schedule(static) if (parallel)
+    for (i = 0; i < count; i++) {
+        memcpy(batch_images + i * image_size, images + (size_t) order[i] * image_size, image_size);
+        batch_labels[i] = labels[order[i]];
+    }
+}
+
+void mnist_sampler_free(mnist_sampler_t * sampler)
+{
+    if (NULL == sampler) {
+        return;
+    }
+
+    free(sampler->blocks);
+    free(sampler->order);
+    free(sampler);
+}
@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/mnist_serve.h"
+
+// Complete requests a connection reads in one go
+#define CONNECTION_REQUESTS 64
+
+// Micro-batches of requests the queue holds before reading stops
+#define QUEUE_BATCHES 4
+
+typedef struct connection_t_ {
+    int in;               // -1 for a free slot
+    int out;
+    int eof;              // Nothing more will be read
+    uint64_t pending;     // Requests queued or being answered
+    uint8_t * buffer;     // Partly read requests
+    size_t filled;
+    pthread_mutex_t write_lock;
+} connection_t;
+
+typedef struct request_t_ {
+    int connection;
+    uint32_t id;
+    double arrival;
+} request_t;
+
+typedef struct server_t_ {
+    mnist_serve_config_t config;
+    size_t request_bytes;
+    size_t reply_bytes;
+
+    connection_t connections[MNIST_SERVE_MAX_CLIENTS];
+
+    // Ring of queued requests: the oldest is at head
+    request_t * queue;
+    uint8_t * queue_images;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t dequeued;
+
+    // Latency of every answered request, sorted for the percentiles
+    double * latencies;
+    uint64_t latency_capacity;
+    mnist_serve_stats_t stats;
+    double first_arrival;
+    double last_reply;
+} server_t;
+
+typedef struct worker_t_ {
+    server_t * server;
+    int index;
+    int started;
+    pthread_t thread;
+} worker_t;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int signal)
+{
+    (void) signal;
+    interrupted = 1;
+}
+
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static int write_all(int fd, const void * data, size_t bytes)
+{
+    const uint8_t * next = data;
+    ssize_t written;
+
+    while (bytes > 0) {
+        written = write(fd, next, bytes);
+
+        if (written < 0 && EINTR == errno) {
+            continue;
+        } else if (written <= 0) {
+            return -1;
+        }
+
+        next += written;
+        bytes -= written;
+    }
+
+    return 0;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Take the next micro-batch: wait for a first request, then until the batch
+ * is full or the oldest request has waited for the latency budget. Returns
+ * the number of requests taken, zero once the server stops and the queue is
+ * drained.
+ */
+static uint32_t take_batch(server_t * server, request_t * requests, uint8_t * images)
+{
+    const mnist_serve_config_t * config = &server->config;
+    struct timespec deadline;
+    double due;
+    uint32_t n, i, slot;
+
+    pthread_mutex_lock(&server->lock);
+
+    while (0 == server->count && !server->stop) {
+        pthread_cond_wait(&server->queued, &server->lock);
+    }
+
+    while (server->count > 0 && server->count < config->max_batch && !server->stop) {
+        due = server->queue[server->head].arrival + config->budget;
+
+        if (now() >= due) {
+            break;
+        }
+
+        deadline.tv_sec = (time_t) due;
+        deadline.tv_nsec = (long) ((due - (double) deadline.tv_sec) * 1e9);
+        pthread_cond_timedwait(&server->queued, &server->lock, &deadline);
+    }
+
+    n = server->count < config->max_batch ? server->count : config->max_batch;
+
+    for (i = 0; i < n; i++) {
+        slot = (server->head + i) % server->capacity;
+        requests[i] = server->queue[slot];
+        memcpy(images + (size_t) i * config->image_size, server->queue_images + (size_t) slot * config->image_size, config->image_size);
+    }
+
+    server->head = (server->head + n) % server->capacity;
+    server->count -= n;
+
+    if (n > 0) {
+        pthread_cond_signal(&server->dequeued);
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+    return n;
+}
+
+/**
+ * Run micro-batches through the model and write every reply to its
+ * connection, consecutive replies to one connection in a single write.
+ */
+static void * worker_main(void * arg)
+{
+    worker_t * worker = arg;
+    server_t * server = worker->server;
+    const mnist_serve_config_t * config = &server->config;
+    request_t * requests = malloc(config->max_batch * sizeof(request_t));
+    uint8_t * images = malloc((size_t) config->max_batch * config->image_size);
+    float * probabilities = malloc((size_t) config->max_batch * config->labels * sizeof(float));
+    uint8_t * replies = malloc((size_t) config->max_batch * server->reply_bytes);
+    void * workspace = malloc(config->workspace_bytes);
+    double done;
+    uint32_t n, i, first;
+
+#ifdef __linux__
+    if (config->pin) {
+        cpu_set_t cpus;
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->index % (processors > 0 ? processors : 1), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    }
+#endif
+
+    if (NULL == requests || NULL == images || NULL == probabilities || NULL == replies || NULL == workspace) {
+        fprintf(stderr, "Could not allocate memory for a batch of %u requests\n", config->max_batch);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((n = take_batch(server, requests, images)) > 0) {
+        config->infer(config->context, images, n, probabilities, workspace);
+
+        for (i = 0; i < n; i++) {
+            memcpy(replies + i * server->reply_bytes, &requests[i].id, sizeof(uint32_t));
+            memcpy(replies + i * server->reply_bytes + sizeof(uint32_t), probabilities + (size_t) i * config->labels, config->labels * sizeof(float));
+        }
+
+        for (first = 0; first < n; first = i) {
+            connection_t * connection = &server->connections[requests[first].connection];
+
+            for (i = first + 1; i < n && requests[i].connection == requests[first].connection; i++);
+
+            // A client that went away just misses its replies
+            pthread_mutex_lock(&connection->write_lock);
+            write_all(connection->out, replies + first * server->reply_bytes, (i - first) * server->reply_bytes);
+            pthread_mutex_unlock(&connection->write_lock);
+        }
+
+        done = now();
+
+        pthread_mutex_lock(&server->lock);
+
+        for (i = 0; i < n; i++) {
+            server->connections[requests[i].connection].pending--;
+
+            if (server->stats.requests == server->latency_capacity) {
+                server->latency_capacity = 2 * server->latency_capacity;
+                server->latencies = realloc(server->latencies, server->latency_capacity * sizeof(double));
+
+                if (NULL == server->latencies) {
+                    fprintf(stderr, "Could not allocate memory for %lu latencies\n", (unsigned long) server->latency_capacity);
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            server->latencies[server->stats.requests++] = done - requests[i].arrival;
+        }
+
+        server->stats.batches++;
+        server->last_reply = done;
+
+        // The front end closes drained connections
+        pthread_cond_signal(&server->dequeued);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    free(requests);
+    free(images);
+    free(probabilities);
+    free(replies);
+    free(workspace);
+
+    return NULL;
+}
+
+static int open_connection(server_t * server, int in, int out)
+{
+    mnist_serve_hello_t hello = { server->config.image_size, server->config.labels };
+    connection_t * connection;
+    int i;
+
+    for (i = 0; i < MNIST_SERVE_MAX_CLIENTS && -1 != server->connections[i].in; i++);
+
+    if (MNIST_SERVE_MAX_CLIENTS == i || 0 != write_all(out, &hello, sizeof(hello))) {
+        return -1;
+    }
+
+    connection = &server->connections[i];
+
+    pthread_mutex_lock(&server->lock);
+    connection->in = in;
+    connection->out = out;
+    connection->eof = 0;
+    connection->filled = 0;
+    server->stats.clients++;
+    pthread_mutex_unlock(&server->lock);
+
+    return i;
+}
+
+/**
+ * Read what a connection has sent and queue its complete requests, waiting
+ * for the workers while the queue is full.
+ */
+static void read_connection(server_t * server, int index)
+{
+    connection_t * connection = &server->connections[index];
+    const size_t capacity = CONNECTION_REQUESTS * server->request_bytes;
+    const uint32_t image_size = server->config.image_size;
+    ssize_t bytes;
+    size_t offset;
+    double arrival;
+    uint32_t slot;
+
+    bytes = read(connection->in, connection->buffer + connection->filled, capacity - connection->filled);
+
+    if (bytes < 0 && (EINTR == errno || EAGAIN == errno)) {
+        return;
+    } else if (bytes <= 0) {
+        connection->eof = 1;
+        return;
+    }
+
+    connection->filled += bytes;
+    arrival = now();
+
+    pthread_mutex_lock(&server->lock);
+
+    if (0.0 == server->first_arrival) {
+        server->first_arrival = arrival;
+    }
+
+    for (offset = 0; offset + server->request_bytes <= connection->filled; offset += server->request_bytes) {
+        while (server->count == server->capacity) {
+            pthread_cond_wait(&server->dequeued, &server->lock);
+        }
+
+        slot = (server->head + server->count) % server->capacity;
+        server->queue[slot].connection = index;
+        server->queue[slot].arrival = arrival;
+        memcpy(&server->queue[slot].id, connection->buffer + offset, sizeof(uint32_t));
+        memcpy(server->queue_images + (size_t) slot * image_size, connection->buffer + offset + sizeof(uint32_t), image_size);
+        server->count++;
+        connection->pending++;
+    }
+
+    pthread_cond_broadcast(&server->queued);
+    pthread_mutex_unlock(&server->lock);
+
+    memmove(connection->buffer, connection->buffer + offset, connection->filled - offset);
+    connection->filled -= offset;
+}
+
+/**
+ * Close the connections that sent everything and have all their replies.
+ * Returns the number of connections still open.
+ */
+static int close_drained(server_t * server)
+{
+    connection_t * connection;
+    int i, open = 0;
+
+    pthread_mutex_lock(&server->lock);
+
+    for (i = 0; i < MNIST_SERVE_MAX_CLIENTS; i++) {
+        connection = &server->connections[i];
+
+        if (-1 != connection->in && connection->eof && 0 == connection->pending) {
+            if (STDIN_FILENO != connection->in) {
+                close(connection->in);
+            }
+
+            connection->in = -1;
+        } else if (-1 != connection->in) {
+            open++;
+        }
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+    return open;
+}
+
+static int listen_socket(const char * path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || 0 != bind(fd, (struct sockaddr *) &address, sizeof(address)) || 0 != listen(fd, MNIST_SERVE_MAX_CLIENTS)) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static void server_free(server_t * server)
+{
+    int i;
+
+    for (i = 0; i < MNIST_SERVE_MAX_CLIENTS; i++) {
+        free(server->connections[i].buffer);
+        pthread_mutex_destroy(&server->connections[i].write_lock);
+    }
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->queued);
+    pthread_cond_destroy(&server->dequeued);
+    free(server->queue);
+    free(server->queue_images);
+    free(server->latencies);
+    free(server);
+}
+
+static server_t * server_create(const mnist_serve_config_t * config)
+{
+    server_t * server = calloc(1, sizeof(server_t));
+    pthread_condattr_t monotonic;
+    int i, ok = NULL != server;
+
+    if (!ok) {
+        return NULL;
+    }
+
+    server->config = *config;
+    server->request_bytes = sizeof(uint32_t) + config->image_size;
+    server->reply_bytes = sizeof(uint32_t) + config->labels * sizeof(float);
+    server->capacity = QUEUE_BATCHES * config->max_batch * config->workers;
+    server->queue = malloc(server->capacity * sizeof(request_t));
+    server->queue_images = malloc((size_t) server->capacity * config->image_size);
+    server->latency_capacity = 1 << 16;
+    server->latencies = malloc(server->latency_capacity * sizeof(double));
+    ok = NULL != server->queue && NULL != server->queue_images && NULL != server->latencies;
+
+    // Batch deadlines are on the monotonic clock
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->queued, &monotonic);
+    pthread_cond_init(&server->dequeued, NULL);
+    pthread_condattr_destroy(&monotonic);
+
+    for (i = 0; i < MNIST_SERVE_MAX_CLIENTS; i++) {
+        server->connections[i].in = -1;
+        server->connections[i].buffer = malloc(CONNECTION_REQUESTS * server->request_bytes);
+        ok = ok && NULL != server->connections[i].buffer;
+        pthread_mutex_init(&server->connections[i].write_lock, NULL);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Could not allocate memory for a queue of %u requests\n", server->capacity);
+        server_free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+static void summarize(server_t * server, mnist_serve_stats_t * stats)
+{
+    uint64_t i, n = server->stats.requests;
+    double sum = 0.0;
+
+    *stats = server->stats;
+
+    if (0 == n) {
+        return;
+    }
+
+    qsort(server->latencies, n, sizeof(double), compare_doubles);
+
+    for (i = 0; i < n; i++) {
+        sum += server->latencies[i];
+    }
+
+    stats->elapsed = server->last_reply - server->first_arrival;
+    stats->p50 = server->latencies[(n - 1) / 2];
+    stats->p99 = server->latencies[(n - 1) * 99 / 100];
+    stats->max = server->latencies[n - 1];
+    stats->mean = sum / n;
+}
+
+/**
+ * Serve requests until stdin is closed or, on a socket, until the process is
+ * interrupted. A front end thread (the caller) reads every connection and
+ * queues the requests; pinned workers take them in micro-batches of up to
+ * max_batch, waiting at most the latency budget for a batch to fill, so a
+ * lone request is answered within the budget and a burst is answered in full
+ * batches. Returns 0 on success.
+ */
+int mnist_serve_run(const mnist_serve_config_t * config, mnist_serve_stats_t * stats)
+{
+    struct pollfd fds[MNIST_SERVE_MAX_CLIENTS + 1];
+    int indices[MNIST_SERVE_MAX_CLIENTS + 1];
+    struct sigaction action, previous_int, previous_term, previous_pipe;
+    server_t * server;
+    worker_t * workers;
+    int listener = -1, started = 0, nfds, open, i, client;
+
+    memset(stats, 0, sizeof(mnist_serve_stats_t));
+
+    if (0 == config->max_batch || config->workers <= 0 || 0 == config->image_size || NULL == config->infer) {
+        return -1;
+    }
+
+    server = server_create(config);
+    workers = calloc(config->workers, sizeof(worker_t));
+
+    if (NULL == server || NULL == workers) {
+        free(workers);
+        return -1;
+    }
+
+    if (NULL != config->socket_path) {
+        listener = listen_socket(config->socket_path);
+    } else if (open_connection(server, STDIN_FILENO, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Could not write to stdout\n");
+    }
+
+    if (NULL != config->socket_path && listener < 0) {
+        server_free(server);
+        free(workers);
+        return -1;
+    }
+
+    // Interrupting stops a socket server; replies to clients that have gone
+    // must not kill the process
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, &previous_pipe);
+    interrupted = 0;
+
+    for (i = 0; i < config->workers; i++) {
+        workers[i].server = server;
+        workers[i].index = i;
+
+        if (0 == pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            workers[i].started = 1;
+            started++;
+        }
+    }
+
+    while (started > 0 && !interrupted) {
+        open = close_drained(server);
+
+        // On stdin the server ends with its only connection
+        if (NULL == config->socket_path && 0 == open) {
+            break;
+        }
+
+        nfds = 0;
+
+        if (listener >= 0) {
+            fds[nfds].fd = listener;
+            fds[nfds].events = POLLIN;
+            indices[nfds++] = -1;
+        }
+
+        for (i = 0; i < MNIST_SERVE_MAX_CLIENTS; i++) {
+            if (-1 != server->connections[i].in && !server->connections[i].eof) {
+                fds[nfds].fd = server->connections[i].in;
+                fds[nfds].events = POLLIN;
+                indices[nfds++] = i;
+            }
+        }
+
+        if (poll(fds, nfds, 100) <= 0) {
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (0 == (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            if (-1 == indices[i]) {
+                client = accept(listener, NULL, NULL);
+
+                if (client >= 0 && open_connection(server, client, client) < 0) {
+                    close(client);
+                }
+            } else {
+                read_connection(server, indices[i]);
+            }
+        }
+    }
+
+    // The workers answer everything queued before they stop
+    pthread_mutex_lock(&server->lock);
+    server->stop = 1;
+    pthread_cond_broadcast(&server->queued);
+    pthread_mutex_unlock(&server->lock);
+
+    for (i = 0; i < config->workers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    for (i = 0; i < MNIST_SERVE_MAX_CLIENTS; i++) {
+        if (-1 != server->connections[i].in && STDIN_FILENO != server->connections[i].in) {
+            close(server->connections[i].in);
+        }
+    }
+
+    if (listener >= 0) {
+        close(listener);
+        unlink(config->socket_path);
+    }
+
+    sigaction(SIGINT, &previous_int, NULL);
+    sigaction(SIGTERM, &previous_term, NULL);
+    sigaction(SIGPIPE, &previous_pipe, NULL);
+
+    summarize(server, stats);
+    server_free(server);
+    free(workers);
+
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_steal.h"
+
+// A thread's range of images, on a cache line of its own. The owner takes
+// tiles from begin and thieves take halves from end, both under the lock;
+// others read the bounds without it to pick a victim
+struct mnist_steal_deque_t_ {
+    omp_lock_t lock;
+    uint32_t begin;
+    uint32_t end;
+    double done;        // When the thread found no more work
+    double idle;
+    uint64_t tiles;
+    uint64_t steals;
+} __attribute__((aligned(64)));
+
+/**
+ * Create the scheduler with a fixed grain of images per tile, or for 0 one
+ * that adapts, starting from MNIST_STEAL_GRAIN. Returns NULL, after saying
+ * why, when it cannot be allocated or there are too many threads.
+ */
+mnist_steal_t * mnist_steal_create(uint32_t grain)
+{
+    mnist_steal_t * steal;
+    int t;
+
+    if (omp_get_max_threads() > MNIST_STEAL_MAX_THREADS) {
+        fprintf(stderr, "Work stealing schedules up to %d threads\n", MNIST_STEAL_MAX_THREADS);
+        return NULL;
+    }
+
+    steal = calloc(1, sizeof(mnist_steal_t));
+
+    if (NULL == steal || 0 != posix_memalign((void **) &steal->deques, 64, MNIST_STEAL_MAX_THREADS * sizeof(mnist_steal_deque_t))) {
+        fprintf(stderr, "Could not allocate memory for the work-stealing scheduler\n");
+        free(steal);
+        return NULL;
+    }
+
+    memset(steal->deques, 0, MNIST_STEAL_MAX_THREADS * sizeof(mnist_steal_deque_t));
+
+    for (t = 0; t < MNIST_STEAL_MAX_THREADS; t++) {
+        omp_init_lock(&steal->deques[t].lock);
+    }
+
+    steal->adaptive = 0 == grain;
+    steal->grain = 0 == grain ? MNIST_STEAL_GRAIN : (grain < MNIST_STEAL_MAX_TILE ? grain : MNIST_STEAL_MAX_TILE);
+
+    return steal;
+}
+
+/**
+ * Called by every thread of a parallel region before its loop over count
+ * images: give the thread the slice schedule(static) would, the first
+ * count % threads threads one image more.
+ */
+void mnist_steal_start(mnist_steal_t * steal, uint32_t count)
+{
+    const int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+    const uint32_t share = count / threads, extra = count % threads;
+    mnist_steal_deque_t * mine = &steal->deques[thread];
+
+    mine->begin = thread * share + ((uint32_t) thread < extra ? thread : extra);
+    mine->end = mine->begin + share + ((uint32_t) thread < extra ? 1 : 0);
+    mine->done = 0.0;
+    mine->idle = 0.0;
+    mine->tiles = 0;
+    mine->steals = 0;
+
+    #pragma omp master
+    {
+        steal->threads = threads;
+        steal->start = omp_get_wtime();
+    }
+
+    // Nobody steals before every deque holds its slice
+    #pragma omp barrier
+}
+
+static uint32_t remaining(mnist_steal_deque_t * deque)
+{
+    const uint32_t begin = __atomic_load_n(&deque->begin, __ATOMIC_RELAXED), end = __atomic_load_n(&deque->end, __ATOMIC_RELAXED);
+
+    return end > begin ? end - begin : 0;
+}
+
+/**
+ * Take the next tile of the calling thread, [*first, *last), from its own
+ * deque or else from the fullest other one. Returns 0 when no deque holds
+ * images any more.
+ */
+int mnist_steal_next(mnist_steal_t * steal, uint32_t * first, uint32_t * last)
+{
+    mnist_steal_deque_t * mine = &steal->deques[omp_get_thread_num()], * victim;
+    uint32_t left, tile, most, half, begin = 0, end = 0;
+    double start = 0.0;
+    int t, best;
+
+    for (;;) {
+        omp_set_lock(&mine->lock);
+        left = mine->end - mine->begin;
+
+        if (left > 0) {
+            tile = left / MNIST_STEAL_SPLIT;
+            tile = tile < steal->grain ? steal->grain : (tile > MNIST_STEAL_MAX_TILE ? MNIST_STEAL_MAX_TILE : tile);
+            tile = tile < left ? tile : left;
+            *first = mine->begin;
+            *last = mine->begin + tile;
+            __atomic_store_n(&mine->begin, mine->begin + tile, __ATOMIC_RELAXED);
+        }
+
+        omp_unset_lock(&mine->lock);
+
+        if (left > 0) {
+            mine->tiles++;
+
+            if (start > 0.0) {
+                mine->idle += omp_get_wtime() - start;
+            }
+
+            return 1;
+        }
+
+        if (0.0 == start) {
+            start = omp_get_wtime();
+        }
+
+        // The fullest deque has the most to share
+        for (t = 0, best = -1, most = 0; t < steal->threads; t++) {
+            if (&steal->deques[t] != mine && remaining(&steal->deques[t]) > most) {
+                most = remaining(&steal->deques[t]);
+                best = t;
+            }
+        }
+
+        if (best < 0) {
+            mine->done = start;
+            return 0;
+        }
+
+        victim = &steal->deques[best];
+        omp_set_lock(&victim->lock);
+        left = victim->end > victim->begin ? victim->end - victim->begin : 0;
+
+        if (left > 0) {
+            half = (left + 1) / 2;
+            begin = victim->end - half;
+            end = victim->end;
+            __atomic_store_n(&victim->end, begin, __ATOMIC_RELAXED);
+        }
+
+        omp_unset_lock(&victim->lock);
+
+        // Another thief may have emptied it first; then look again
+        if (left > 0) {
+            omp_set_lock(&mine->lock);
+            __atomic_store_n(&mine->begin, begin, __ATOMIC_RELAXED);
+            __atomic_store_n(&mine->end, end, __ATOMIC_RELAXED);
+            omp_unset_lock(&mine->lock);
+            mine->steals++;
+        }
+    }
+}
+
+/**
+ * Called by every thread of the region once mnist_steal_next returned 0:
+ * wait for the others, count the time each sat idle until the last one was
+ * done, and adapt the grain.
+ */
+void mnist_steal_finish(mnist_steal_t * steal)
+{
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+        mnist_steal_stats_t loop = { 0 };
+        double end = steal->start, fraction;
+        int t;
+
+        for (t = 0; t < steal->threads; t++) {
+            end = steal->deques[t].done > end ? steal->deques[t].done : end;
+        }
+
+        for (t = 0; t < steal->threads; t++) {
+            loop.tiles += steal->deques[t].tiles;
+            loop.steals += steal->deques[t].steals;
+            loop.idle += steal->deques[t].idle + (end - steal->deques[t].done);
+        }
+
+        loop.thread_time = steal->threads * (end - steal->start);
+        fraction = loop.thread_time > 0.0 ? loop.idle / loop.thread_time : 0.0;
+
+        if (steal->adaptive && fraction > MNIST_STEAL_IDLE_HIGH && steal->grain > 1) {
+            steal->grain /= 2;
+        } else if (steal->adaptive && fraction < MNIST_STEAL_IDLE_LOW && steal->grain < MNIST_STEAL_MAX_TILE) {
+            steal->grain *= 2;
+        }
+
+        steal->step.tiles += loop.tiles;
+        steal->step.steals += loop.steals;
+        steal->step.idle += loop.idle;
+        steal->step.thread_time += loop.thread_time;
+        steal->run.tiles += loop.tiles;
+        steal->run.steals += loop.steals;
+        steal->run.idle += loop.idle;
+        steal->run.thread_time += loop.thread_time;
+    }
+}
+
+void mnist_steal_reset(mnist_steal_t * steal)
+{
+    if (NULL != steal) {
+        memset(&steal->step, 0, sizeof(mnist_steal_stats_t));
+    }
+}
+
+/**
+ * Add the steals and idle time since the reset to the open record.
+ */
+void mnist_steal_record(mnist_steal_t * steal, mnist_records_t * records)
+{
+    if (NULL == steal) {
+        return;
+    }
+
+    mnist_records_double(records, "tiles", steal->step.tiles);
+    mnist_records_double(records, "steals", steal->step.steals);
+    mnist_records_double(records, "idle_time", steal->step.idle);
+    mnist_records_int(records, "grain", steal->grain);
+}
+
+/**
+ * Print the steals and idle time of the run.
+ */
+void mnist_steal_print(mnist_steal_t * steal)
+{
+    if (NULL == steal) {
+        return;
+    }
+
+    printf("Work Stealing: %.0f tiles, %.0f steals, grain %u images%s\n", steal->run.tiles, steal->run.steals, steal->grain, steal->adaptive ? " (adaptive)" : "");
+    printf("Work Stealing Idle Time: %.6f thread seconds (%.1f%% of %.6f)\n", steal->run.idle,
+        steal->run.thread_time > 0.0 ? 100.0 * steal->run.idle / steal->run.thread_time : 0.0, steal->run.thread_time);
+}
+
+void mnist_steal_free(mnist_steal_t * steal)
+{
+    int t;
+
+    if (NULL == steal) {
+        return;
+    }
+
+    for (t = 0; t < MNIST_STEAL_MAX_THREADS; t++) {
+        omp_destroy_lock(&steal->deques[t].lock);
+    }
+
+    free(steal->deques);
+    free(steal);
+}
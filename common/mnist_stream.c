@@ -0,0 +1,624 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_stream.h"
+
+// The images and the labels of a window are read by separate requests
+#define IMAGES 0
+#define LABELS 1
+
+/**
+ * Minimal io_uring submission and completion rings, driven through the raw
+ * system calls so that liburing is not required.
+ */
+typedef struct uring_t_ {
+    int fd;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ring;
+    void * cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned entries;
+    unsigned inflight;
+} uring_t;
+
+struct mnist_stream_t_ {
+    mnist_stream_config_t config;
+    int fd[2];
+    off_t data_offset[2];
+    size_t image_size;
+    uint32_t windows;
+
+    // Window sequence number s is loaded into buffer s % buffers
+    uint8_t ** data[2];
+    uint64_t * sequence;
+    size_t (* done)[2];
+    size_t (* length)[2];
+    struct iovec (* iov)[2];
+    int * ready;
+    int failed;
+    uint64_t next_window;
+    int holding;
+
+    int using_ring;
+    uring_t ring;
+
+    // pread thread, used when io_uring is not available
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t requested;
+    pthread_cond_t completed;
+    uint64_t issued;
+    uint64_t loaded;
+    int stop;
+
+    mnist_stream_stats_t stats;
+};
+
+static uint32_t swap_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+static int uring_setup(uring_t * ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (MAP_FAILED == ring->sq_ring || MAP_FAILED == ring->cq_ring || MAP_FAILED == ring->sqes) {
+        if (MAP_FAILED != ring->sq_ring) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+
+        if (MAP_FAILED != ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+
+        if (MAP_FAILED != ring->sqes) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    return 1;
+}
+
+static void uring_free(uring_t * ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * Queue and submit one readv of iov at offset, tagged with user_data.
+ */
+static int uring_readv(uring_t * ring, int fd, struct iovec * iov, off_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (1 != syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0)) {
+        return 0;
+    }
+
+    ring->inflight++;
+
+    return 1;
+}
+
+/**
+ * Submit the read of the remaining part of one request of a buffer.
+ */
+static int submit(mnist_stream_t * stream, int buffer, int kind)
+{
+    const uint32_t window = stream->sequence[buffer] % stream->windows;
+    const size_t entry_size = (IMAGES == kind) ? stream->image_size : 1;
+    const off_t offset = stream->data_offset[kind] + ((off_t) stream->config.first + (off_t) window * stream->config.window_images) * entry_size;
+    const size_t done = stream->done[buffer][kind];
+
+    stream->iov[buffer][kind].iov_base = stream->data[kind][buffer] + done;
+    stream->iov[buffer][kind].iov_len = stream->length[buffer][kind] - done;
+
+    return uring_readv(&stream->ring, stream->fd[kind], &stream->iov[buffer][kind], offset + done, buffer * 2 + kind);
+}
+
+/**
+ * Wait for at least one completion and account for every completion that is
+ * available. Short reads are resubmitted for the remainder, and failed reads
+ * mark the stream as failed. Returns 0 if the ring itself failed.
+ */
+static int reap(mnist_stream_t * stream)
+{
+    uring_t * ring = &stream->ring;
+    unsigned head, tail;
+
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && EINTR != errno) {
+        stream->failed = 1;
+        return 0;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+        int buffer = cqe->user_data / 2, kind = cqe->user_data % 2;
+
+        ring->inflight--;
+
+        if (-EINTR == cqe->res || -EAGAIN == cqe->res) {
+            stream->failed |= !submit(stream, buffer, kind);
+            continue;
+        }
+
+        if (cqe->res <= 0) {
+            fprintf(stderr, "Could not read window %lu of %s (%s)\n", (unsigned long) stream->sequence[buffer],
+                (IMAGES == kind) ? stream->config.image_path : stream->config.label_path, 0 == cqe->res ? "end of file" : strerror(-cqe->res));
+            stream->failed = 1;
+            continue;
+        }
+
+        stream->done[buffer][kind] += cqe->res;
+        stream->stats.bytes_read += cqe->res;
+
+        if (stream->done[buffer][kind] < stream->length[buffer][kind]) {
+            stream->failed |= !submit(stream, buffer, kind);
+        } else if (stream->done[buffer][IMAGES] == stream->length[buffer][IMAGES] && stream->done[buffer][LABELS] == stream->length[buffer][LABELS]) {
+            stream->ready[buffer] = 1;
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Read exactly length bytes at offset, retrying on short reads.
+ */
+static int read_exact(int fd, void * buffer, size_t length, off_t offset)
+{
+    uint8_t * cursor = buffer;
+    ssize_t bytes;
+
+    while (length > 0) {
+        bytes = pread(fd, cursor, length, offset);
+
+        if (bytes <= 0) {
+            return 0;
+        }
+
+        cursor += bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+
+    return 1;
+}
+
+/**
+ * Fallback loader: load the requested windows one after the other with pread.
+ */
+static void * loader_main(void * argument)
+{
+    mnist_stream_t * stream = argument;
+    const size_t entry_size[2] = {stream->image_size, 1};
+    uint64_t sequence;
+    int buffer, kind, ok;
+
+    pthread_mutex_lock(&stream->lock);
+
+    while (1) {
+        while (!stream->stop && stream->loaded == stream->issued) {
+            pthread_cond_wait(&stream->requested, &stream->lock);
+        }
+
+        if (stream->stop) {
+            break;
+        }
+
+        sequence = stream->loaded;
+        buffer = sequence % stream->config.buffers;
+        pthread_mutex_unlock(&stream->lock);
+
+        for (kind = IMAGES, ok = 1; kind <= LABELS && ok; kind++) {
+            off_t offset = stream->data_offset[kind] + ((off_t) stream->config.first + (off_t) (sequence % stream->windows) * stream->config.window_images) * entry_size[kind];
+
+            ok = read_exact(stream->fd[kind], stream->data[kind][buffer], stream->length[buffer][kind], offset);
+        }
+
+        pthread_mutex_lock(&stream->lock);
+
+        if (!ok) {
+            fprintf(stderr, "Could not read window %lu of %s\n", (unsigned long) sequence, stream->config.image_path);
+            stream->failed = 1;
+        }
+
+        stream->stats.bytes_read += stream->length[buffer][IMAGES] + stream->length[buffer][LABELS];
+        stream->ready[buffer] = 1;
+        stream->loaded++;
+        pthread_cond_broadcast(&stream->completed);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+/**
+ * Start loading window sequence number sequence into its buffer.
+ */
+static int issue(mnist_stream_t * stream, uint64_t sequence)
+{
+    const int buffer = sequence % stream->config.buffers;
+    const uint32_t window = sequence % stream->windows;
+    const uint32_t first = window * stream->config.window_images;
+    const uint32_t size = stream->config.count - first < stream->config.window_images ? stream->config.count - first : stream->config.window_images;
+
+    stream->sequence[buffer] = sequence;
+    stream->length[buffer][IMAGES] = (size_t) size * stream->image_size;
+    stream->length[buffer][LABELS] = size;
+    stream->done[buffer][IMAGES] = stream->done[buffer][LABELS] = 0;
+
+    if (stream->using_ring) {
+        stream->ready[buffer] = 0;
+        return submit(stream, buffer, IMAGES) && submit(stream, buffer, LABELS);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->ready[buffer] = 0;
+    stream->issued++;
+    pthread_cond_signal(&stream->requested);
+    pthread_mutex_unlock(&stream->lock);
+
+    return 1;
+}
+
+/**
+ * Open the image and label files of a stream and check their headers.
+ */
+static int open_files(mnist_stream_t * stream)
+{
+    mnist_image_file_header_t image_header;
+    mnist_label_file_header_t label_header;
+    uint32_t available;
+
+    stream->fd[IMAGES] = open(stream->config.image_path, O_RDONLY);
+    stream->fd[LABELS] = open(stream->config.label_path, O_RDONLY);
+
+    if (stream->fd[IMAGES] < 0 || stream->fd[LABELS] < 0) {
+        fprintf(stderr, "Could not open file: %s\n", stream->fd[IMAGES] < 0 ? stream->config.image_path : stream->config.label_path);
+        return 0;
+    }
+
+    if (!read_exact(stream->fd[IMAGES], &image_header, sizeof(image_header), 0) || MNIST_IMAGE_MAGIC != swap_uint32(image_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from image file: %s\n", stream->config.image_path);
+        return 0;
+    }
+
+    if (!read_exact(stream->fd[LABELS], &label_header, sizeof(label_header), 0) || MNIST_LABEL_MAGIC != swap_uint32(label_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from label file: %s\n", stream->config.label_path);
+        return 0;
+    }
+
+    if ((uint32_t) stream->config.height != swap_uint32(image_header.number_of_rows) || (uint32_t) stream->config.width != swap_uint32(image_header.number_of_columns)) {
+        fprintf(stderr, "Invalid image dimensions in image file %s (%ux%u not %dx%d)\n", stream->config.image_path,
+            swap_uint32(image_header.number_of_columns), swap_uint32(image_header.number_of_rows), stream->config.width, stream->config.height);
+        return 0;
+    }
+
+    available = swap_uint32(image_header.number_of_images);
+
+    if (available != swap_uint32(label_header.number_of_labels) || stream->config.first >= available) {
+        fprintf(stderr, "Invalid image range %u of %u in %s\n", stream->config.first, available, stream->config.image_path);
+        return 0;
+    }
+
+    if (0 == stream->config.count || stream->config.count > available - stream->config.first) {
+        stream->config.count = available - stream->config.first;
+    }
+
+    // Keep only this shard of the range, the last shard takes the remainder
+    if (stream->config.shards > 1) {
+        uint32_t shard_size = stream->config.count / stream->config.shards;
+
+        stream->config.first += stream->config.shard * shard_size;
+        stream->config.count = (stream->config.shard == stream->config.shards - 1) ?
+            stream->config.count - stream->config.shard * shard_size : shard_size;
+    }
+
+    if (0 == stream->config.count) {
+        fprintf(stderr, "Invalid image range %u of %u in %s\n", stream->config.first, available, stream->config.image_path);
+        return 0;
+    }
+
+    stream->data_offset[IMAGES] = sizeof(mnist_image_file_header_t);
+    stream->data_offset[LABELS] = sizeof(mnist_label_file_header_t);
+
+    return 1;
+}
+
+/**
+ * Open a stream over a range of an IDX dataset and start loading the first
+ * windows. Only buffers windows of window_images images are held in memory.
+ */
+mnist_stream_t * mnist_stream_open(const mnist_stream_config_t * config)
+{
+    mnist_stream_t * stream;
+    int i, kind;
+
+    if (0 == config->window_images || config->buffers < 2 || config->width <= 0 || config->height <= 0) {
+        return NULL;
+    }
+
+    stream = calloc(1, sizeof(mnist_stream_t));
+
+    if (NULL == stream) {
+        return NULL;
+    }
+
+    stream->config = *config;
+    stream->fd[IMAGES] = stream->fd[LABELS] = -1;
+    stream->image_size = (size_t) config->width * config->height;
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->requested, NULL);
+    pthread_cond_init(&stream->completed, NULL);
+
+    if (!open_files(stream)) {
+        mnist_stream_close(stream);
+        return NULL;
+    }
+
+    stream->windows = (stream->config.count + config->window_images - 1) / config->window_images;
+    stream->sequence = calloc(config->buffers, sizeof(uint64_t));
+    stream->done = calloc(config->buffers, sizeof(* stream->done));
+    stream->length = calloc(config->buffers, sizeof(* stream->length));
+    stream->iov = calloc(config->buffers, sizeof(* stream->iov));
+    stream->ready = calloc(config->buffers, sizeof(int));
+    stream->data[IMAGES] = calloc(config->buffers, sizeof(uint8_t *));
+    stream->data[LABELS] = calloc(config->buffers, sizeof(uint8_t *));
+
+    if (NULL == stream->sequence || NULL == stream->done || NULL == stream->length || NULL == stream->iov ||
+        NULL == stream->ready || NULL == stream->data[IMAGES] || NULL == stream->data[LABELS]) {
+        fprintf(stderr, "Could not allocated memory for %d windows\n", config->buffers);
+        mnist_stream_close(stream);
+        return NULL;
+    }
+
+    for (i = 0; i < config->buffers; i++) {
+        for (kind = IMAGES; kind <= LABELS; kind++) {
+            size_t bytes = (size_t) config->window_images * (IMAGES == kind ? stream->image_size : 1);
+
+            if (0 != posix_memalign((void **) &stream->data[kind][i], 4096, bytes)) {
+                stream->data[kind][i] = NULL;
+                fprintf(stderr, "Could not allocated memory for %d windows\n", config->buffers);
+                mnist_stream_close(stream);
+                return NULL;
+            }
+        }
+    }
+
+    // Up to two requests per buffer, plus resubmitted short reads
+    if (config->use_io_uring && uring_setup(&stream->ring, 4 * config->buffers)) {
+        stream->using_ring = 1;
+    } else if (0 == pthread_create(&stream->thread, NULL, loader_main, stream)) {
+        stream->thread_started = 1;
+    } else {
+        fprintf(stderr, "Could not start the stream loader thread\n");
+        mnist_stream_close(stream);
+        return NULL;
+    }
+
+    stream->stats.io_uring = stream->using_ring;
+
+    for (i = 0; i < config->buffers; i++) {
+        if (!issue(stream, i)) {
+            fprintf(stderr, "Could not submit reads for %s\n", config->image_path);
+            mnist_stream_close(stream);
+            return NULL;
+        }
+    }
+
+    return stream;
+}
+
+/**
+ * Number of images in one epoch of the stream.
+ */
+uint32_t mnist_stream_size(const mnist_stream_t * stream)
+{
+    return stream->config.count;
+}
+
+/**
+ * Number of windows in one epoch of the stream.
+ */
+uint32_t mnist_stream_windows(const mnist_stream_t * stream)
+{
+    return stream->windows;
+}
+
+/**
+ * Return the next window, in order and wrapping around at the end of every
+ * epoch. The window returned by the previous call is released, and its
+ * buffer starts loading the window buffers - 1 ahead of the one returned, so
+ * the reads overlap with the training on the current window. Returns 0 on
+ * success.
+ */
+int mnist_stream_next(mnist_stream_t * stream, mnist_stream_window_t * window)
+{
+    const uint64_t sequence = stream->next_window;
+    const int buffer = sequence % stream->config.buffers;
+    double start_time;
+
+    // Submission is part of the stall: io_uring completes reads of cached
+    // pages inline
+    start_time = omp_get_wtime();
+
+    if (stream->holding && !issue(stream, sequence - 1 + stream->config.buffers)) {
+        stream->failed = 1;
+    }
+
+    if (stream->using_ring) {
+        while (!stream->failed && !stream->ready[buffer] && reap(stream));
+    } else {
+        pthread_mutex_lock(&stream->lock);
+
+        while (!stream->failed && !stream->ready[buffer]) {
+            pthread_cond_wait(&stream->completed, &stream->lock);
+        }
+
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    stream->stats.stall_time += omp_get_wtime() - start_time;
+
+    if (stream->failed) {
+        return -1;
+    }
+
+    window->images = stream->data[IMAGES][buffer];
+    window->labels = stream->data[LABELS][buffer];
+    window->size = stream->length[buffer][LABELS];
+
+    stream->next_window++;
+    stream->holding = 1;
+    stream->stats.windows++;
+
+    return 0;
+}
+
+void mnist_stream_stats(const mnist_stream_t * stream, mnist_stream_stats_t * stats)
+{
+    *stats = stream->stats;
+}
+
+/**
+ * Wait for the reads in flight, stop the loader and free the stream.
+ */
+void mnist_stream_close(mnist_stream_t * stream)
+{
+    int i;
+
+    if (stream->using_ring) {
+        while (stream->ring.inflight > 0 && reap(stream));
+
+        uring_free(&stream->ring);
+    }
+
+    if (stream->thread_started) {
+        pthread_mutex_lock(&stream->lock);
+        stream->stop = 1;
+        pthread_cond_signal(&stream->requested);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->requested);
+    pthread_cond_destroy(&stream->completed);
+
+    for (i = 0; i < stream->config.buffers; i++) {
+        if (NULL != stream->data[IMAGES]) {
+            free(stream->data[IMAGES][i]);
+        }
+
+        if (NULL != stream->data[LABELS]) {
+            free(stream->data[LABELS][i]);
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (stream->fd[i] >= 0) {
+            close(stream->fd[i]);
+        }
+    }
+
+    free(stream->data[IMAGES]);
+    free(stream->data[LABELS]);
+    free(stream->sequence);
+    free(stream->done);
+    free(stream->length);
+    free(stream->iov);
+    free(stream->ready);
+    free(stream);
+}
@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <float.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "../include/mnist_tune.h"
+
+#define SETTINGS (sizeof(mnist_tune_settings_t) / sizeof(int))
+#define LINE 1024
+
+// Candidates of the probes, smallest first
+static const int grains[] = { 0, 8, 32, 128 };
+static const int buckets[] = { 0, 1 << 14, 1 << 16, 1 << 18 };
+
+void mnist_tune_config_init(mnist_tune_config_t * config)
+{
+    memset(config, 0, sizeof(mnist_tune_config_t));
+    config->load = 1;
+    config->profile = MNIST_TUNE_PROFILE;
+    config->steps = MNIST_TUNE_STEPS;
+    config->settings = (mnist_tune_settings_t) { MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET };
+}
+
+/**
+ * Parse --autotune, --no-tune, --tune-profile, --tune-steps, --tile,
+ * --work-stealing, --steal-grain, --reduction and --bucket at argv[*i],
+ * moving *i past the value. Returns 0 when the argument is none of them.
+ */
+int mnist_tune_option(mnist_tune_config_t * config, int argc, char * argv[], int * i)
+{
+    const char * value = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (0 == strcmp(argv[*i], "--autotune")) {
+        config->autotune = 1;
+        return 1;
+    } else if (0 == strcmp(argv[*i], "--no-tune")) {
+        config->load = 0;
+        return 1;
+    } else if (0 == strcmp(argv[*i], "--work-stealing")) {
+        config->settings.stealing = 1;
+        return 1;
+    }
+
+    if (NULL == value) {
+        return 0;
+    }
+
+    if (0 == strcmp(argv[*i], "--tune-profile")) {
+        config->profile = value;
+    } else if (0 == strcmp(argv[*i], "--tune-steps")) {
+        config->steps = atoi(value) < 1 ? 1 : (atoi(value) > MNIST_TUNE_MAX_STEPS ? MNIST_TUNE_MAX_STEPS : atoi(value));
+    } else if (0 == strcmp(argv[*i], "--tile")) {
+        config->settings.tile = atoi(value);
+
+        if (config->settings.tile < 1 || config->settings.tile > MNIST_MLP_TILE) {
+            fprintf(stderr, "Tiles hold 1 to %d images, not %s\n", MNIST_MLP_TILE, value);
+            exit(EXIT_FAILURE);
+        }
+    } else if (0 == strcmp(argv[*i], "--steal-grain")) {
+        config->settings.grain = atoi(value) > 0 ? atoi(value) : 0;
+    } else if (0 == strcmp(argv[*i], "--reduction")) {
+        config->settings.reduction = mnist_backend_strategy_parse(value);
+
+        if (config->settings.reduction < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (0 == strcmp(argv[*i], "--bucket")) {
+        config->settings.bucket = atoi(value) > 0 ? atoi(value) : 0;
+    } else {
+        return 0;
+    }
+
+    (*i)++;
+
+    return 1;
+}
+
+/**
+ * The CPU model and count, with everything but letters, digits, dots and
+ * dashes squeezed into underscores, so it is one word of the profile.
+ */
+static void machine(char * name, size_t size)
+{
+    char line[LINE], * model = NULL, * out = name;
+    FILE * cpuinfo = fopen("/proc/cpuinfo", "r");
+    size_t length = 0;
+
+    while (NULL != cpuinfo && NULL == model && NULL != fgets(line, sizeof(line), cpuinfo)) {
+        if (0 == strncmp(line, "model name", 10) && NULL != strchr(line, ':')) {
+            model = strchr(line, ':') + 1;
+        }
+    }
+
+    if (NULL != cpuinfo) {
+        fclose(cpuinfo);
+    }
+
+    for (model = NULL != model ? model : "unknown"; '\0' != *model && length + 1 < size; model++) {
+        if (isalnum((unsigned char) *model) || '.' == *model || '-' == *model) {
+            out[length++] = *model;
+        } else if (length > 0 && '_' != out[length - 1]) {
+            out[length++] = '_';
+        }
+    }
+
+    while (length > 0 && '_' == out[length - 1]) {
+        length--;
+    }
+
+    snprintf(out + length, size - length, "-%ldcpus", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/**
+ * The key of this machine and run in the profile.
+ */
+void mnist_tune_key(char * key, size_t size, mnist_backend_t * backend, const char * hidden, int bf16)
+{
+    char name[MNIST_TUNE_KEY / 2];
+
+    machine(name, sizeof(name));
+    snprintf(key, size, "machine=%s width=%d height=%d backend=%s processes=%d model=%s precision=%s", name, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT,
+        backend->name, backend->size, NULL != hidden ? hidden : "softmax", bf16 ? "bf16" : "fp32");
+}
+
+static int matches(const char * line, const char * key)
+{
+    const size_t length = strlen(key);
+
+    return 0 == strncmp(line, key, length) && (' ' == line[length] || '\n' == line[length] || '\0' == line[length]);
+}
+
+/**
+ * Read the settings saved for the key, the last line of the profile with it.
+ * Returns 1 when there is one; settings the line does not give are left
+ * MNIST_TUNE_UNSET.
+ */
+int mnist_tune_load(const char * path, const char * key, mnist_tune_settings_t * settings)
+{
+    char line[LINE], name[32], * word, * next;
+    FILE * profile = fopen(path, "r");
+    int found = 0, bad_threads, bad_tile;
+
+    if (NULL == profile) {
+        return 0;
+    }
+
+    while (NULL != fgets(line, sizeof(line), profile)) {
+        if (!matches(line, key)) {
+            continue;
+        }
+
+        found = 1;
+        *settings = (mnist_tune_settings_t) { MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET };
+
+        for (word = strtok_r(line + strlen(key), " \t\n", &next); NULL != word; word = strtok_r(NULL, " \t\n", &next)) {
+            if (1 == sscanf(word, "reduction=%31s", name)) {
+                settings->reduction = mnist_backend_strategy_parse(name);
+            } else if (1 != sscanf(word, "threads=%d", &settings->threads) && 1 != sscanf(word, "tile=%d", &settings->tile) &&
+                1 != sscanf(word, "stealing=%d", &settings->stealing) && 1 != sscanf(word, "grain=%d", &settings->grain)) {
+                sscanf(word, "bucket=%d", &settings->bucket);
+            }
+        }
+    }
+
+    fclose(profile);
+
+    if (!found) {
+        return 0;
+    }
+
+    // A line edited by hand may ask for what cannot be
+    bad_threads = MNIST_TUNE_UNSET != settings->threads && settings->threads < 1;
+    bad_tile = MNIST_TUNE_UNSET != settings->tile && (settings->tile < 1 || settings->tile > MNIST_MLP_TILE);
+
+    if (bad_threads || bad_tile) {
+        fprintf(stderr, "Ignoring the invalid threads or tile of %s\n", path);
+        settings->threads = bad_threads ? MNIST_TUNE_UNSET : settings->threads;
+        settings->tile = bad_tile ? MNIST_TUNE_UNSET : settings->tile;
+    }
+
+    return 1;
+}
+
+/**
+ * Save the settings under the key, replacing its line, through a temporary
+ * file renamed over the profile. Returns 0 on success.
+ */
+int mnist_tune_save(const char * path, const char * key, const mnist_tune_settings_t * settings, double time)
+{
+    char line[LINE], temporary[LINE];
+    FILE * profile = fopen(path, "r"), * out;
+    int ok;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    out = fopen(temporary, "w");
+
+    if (NULL == out) {
+        fprintf(stderr, "Could not write the profile %s\n", path);
+
+        if (NULL != profile) {
+            fclose(profile);
+        }
+
+        return -1;
+    }
+
+    if (NULL == profile) {
+        fprintf(out, "# Settings chosen by --autotune, one line per machine and run\n");
+    }
+
+    while (NULL != profile && NULL != fgets(line, sizeof(line), profile)) {
+        if (!matches(line, key)) {
+            fputs(line, out);
+        }
+    }
+
+    fprintf(out, "%s threads=%d tile=%d stealing=%d grain=%d reduction=%s bucket=%d step_time=%.6f\n", key, settings->threads, settings->tile, settings->stealing,
+        settings->grain, mnist_backend_strategy_name(settings->reduction), settings->bucket, time);
+
+    if (NULL != profile) {
+        fclose(profile);
+    }
+
+    ok = 0 == fclose(out);
+
+    if (!ok || 0 != rename(temporary, path)) {
+        fprintf(stderr, "Could not write the profile %s\n", path);
+        remove(temporary);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * The settings of a run: those of the command line, then of the profile,
+ * which may be NULL, then the defaults. OMP_NUM_THREADS, when set, chooses the
+ * threads over the profile.
+ */
+void mnist_tune_resolve(const mnist_tune_config_t * config, const mnist_tune_settings_t * profile, mnist_tune_settings_t * settings)
+{
+    const mnist_tune_settings_t defaults = { omp_get_max_threads(), MNIST_MLP_TILE, 0, 0, MNIST_BACKEND_ALLREDUCE, 0 };
+    const int * given = (const int *) &config->settings, * saved = (const int *) profile, * fallback = (const int *) &defaults;
+    int * fields = (int *) settings;
+    size_t f;
+
+    for (f = 0; f < SETTINGS; f++) {
+        if (MNIST_TUNE_UNSET != given[f]) {
+            fields[f] = given[f];
+        } else if (NULL != saved && MNIST_TUNE_UNSET != saved[f] && !(0 == f && NULL != getenv("OMP_NUM_THREADS"))) {
+            fields[f] = saved[f];
+        } else {
+            fields[f] = fallback[f];
+        }
+    }
+}
+
+/**
+ * Run the model with the settings: the threads of the parallel regions that
+ * follow, the tile of the kernels, the scheduler and the reduction. Returns
+ * 0 on success.
+ */
+int mnist_tune_apply(const mnist_tune_settings_t * settings, mnist_model_t * model)
+{
+    omp_set_num_threads(settings->threads);
+
+    if (NULL != model->parameters) {
+        model->mlp.tile = settings->tile;
+    }
+
+    model->backend->strategy = settings->reduction;
+    model->backend->bucket = settings->bucket;
+
+    mnist_steal_free(model->steal);
+    model->steal = settings->stealing ? mnist_steal_create(settings->grain) : NULL;
+
+    return settings->stealing && NULL == model->steal ? -1 : 0;
+}
+
+/**
+ * Describe the settings that matter to the model and backend.
+ */
+void mnist_tune_describe(const mnist_tune_settings_t * settings, mnist_model_t * model, char * text, size_t size)
+{
+    size_t length = snprintf(text, size, "%d thread%s", settings->threads, 1 == settings->threads ? "" : "s");
+
+    if (NULL != model->parameters) {
+        length += snprintf(text + length, length < size ? size - length : 0, ", tiles of %d images", settings->tile);
+    } else if (settings->stealing && 0 == settings->grain) {
+        length += snprintf(text + length, length < size ? size - length : 0, ", work stealing with an adaptive grain");
+    } else if (settings->stealing) {
+        length += snprintf(text + length, length < size ? size - length : 0, ", work stealing with a grain of %d images", settings->grain);
+    } else {
+        length += snprintf(text + length, length < size ? size - length : 0, ", static schedule");
+    }
+
+    if (model->backend->size > 1 && settings->bucket > 0) {
+        snprintf(text + length, length < size ? size - length : 0, ", %s in buckets of %d elements", mnist_backend_strategy_name(settings->reduction), settings->bucket);
+    } else if (model->backend->size > 1) {
+        snprintf(text + length, length < size ? size - length : 0, ", %s", mnist_backend_strategy_name(settings->reduction));
+    }
+}
+
+static int compare_times(const void * a, const void * b)
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * The median of times measured on every process, each the slowest one's.
+ */
+static double median(mnist_backend_t * backend, double * times, int count)
+{
+    backend->allreduce(backend, times, count, MNIST_BACKEND_DOUBLE, MNIST_BACKEND_MAX);
+    qsort(times, count, sizeof(double), compare_times);
+
+    return count % 2 ? times[count / 2] : 0.5 * (times[count / 2 - 1] + times[count / 2]);
+}
+
+typedef struct tuner_t_ {
+    const mnist_tune_config_t * config;
+    mnist_model_t * model;
+    mnist_tune_step_t step;
+    void * context;
+    int steps;  // Run so far, which the training step is told
+    int probes;
+} tuner_t;
+
+static void report(tuner_t * tuner, const mnist_tune_settings_t * settings, double time, const char * unit)
+{
+    char text[MNIST_TUNE_KEY];
+
+    tuner->probes++;
+
+    if (0 == tuner->model->backend->rank) {
+        mnist_tune_describe(settings, tuner->model, text, sizeof(text));
+
+        if (DBL_MAX == time) {
+            printf("%02d\tskipped\t\t%s\n", tuner->probes, text);
+        } else {
+            printf("%02d\t%.6f\t%s\t%s\n", tuner->probes, time, unit, text);
+        }
+    }
+}
+
+/**
+ * Median seconds of a training step with the settings, after an untimed one
+ * that lets the threads first touch their data and the grain adapt, or
+ * DBL_MAX when the settings cannot be applied.
+ */
+static double probe_steps(tuner_t * tuner, const mnist_tune_settings_t * settings)
+{
+    mnist_backend_t * backend = tuner->model->backend;
+    double times[MNIST_TUNE_MAX_STEPS], start, time;
+    int s;
+
+    if (0 != mnist_tune_apply(settings, tuner->model)) {
+        report(tuner, settings, DBL_MAX, "step");
+        return DBL_MAX;
+    }
+
+    backend->barrier(backend);
+    tuner->step(tuner->context, tuner->steps++);
+
+    for (s = 0; s < tuner->config->steps; s++) {
+        backend->barrier(backend);
+        start = omp_get_wtime();
+        tuner->step(tuner->context, tuner->steps++);
+        times[s] = omp_get_wtime() - start;
+    }
+
+    time = median(backend, times, tuner->config->steps);
+    report(tuner, settings, time, "step");
+
+    return time;
+}
+
+/**
+ * Median seconds of the gradient reduction alone with the settings; the
+ * gradient is zeroed first, so that its sums stay zero.
+ */
+static double probe_reduction(tuner_t * tuner, const mnist_tune_settings_t * settings)
+{
+    mnist_backend_t * backend = tuner->model->backend;
+    double times[MNIST_TUNE_REDUCTIONS], start, time;
+    int r;
+
+    if (0 != mnist_tune_apply(settings, tuner->model)) {
+        report(tuner, settings, DBL_MAX, "reduction");
+        return DBL_MAX;
+    }
+
+    mnist_model_zero_gradient(tuner->model);
+    backend->barrier(backend);
+    mnist_model_reduce_gradient(tuner->model);
+
+    for (r = 0; r < MNIST_TUNE_REDUCTIONS; r++) {
+        backend->barrier(backend);
+        start = omp_get_wtime();
+        mnist_model_reduce_gradient(tuner->model);
+        times[r] = omp_get_wtime() - start;
+    }
+
+    time = median(backend, times, MNIST_TUNE_REDUCTIONS);
+    report(tuner, settings, time, "reduction");
+
+    return time;
+}
+
+/**
+ * Whether two settings run the model alike: the grain matters only with work
+ * stealing, the tile only to the multi-layer perceptron and the reduction
+ * only between processes.
+ */
+static int same(const mnist_tune_settings_t * a, const mnist_tune_settings_t * b, mnist_model_t * model)
+{
+    return a->threads == b->threads && (NULL == model->parameters || a->tile == b->tile) && a->stealing == b->stealing &&
+        (!a->stealing || a->grain == b->grain) && (model->backend->size < 2 || (a->reduction == b->reduction && a->bucket == b->bucket));
+}
+
+/**
+ * Probe the candidate and keep it when it is faster than the best so far.
+ */
+static void try_settings(tuner_t * tuner, double (*probe)(tuner_t *, const mnist_tune_settings_t *), const mnist_tune_settings_t * candidate,
+    mnist_tune_settings_t * best, double * best_time)
+{
+    double time;
+
+    if (same(candidate, best, tuner->model)) {
+        return;
+    }
+
+    time = probe(tuner, candidate);
+
+    if (time < *best_time) {
+        *best = *candidate;
+        *best_time = time;
+    }
+}
+
+/**
+ * Find the fastest settings for the model and backend by timing steps of the
+ * run, which leaves the model with the settings of the last probe. Returns 0
+ * on success.
+ */
+int mnist_tune_run(const mnist_tune_config_t * config, mnist_model_t * model, mnist_tune_step_t step, void * context, mnist_tune_result_t * result)
+{
+    const mnist_tune_settings_t * fixed = &config->settings;
+    const int max_threads = omp_get_max_threads();
+    const size_t count = mnist_model_parameter_bytes(model) / sizeof(float);
+    tuner_t tuner = { .config = config, .model = model, .step = step, .context = context };
+    mnist_tune_config_t none = *config;
+    mnist_tune_settings_t defaults, best, candidate;
+    double best_time;
+    size_t c;
+    int t;
+
+    none.settings = (mnist_tune_settings_t) { MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET, MNIST_TUNE_UNSET };
+    mnist_tune_resolve(&none, NULL, &defaults);
+    mnist_tune_resolve(config, NULL, &best);
+
+    if (0 == model->backend->rank) {
+        printf("Probe\tTime (s)\tOf\tSettings\n");
+    }
+
+    result->default_time = probe_steps(&tuner, &defaults);
+    best_time = same(&defaults, &best, model) ? result->default_time : probe_steps(&tuner, &best);
+
+    if (DBL_MAX == best_time) {
+        return -1;
+    }
+
+    // Threads per process, doubling up to those OpenMP was given
+    for (t = 1; MNIST_TUNE_UNSET == fixed->threads; t = 2 * t < max_threads ? 2 * t : max_threads) {
+        candidate = best;
+        candidate.threads = t;
+        try_settings(&tuner, probe_steps, &candidate, &best, &best_time);
+
+        if (t == max_threads) {
+            break;
+        }
+    }
+
+    if (NULL != model->parameters && MNIST_TUNE_UNSET == fixed->tile) {
+        // Tiles of the kernels, halving from the largest the workspace holds
+        for (t = MNIST_MLP_TILE; t >= 8; t /= 2) {
+            candidate = best;
+            candidate.tile = t;
+            try_settings(&tuner, probe_steps, &candidate, &best, &best_time);
+        }
+    } else if (NULL == model->parameters && 0 != fixed->stealing) {
+        // Work stealing with every grain, unless fixed
+        for (c = 0; c < sizeof(grains) / sizeof(grains[0]); c++) {
+            candidate = best;
+            candidate.stealing = 1;
+            candidate.grain = MNIST_TUNE_UNSET == fixed->grain ? grains[c] : fixed->grain;
+            try_settings(&tuner, probe_steps, &candidate, &best, &best_time);
+
+            if (MNIST_TUNE_UNSET != fixed->grain) {
+                break;
+            }
+        }
+    }
+
+    result->time = best_time;
+
+    // The reduction is timed on its own, as it is a small part of a step
+    if (model->backend->size > 1 && (MNIST_TUNE_UNSET == fixed->reduction || MNIST_TUNE_UNSET == fixed->bucket)) {
+        best_time = probe_reduction(&tuner, &best);
+
+        for (t = MNIST_BACKEND_ALLREDUCE; t <= MNIST_BACKEND_REDUCE_SCATTER; t++) {
+            for (c = 0; c < sizeof(buckets) / sizeof(buckets[0]); c++) {
+                candidate = best;
+                candidate.reduction = MNIST_TUNE_UNSET == fixed->reduction ? t : fixed->reduction;
+                candidate.bucket = MNIST_TUNE_UNSET == fixed->bucket ? buckets[c] : fixed->bucket;
+
+                // Buckets as large as the gradient are one collective
+                if (0 == candidate.bucket || (size_t) candidate.bucket < count) {
+                    try_settings(&tuner, probe_reduction, &candidate, &best, &best_time);
+                }
+
+                if (MNIST_TUNE_UNSET != fixed->bucket) {
+                    break;
+                }
+            }
+
+            if (MNIST_TUNE_UNSET != fixed->reduction) {
+                break;
+            }
+        }
+
+        result->time = probe_steps(&tuner, &best);
+    }
+
+    // The defaults were probed first, before anything was warm, so they are
+    // timed again against what was chosen
+    if (!same(&defaults, &best, model)) {
+        best_time = probe_steps(&tuner, &defaults);
+        result->default_time = best_time < result->default_time ? best_time : result->default_time;
+    }
+
+    result->best = best;
+    result->probes = tuner.probes;
+
+    return 0;
+}
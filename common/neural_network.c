@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/neural_network.h"
+#include "../include/mnist_numa.h"
+
+// Convert a pixel value from 0-255 to one from 0 to 1
+#define PIXEL_SCALE(x) (((float) (x)) / 255.0f)
+
+// Returns a random value between 0 and 1
+#define RAND_FLOAT() (((float) rand()) / ((float) RAND_MAX))
+
+/**
+ * Initialise the weights and bias vectors with values between 0 and 1
+ */
+void neural_network_random_weights(neural_network_t * network)
+{
+    int i, j;
+
+    for (i = 0; i < MNIST_LABELS; i++) {
+        network->b[i] = RAND_FLOAT();
+
+        for (j = 0; j < MNIST_IMAGE_SIZE; j++) {
+            network->W[i][j] = RAND_FLOAT();
+        }
+    }
+}
+
+/**
+ * Calculate the softmax vector from the activations. This uses a more
+ * numerically stable algorithm that normalises the activations to prevent
+ * large exponents.
+ */
+void neural_network_softmax(float * activations, int length)
+{
+    int i;
+    float sum, max;
+
+    for (i = 1, max = activations[0]; i < length; i++) {
+        if (activations[i] > max) {
+            max = activations[i];
+        }
+    }
+
+    for (i = 0, sum = 0; i < length; i++) {
+        activations[i] = exp(activations[i] - max);
+        sum += activations[i];
+    }
+
+    for (i = 0; i < length; i++) {
+        activations[i] /= sum;
+    }
+}
+
+/**
+ * Use the weights and bias vector to forward propogate through the neural
+ * network and calculate the activations.
+ */
+void neural_network_hypothesis(mnist_image_t * image, neural_network_t * network, float activations[MNIST_LABELS])
+{
+    int i, j;
+
+    for (i = 0; i < MNIST_LABELS; i++) {
+        activations[i] = network->b[i];
+
+        for (j = 0; j < MNIST_IMAGE_SIZE; j++) {
+            activations[i] += network->W[i][j] * PIXEL_SCALE(image->pixels[j]);
+        }
+    }
+
+    neural_network_softmax(activations, MNIST_LABELS);
+}
+
+/**
+ * Update the gradients for this step of gradient descent using the gradient
+ * contributions from a single training example (image).
+ * 
+ * This function returns the loss ontribution from this training example.
+ */
+float neural_network_gradient_update(mnist_image_t * image, neural_network_t * network, neural_network_gradient_t * gradient, uint8_t label)
+{
+    float activations[MNIST_LABELS];
+    float b_grad, W_grad;
+    int i, j;
+
+    // First forward propagate through the network to calculate activations
+    neural_network_hypothesis(image, network, activations);
+
+    for (i = 0; i < MNIST_LABELS; i++) {
+        // This is the gradient for a softmax bias input
+        b_grad = (i == label) ? activations[i] - 1 : activations[i];
+
+        for (j = 0; j < MNIST_IMAGE_SIZE; j++) {
+            // The gradient for the neuron weight is the bias multiplied by the input weight
+            W_grad = b_grad * PIXEL_SCALE(image->pixels[j]);
+
+            // Update the weight gradient
+            gradient->W_grad[i][j] += W_grad;
+        }
+
+        // Update the bias gradient
+        gradient->b_grad[i] += b_grad;
+    }
+
+    // Cross entropy loss
+    return 0.0f - log(activations[label]);
+}
+
+/**
+ * Accumulate the gradient and loss contributions of every image in a batch.
+ */
+float neural_network_accumulate(mnist_dataset_t * batch, neural_network_t * network, neural_network_gradient_t * gradient)
+{
+    float total_loss;
+    int i;
+
+    for (i = 0, total_loss = 0; i < batch->size; i++) {
+        total_loss += neural_network_gradient_update(&batch->images[i], network, gradient, batch->labels[i]);
+    }
+
+    return total_loss;
+}
+
+// Private gradient of every thread, kept from batch to batch. Each thread
+// allocates and first touches its own, so it lives on the thread's NUMA node
+static neural_network_gradient_t * thread_gradient = NULL;
+#pragma omp threadprivate(thread_gradient)
+
+/**
+ * Accumulate the gradient and loss of a batch using all OpenMP threads. Each
+ * thread sums into a private gradient so that threads never race on the same
+ * element; the private gradients are then added into gradient. The images
+ * are split in static slices, or with a work-stealing scheduler in tiles of
+ * the same slices that idle threads take over from busy ones.
+ */
+float neural_network_accumulate_parallel(mnist_dataset_t * batch, neural_network_t * network, neural_network_gradient_t * gradient, mnist_steal_t * steal)
+{
+    float total_loss = 0.0f;
+
+    #pragma omp parallel reduction(+:total_loss)
+    {
+        if (NULL == thread_gradient) {
+            thread_gradient = mnist_numa_alloc(sizeof(neural_network_gradient_t));
+
+            if (NULL == thread_gradient) {
+                fprintf(stderr, "Could not allocate memory for a thread gradient\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        memset(thread_gradient, 0, sizeof(neural_network_gradient_t));
+
+        if (NULL == steal) {
+            // Static slices, the ones the images were placed by
+            #pragma omp for schedule(static)
+            for (int i = 0; i < batch->size; i++) {
+                total_loss += neural_network_gradient_update(&batch->images[i], network, thread_gradient, batch->labels[i]);
+            }
+        } else {
+            uint32_t first, last;
+
+            mnist_steal_start(steal, batch->size);
+
+            while (mnist_steal_next(steal, &first, &last)) {
+                for (uint32_t i = first; i < last; i++) {
+                    total_loss += neural_network_gradient_update(&batch->images[i], network, thread_gradient, batch->labels[i]);
+                }
+            }
+
+            mnist_steal_finish(steal);
+        }
+
+        #pragma omp critical
+        {
+            for (int i = 0; i < MNIST_LABELS; i++) {
+                gradient->b_grad[i] += thread_gradient->b_grad[i];
+
+                for (int j = 0; j < MNIST_IMAGE_SIZE; j++) {
+                    gradient->W_grad[i][j] += thread_gradient->W_grad[i][j];
+                }
+            }
+        }
+    }
+
+    return total_loss;
+}
+
+/**
+ * Count the pages of the threads' private gradients on their own NUMA node,
+ * and elsewhere.
+ */
+void neural_network_gradient_locality(mnist_numa_locality_t * locality)
+{
+    #pragma omp parallel
+    {
+        mnist_numa_locality_t mine = { 0 };
+
+        if (NULL != thread_gradient) {
+            mnist_numa_page_locality(thread_gradient, sizeof(neural_network_gradient_t), -1, &mine);
+        }
+
+        #pragma omp critical
+        {
+            locality->local += mine.local;
+            locality->remote += mine.remote;
+            locality->unknown += mine.unknown;
+        }
+    }
+}
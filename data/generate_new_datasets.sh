@@ -8,12 +8,21 @@ declare -a scales=(1 2 4)
 # Base size of MNIST images
 base_size=28
 
-python_script="upscale_mnist.py"
+# Native, multithreaded upscaler (bit compatible with upscale_mnist.py)
+upscaler="./upscale_mnist"
+
+# Converts the upscaled IDX files into compressed chunked containers
+converter="./idx_to_chunked"
 
 # Output directory for the upscaled datasets
 output_dir="upscaled_datasets"
 mkdir -p "$output_dir"
 
+if ! make -s upscale_mnist idx_to_chunked; then
+    echo "Failed to build ${upscaler} and ${converter}."
+    exit 1
+fi
+
 for dataset in "${datasets[@]}"; do
     for scale in "${scales[@]}"; do
 
@@ -22,15 +31,21 @@ for dataset in "${datasets[@]}"; do
         output_file="${output_dir}/${dataset}-upscaled-${scale}x.ubyte"
         
         echo "Upscaling ${dataset} to ${new_size}x${new_size}..."
-        python3 "$python_script" "$dataset" "$output_file" "$new_size" "$new_size"
+        "$upscaler" "$dataset" "$output_file" "$new_size" "$new_size"
         
-        # Check if the script succeeded
+        # Check if the upscaler succeeded
         if [[ $? -eq 0 ]]; then
             echo "Upscaled dataset saved to ${output_file}."
         else
             echo "Failed to upscale ${dataset} to ${new_size}x${new_size}."
             exit 1
         fi
+
+        # Compressed copy with the labels, read by the --chunked option
+        if ! "$converter" "$output_file" "${dataset/images-idx3/labels-idx1}" "${output_file}.chunked"; then
+            echo "Failed to convert ${output_file} into a chunked container."
+            exit 1
+        fi
     done
 done
 
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_chunked.h"
+
+// Chunks compressed per block; bounds memory use regardless of dataset size
+#define BLOCK_CHUNKS 64
+
+/**
+ * Convert between the big endian IDX header fields and host byte order.
+ */
+static uint32_t swap_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+/**
+ * Convert to the little endian container fields from host byte order.
+ */
+static uint32_t le_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+static uint64_t le_uint64(uint64_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(in);
+#else
+    return in;
+#endif
+}
+
+static void usage(const char * program)
+{
+    fprintf(stderr, "Usage: %s IMAGES LABELS OUTPUT [--chunk IMAGES_PER_CHUNK]\n", program);
+}
+
+/**
+ * Convert an IDX image file and its label file into a chunked container (see
+ * mnist_chunked.h). Chunks are compressed in parallel with OpenMP, a block at
+ * a time, and streamed to the output; the chunk index is written last.
+ */
+int main(int argc, char * argv[])
+{
+    mnist_image_file_header_t image_header;
+    mnist_label_file_header_t label_header;
+    mnist_chunked_header_t header;
+    FILE * images, * labels, * output;
+    uint8_t * raw, * label_data, * encoded;
+    uint64_t * offsets, offset, raw_bytes;
+    size_t image_size, chunk_size, * encoded_size;
+    uint32_t number_of_images, number_of_chunks, per_chunk = MNIST_CHUNKED_IMAGES_PER_CHUNK, chunk, block, i;
+    int width, height;
+    double start_time;
+
+    if (argc != 4 && !(argc == 6 && 0 == strcmp(argv[4], "--chunk") && (per_chunk = atoi(argv[5])) > 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    images = fopen(argv[1], "rb");
+    labels = fopen(argv[2], "rb");
+
+    if (NULL == images || NULL == labels) {
+        fprintf(stderr, "Could not open file: %s\n", NULL == images ? argv[1] : argv[2]);
+        return 1;
+    }
+
+    if (1 != fread(&image_header, sizeof(mnist_image_file_header_t), 1, images) || MNIST_IMAGE_MAGIC != swap_uint32(image_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from image file: %s\n", argv[1]);
+        return 1;
+    }
+
+    if (1 != fread(&label_header, sizeof(mnist_label_file_header_t), 1, labels) || MNIST_LABEL_MAGIC != swap_uint32(label_header.magic_number)) {
+        fprintf(stderr, "Invalid header read from label file: %s\n", argv[2]);
+        return 1;
+    }
+
+    number_of_images = swap_uint32(image_header.number_of_images);
+
+    if (number_of_images != swap_uint32(label_header.number_of_labels)) {
+        fprintf(stderr, "Number of images does not match number of labels (%u != %u)\n", number_of_images, swap_uint32(label_header.number_of_labels));
+        return 1;
+    }
+
+    number_of_chunks = (number_of_images + per_chunk - 1) / per_chunk;
+    height = swap_uint32(image_header.number_of_rows);
+    width = swap_uint32(image_header.number_of_columns);
+    image_size = (size_t) width * height;
+    chunk_size = image_size * per_chunk;
+
+    header.magic_number = le_uint32(MNIST_CHUNKED_MAGIC);
+    header.version = le_uint32(MNIST_CHUNKED_VERSION);
+    header.codec = le_uint32(MNIST_CODEC_GRADIENT_RLE);
+    header.number_of_images = le_uint32(number_of_images);
+    header.number_of_rows = le_uint32(height);
+    header.number_of_columns = le_uint32(width);
+    header.images_per_chunk = le_uint32(per_chunk);
+    header.number_of_chunks = le_uint32(number_of_chunks);
+
+    offsets = calloc(number_of_chunks + 1, sizeof(uint64_t));
+    label_data = malloc(number_of_images);
+    raw = malloc(BLOCK_CHUNKS * chunk_size);
+    encoded = malloc(BLOCK_CHUNKS * MNIST_CHUNKED_BOUND(chunk_size));
+    encoded_size = malloc(BLOCK_CHUNKS * sizeof(size_t));
+
+    if (NULL == offsets || NULL == label_data || NULL == raw || NULL == encoded || NULL == encoded_size) {
+        fprintf(stderr, "Could not allocated memory for %d chunks\n", BLOCK_CHUNKS);
+        return 1;
+    }
+
+    if (number_of_images != fread(label_data, 1, number_of_images, labels)) {
+        fprintf(stderr, "Could not read %u labels from: %s\n", number_of_images, argv[2]);
+        return 1;
+    }
+
+    output = fopen(argv[3], "wb");
+
+    if (NULL == output) {
+        fprintf(stderr, "Could not open file: %s\n", argv[3]);
+        return 1;
+    }
+
+    // The index is rewritten once the chunk sizes are known
+    offset = sizeof(mnist_chunked_header_t) + (number_of_chunks + 1) * sizeof(uint64_t) + number_of_images;
+    fwrite(&header, sizeof(mnist_chunked_header_t), 1, output);
+    fwrite(offsets, sizeof(uint64_t), number_of_chunks + 1, output);
+    fwrite(label_data, 1, number_of_images, output);
+
+    start_time = omp_get_wtime();
+
+    for (chunk = 0; chunk < number_of_chunks; chunk += block) {
+        uint32_t first_image = chunk * per_chunk;
+        uint32_t block_images = number_of_images - first_image < BLOCK_CHUNKS * per_chunk ? number_of_images - first_image : BLOCK_CHUNKS * per_chunk;
+
+        block = (block_images + per_chunk - 1) / per_chunk;
+
+        if (block_images != fread(raw, image_size, block_images, images)) {
+            fprintf(stderr, "Could not read %u images from: %s\n", block_images, argv[1]);
+            return 1;
+        }
+
+        #pragma omp parallel
+        {
+            uint8_t * scratch = malloc(chunk_size);
+
+            #pragma omp for schedule(dynamic)
+            for (i = 0; i < block; i++) {
+                uint32_t count = block_images - i * per_chunk < per_chunk ? block_images - i * per_chunk : per_chunk;
+
+                encoded_size[i] = mnist_chunked_encode(raw + i * chunk_size, width, height, count, encoded + i * MNIST_CHUNKED_BOUND(chunk_size), scratch);
+            }
+
+            free(scratch);
+        }
+
+        for (i = 0; i < block; i++) {
+            offsets[chunk + i] = le_uint64(offset);
+            offset += encoded_size[i];
+
+            if (encoded_size[i] != fwrite(encoded + i * MNIST_CHUNKED_BOUND(chunk_size), 1, encoded_size[i], output)) {
+                fprintf(stderr, "Could not write chunk %u to: %s\n", chunk + i, argv[3]);
+                return 1;
+            }
+        }
+    }
+
+    offsets[number_of_chunks] = le_uint64(offset);
+
+    if (0 != fseek(output, sizeof(mnist_chunked_header_t), SEEK_SET) ||
+        number_of_chunks + 1 != fwrite(offsets, sizeof(uint64_t), number_of_chunks + 1, output)) {
+        fprintf(stderr, "Could not write the chunk index to: %s\n", argv[3]);
+        return 1;
+    }
+
+    raw_bytes = sizeof(mnist_image_file_header_t) + (uint64_t) number_of_images * image_size;
+    printf("Compressed %u images into %u chunks in %.3f seconds using %d threads.\n", number_of_images, number_of_chunks, omp_get_wtime() - start_time, omp_get_max_threads());
+    printf("%s: %lu bytes (%.2fx smaller than the IDX images).\n", argv[3], (unsigned long) offset, (double) raw_bytes / offset);
+
+    free(offsets);
+    free(label_data);
+    free(raw);
+    free(encoded);
+    free(encoded_size);
+    fclose(images);
+    fclose(labels);
+
+    return 0 == fclose(output) ? 0 : 1;
+}
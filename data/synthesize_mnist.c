@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_sampler.h"
+
+// Images generated per block; bounds memory use regardless of dataset size
+#define BLOCK_IMAGES 8192
+
+// Anchor points of the digit strokes, in a unit box (x right, y down)
+#define ANCHORS 10
+#define MAX_STROKES 5
+
+static const float anchors[ANCHORS][2] = {
+    { 0.0f, 0.0f }, { 1.0f, 0.0f },    // 0 top left, 1 top right
+    { 0.0f, 0.5f }, { 1.0f, 0.5f },    // 2 middle left, 3 middle right
+    { 0.0f, 1.0f }, { 1.0f, 1.0f },    // 4 bottom left, 5 bottom right
+    { 0.5f, 0.0f }, { 0.5f, 1.0f },    // 6 top centre, 7 bottom centre
+    { 0.2f, 0.2f }, { 0.4f, 1.0f }     // 8 serif of the one, 9 foot of the seven
+};
+
+// Strokes of every digit as pairs of anchors, a seven segment style skeleton
+static const int strokes[MNIST_LABELS][MAX_STROKES][2] = {
+    { { 0, 1 }, { 1, 5 }, { 5, 4 }, { 4, 0 }, { -1, -1 } },
+    { { 6, 7 }, { 8, 6 }, { -1, -1 } },
+    { { 0, 1 }, { 1, 3 }, { 3, 2 }, { 2, 4 }, { 4, 5 } },
+    { { 0, 1 }, { 1, 5 }, { 5, 4 }, { 2, 3 }, { -1, -1 } },
+    { { 0, 2 }, { 2, 3 }, { 1, 5 }, { -1, -1 } },
+    { { 1, 0 }, { 0, 2 }, { 2, 3 }, { 3, 5 }, { 5, 4 } },
+    { { 1, 0 }, { 0, 4 }, { 4, 5 }, { 5, 3 }, { 3, 2 } },
+    { { 0, 1 }, { 1, 9 }, { -1, -1 } },
+    { { 0, 1 }, { 1, 5 }, { 5, 4 }, { 4, 0 }, { 2, 3 } },
+    { { 3, 2 }, { 2, 0 }, { 0, 1 }, { 1, 5 }, { 5, 4 } }
+};
+
+typedef struct synthesis_config_t_ {
+    uint32_t width;
+    uint32_t height;
+    float sparsity;   // Target fraction of background (zero) pixels
+    float noise;      // Fraction of background pixels set to faint noise
+    uint64_t seed;
+} synthesis_config_t;
+
+/**
+ * Convert between the big endian IDX header fields and host byte order.
+ */
+static uint32_t swap_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+/**
+ * Uniform float in [-1, 1) from the counter-th draw of an image.
+ */
+static float draw(const synthesis_config_t * config, uint64_t image, int counter)
+{
+    return (float) (mnist_random(config->seed, 0, image, counter) >> 40) / (float) (1 << 23) - 1.0f;
+}
+
+/**
+ * Render one digit-like image. Everything about it, label included, is drawn
+ * from the counter-based stream of its index, so images can be generated in
+ * any order and on any thread with identical results.
+ */
+static uint8_t synthesize_image(const synthesis_config_t * config, uint64_t image, uint8_t * pixels)
+{
+    uint8_t label = mnist_random(config->seed, 0, image, 0) % MNIST_LABELS;
+    float points[ANCHORS][2], box, box_width, box_height, centre_x, centre_y, slant;
+    float length = 0.0f, thickness, limit, caps, area, noise;
+    int i, x, y;
+
+    memset(pixels, 0, (size_t) config->width * config->height);
+
+    // Random size, aspect, position and slant, in units of the image
+    box = 0.65f + 0.1f * draw(config, image, 1);
+    box_width = box * (0.55f + 0.1f * draw(config, image, 2));
+    box_height = box;
+    centre_x = 0.5f + 0.5f * (1.0f - box_width) * 0.3f * draw(config, image, 3);
+    centre_y = 0.5f + 0.5f * (1.0f - box_height) * 0.3f * draw(config, image, 4);
+    slant = 0.2f * draw(config, image, 5);
+
+    // Jittered anchors in pixels, shared by the strokes meeting there
+    for (i = 0; i < ANCHORS; i++) {
+        float u = anchors[i][0] - 0.5f + 0.08f * draw(config, image, 8 + 2 * i);
+        float v = anchors[i][1] - 0.5f + 0.08f * draw(config, image, 9 + 2 * i);
+
+        points[i][0] = (centre_x + u * box_width + slant * v * box_height) * config->width;
+        points[i][1] = (centre_y + v * box_height) * config->height;
+    }
+
+    for (i = 0; i < MAX_STROKES && strokes[label][i][0] >= 0; i++) {
+        const float * a = points[strokes[label][i][0]], * b = points[strokes[label][i][1]];
+
+        length += sqrtf((b[0] - a[0]) * (b[0] - a[0]) + (b[1] - a[1]) * (b[1] - a[1]));
+    }
+
+    // Half the stroke width such that the strokes cover about 1 - sparsity of
+    // the image: the inked radius r solves n pi / 2 r^2 + 2 length r = area,
+    // counting half of the round caps (the others overlap at the joints),
+    // and the antialiased edge adds half a pixel to r
+    limit = 0.25f * (config->width < config->height ? config->width : config->height);
+    caps = i * (float) M_PI / 2.0f;
+    area = (1.0f - config->sparsity) * config->width * config->height;
+    thickness = (sqrtf(length * length + caps * area) - length) / caps - 0.5f;
+    thickness *= 1.0f + 0.15f * draw(config, image, 6);
+    thickness = thickness < 0.5f ? 0.5f : (thickness > limit ? limit : thickness);
+
+    for (i = 0; i < MAX_STROKES && strokes[label][i][0] >= 0; i++) {
+        const float * a = points[strokes[label][i][0]], * b = points[strokes[label][i][1]];
+        float dx = b[0] - a[0], dy = b[1] - a[1], squared = dx * dx + dy * dy + 1e-6f;
+        int x0 = (int) floorf(fminf(a[0], b[0]) - thickness - 1.0f), x1 = (int) ceilf(fmaxf(a[0], b[0]) + thickness + 1.0f);
+        int y0 = (int) floorf(fminf(a[1], b[1]) - thickness - 1.0f), y1 = (int) ceilf(fmaxf(a[1], b[1]) + thickness + 1.0f);
+
+        x0 = x0 < 0 ? 0 : x0;
+        y0 = y0 < 0 ? 0 : y0;
+        x1 = x1 > (int) config->width - 1 ? (int) config->width - 1 : x1;
+        y1 = y1 > (int) config->height - 1 ? (int) config->height - 1 : y1;
+
+        // Antialiased capsule: full ink inside the stroke, a one pixel ramp
+        for (y = y0; y <= y1; y++) {
+            uint8_t * row = pixels + (size_t) y * config->width;
+
+            for (x = x0; x <= x1; x++) {
+                float px = x + 0.5f - a[0], py = y + 0.5f - a[1];
+                float t = fminf(fmaxf((px * dx + py * dy) / squared, 0.0f), 1.0f);
+                float ex = px - t * dx, ey = py - t * dy;
+                float ink = thickness + 0.5f - sqrtf(ex * ex + ey * ey);
+
+                if (ink > 0.0f) {
+                    uint8_t value = ink >= 1.0f ? 255 : (uint8_t) (255.0f * ink);
+
+                    row[x] = row[x] > value ? row[x] : value;
+                }
+            }
+        }
+    }
+
+    // Faint background noise, so the images are not perfectly compressible
+    if (config->noise > 0.0f) {
+        for (i = 0; i < (int) (config->width * config->height); i++) {
+            uint64_t r = mnist_random(config->seed, 1, image, i);
+
+            noise = (float) (r >> 40) / (float) (1 << 24);
+
+            if (0 == pixels[i] && noise < config->noise) {
+                pixels[i] = 1 + (r & 0x3F);
+            }
+        }
+    }
+
+    return label;
+}
+
+static void usage(const char * program)
+{
+    fprintf(stderr, "Usage: %s IMAGES LABELS COUNT WIDTH HEIGHT [--sparsity S] [--noise P] [--seed N]\n", program);
+}
+
+/**
+ * Write a synthetic IDX image file and its label file of any number of
+ * digit-like images of any size, for scaling experiments beyond the 60000
+ * MNIST images. Blocks of images are rendered in parallel with OpenMP while
+ * the previous block is written out.
+ */
+int main(int argc, char * argv[])
+{
+    const char * image_path, * label_path;
+    synthesis_config_t config = { .sparsity = 0.81f, .noise = 0.0f, .seed = 0 };
+    mnist_image_file_header_t image_header;
+    mnist_label_file_header_t label_header;
+    FILE * images, * labels;
+    uint8_t * block_images[2], * block_labels[2];
+    uint64_t ink = 0;
+    uint32_t number_of_images, blocks, block, previous_size = 0;
+    size_t image_size;
+    double start_time, seconds;
+    int i, failed = 0;
+
+    if (argc < 6) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    image_path = argv[1];
+    label_path = argv[2];
+    number_of_images = strtoul(argv[3], NULL, 10);
+    config.width = atoi(argv[4]);
+    config.height = atoi(argv[5]);
+
+    for (i = 6; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--sparsity") && i + 1 < argc) {
+            config.sparsity = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--noise") && i + 1 < argc) {
+            config.noise = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--seed") && i + 1 < argc) {
+            config.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (0 == number_of_images || 0 == config.width || 0 == config.height || config.sparsity < 0.0f || config.sparsity >= 1.0f) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    images = fopen(image_path, "wb");
+    labels = fopen(label_path, "wb");
+
+    if (NULL == images || NULL == labels) {
+        fprintf(stderr, "Could not open file: %s\n", NULL == images ? image_path : label_path);
+        return 1;
+    }
+
+    image_header.magic_number = swap_uint32(MNIST_IMAGE_MAGIC);
+    image_header.number_of_images = swap_uint32(number_of_images);
+    image_header.number_of_rows = swap_uint32(config.height);
+    image_header.number_of_columns = swap_uint32(config.width);
+    label_header.magic_number = swap_uint32(MNIST_LABEL_MAGIC);
+    label_header.number_of_labels = swap_uint32(number_of_images);
+
+    fwrite(&image_header, sizeof(mnist_image_file_header_t), 1, images);
+    fwrite(&label_header, sizeof(mnist_label_file_header_t), 1, labels);
+
+    image_size = (size_t) config.width * config.height;
+
+    for (i = 0; i < 2; i++) {
+        block_images[i] = malloc(BLOCK_IMAGES * image_size);
+        block_labels[i] = malloc(BLOCK_IMAGES);
+
+        if (NULL == block_images[i] || NULL == block_labels[i]) {
+            fprintf(stderr, "Could not allocated memory for %d images\n", BLOCK_IMAGES);
+            return 1;
+        }
+    }
+
+    blocks = (number_of_images + BLOCK_IMAGES - 1) / BLOCK_IMAGES;
+    start_time = omp_get_wtime();
+
+    // Block b is rendered into buffer b % 2 while one thread writes block
+    // b - 1 from the other buffer, then joins the rendering
+    for (block = 0; block <= blocks; block++) {
+        uint64_t first = (uint64_t) block * BLOCK_IMAGES;
+        uint32_t size = block == blocks ? 0 : (number_of_images - first < BLOCK_IMAGES ? number_of_images - first : BLOCK_IMAGES);
+        uint8_t * out_images = block_images[block % 2], * out_labels = block_labels[block % 2];
+        int64_t j;
+
+        #pragma omp parallel reduction(+:ink)
+        {
+            #pragma omp single nowait
+            {
+                if (previous_size > 0 &&
+                    (previous_size != fwrite(block_images[(block + 1) % 2], image_size, previous_size, images) ||
+                     previous_size != fwrite(block_labels[(block + 1) % 2], 1, previous_size, labels))) {
+                    failed = 1;
+                }
+            }
+
+            #pragma omp for schedule(dynamic, 64)
+            for (j = 0; j < size; j++) {
+                uint8_t * pixels = out_images + j * image_size;
+                size_t k;
+
+                out_labels[j] = synthesize_image(&config, first + j, pixels);
+
+                for (k = 0; k < image_size; k++) {
+                    ink += 0 != pixels[k];
+                }
+            }
+        }
+
+        if (failed) {
+            fprintf(stderr, "Could not write %u images to: %s\n", previous_size, image_path);
+            return 1;
+        }
+
+        previous_size = size;
+    }
+
+    seconds = omp_get_wtime() - start_time;
+
+    printf("Synthesized %u images of size %ux%u in %.3f seconds using %d threads (%.1f MB/s).\n", number_of_images, config.width, config.height,
+        seconds, omp_get_max_threads(), number_of_images * (double) image_size / seconds / 1e6);
+    printf("Ink covers %.1f%% of the pixels (target %.1f%%).\n", 100.0 * ink / ((double) number_of_images * image_size), 100.0 * (1.0 - config.sparsity));
+    printf("Synthetic dataset saved to %s and %s.\n", image_path, label_path);
+
+    for (i = 0; i < 2; i++) {
+        free(block_images[i]);
+        free(block_labels[i]);
+    }
+
+    return 0 == fclose(images) && 0 == fclose(labels) ? 0 : 1;
+}
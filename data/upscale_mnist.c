@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_resample.h"
+
+// Images resampled per block; bounds memory use regardless of dataset size
+#define BLOCK_IMAGES 8192
+
+/**
+ * Convert between the big endian IDX header fields and host byte order.
+ */
+static uint32_t swap_uint32(uint32_t in)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(in);
+#else
+    return in;
+#endif
+}
+
+static void usage(const char * program)
+{
+    fprintf(stderr, "Usage: %s INPUT OUTPUT (WIDTH HEIGHT | --scale FACTOR) [--filter bicubic|bilinear]\n", program);
+}
+
+/**
+ * Upscale an IDX image file, equivalent to upscale_mnist.py: every image is
+ * resized with Pillow's bicubic (or bilinear) algorithm and written back as
+ * IDX. Images are processed in blocks, resampled in parallel with OpenMP and
+ * streamed to the output file.
+ */
+int main(int argc, char * argv[])
+{
+    const char * input_path, * output_path;
+    mnist_image_file_header_t header;
+    mnist_filter_t filter = MNIST_FILTER_BICUBIC;
+    mnist_resampler_t * resampler;
+    FILE * input, * output;
+    uint8_t * in_block, * out_block;
+    uint32_t in_width, in_height, number_of_images, done, block;
+    int out_width = 0, out_height = 0, i;
+    double scale = 0.0, start_time;
+    size_t in_size, out_size;
+
+    if (argc < 4) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    input_path = argv[1];
+    output_path = argv[2];
+
+    for (i = 3; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--scale") && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--filter") && i + 1 < argc) {
+            i++;
+
+            if (0 == strcmp(argv[i], "bilinear")) {
+                filter = MNIST_FILTER_BILINEAR;
+            } else if (0 != strcmp(argv[i], "bicubic")) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (0 == out_width) {
+            out_width = atoi(argv[i]);
+        } else if (0 == out_height) {
+            out_height = atoi(argv[i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    input = fopen(input_path, "rb");
+
+    if (NULL == input) {
+        fprintf(stderr, "Could not open file: %s\n", input_path);
+        return 1;
+    }
+
+    if (1 != fread(&header, sizeof(mnist_image_file_header_t), 1, input) || MNIST_IMAGE_MAGIC != swap_uint32(header.magic_number)) {
+        fprintf(stderr, "Invalid header read from image file: %s\n", input_path);
+        fclose(input);
+        return 1;
+    }
+
+    // IDX stores dimension 1 (rows) then dimension 2 (columns)
+    number_of_images = swap_uint32(header.number_of_images);
+    in_height = swap_uint32(header.number_of_rows);
+    in_width = swap_uint32(header.number_of_columns);
+
+    if (scale > 0.0) {
+        out_width = (int) (in_width * scale + 0.5);
+        out_height = (int) (in_height * scale + 0.5);
+    }
+
+    resampler = mnist_resampler_create(in_width, in_height, out_width, out_height, filter);
+
+    if (NULL == resampler) {
+        fprintf(stderr, "Invalid output size %dx%d\n", out_width, out_height);
+        fclose(input);
+        return 1;
+    }
+
+    output = fopen(output_path, "wb");
+
+    if (NULL == output) {
+        fprintf(stderr, "Could not open file: %s\n", output_path);
+        fclose(input);
+        return 1;
+    }
+
+    header.number_of_rows = swap_uint32(out_height);
+    header.number_of_columns = swap_uint32(out_width);
+    fwrite(&header, sizeof(mnist_image_file_header_t), 1, output);
+
+    printf("Loaded %u images of size %ux%u.\n", number_of_images, in_width, in_height);
+
+    in_size = (size_t) in_width * in_height;
+    out_size = (size_t) out_width * out_height;
+    in_block = malloc(BLOCK_IMAGES * in_size);
+    out_block = malloc(BLOCK_IMAGES * out_size);
+
+    if (NULL == in_block || NULL == out_block) {
+        fprintf(stderr, "Could not allocated memory for %d images\n", BLOCK_IMAGES);
+        return 1;
+    }
+
+    start_time = omp_get_wtime();
+
+    for (done = 0; done < number_of_images; done += block) {
+        block = number_of_images - done < BLOCK_IMAGES ? number_of_images - done : BLOCK_IMAGES;
+
+        if (block != fread(in_block, in_size, block, input)) {
+            fprintf(stderr, "Could not read %u images from: %s\n", block, input_path);
+            return 1;
+        }
+
+        #pragma omp parallel
+        {
+            void * scratch = malloc(mnist_resample_scratch_size(resampler));
+            uint32_t j;
+
+            #pragma omp for schedule(static)
+            for (j = 0; j < block; j++) {
+                mnist_resample(resampler, in_block + j * in_size, out_block + j * out_size, scratch);
+            }
+
+            free(scratch);
+        }
+
+        if (block != fwrite(out_block, out_size, block, output)) {
+            fprintf(stderr, "Could not write %u images to: %s\n", block, output_path);
+            return 1;
+        }
+    }
+
+    printf("Upscaled images to size %dx%d in %.3f seconds using %d threads.\n", out_width, out_height, omp_get_wtime() - start_time, omp_get_max_threads());
+    printf("Upscaled images saved to %s.\n", output_path);
+
+    free(in_block);
+    free(out_block);
+    mnist_resampler_free(resampler);
+    fclose(input);
+
+    return 0 == fclose(output) ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#ifndef MNIST_ARENA_H_
+#define MNIST_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Alignment of every buffer: a cache line, and the widest vector load
+#define MNIST_ARENA_ALIGNMENT 64
+
+// Transparent huge page size, to which large buffers are also aligned
+#define MNIST_ARENA_HUGE_PAGE (2UL << 20)
+
+// Address space reserved up front; only what is handed out is committed
+#define MNIST_ARENA_RESERVE (64UL << 30)
+
+/**
+ * Memory for the buffers that live for the whole run: the datasets, the
+ * parameters, the gradients, the optimizer state and the scratch space of
+ * the kernels. A range of address space is reserved once, and buffers are
+ * carved from it in order and never freed one by one, so training steps
+ * allocate nothing. With huge set, the range is backed by 2 MB transparent
+ * huge pages.
+ */
+typedef struct mnist_arena_t_ {
+    uint8_t * base;
+    size_t reserved;
+    size_t committed;  // Readable and writable, in huge page steps
+    size_t used;
+    uint64_t buffers;
+    int huge;
+    pthread_mutex_t lock;
+} mnist_arena_t;
+
+typedef struct mnist_arena_stats_t_ {
+    uint64_t buffers;    // Buffers handed out
+    size_t used;         // Bytes handed out, with alignment
+    size_t committed;
+    size_t huge;         // Bytes backed by huge pages, as the kernel reports
+} mnist_arena_stats_t;
+
+mnist_arena_t * mnist_arena_create(int huge);
+void * mnist_arena_alloc(mnist_arena_t * arena, size_t bytes);
+void mnist_arena_stats(mnist_arena_t * arena, mnist_arena_stats_t * stats);
+void mnist_arena_free(mnist_arena_t * arena);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef MNIST_BACKEND_H_
+#define MNIST_BACKEND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Element types of collective operations; MNIST_BACKEND_BF16 elements are
+// summed in fp32 and rounded back
+typedef enum mnist_backend_type_t_ {
+    MNIST_BACKEND_INT,
+    MNIST_BACKEND_UINT32,
+    MNIST_BACKEND_UINT64,
+    MNIST_BACKEND_FLOAT,
+    MNIST_BACKEND_DOUBLE,
+    MNIST_BACKEND_BF16
+} mnist_backend_type_t;
+
+typedef enum mnist_backend_op_t_ {
+    MNIST_BACKEND_SUM,
+    MNIST_BACKEND_MIN,
+    MNIST_BACKEND_MAX
+} mnist_backend_op_t;
+
+// How large messages such as the gradient are summed between processes, as
+// the strategies of the communication microbenchmark of the same names
+typedef enum mnist_backend_strategy_t_ {
+    MNIST_BACKEND_ALLREDUCE,       // One MPI_Allreduce
+    MNIST_BACKEND_REDUCE_SCATTER   // MPI_Reduce_scatter_block, then MPI_Allgather
+} mnist_backend_strategy_t;
+
+typedef struct mnist_backend_t_ mnist_backend_t;
+
+/**
+ * How the driver spreads a training step: the name selects the backend at
+ * run time, parallel runs the kernels on all OpenMP threads, and the
+ * operations combine the gradients, counters and decisions of the processes.
+ * Every operation is in place and does nothing with a single process, so the
+ * driver and the model layer run the same code on every backend.
+ */
+struct mnist_backend_t_ {
+    const char * name;
+    int rank;
+    int size;
+    int parallel;     // Kernels on all OpenMP threads
+    int distributed;  // Gradients travel between processes, even with one
+    mnist_backend_strategy_t strategy;  // Of allreduce
+    size_t bucket;    // Elements per collective of allreduce, 0 for all at once
+    void (*allreduce)(mnist_backend_t * backend, void * data, size_t count, mnist_backend_type_t type, mnist_backend_op_t op);
+    void (*reduce)(mnist_backend_t * backend, void * data, size_t count, mnist_backend_type_t type, mnist_backend_op_t op);
+    void (*broadcast)(mnist_backend_t * backend, void * data, size_t bytes);
+    void (*barrier)(mnist_backend_t * backend);
+    void (*abort)(mnist_backend_t * backend, int status);
+    void (*finalize)(mnist_backend_t * backend);
+    void * context;
+};
+
+const char * mnist_backend_default(void);
+const char * mnist_backend_names(void);
+const char * mnist_backend_option(int argc, char * argv[]);
+const char * mnist_backend_strategy_name(mnist_backend_strategy_t strategy);
+int mnist_backend_strategy_parse(const char * name);
+mnist_backend_t * mnist_backend_create(const char * name, int * argc, char *** argv);
+void mnist_backend_free(mnist_backend_t * backend);
+
+#endif
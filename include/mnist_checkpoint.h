@@ -0,0 +1,66 @@
+#ifndef MNIST_CHECKPOINT_H_
+#define MNIST_CHECKPOINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MNIST_CHECKPOINT_MAGIC 0x50434E4D // "MNCP"
+#define MNIST_CHECKPOINT_VERSION 2
+
+#ifndef MNIST_CHECKPOINT_EVERY
+#define MNIST_CHECKPOINT_EVERY 10
+#endif
+
+/**
+ * Training state saved next to the parameters. It holds nothing specific to
+ * a process, so a checkpoint can be resumed with any number of them.
+ */
+typedef struct mnist_checkpoint_state_t_ {
+    uint64_t step;           // Steps completed
+    uint64_t seed;           // The random streams are counter-based, so the
+                             // seed and the step are their whole state
+    uint64_t data_hash;      // mnist_checkpoint_hash of the training data
+    uint64_t model_hash;     // Shape of the network, zero for the softmax layer
+    uint32_t width;          // Image size the parameters were trained for
+    uint32_t height;
+    uint32_t batch_size;     // Zero for full batch gradient descent
+    uint32_t block_size;
+    float learning_rate;
+} __attribute__((packed)) mnist_checkpoint_state_t;
+
+/**
+ * File layout, in host byte order:
+ *
+ *   mnist_checkpoint_header_t
+ *   uint8_t parameters[parameter_bytes]
+ *   uint8_t optimizer[optimizer_bytes]   optimizer state, if any
+ *
+ * The checksum is the FNV-1a hash of everything after the header.
+ */
+typedef struct mnist_checkpoint_header_t_ {
+    uint32_t magic_number;
+    uint32_t version;
+    mnist_checkpoint_state_t state;
+    uint64_t parameter_bytes;
+    uint64_t optimizer_bytes;
+    uint64_t checksum;
+} __attribute__((packed)) mnist_checkpoint_header_t;
+
+typedef struct mnist_checkpoint_stats_t_ {
+    uint64_t written;        // Checkpoints written to disk
+    uint64_t skipped;        // Checkpoints dropped because the last was still being written
+    uint64_t failed;
+    double snapshot_time;    // Seconds training spent copying snapshots
+    double write_time;       // Seconds the writer spent writing
+} mnist_checkpoint_stats_t;
+
+typedef struct mnist_checkpointer_t_ mnist_checkpointer_t;
+
+uint64_t mnist_checkpoint_hash(const char * image_path, const char * label_path, uint32_t size, int width, int height);
+int mnist_checkpoint_load(const char * path, mnist_checkpoint_state_t * state, void * parameters, size_t parameter_bytes, void * optimizer, size_t optimizer_bytes);
+mnist_checkpointer_t * mnist_checkpointer_create(const char * path, size_t parameter_bytes, size_t optimizer_bytes);
+int mnist_checkpointer_save(mnist_checkpointer_t * checkpointer, const mnist_checkpoint_state_t * state, const void * parameters, const void * optimizer, int wait);
+void mnist_checkpointer_stats(mnist_checkpointer_t * checkpointer, mnist_checkpoint_stats_t * stats);
+void mnist_checkpointer_free(mnist_checkpointer_t * checkpointer);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef MNIST_CHUNKED_H_
+#define MNIST_CHUNKED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MNIST_CHUNKED_MAGIC 0x4B434E4D // "MNCK"
+#define MNIST_CHUNKED_VERSION 1
+
+// Codecs for the chunk payloads
+#define MNIST_CODEC_GRADIENT_RLE 1 // Gradient predicted residuals, run length and nibble packed
+
+#ifndef MNIST_CHUNKED_IMAGES_PER_CHUNK
+#define MNIST_CHUNKED_IMAGES_PER_CHUNK 256
+#endif
+
+// Worst case size of an encoded chunk of length raw bytes
+#define MNIST_CHUNKED_BOUND(length) ((length) + (length) / 64 + 1)
+
+/**
+ * Container layout, all fields little endian:
+ *
+ *   mnist_chunked_header_t
+ *   uint64_t chunk_offsets[number_of_chunks + 1]  absolute file offsets
+ *   uint8_t labels[number_of_images]              uncompressed
+ *   chunk payloads
+ *
+ * Every chunk holds images_per_chunk images (the last one possibly fewer) and
+ * is compressed independently, so any range of chunks can be read and decoded
+ * on its own.
+ */
+typedef struct mnist_chunked_header_t_ {
+    uint32_t magic_number;
+    uint32_t version;
+    uint32_t codec;
+    uint32_t number_of_images;
+    uint32_t number_of_rows;
+    uint32_t number_of_columns;
+    uint32_t images_per_chunk;
+    uint32_t number_of_chunks;
+} __attribute__((packed)) mnist_chunked_header_t;
+
+typedef struct mnist_chunked_file_t_ {
+    int fd;
+    mnist_chunked_header_t header;
+    uint64_t * offsets;
+    uint8_t * labels;
+    // Statistics of the last mnist_chunked_read
+    uint64_t compressed_bytes;
+    double read_time;
+    double decode_time;
+} mnist_chunked_file_t;
+
+mnist_chunked_file_t * mnist_chunked_open(const char * path);
+void mnist_chunked_close(mnist_chunked_file_t * file);
+void mnist_chunked_shard(const mnist_chunked_file_t * file, int shard, int shards, uint32_t * first_chunk, uint32_t * chunks);
+uint32_t mnist_chunked_images(const mnist_chunked_file_t * file, uint32_t first_chunk, uint32_t chunks);
+int mnist_chunked_read(mnist_chunked_file_t * file, uint32_t first_chunk, uint32_t chunks, uint8_t * images, uint8_t * labels);
+size_t mnist_chunked_encode(const uint8_t * images, int width, int height, uint32_t count, uint8_t * out, uint8_t * scratch);
+int mnist_chunked_decode(const uint8_t * in, size_t length, int width, int height, uint32_t count, uint8_t * images);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef MNIST_CONVERGENCE_H_
+#define MNIST_CONVERGENCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mnist_arena.h"
+#include "mnist_records.h"
+
+#define MNIST_CONVERGENCE_EVERY 5
+#define MNIST_CONVERGENCE_IMAGES 1000
+
+typedef struct mnist_convergence_config_t_ {
+    double target;    // Validation accuracy to train to, 0 for none
+    double budget;    // Seconds of training, validation included, 0 for none
+    uint32_t every;   // Steps between validations
+    uint32_t images;  // Random test images validated on, 0 for all of them
+    uint64_t seed;    // Of the choice of the validation images
+} mnist_convergence_config_t;
+
+typedef struct mnist_convergence_point_t_ {
+    int steps;        // Trained before the validation
+    double time;      // Seconds since the start of training
+    double accuracy;
+} mnist_convergence_point_t;
+
+/**
+ * Time to accuracy of a training run: the network is validated every few
+ * steps on a fixed random subset of the test set, and training stops as soon
+ * as it reaches the target accuracy or runs out of its time budget. Times are
+ * wall-clock seconds since mnist_convergence_start, validations included,
+ * which is what the run would take to deliver a network that good.
+ */
+typedef struct mnist_convergence_t_ {
+    mnist_convergence_config_t config;
+    double start;
+    double validation_time;
+    mnist_convergence_point_t * points;  // The accuracy curve
+    uint32_t count;
+    uint32_t capacity;
+    int reached;                         // Index of the first point at the target, or -1
+    int best;                            // Index of the most accurate point, or -1
+} mnist_convergence_t;
+
+void mnist_convergence_config_init(mnist_convergence_config_t * config);
+int mnist_convergence_option(mnist_convergence_config_t * config, int argc, char * argv[], int * i);
+int mnist_convergence_enabled(const mnist_convergence_config_t * config);
+uint32_t mnist_convergence_subset(const mnist_convergence_config_t * config, const uint8_t * images, const uint8_t * labels, uint32_t size, size_t image_size,
+    uint8_t ** subset_images, uint8_t ** subset_labels, mnist_arena_t * arena);
+mnist_convergence_t * mnist_convergence_create(const mnist_convergence_config_t * config, int steps, mnist_arena_t * arena);
+void mnist_convergence_start(mnist_convergence_t * convergence);
+double mnist_convergence_elapsed(const mnist_convergence_t * convergence);
+int mnist_convergence_due(const mnist_convergence_t * convergence, int step);
+int mnist_convergence_update(mnist_convergence_t * convergence, int step, double elapsed, double accuracy, mnist_records_t * records);
+int mnist_convergence_done(const mnist_convergence_t * convergence);
+void mnist_convergence_print(const mnist_convergence_t * convergence, uint32_t images);
+void mnist_convergence_record(const mnist_convergence_t * convergence, mnist_records_t * records);
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef MNIST_FILE_H_
 #define MNIST_FILE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "mnist_arena.h"
+
 #define MNIST_LABEL_MAGIC 0x00000801
 #define MNIST_IMAGE_MAGIC 0x00000803
 
@@ -33,6 +36,13 @@
 #define TRAIN_IMAGES_FILE "../data/train-images-idx3-ubyte"
 #endif
 
+/**
+ * Original 28x28 training images, upscaled on the fly by --pipeline
+ */
+#ifndef TRAIN_BASE_IMAGES_FILE
+#define TRAIN_BASE_IMAGES_FILE "../data/train-images-idx3-ubyte"
+#endif
+
 #ifndef  TRAIN_LABELS_FILE
 #define TRAIN_LABELS_FILE "../data/train-labels-idx1-ubyte"
 #endif
@@ -45,6 +55,18 @@
 #define TEST_LABELS_FILE "../data/t10k-labels-idx1-ubyte"
 #endif
 
+/**
+ * Compressed chunked containers written by data/idx_to_chunked next to the
+ * IDX image files, holding the images and the labels
+ */
+#ifndef TRAIN_CHUNKED_FILE
+#define TRAIN_CHUNKED_FILE TRAIN_IMAGES_FILE ".chunked"
+#endif
+
+#ifndef TEST_CHUNKED_FILE
+#define TEST_CHUNKED_FILE TEST_IMAGES_FILE ".chunked"
+#endif
+
 typedef struct mnist_label_file_header_t_ {
     uint32_t magic_number;
     uint32_t number_of_labels;
@@ -65,9 +87,22 @@ typedef struct mnist_dataset_t_ {
     mnist_image_t * images;
     uint8_t * labels;
     uint32_t size;
+    // Non-NULL when images/labels point into mmap()ed files or pages instead of the heap
+    void * image_mapping;
+    void * label_mapping;
+    size_t image_mapping_size;
+    size_t label_mapping_size;
+    mnist_arena_t * arena;  // Owns images and labels when not NULL
 } mnist_dataset_t;
 
-mnist_dataset_t * mnist_get_dataset(const char * image_path, const char * label_path);
+// Flags for mnist_map_dataset
+#define MNIST_MAP_SEQUENTIAL 0x1 // madvise(MADV_SEQUENTIAL): aggressive read-ahead over the file
+#define MNIST_MAP_WILLNEED 0x2 // madvise(MADV_WILLNEED): start paging the files in asynchronously
+#define MNIST_MAP_POPULATE 0x4 // MAP_POPULATE: prefault every page before returning
+
+mnist_dataset_t * mnist_get_dataset(const char * image_path, const char * label_path, mnist_arena_t * arena);
+mnist_dataset_t * mnist_get_chunked_dataset(const char * path, int shard, int shards, mnist_arena_t * arena);
+mnist_dataset_t * mnist_map_dataset(const char * image_path, const char * label_path, int flags);
 void mnist_free_dataset(mnist_dataset_t * dataset);
 int mnist_batch(mnist_dataset_t * dataset, mnist_dataset_t * batch, int batch_size, int batch_number);
 
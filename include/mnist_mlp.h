@@ -0,0 +1,51 @@
+#ifndef MNIST_MLP_H_
+#define MNIST_MLP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MNIST_MLP_MAX_HIDDEN 8
+
+// Most images forward and back propagated together by the batched kernels,
+// which the workspace is sized for
+#ifndef MNIST_MLP_TILE
+#define MNIST_MLP_TILE 64
+#endif
+
+/**
+ * Layout of a multi-layer perceptron: hidden layers with ReLU activations and
+ * a softmax output layer. The parameters of all layers live in one contiguous
+ * array of floats, layer by layer the weights (outputs x inputs, row major)
+ * followed by the biases, and so does the gradient. The layout holds no
+ * pointers, so it can be copied between processes and mapped to devices.
+ */
+typedef struct mnist_mlp_t_ {
+    int layers;                                // Weight layers, hidden layers + 1
+    int sizes[MNIST_MLP_MAX_HIDDEN + 2];       // Neurons per layer, inputs first and labels last
+    size_t offsets[MNIST_MLP_MAX_HIDDEN + 1];  // First parameter of every weight layer
+    size_t parameters;                         // Floats of parameters, and of the gradient
+    size_t activations;                        // Neurons of all layers, inputs included
+    int max_size;
+    int tile;                                  // Images per tile, up to MNIST_MLP_TILE
+} mnist_mlp_t;
+
+int mnist_mlp_init(mnist_mlp_t * mlp, int inputs, const char * hidden, int outputs);
+uint64_t mnist_mlp_hash(const mnist_mlp_t * mlp);
+void mnist_mlp_random_parameters(const mnist_mlp_t * mlp, float * parameters, uint64_t seed, int parallel);
+size_t mnist_mlp_workspace_size(const mnist_mlp_t * mlp);
+float mnist_mlp_accumulate(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace);
+float mnist_mlp_accumulate_parallel(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace);
+void mnist_mlp_zero_gradient(const mnist_mlp_t * mlp, float * gradient);
+uint32_t mnist_mlp_count_correct(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, const uint8_t * labels, uint32_t count, float * workspace);
+void mnist_mlp_probabilities(const mnist_mlp_t * mlp, const float * parameters, const uint8_t * images, uint32_t count, float * probabilities, float * workspace);
+
+// Mixed precision: the kernels read a bf16 working copy of the fp32 parameters
+void mnist_mlp_round_bf16(const float * values, uint16_t * bf16, size_t count, int parallel);
+void mnist_mlp_widen_bf16(const uint16_t * bf16, float * values, size_t count, int parallel);
+void mnist_mlp_add_bf16(const uint16_t * in, uint16_t * inout, size_t count);
+float mnist_mlp_accumulate_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace);
+float mnist_mlp_accumulate_bf16_parallel(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * gradient, float * workspace);
+uint32_t mnist_mlp_count_correct_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, const uint8_t * labels, uint32_t count, float * workspace);
+void mnist_mlp_probabilities_bf16(const mnist_mlp_t * mlp, const uint16_t * weights, const uint8_t * images, uint32_t count, float * probabilities, float * workspace);
+
+#endif
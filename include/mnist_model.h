@@ -0,0 +1,71 @@
+#ifndef MNIST_MODEL_H_
+#define MNIST_MODEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mnist_file.h"
+#include "neural_network.h"
+#include "mnist_mlp.h"
+#include "mnist_optimizer.h"
+#include "mnist_perf.h"
+#include "mnist_steal.h"
+#include "mnist_numa.h"
+#include "mnist_arena.h"
+#include "mnist_sampler.h"
+#include "mnist_stream.h"
+#include "mnist_pipeline.h"
+#include "mnist_backend.h"
+
+/**
+ * The network being trained: the single layer softmax network, or with
+ * --hidden a multi-layer perceptron whose parameters, gradient and kernel
+ * workspace are contiguous arrays. With --bf16 the kernels read a bf16
+ * working copy of the parameters, which stay the fp32 master copy, and
+ * gradients travel between processes as bf16. Either network's parameters and
+ * gradient are flat arrays of floats, which the optimizer updates. Every
+ * buffer of the model is carved from the arena.
+ *
+ * The backend decides whether the kernels run on one thread or all of them,
+ * and combines the gradients of its processes; every process applies the same
+ * update with its own copy of the optimizer, so only the gradient is sent.
+ */
+typedef struct mnist_model_t_ {
+    neural_network_t network;
+    neural_network_gradient_t gradient;
+    mnist_mlp_t mlp;
+    float * parameters;  // NULL for the softmax network
+    float * mlp_gradient;
+    float * workspace;
+    uint16_t * weights;  // bf16 working copy, NULL in fp32
+    uint16_t * message;  // bf16 gradient reduced between processes
+    mnist_optimizer_t * optimizer;
+    mnist_perf_t * perf;  // Counters of the phases of a step, NULL without --perf
+    mnist_steal_t * steal;  // Scheduler of the softmax network's images, NULL without --work-stealing
+    mnist_backend_t * backend;
+} mnist_model_t;
+
+mnist_model_t * mnist_model_create(const char * hidden, int bf16, const mnist_optimizer_config_t * optimizer, mnist_backend_t * backend, mnist_arena_t * arena);
+void mnist_model_free(mnist_model_t * model);
+void * mnist_model_parameters(mnist_model_t * model);
+size_t mnist_model_parameter_bytes(mnist_model_t * model);
+float * mnist_model_gradient(mnist_model_t * model);
+uint64_t mnist_model_hash(mnist_model_t * model);
+void mnist_model_round_weights(mnist_model_t * model);
+void mnist_model_random_weights(mnist_model_t * model, uint64_t seed);
+void mnist_model_zero_gradient(mnist_model_t * model);
+float mnist_model_accumulate(mnist_model_t * model, mnist_dataset_t * batch);
+void mnist_model_reduce_gradient(mnist_model_t * model);
+void mnist_model_apply_gradient(mnist_model_t * model, uint32_t size);
+float mnist_model_update(mnist_model_t * model, float local_loss, uint32_t size);
+void mnist_model_gradient_locality(mnist_model_t * model, mnist_numa_locality_t * locality);
+int mnist_model_count_correct(mnist_model_t * model, mnist_dataset_t * dataset);
+float mnist_model_accuracy(mnist_model_t * model, mnist_dataset_t * dataset);
+float mnist_model_stream_accuracy(mnist_model_t * model, mnist_stream_t * stream);
+float mnist_model_shard_step(mnist_model_t * model, mnist_dataset_t * shard, uint32_t train_size);
+float mnist_model_stream_step(mnist_model_t * model, mnist_stream_t * stream, uint32_t train_size);
+float mnist_model_pipeline_step(mnist_model_t * model, mnist_pipeline_t * pipeline, uint32_t train_size);
+float mnist_model_minibatch_epoch(mnist_model_t * model, mnist_dataset_t * shard, mnist_sampler_t * sampler, uint64_t epoch, uint32_t batch_size, uint32_t batches, mnist_dataset_t * batch);
+float mnist_model_training_step(mnist_model_t * model, mnist_dataset_t * dataset);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef MNIST_NUMA_H_
+#define MNIST_NUMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MNIST_NUMA_MAX_CPUS 1024
+
+/**
+ * Pages of a buffer on the NUMA node of the thread that works on them, and
+ * elsewhere, as counted by mnist_numa_locality.
+ */
+typedef struct mnist_numa_locality_t_ {
+    uint64_t local;
+    uint64_t remote;
+    uint64_t unknown;  // Not yet touched, or the kernel would not say
+} mnist_numa_locality_t;
+
+int mnist_numa_nodes(void);
+int mnist_numa_node(void);
+int mnist_numa_pin_threads(void);
+void * mnist_numa_alloc(size_t bytes);
+void mnist_numa_free(void * memory, size_t bytes);
+int mnist_numa_read(int fd, off_t offset, void * destination, size_t count, size_t element);
+uint64_t mnist_numa_place(void * base, size_t count, size_t element);
+void mnist_numa_locality(const void * base, size_t count, size_t element, mnist_numa_locality_t * locality);
+void mnist_numa_page_locality(const void * memory, size_t bytes, int node, mnist_numa_locality_t * locality);
+
+#endif
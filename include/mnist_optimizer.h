@@ -0,0 +1,56 @@
+#ifndef MNIST_OPTIMIZER_H_
+#define MNIST_OPTIMIZER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mnist_arena.h"
+
+typedef enum mnist_optimizer_type_t_ {
+    MNIST_OPTIMIZER_SGD,
+    MNIST_OPTIMIZER_MOMENTUM,
+    MNIST_OPTIMIZER_NESTEROV,
+    MNIST_OPTIMIZER_ADAM
+} mnist_optimizer_type_t;
+
+typedef enum mnist_schedule_type_t_ {
+    MNIST_SCHEDULE_CONSTANT,
+    MNIST_SCHEDULE_COSINE
+} mnist_schedule_type_t;
+
+typedef struct mnist_optimizer_config_t_ {
+    mnist_optimizer_type_t type;
+    mnist_schedule_type_t schedule;
+    float learning_rate;      // Peak learning rate, after the warmup
+    float min_learning_rate;  // Learning rate the cosine schedule decays to
+    float momentum;           // Momentum and Nesterov
+    float beta1;              // Adam
+    float beta2;
+    float epsilon;
+    uint64_t warmup;          // Updates the learning rate ramps up over
+    uint64_t total;           // Updates the cosine schedule spans
+} mnist_optimizer_config_t;
+
+/**
+ * Applies updates to a contiguous array of float parameters from a gradient
+ * summed over a batch. Its state (velocities, Adam moments) is one contiguous
+ * array too, saved in checkpoints next to the parameters.
+ */
+typedef struct mnist_optimizer_t_ {
+    mnist_optimizer_config_t config;
+    size_t count;         // Parameters
+    uint64_t updates;     // Updates applied, which drive the schedule
+    float * state;        // count floats per moment, never NULL
+    size_t state_bytes;
+    mnist_arena_t * arena;  // Owns the state when not NULL
+} mnist_optimizer_t;
+
+void mnist_optimizer_config_init(mnist_optimizer_config_t * config);
+int mnist_optimizer_option(mnist_optimizer_config_t * config, int argc, char * argv[], int * i);
+const char * mnist_optimizer_name(const mnist_optimizer_config_t * config);
+mnist_optimizer_t * mnist_optimizer_create(const mnist_optimizer_config_t * config, size_t count, mnist_arena_t * arena);
+float mnist_optimizer_learning_rate(const mnist_optimizer_t * optimizer);
+void mnist_optimizer_step(mnist_optimizer_t * optimizer, float * parameters, const float * gradient, uint32_t size, int parallel);
+void mnist_optimizer_free(mnist_optimizer_t * optimizer);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MNIST_PERF_H_
+#define MNIST_PERF_H_
+
+#include <stdint.h>
+
+#include "mnist_records.h"
+
+#define MNIST_PERF_MAX_THREADS 512
+
+// Hardware counters opened on every thread; MNIST_PERF_FP_OPS is the sum of
+// the floating point operations of the single precision instructions of
+// every width, which only Intel CPUs count (FP_ARITH_INST_RETIRED)
+typedef enum mnist_perf_event_t_ {
+    MNIST_PERF_CYCLES,
+    MNIST_PERF_INSTRUCTIONS,
+    MNIST_PERF_LLC_REFERENCES,
+    MNIST_PERF_LLC_MISSES,
+    MNIST_PERF_FP_OPS,
+    MNIST_PERF_EVENTS
+} mnist_perf_event_t;
+
+// Phases of a training step. The kernels run the forward and the backward
+// pass of every image, or tile of images, back to back while its activations
+// are in cache, so both are counted together as the gradient phase
+typedef enum mnist_perf_phase_t_ {
+    MNIST_PERF_GRADIENT,
+    MNIST_PERF_REDUCE,
+    MNIST_PERF_UPDATE,
+    MNIST_PERF_PHASES
+} mnist_perf_phase_t;
+
+// Raw counters behind the events: FP_OPS takes one per vector width
+#define MNIST_PERF_COUNTERS (MNIST_PERF_EVENTS + 3)
+
+/**
+ * Counters of the OpenMP threads of a process, opened with perf_event_open
+ * for user space only, which unprivileged processes may do for their own
+ * threads. Counts are summed over the threads between mnist_perf_begin and
+ * mnist_perf_end, per phase, until mnist_perf_reset; counters the kernel
+ * multiplexed are scaled to the time they were enabled.
+ */
+typedef struct mnist_perf_t_ {
+    int threads;
+    int fds[MNIST_PERF_MAX_THREADS][MNIST_PERF_COUNTERS];  // -1 where not opened
+    int available[MNIST_PERF_EVENTS];                      // On every thread
+    int phase;                                             // Running, or -1
+    double start[MNIST_PERF_EVENTS];
+    double counts[MNIST_PERF_PHASES][MNIST_PERF_EVENTS];
+    uint64_t runs[MNIST_PERF_PHASES];                      // Phases counted since the reset
+} mnist_perf_t;
+
+mnist_perf_t * mnist_perf_create(void);
+void mnist_perf_begin(mnist_perf_t * perf, mnist_perf_phase_t phase);
+void mnist_perf_end(mnist_perf_t * perf);
+void mnist_perf_reset(mnist_perf_t * perf);
+void mnist_perf_print(mnist_perf_t * perf, uint64_t images);
+void mnist_perf_record(mnist_perf_t * perf, mnist_records_t * records);
+void mnist_perf_free(mnist_perf_t * perf);
+
+#endif
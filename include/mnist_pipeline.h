@@ -0,0 +1,48 @@
+#ifndef MNIST_PIPELINE_H_
+#define MNIST_PIPELINE_H_
+
+#include <stdint.h>
+
+typedef struct mnist_pipeline_config_t_ {
+    const char * image_path;
+    const char * label_path;
+    uint32_t first;      // First base image to stream
+    uint32_t count;      // Number of base images per epoch, zero for all after first
+    int shard;           // Stream only part shard of shards equal parts of the range,
+    int shards;          // zero shards for the whole range
+    int out_width;       // Resolution the images are upscaled to
+    int out_height;
+    int batch_size;      // Images per batch
+    int slots;           // Batches in the ring
+    int producers;       // Producer threads
+    int max_shift;       // Random translation in output pixels, zero to disable
+    float max_rotation;  // Random rotation in degrees, zero to disable
+    uint64_t seed;
+    uint64_t first_epoch;  // Epoch the augmentation starts from, for resumed runs
+} mnist_pipeline_config_t;
+
+typedef struct mnist_pipeline_batch_t_ {
+    uint8_t * images;    // size images of out_width * out_height pixels
+    uint8_t * labels;
+    uint32_t size;
+    uint64_t sequence;
+} mnist_pipeline_batch_t;
+
+typedef struct mnist_pipeline_stats_t_ {
+    double consumer_wait;  // Seconds the trainer was blocked waiting for a batch
+    double producer_wait;  // Seconds producers were blocked on a full ring (summed)
+    double produce_time;   // Seconds producers spent generating batches (summed)
+    uint64_t batches;      // Batches consumed so far
+} mnist_pipeline_stats_t;
+
+typedef struct mnist_pipeline_t_ mnist_pipeline_t;
+
+mnist_pipeline_t * mnist_pipeline_create(const mnist_pipeline_config_t * config);
+uint32_t mnist_pipeline_size(const mnist_pipeline_t * pipeline);
+uint32_t mnist_pipeline_batches(const mnist_pipeline_t * pipeline);
+void mnist_pipeline_next(mnist_pipeline_t * pipeline, mnist_pipeline_batch_t * batch);
+void mnist_pipeline_release(mnist_pipeline_t * pipeline, mnist_pipeline_batch_t * batch);
+void mnist_pipeline_stats(mnist_pipeline_t * pipeline, mnist_pipeline_stats_t * stats);
+void mnist_pipeline_free(mnist_pipeline_t * pipeline);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef MNIST_RECORDS_H_
+#define MNIST_RECORDS_H_
+
+#include <stdint.h>
+
+// Bumped whenever a field changes meaning or disappears; new fields may be
+// added without it
+#define MNIST_RECORDS_VERSION 1
+
+/**
+ * Machine readable results of a run, one JSON object per line next to the
+ * human readable output: a "run" record describing the configuration, a
+ * "step" record per training step and a "summary" record at the end. Every
+ * function does nothing on a NULL stream, so processes that do not report
+ * simply hold none.
+ */
+typedef struct mnist_records_t_ mnist_records_t;
+
+mnist_records_t * mnist_records_open(const char * path);
+void mnist_records_begin(mnist_records_t * records, const char * type);
+void mnist_records_string(mnist_records_t * records, const char * name, const char * value);
+void mnist_records_int(mnist_records_t * records, const char * name, int64_t value);
+void mnist_records_double(mnist_records_t * records, const char * name, double value);
+void mnist_records_end(mnist_records_t * records);
+void mnist_records_close(mnist_records_t * records);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef MNIST_RESAMPLE_H_
+#define MNIST_RESAMPLE_H_
+
+#include <stdint.h>
+
+typedef enum mnist_filter_t_ {
+    MNIST_FILTER_BILINEAR,
+    MNIST_FILTER_BICUBIC
+} mnist_filter_t;
+
+/**
+ * Precomputed separable resampling kernels for one input/output size pair.
+ * Coefficients are fixed point and padded to a constant number of taps per
+ * output pixel, so the inner loops are branch free.
+ */
+typedef struct mnist_resampler_t_ {
+    int in_width;
+    int in_height;
+    int out_width;
+    int out_height;
+    int h_taps;
+    int v_taps;
+    int32_t * h_index;
+    int32_t * h_coeffs;
+    int32_t * v_index;
+    int32_t * v_coeffs;
+} mnist_resampler_t;
+
+mnist_resampler_t * mnist_resampler_create(int in_width, int in_height, int out_width, int out_height, mnist_filter_t filter);
+void mnist_resampler_free(mnist_resampler_t * resampler);
+int mnist_resample_scratch_size(const mnist_resampler_t * resampler);
+void mnist_resample(const mnist_resampler_t * resampler, const uint8_t * in, uint8_t * out, void * scratch);
+
+#endif
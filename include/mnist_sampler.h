@@ -0,0 +1,36 @@
+#ifndef MNIST_SAMPLER_H_
+#define MNIST_SAMPLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MNIST_SAMPLER_BLOCK_SIZE
+#define MNIST_SAMPLER_BLOCK_SIZE 256
+#endif
+
+/**
+ * Shuffles the order of an epoch in two levels: blocks of block_size
+ * contiguous images are permuted, then the images within each block. Reads
+ * therefore stay within a block for block_size images, which keeps them
+ * cache and prefetch friendly, while the epoch order is still random.
+ *
+ * The random numbers come from a counter-based generator keyed by the seed,
+ * the stream (e.g. the MPI rank) and the epoch, so every rank and every epoch
+ * can be reproduced on its own without sharing a global generator.
+ */
+typedef struct mnist_sampler_t_ {
+    uint32_t size;        // Images to sample from
+    uint32_t block_size;  // Contiguous images per block
+    uint64_t seed;
+    uint64_t stream;
+    uint32_t * blocks;    // Block order of the current epoch
+    uint32_t * order;     // Image order of the current epoch
+} mnist_sampler_t;
+
+uint64_t mnist_random(uint64_t seed, uint64_t stream, uint64_t epoch, uint64_t counter);
+mnist_sampler_t * mnist_sampler_create(uint32_t size, uint32_t block_size, uint64_t seed, uint64_t stream);
+const uint32_t * mnist_sampler_epoch(mnist_sampler_t * sampler, uint64_t epoch, int parallel);
+void mnist_sampler_gather(const uint32_t * order, uint32_t count, const uint8_t * images, const uint8_t * labels, size_t image_size, uint8_t * batch_images, uint8_t * batch_labels, int parallel);
+void mnist_sampler_free(mnist_sampler_t * sampler);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MNIST_SERVE_H_
+#define MNIST_SERVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Clients served at once on a socket
+#define MNIST_SERVE_MAX_CLIENTS 64
+
+/**
+ * Wire protocol, in native byte order since both ends are on one machine:
+ * on connecting the server sends a hello of two uint32 values, the pixels per
+ * image and the labels per reply. A request is a uint32 id followed by the
+ * pixels of one image; its reply is the same id followed by one float
+ * probability per label. Clients may send many requests before reading any
+ * replies, and replies may arrive out of order, so they carry the id.
+ */
+typedef struct mnist_serve_hello_t_ {
+    uint32_t image_size;
+    uint32_t labels;
+} mnist_serve_hello_t;
+
+/**
+ * Classify count images of image_size pixels into labels probabilities per
+ * image. Called by one worker at a time with that worker's workspace.
+ */
+typedef void (* mnist_serve_infer_t)(void * context, const uint8_t * images, uint32_t count, float * probabilities, void * workspace);
+
+typedef struct mnist_serve_config_t_ {
+    const char * socket_path;  // UNIX domain socket to listen on, NULL for stdin and stdout
+    uint32_t image_size;       // Pixels per request
+    uint32_t labels;           // Probabilities per reply
+    uint32_t max_batch;        // Requests per micro-batch
+    double budget;             // Seconds the oldest request waits for its batch to fill
+    int workers;               // Inference threads
+    int pin;                   // Pin worker i to CPU i
+    size_t workspace_bytes;    // Workspace of every worker
+    mnist_serve_infer_t infer;
+    void * context;
+} mnist_serve_config_t;
+
+typedef struct mnist_serve_stats_t_ {
+    uint64_t requests;  // Requests answered
+    uint64_t batches;   // Micro-batches run
+    uint64_t clients;   // Connections accepted
+    double elapsed;     // Seconds from the first request to the last reply
+    double p50;         // Latency from a request's arrival to its reply, in seconds
+    double p99;
+    double max;
+    double mean;
+} mnist_serve_stats_t;
+
+int mnist_serve_run(const mnist_serve_config_t * config, mnist_serve_stats_t * stats);
+
+#endif
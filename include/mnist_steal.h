@@ -0,0 +1,59 @@
+#ifndef MNIST_STEAL_H_
+#define MNIST_STEAL_H_
+
+#include <stdint.h>
+#include <omp.h>
+
+#include "mnist_records.h"
+
+#define MNIST_STEAL_MAX_THREADS 512
+#define MNIST_STEAL_GRAIN 8        // Images per tile the adaptive grain starts at
+#define MNIST_STEAL_MAX_TILE 256
+#define MNIST_STEAL_SPLIT 8        // A thread takes this fraction of what it has left
+#define MNIST_STEAL_IDLE_HIGH 0.05 // Idle thread time above which the grain halves
+#define MNIST_STEAL_IDLE_LOW 0.01  // and below which it doubles
+
+// What the scheduler counted, as doubles so that processes can sum them
+typedef struct mnist_steal_stats_t_ {
+    double tiles;        // Tiles run
+    double steals;       // Ranges taken from other threads
+    double idle;         // Thread seconds spent without work
+    double thread_time;  // Thread seconds inside scheduled loops
+} mnist_steal_stats_t;
+
+#define MNIST_STEAL_STATS (sizeof(mnist_steal_stats_t) / sizeof(double))
+
+/**
+ * Work-stealing scheduler of the images of a batch over the OpenMP threads.
+ * Every thread starts on a deque holding the static slice it would get from
+ * schedule(static), so images stay with the thread they were placed by, and
+ * takes tiles from the front of it: a fraction of what it has left, no
+ * smaller than the grain. A thread whose deque ran dry takes the back half of
+ * the fullest other deque, so threads slowed by OS noise, SMT siblings or a
+ * lower clock hand their remaining images to the idle ones. Unless fixed, the
+ * grain halves after a loop in which the threads sat idle for more than
+ * MNIST_STEAL_IDLE_HIGH of their time, and doubles below MNIST_STEAL_IDLE_LOW,
+ * trading the cost of taking tiles against the imbalance at the end.
+ */
+typedef struct mnist_steal_deque_t_ mnist_steal_deque_t;
+
+typedef struct mnist_steal_t_ {
+    int threads;                // Of the running loop
+    uint32_t grain;
+    int adaptive;
+    mnist_steal_deque_t * deques;
+    double start;
+    mnist_steal_stats_t step;   // Since the reset
+    mnist_steal_stats_t run;    // Since the creation
+} mnist_steal_t;
+
+mnist_steal_t * mnist_steal_create(uint32_t grain);
+void mnist_steal_start(mnist_steal_t * steal, uint32_t count);
+int mnist_steal_next(mnist_steal_t * steal, uint32_t * first, uint32_t * last);
+void mnist_steal_finish(mnist_steal_t * steal);
+void mnist_steal_reset(mnist_steal_t * steal);
+void mnist_steal_record(mnist_steal_t * steal, mnist_records_t * records);
+void mnist_steal_print(mnist_steal_t * steal);
+void mnist_steal_free(mnist_steal_t * steal);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef MNIST_STREAM_H_
+#define MNIST_STREAM_H_
+
+#include <stdint.h>
+
+typedef struct mnist_stream_config_t_ {
+    const char * image_path;
+    const char * label_path;
+    uint32_t first;          // First image to stream
+    uint32_t count;          // Number of images per epoch, zero for all after first
+    int shard;               // Stream only part shard of shards equal parts of the range,
+    int shards;              // zero shards for the whole range
+    int width;               // Expected image size, checked against the file
+    int height;
+    uint32_t window_images;  // Images per window
+    int buffers;             // Windows in memory: 2 for double, 3 for triple buffering
+    int use_io_uring;        // Read with io_uring, otherwise (or if unavailable) with a pread thread
+} mnist_stream_config_t;
+
+typedef struct mnist_stream_window_t_ {
+    uint8_t * images;        // size images of width * height pixels
+    uint8_t * labels;
+    uint32_t size;
+} mnist_stream_window_t;
+
+typedef struct mnist_stream_stats_t_ {
+    double stall_time;       // Seconds the trainer waited for windows to load
+    uint64_t bytes_read;
+    uint64_t windows;        // Windows consumed so far
+    int io_uring;            // Whether io_uring is in use
+} mnist_stream_stats_t;
+
+typedef struct mnist_stream_t_ mnist_stream_t;
+
+mnist_stream_t * mnist_stream_open(const mnist_stream_config_t * config);
+uint32_t mnist_stream_size(const mnist_stream_t * stream);
+uint32_t mnist_stream_windows(const mnist_stream_t * stream);
+int mnist_stream_next(mnist_stream_t * stream, mnist_stream_window_t * window);
+void mnist_stream_stats(const mnist_stream_t * stream, mnist_stream_stats_t * stats);
+void mnist_stream_close(mnist_stream_t * stream);
+
+#endif
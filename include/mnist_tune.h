@@ -0,0 +1,78 @@
+#ifndef MNIST_TUNE_H_
+#define MNIST_TUNE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mnist_model.h"
+
+// Profile read and written when --tune-profile does not name another
+#ifndef MNIST_TUNE_PROFILE
+#define MNIST_TUNE_PROFILE "mnist.tune"
+#endif
+
+#define MNIST_TUNE_UNSET -1
+#define MNIST_TUNE_STEPS 3           // Timed steps per probe, after one untimed
+#define MNIST_TUNE_REDUCTIONS 20     // Timed gradient reductions per probe
+#define MNIST_TUNE_KEY 512
+#define MNIST_TUNE_MAX_STEPS 64
+
+/**
+ * The settings of a run that change how fast it trains but not what it
+ * computes. Fields left MNIST_TUNE_UNSET are taken from the profile, and
+ * then from the defaults: all OpenMP threads, tiles of MNIST_MLP_TILE
+ * images, the static schedule and one MPI_Allreduce of the whole gradient.
+ */
+typedef struct mnist_tune_settings_t_ {
+    int threads;    // OpenMP threads of every process
+    int tile;       // Images per tile of the multi-layer perceptron's kernels
+    int stealing;   // Work stealing of the softmax network's images
+    int grain;      // Images per stolen tile, 0 adapts
+    int reduction;  // mnist_backend_strategy_t of the gradient
+    int bucket;     // Gradient elements per collective, 0 for all at once
+} mnist_tune_settings_t;
+
+/**
+ * The autotuner times a few steps of the run as configured under candidate
+ * settings, one dimension at a time, keeping the fastest of each before
+ * trying the next: the threads per process, then the schedule and grain of
+ * the softmax network or the tile of the multi-layer perceptron, then with
+ * several processes the strategy and bucket of the gradient reduction, which
+ * is timed on its own. Settings given on the command line are not probed.
+ * Every probe lasts as long as the slowest process, so all of them choose
+ * the same settings.
+ *
+ * The profile is a text file with a line per machine and run, keyed by the
+ * CPU model and count, the image size, the backend, the processes and the
+ * network, so one file can hold the settings of every node type of a
+ * cluster and every binary; rewriting a key replaces its line.
+ */
+typedef struct mnist_tune_config_t_ {
+    int autotune;                    // Probe and write the profile instead of training
+    int load;                        // Apply the profile, unless --no-tune
+    const char * profile;
+    int steps;                       // Timed steps per probe
+    mnist_tune_settings_t settings;  // From the command line
+} mnist_tune_config_t;
+
+// One training step of the run being tuned, returning its loss
+typedef float (*mnist_tune_step_t)(void * context, int step);
+
+typedef struct mnist_tune_result_t_ {
+    mnist_tune_settings_t best;
+    double time;          // Median seconds per step of the best settings
+    double default_time;  // and of the defaults
+    int probes;
+} mnist_tune_result_t;
+
+void mnist_tune_config_init(mnist_tune_config_t * config);
+int mnist_tune_option(mnist_tune_config_t * config, int argc, char * argv[], int * i);
+void mnist_tune_key(char * key, size_t size, mnist_backend_t * backend, const char * hidden, int bf16);
+int mnist_tune_load(const char * path, const char * key, mnist_tune_settings_t * settings);
+int mnist_tune_save(const char * path, const char * key, const mnist_tune_settings_t * settings, double time);
+void mnist_tune_resolve(const mnist_tune_config_t * config, const mnist_tune_settings_t * profile, mnist_tune_settings_t * settings);
+int mnist_tune_apply(const mnist_tune_settings_t * settings, mnist_model_t * model);
+void mnist_tune_describe(const mnist_tune_settings_t * settings, mnist_model_t * model, char * text, size_t size);
+int mnist_tune_run(const mnist_tune_config_t * config, mnist_model_t * model, mnist_tune_step_t step, void * context, mnist_tune_result_t * result);
+
+#endif
@@ -2,6 +2,8 @@
 #define NEURAL_NETWORK_H_
 
 #include "mnist_file.h"
+#include "mnist_numa.h"
+#include "mnist_steal.h"
 
 typedef struct neural_network_t_ {
     float b[MNIST_LABELS];
@@ -14,8 +16,10 @@ typedef struct neural_network_gradient_t_ {
 } neural_network_gradient_t;
 
 void neural_network_random_weights(neural_network_t * network);
+void neural_network_softmax(float * activations, int length);
 void neural_network_hypothesis(mnist_image_t * image, neural_network_t * network, float activations[MNIST_LABELS]);
 float neural_network_gradient_update(mnist_image_t * image, neural_network_t * network, neural_network_gradient_t * gradient, uint8_t label);
-float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t * network, float learning_rate);
-float neural_network_training_step_parallel(mnist_dataset_t *dataset, neural_network_t *network, float learning_rate);
+float neural_network_accumulate(mnist_dataset_t * batch, neural_network_t * network, neural_network_gradient_t * gradient);
+float neural_network_accumulate_parallel(mnist_dataset_t * batch, neural_network_t * network, neural_network_gradient_t * gradient, mnist_steal_t * steal);
+void neural_network_gradient_locality(mnist_numa_locality_t * locality);
 #endif
@@ -2,6 +2,9 @@
 #define NEURAL_NETWORK_H_
 
 #include "mnist_file.h"
+#include "mnist_mlp.h"
+#include "mnist_optimizer.h"
+#include "mnist_arena.h"
 
 typedef struct neural_network_t_ {
     float b[MNIST_LABELS];
@@ -13,9 +16,27 @@ typedef struct neural_network_gradient_t_ {
     float W_grad[MNIST_LABELS][MNIST_IMAGE_SIZE];
 } neural_network_gradient_t;
 
+/**
+ * Buffers of the training steps, carved from an arena once and kept mapped
+ * on the devices for the whole run, so that steps allocate nothing on the
+ * host or on the devices: a gradient and a loss per device, and for the
+ * multi-layer perceptron the kernel workspace of every device.
+ */
+typedef struct neural_network_buffers_t_ {
+    int devices;
+    size_t parameters;      // Floats per gradient
+    float * gradients;      // Summed into the first one after every step
+    float * losses;
+    float * workspaces;     // NULL for the softmax network
+    size_t workspace_size;  // Floats per device
+} neural_network_buffers_t;
+
 void neural_network_random_weights(neural_network_t * network);
 void neural_network_hypothesis(uint8_t * image, float * b, float W[MNIST_LABELS][MNIST_IMAGE_SIZE], float activations[MNIST_LABELS]);
 float neural_network_gradient_update(uint8_t * image, float * b, float W[MNIST_LABELS][MNIST_IMAGE_SIZE], float * b_grad_l, float * W_grad_l, uint8_t label, int worker);
-float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t * network, float learning_rate);
+int neural_network_buffers_create(neural_network_buffers_t * buffers, const mnist_mlp_t * mlp, int devices, mnist_arena_t * arena);
+void neural_network_buffers_release(neural_network_buffers_t * buffers);
+float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t * network, mnist_optimizer_t * optimizer, neural_network_buffers_t * buffers);
+float neural_network_mlp_training_step(mnist_dataset_t * dataset, const mnist_mlp_t * mlp, float * parameters, uint16_t * weights, mnist_optimizer_t * optimizer, neural_network_buffers_t * buffers);
 
 #endif
\ No newline at end of file
@@ -17,34 +17,13 @@ export OMP_NUM_THREADS=48
 
 # make all
 
-test_mnist_binary() {
-    local binary_path=$1
-    local bins=$(ls $1)
-    local nnodes=$2
-    local pe=$3
-    local output=$4
-
-    mkdir -p temp
-
-    echo "Binary,Nodes,Final Accuracy,Total Duration,Mean Iteration Time" > $output/stats.csv
-
-    # Loop over each binary in the specified directory
-    for binary in $bins; do
-        for nodes in $(seq 1 $nnodes); do        
-            mpirun -np $nodes --map-by ppr:1:socket:PE=$pe ./$binary_path/$binary > temp/temp.log
-
-            # Extract the last three metrics from the output log
-            final_accuracy=$(grep "Final Accuracy" temp/temp.log | awk '{print $3}')
-            total_duration=$(grep "Total Duration" temp/temp.log | awk '{print $3}')
-            mean_iteration_time=$(grep "Mean Iteration Time" temp/temp.log | awk '{print $4}')
-
-            # Append the statistics to the CSV file for the current binary
-            echo "$binary,$nodes,$final_accuracy,$total_duration,$mean_iteration_time" >> $output/stats.csv
-        done
-    done
-
-    rm -rf temp
-}
-
-# Call the function with the appropriate parameters
-test_mnist_binary "bin" $SLURM_NTASKS $OMP_NUM_THREADS "output"
+# Strong scaling over 1 to $SLURM_NTASKS processes of every image size, from
+# the structured records of the runs
+python3 ../utilities/scaling.py --backends mpi_openmp --sizes 1x,2x,4x --ranks $(seq -s, 1 $SLURM_NTASKS) \
+    --threads $OMP_NUM_THREADS --steps 100 --launcher "mpirun -np {ranks} --map-by ppr:1:socket:PE={threads}" \
+    --records-dir output/records --output output/scaling.csv --legacy-output output/stats.csv
+
+# Cost of the gradient synchronization alone, per strategy and process count
+for size in 1x 2x 4x; do
+    mpirun -np $SLURM_NTASKS --map-by ppr:1:socket:PE=$OMP_NUM_THREADS bin/mnist-comm-$size $([ $size != 1x ] && echo --no-header)
+done > output/comm.csv
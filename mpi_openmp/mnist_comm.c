@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "../include/mnist_file.h"
+#include "../include/mnist_mlp.h"
+
+/**
+ * Microbenchmark of the gradient synchronization of a training step, without
+ * the computation around it, for the image size the binary is built for
+ * (mnist-comm-1x, -2x and -4x, like the trainers). Every strategy moves the
+ * gradient of the softmax network, or with --hidden of a multi-layer
+ * perceptron, and the loss, between the first N processes for every N of
+ * --ranks, so one mpirun sweeps the process counts on a single host through
+ * shared memory as well as across a cluster. The median and interquartile
+ * range of the slowest process's time per step are reported with the
+ * algorithm and bus bandwidth, as CSV or JSON lines.
+ */
+
+#define COMM_ITERATIONS 50
+#define COMM_WARMUP 5
+#define COMM_MAX_ITERATIONS 10000
+#define COMM_MAX_RANKS 64
+
+typedef struct comm_t_ {
+    size_t count;                    // Floats of the gradient and parameters
+    int segments;                    // Rows and biases, as the per-row sequence sends them
+    size_t * offsets;
+    size_t * lengths;
+    float * gradient;
+    float * global;                  // Reduced gradient on the root
+    float * parameters;
+    float * shard;                   // Of the reduce-scatter
+    uint16_t * message;              // bf16 gradient
+    MPI_Request * requests;
+    MPI_Op bf16_sum;
+} comm_t;
+
+typedef void (* comm_run_t)(comm_t * comm, MPI_Comm communicator);
+
+typedef struct comm_strategy_t_ {
+    const char * name;
+    comm_run_t run;
+    size_t element;                  // Bytes of a gradient element
+} comm_strategy_t;
+
+typedef struct comm_config_t_ {
+    int iterations;
+    int warmup;
+    int json;
+    int header;
+    const char * strategies;
+    const char * hidden;
+} comm_config_t;
+
+static void * comm_alloc(size_t bytes)
+{
+    void * memory = calloc(1, bytes > 0 ? bytes : 1);
+
+    if (NULL == memory) {
+        fprintf(stderr, "Could not allocate %lu bytes\n", (unsigned long) bytes);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    return memory;
+}
+
+/**
+ * MPI reduction of bf16 gradient messages, summed in fp32, as the trainer's.
+ */
+static void bf16_sum(void * in, void * inout, int * length, MPI_Datatype * type)
+{
+    (void) type;
+    mnist_mlp_add_bf16(in, inout, *length);
+}
+
+static void add_segment(comm_t * comm, size_t offset, size_t length)
+{
+    comm->offsets[comm->segments] = offset;
+    comm->lengths[comm->segments] = length;
+    comm->segments++;
+}
+
+/**
+ * Buffers of the network's size, with the rows of its weights and its biases
+ * as segments: for the softmax network the biases and then every row of
+ * weights, the order of the trainer's original per-row update, and for the
+ * perceptron every layer's rows followed by its biases. The buffers hold
+ * zeros, so that however often they are summed they stay finite.
+ */
+static void comm_init(comm_t * comm, const char * hidden, int size)
+{
+    mnist_mlp_t mlp;
+    size_t segments;
+    int l, j;
+
+    memset(comm, 0, sizeof(comm_t));
+
+    if (NULL == hidden) {
+        comm->count = (size_t) MNIST_LABELS * (MNIST_IMAGE_SIZE + 1);
+        segments = MNIST_LABELS + 1;
+    } else {
+        if (0 != mnist_mlp_init(&mlp, MNIST_IMAGE_SIZE, hidden, MNIST_LABELS)) {
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+
+        comm->count = mlp.parameters;
+
+        for (l = 0, segments = 0; l < mlp.layers; l++) {
+            segments += mlp.sizes[l + 1] + 1;
+        }
+    }
+
+    comm->offsets = comm_alloc(segments * sizeof(size_t));
+    comm->lengths = comm_alloc(segments * sizeof(size_t));
+
+    if (NULL == hidden) {
+        add_segment(comm, 0, MNIST_LABELS);
+
+        for (j = 0; j < MNIST_LABELS; j++) {
+            add_segment(comm, MNIST_LABELS + (size_t) j * MNIST_IMAGE_SIZE, MNIST_IMAGE_SIZE);
+        }
+    } else {
+        for (l = 0; l < mlp.layers; l++) {
+            for (j = 0; j < mlp.sizes[l + 1]; j++) {
+                add_segment(comm, mlp.offsets[l] + (size_t) j * mlp.sizes[l], mlp.sizes[l]);
+            }
+
+            add_segment(comm, mlp.offsets[l] + (size_t) mlp.sizes[l + 1] * mlp.sizes[l], mlp.sizes[l + 1]);
+        }
+    }
+
+    // The reduce-scatter splits a gradient padded to a multiple of the
+    // processes, which is less than size floats longer
+    comm->gradient = comm_alloc((comm->count + size) * sizeof(float));
+    comm->global = comm_alloc(comm->count * sizeof(float));
+    comm->parameters = comm_alloc((comm->count + size) * sizeof(float));
+    comm->shard = comm_alloc(comm->count * sizeof(float));
+    comm->message = comm_alloc(comm->count * sizeof(uint16_t));
+    comm->requests = comm_alloc((comm->segments + 1) * sizeof(MPI_Request));
+
+    MPI_Op_create(bf16_sum, 1, &comm->bf16_sum);
+}
+
+static void comm_free(comm_t * comm)
+{
+    MPI_Op_free(&comm->bf16_sum);
+
+    free(comm->offsets);
+    free(comm->lengths);
+    free(comm->gradient);
+    free(comm->global);
+    free(comm->parameters);
+    free(comm->shard);
+    free(comm->message);
+    free(comm->requests);
+}
+
+/**
+ * The sequence of the trainer's original per-row update: the loss and then
+ * every row of the gradient reduced to the root, and every row of the updated
+ * network broadcast back.
+ */
+static void run_rowwise(comm_t * comm, MPI_Comm communicator)
+{
+    float loss = 1.0f, global_loss;
+    int s;
+
+    MPI_Reduce(&loss, &global_loss, 1, MPI_FLOAT, MPI_SUM, 0, communicator);
+
+    for (s = 0; s < comm->segments; s++) {
+        MPI_Reduce(comm->gradient + comm->offsets[s], comm->global + comm->offsets[s], comm->lengths[s], MPI_FLOAT, MPI_SUM, 0, communicator);
+    }
+
+    for (s = 0; s < comm->segments; s++) {
+        MPI_Bcast(comm->parameters + comm->offsets[s], comm->lengths[s], MPI_FLOAT, 0, communicator);
+    }
+}
+
+/**
+ * The loss and one allreduce of the whole gradient, as the trainer does now.
+ */
+static void run_allreduce(comm_t * comm, MPI_Comm communicator)
+{
+    float loss = 1.0f, global_loss;
+
+    MPI_Allreduce(&loss, &global_loss, 1, MPI_FLOAT, MPI_SUM, communicator);
+    MPI_Allreduce(MPI_IN_PLACE, comm->gradient, comm->count, MPI_FLOAT, MPI_SUM, communicator);
+}
+
+/**
+ * The trainer's allreduce with --bf16: half the bytes, summed in fp32.
+ */
+static void run_allreduce_bf16(comm_t * comm, MPI_Comm communicator)
+{
+    float loss = 1.0f, global_loss;
+
+    MPI_Allreduce(&loss, &global_loss, 1, MPI_FLOAT, MPI_SUM, communicator);
+    MPI_Allreduce(MPI_IN_PLACE, comm->message, comm->count, MPI_UINT16_T, comm->bf16_sum, communicator);
+}
+
+/**
+ * A sharded update: every process receives the sum of its slice of the
+ * gradient, would update that slice of the parameters, and gathers the
+ * slices of the others.
+ */
+static void run_reduce_scatter(comm_t * comm, MPI_Comm communicator)
+{
+    float loss = 1.0f, global_loss;
+    int size, chunk;
+
+    MPI_Comm_size(communicator, &size);
+    chunk = (comm->count + size - 1) / size;
+
+    MPI_Allreduce(&loss, &global_loss, 1, MPI_FLOAT, MPI_SUM, communicator);
+    MPI_Reduce_scatter_block(comm->gradient, comm->shard, chunk, MPI_FLOAT, MPI_SUM, communicator);
+    MPI_Allgather(comm->shard, chunk, MPI_FLOAT, comm->parameters, chunk, MPI_FLOAT, communicator);
+}
+
+/**
+ * Every row's allreduce in flight at once, as rows finished by the kernels
+ * could be sent while the others are computed.
+ */
+static void run_nonblocking(comm_t * comm, MPI_Comm communicator)
+{
+    float loss = 1.0f, global_loss;
+    int s;
+
+    MPI_Iallreduce(&loss, &global_loss, 1, MPI_FLOAT, MPI_SUM, communicator, &comm->requests[comm->segments]);
+
+    for (s = 0; s < comm->segments; s++) {
+        MPI_Iallreduce(MPI_IN_PLACE, comm->gradient + comm->offsets[s], comm->lengths[s], MPI_FLOAT, MPI_SUM, communicator, &comm->requests[s]);
+    }
+
+    MPI_Waitall(comm->segments + 1, comm->requests, MPI_STATUSES_IGNORE);
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Quantile q of n sorted values, interpolated between the nearest two.
+ */
+static double quantile(const double * sorted, int n, double q)
+{
+    const double position = q * (n - 1);
+    const int below = (int) position;
+
+    return below + 1 < n ? sorted[below] + (position - below) * (sorted[below + 1] - sorted[below]) : sorted[n - 1];
+}
+
+/**
+ * Time a strategy on a communicator: every step starts together after a
+ * barrier and lasts as long as its slowest process. Returns the sorted step
+ * times on rank 0 of the communicator.
+ */
+static void measure(comm_t * comm, const comm_strategy_t * strategy, const comm_config_t * config, MPI_Comm communicator, double * times)
+{
+    double start;
+    int i, rank;
+
+    MPI_Comm_rank(communicator, &rank);
+
+    for (i = 0; i < config->warmup; i++) {
+        strategy->run(comm, communicator);
+    }
+
+    for (i = 0; i < config->iterations; i++) {
+        MPI_Barrier(communicator);
+        start = MPI_Wtime();
+        strategy->run(comm, communicator);
+        times[i] = MPI_Wtime() - start;
+    }
+
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : times, times, config->iterations, MPI_DOUBLE, MPI_MAX, 0, communicator);
+
+    if (0 == rank) {
+        qsort(times, config->iterations, sizeof(double), compare_doubles);
+    }
+}
+
+/**
+ * The algorithm bandwidth is the gradient's bytes over the time of a step,
+ * and the bus bandwidth scales it by the 2 (p - 1) / p of the gradient every
+ * process sends and receives in a bandwidth optimal allreduce, so that it
+ * can be compared with the links' speed whatever the process count.
+ */
+static void report(const comm_t * comm, const comm_strategy_t * strategy, const comm_config_t * config, const double * times, int ranks)
+{
+    const double median = quantile(times, config->iterations, 0.5);
+    const double iqr = quantile(times, config->iterations, 0.75) - quantile(times, config->iterations, 0.25);
+    const double bytes = (double) comm->count * strategy->element;
+    const double algorithm = median > 0.0 ? bytes / median / 1e9 : 0.0;
+    const double bus = algorithm * 2.0 * (ranks - 1) / ranks;
+
+    if (config->json) {
+        printf("{\"strategy\": \"%s\", \"width\": %d, \"height\": %d, \"parameters\": %lu, \"bytes\": %.0f, \"segments\": %d, \"ranks\": %d, \"iterations\": %d, "
+            "\"median_us\": %.4f, \"iqr_us\": %.4f, \"algbw_gb_per_s\": %.3f, \"busbw_gb_per_s\": %.3f}\n",
+            strategy->name, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT, (unsigned long) comm->count, bytes, comm->segments, ranks, config->iterations,
+            median * 1e6, iqr * 1e6, algorithm, bus);
+    } else {
+        printf("%s,%d,%d,%lu,%.0f,%d,%d,%d,%.4f,%.4f,%.3f,%.3f\n", strategy->name, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT, (unsigned long) comm->count,
+            bytes, comm->segments, ranks, config->iterations, median * 1e6, iqr * 1e6, algorithm, bus);
+    }
+
+    fflush(stdout);
+}
+
+/**
+ * Whether a comma separated list holds a name, or is NULL for all of them.
+ */
+static int listed(const char * list, const char * name)
+{
+    const size_t length = strlen(name);
+    const char * item = list;
+
+    if (NULL == list) {
+        return 1;
+    }
+
+    while (NULL != item && '\0' != *item) {
+        if (0 == strncmp(item, name, length) && (',' == item[length] || '\0' == item[length])) {
+            return 1;
+        }
+
+        item = strchr(item, ',');
+        item = NULL != item ? item + 1 : NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * The process counts to sweep: those of a comma separated list, or the
+ * powers of two below the world size and the world size itself.
+ */
+static int parse_ranks(const char * list, int size, int * ranks)
+{
+    const char * item = list;
+    int count = 0, r;
+
+    if (NULL == list) {
+        for (r = 2; r < size && count < COMM_MAX_RANKS - 1; r *= 2) {
+            ranks[count++] = r;
+        }
+
+        ranks[count++] = size;
+
+        return count;
+    }
+
+    while (NULL != item && '\0' != *item && count < COMM_MAX_RANKS) {
+        r = atoi(item);
+
+        if (r < 1 || r > size) {
+            return -1;
+        }
+
+        ranks[count++] = r;
+        item = strchr(item, ',');
+        item = NULL != item ? item + 1 : NULL;
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    static const comm_strategy_t strategies[] = {
+        { "rowwise", run_rowwise, sizeof(float) },
+        { "allreduce", run_allreduce, sizeof(float) },
+        { "allreduce-bf16", run_allreduce_bf16, sizeof(uint16_t) },
+        { "reduce-scatter", run_reduce_scatter, sizeof(float) },
+        { "nonblocking", run_nonblocking, sizeof(float) }
+    };
+    const int strategy_count = sizeof(strategies) / sizeof(strategies[0]);
+    comm_config_t config = {
+        .iterations = COMM_ITERATIONS,
+        .warmup = COMM_WARMUP,
+        .json = 0,
+        .header = 1,
+        .strategies = NULL,
+        .hidden = NULL
+    };
+    double times[COMM_MAX_ITERATIONS];
+    const char * rank_list = NULL;
+    int ranks[COMM_MAX_RANKS];
+    int rank, size, rank_count, i, r, s;
+    MPI_Comm communicator;
+    comm_t comm;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    for (i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            config.iterations = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            config.warmup = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--ranks") && i + 1 < argc) {
+            rank_list = argv[++i];
+        } else if (0 == strcmp(argv[i], "--strategies") && i + 1 < argc) {
+            config.strategies = argv[++i];
+        } else if (0 == strcmp(argv[i], "--hidden") && i + 1 < argc) {
+            config.hidden = argv[++i];
+        } else if (0 == strcmp(argv[i], "--json")) {
+            config.json = 1;
+        } else if (0 == strcmp(argv[i], "--no-header")) {
+            config.header = 0;
+        } else {
+            if (0 == rank) {
+                fprintf(stderr, "Usage: %s [--iterations N] [--warmup N] [--ranks LIST] [--strategies LIST] [--hidden SIZES] [--json] [--no-header]\n", argv[0]);
+            }
+
+            MPI_Finalize();
+            return EXIT_FAILURE;
+        }
+    }
+
+    rank_count = parse_ranks(rank_list, size, ranks);
+
+    if (config.iterations < 1 || config.iterations > COMM_MAX_ITERATIONS || config.warmup < 0 || rank_count < 1) {
+        if (0 == rank) {
+            fprintf(stderr, "--iterations must be between 1 and %d and --ranks between 1 and the %d processes\n", COMM_MAX_ITERATIONS, size);
+        }
+
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    comm_init(&comm, config.hidden, size);
+
+    if (0 == rank && config.header && !config.json) {
+        printf("strategy,width,height,parameters,bytes,segments,ranks,iterations,median_us,iqr_us,algbw_gb_per_s,busbw_gb_per_s\n");
+    }
+
+    for (r = 0; r < rank_count; r++) {
+        // The first ranks[r] processes take part, the others wait
+        MPI_Comm_split(MPI_COMM_WORLD, rank < ranks[r] ? 0 : MPI_UNDEFINED, rank, &communicator);
+
+        for (s = 0; s < strategy_count; s++) {
+            if (MPI_COMM_NULL == communicator || !listed(config.strategies, strategies[s].name)) {
+                continue;
+            }
+
+            measure(&comm, &strategies[s], &config, communicator, times);
+
+            if (0 == rank) {
+                report(&comm, &strategies[s], &config, times, ranks[r]);
+            }
+        }
+
+        if (MPI_COMM_NULL != communicator) {
+            MPI_Comm_free(&communicator);
+        }
+
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    comm_free(&comm);
+    MPI_Finalize();
+
+    return 0;
+}
@@ -16,36 +16,10 @@ cd $SLURM_SUBMIT_DIR
 
 echo $(pwd)
 
-test_mnist_binary() {
-    local binary_path=$1
-    local bins=$(ls $1)
-    local nnodes=$(( $2 - 1 ))
-    local output=$3
-
-    mkdir -p temp
-
-    echo "Binary,Nodes,Final Accuracy,Total Duration,Mean Iteration Time" > $output/stats_gpu.csv
-
-    # Loop over each binary in the specified directory
-    for binary in $bins; do
-        for nodes in $(seq 1 $nnodes); do        
-            mpirun -np $nodes apptainer exec --nv ./../../ompc.sif remote-proxy-device :\
-             -np 1 -env LIBOMPTARGET_DISABLE_HOST_PLUGIN=1 apptainer exec ./../../ompc.sif\
-              ./$binary_path/$binary > temp/temp.log
-
-
-            # Extract the last three metrics from the output log
-            final_accuracy=$(grep "Final Accuracy" temp/temp.log | awk '{print $3}')
-            total_duration=$(grep "Total Duration" temp/temp.log | awk '{print $3}')
-            mean_iteration_time=$(grep "Mean Iteration Time" temp/temp_gpu.log | awk '{print $4}')
-
-            # Append the statistics to the CSV file for the current binary
-            echo "$binary,$nodes,$final_accuracy,$total_duration,$mean_iteration_time" >> $output/stats_gpu.csv
-        done
-    done
-
-    rm -rf temp
-}
-
-# Call the function with the appropriate parameters
-test_mnist_binary "bin" $SLURM_NNODES "output"
\ No newline at end of file
+# Strong scaling over 1 to $SLURM_NNODES - 1 GPU workers of every image size,
+# the head process taking the last node, from the structured records of the
+# runs
+python3 ../utilities/scaling.py --backends ompcluster --sizes 1x,2x,4x --ranks $(seq -s, 1 $(( SLURM_NNODES - 1 ))) \
+    --threads $(nproc) --steps 100 \
+    --launcher "mpirun -np {ranks} apptainer exec --nv ./../../ompc.sif remote-proxy-device : -np 1 -env LIBOMPTARGET_DISABLE_HOST_PLUGIN=1 apptainer exec ./../../ompc.sif" \
+    --records-dir output/records_gpu --output output/scaling_gpu.csv --legacy-output output/stats_gpu.csv
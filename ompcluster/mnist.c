@@ -1,11 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <omp.h>
 
-#include "../include/mnist_file_ompc.h"
+#include "../include/mnist_file.h"
 #include "../include/neural_network_ompc.h"
+#include "../include/mnist_checkpoint.h"
+#include "../include/mnist_optimizer.h"
+#include "../include/mnist_arena.h"
+#include "../include/mnist_records.h"
+#include "../include/mnist_convergence.h"
 
 #define STEPS 100
 
@@ -14,18 +20,40 @@ void retrieve_data_from_device(int device, mnist_dataset_t *dataset) {
                                     depend(in: dataset) \
                                     device(device) nowait
     #pragma omp target exit data depend(in: dataset->images, dataset->labels) \
-                                    map(release: dataset->images[0:dataset->size * MNIST_IMAGE_SIZE], \
+                                    map(release: dataset->images[0:dataset->size], \
                                             dataset->labels[0:dataset->size]) \
                                     device(device) nowait
     printf("Data sent to device %d\n", device);
 
 }
 /**
- * Calculate the accuracy of the predictions of a neural network on a dataset.
+ * The options of this driver, for --help and unknown options.
  */
-float calculate_accuracy(mnist_dataset_t *dataset, neural_network_t *network) {
+void print_usage(FILE *stream, const char *program) {
+    fprintf(stream, "Usage: %s [options]\n"
+        "  --steps N  --train-images N  --records PATH\n"
+        "  --optimizer sgd|momentum|nesterov|adam  --lr R  --min-lr R  --momentum M  --schedule constant|cosine  --warmup N\n"
+        "  --target-accuracy A  --time-budget SECONDS  --validate-every N  --validation-images N\n"
+        "  --hidden SIZES  --bf16  --hugepages\n"
+        "  --mmap  --mmap-populate  --chunked\n"
+        "  --checkpoint PATH  --checkpoint-every N  --resume PATH  --eval PATH\n"
+        "  --help\n", program);
+}
+
+/**
+ * Calculate the accuracy of the predictions of a neural network on a dataset,
+ * of the multi-layer perceptron when parameters is not NULL.
+ */
+float calculate_accuracy(mnist_dataset_t *dataset, neural_network_t *network, const mnist_mlp_t *mlp, float *parameters, uint16_t *weights, float *workspace) {
     float activations[MNIST_LABELS], max_activation, b[MNIST_LABELS], W[MNIST_LABELS][MNIST_IMAGE_SIZE];
     int i, j, correct, predict;
+
+    if (NULL != weights) {
+        return ((float)mnist_mlp_count_correct_bf16(mlp, weights, (uint8_t *) dataset->images, dataset->labels, dataset->size, workspace)) / ((float)dataset->size);
+    } else if (NULL != parameters) {
+        return ((float)mnist_mlp_count_correct(mlp, parameters, (uint8_t *) dataset->images, dataset->labels, dataset->size, workspace)) / ((float)dataset->size);
+    }
+
     for (i = 0; i < MNIST_LABELS; i++) {
         b[i] = network->b[i];
         for (j = 0; j < MNIST_IMAGE_SIZE; j++) {
@@ -33,7 +61,7 @@ float calculate_accuracy(mnist_dataset_t *dataset, neural_network_t *network) {
         }
     }
     for (i = 0, correct = 0; i < dataset->size; i++) {
-        neural_network_hypothesis(dataset->images + i * MNIST_IMAGE_SIZE, b, W, activations);
+        neural_network_hypothesis(dataset->images[i].pixels, b, W, activations);
 
         for (j = 0, predict = 0, max_activation = activations[0]; j < MNIST_LABELS; j++) {
             if (max_activation < activations[j]) {
@@ -51,72 +79,397 @@ float calculate_accuracy(mnist_dataset_t *dataset, neural_network_t *network) {
 
 int main(int argc, char *argv[]) {
     mnist_dataset_t *train_dataset, *test_dataset;
-    mnist_dataset_t batch;
+    mnist_dataset_t batch, validation = { 0 };
     neural_network_t network;
-    float loss, accuracy;
-    int i, batches, nworkers;
-    double start_time, end_time, iteration_time, total_time = 0;
+    mnist_mlp_t mlp;
+    float *parameters = NULL, *workspace = NULL;
+    uint16_t *weights = NULL;
+    int use_bf16 = 0, use_hugepages = 0;
+    mnist_optimizer_config_t optimizer_config;
+    mnist_optimizer_t *optimizer;
+    mnist_convergence_config_t convergence_config;
+    mnist_convergence_t *convergence = NULL;
+    mnist_arena_t *arena;
+    mnist_arena_stats_t arena_stats;
+    mnist_records_t *records = NULL;
+    neural_network_buffers_t buffers;
+    void *checkpoint_parameters = &network;
+    size_t checkpoint_bytes = sizeof(neural_network_t);
+    const char *hidden = NULL;
+    float loss, accuracy, master_accuracy = 0.0f;
+    int i, batches, nworkers, map_flags = 0, use_chunked = 0;
+    int steps = STEPS, first_step = 0, checkpoint_every = MNIST_CHECKPOINT_EVERY;
+    const char *checkpoint_path = NULL, *resume_path = NULL, *eval_path = NULL, *records_path = NULL;
+    uint32_t train_images = 0;
+    mnist_checkpointer_t *checkpointer = NULL;
+    mnist_checkpoint_state_t checkpoint = { 0 };
+    mnist_checkpoint_stats_t checkpoint_stats;
+    double start_time, end_time, iteration_time, total_time = 0, train_time, elapsed;
 
+    mnist_optimizer_config_init(&optimizer_config);
+    mnist_convergence_config_init(&convergence_config);
+
+    for (i = 1; i < argc; i++) {
+        // --optimizer, --lr, --min-lr, --momentum, --schedule and --warmup
+        if (mnist_optimizer_option(&optimizer_config, argc, argv, &i)) {
+            continue;
+        }
+
+        // --target-accuracy, --time-budget, --validate-every and
+        // --validation-images
+        if (mnist_convergence_option(&convergence_config, argc, argv, &i)) {
+            continue;
+        }
+
+        if (0 == strcmp(argv[i], "--mmap")) {
+            map_flags |= MNIST_MAP_SEQUENTIAL | MNIST_MAP_WILLNEED;
+        } else if (0 == strcmp(argv[i], "--mmap-populate")) {
+            map_flags |= MNIST_MAP_SEQUENTIAL | MNIST_MAP_POPULATE;
+        } else if (0 == strcmp(argv[i], "--chunked")) {
+            use_chunked = 1;
+        } else if (0 == strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--checkpoint-every") && i + 1 < argc) {
+            checkpoint_every = atoi(argv[++i]);
+
+            if (checkpoint_every < 1) {
+                fprintf(stderr, "--checkpoint-every needs at least 1 step, not %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (0 == strcmp(argv[i], "--resume") && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--eval") && i + 1 < argc) {
+            eval_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--hidden") && i + 1 < argc) {
+            hidden = argv[++i];
+        } else if (0 == strcmp(argv[i], "--bf16")) {
+            use_bf16 = 1;
+        } else if (0 == strcmp(argv[i], "--hugepages")) {
+            use_hugepages = 1;
+        } else if (0 == strcmp(argv[i], "--steps") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--train-images") && i + 1 < argc) {
+            train_images = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--records") && i + 1 < argc) {
+            records_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--help")) {
+            print_usage(stdout, argv[0]);
+            return 0;
+        } else {
+            // An option this driver does not know, or one without its value
+            fprintf(stderr, "Unknown option %s%s\n", argv[i], i + 1 == argc && 0 == strncmp(argv[i], "--", 2) ? " or missing value" : "");
+            print_usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The mixed precision kernels are those of the multi-layer perceptron
+    if (use_bf16 && NULL == hidden) {
+        fprintf(stderr, "--bf16 needs --hidden\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The parameters, the optimizer state and the buffers of the training
+    // steps are carved from one arena, so the steps allocate nothing;
+    // --hugepages backs it with 2 MB pages
+    arena = mnist_arena_create(use_hugepages);
+
+    if (NULL == arena) {
+        exit(EXIT_FAILURE);
+    }
+
+    // --hidden trains a multi-layer perceptron with hidden layers of the
+    // given sizes instead of the single softmax layer
+    if (NULL != hidden) {
+        if (0 != mnist_mlp_init(&mlp, MNIST_IMAGE_SIZE, hidden, MNIST_LABELS)) {
+            exit(EXIT_FAILURE);
+        }
+
+        parameters = (float*)mnist_arena_alloc(arena, mlp.parameters * sizeof(float));
+        workspace = (float*)mnist_arena_alloc(arena, mnist_mlp_workspace_size(&mlp) * sizeof(float));
+        weights = use_bf16 ? (uint16_t*)mnist_arena_alloc(arena, mlp.parameters * sizeof(uint16_t)) : NULL;
+
+        if (NULL == parameters || NULL == workspace || (use_bf16 && NULL == weights)) {
+            fprintf(stderr, "Could not allocate memory for a network of %lu parameters\n", (unsigned long) mlp.parameters);
+            exit(EXIT_FAILURE);
+        }
+
+        checkpoint_parameters = parameters;
+        checkpoint_bytes = mlp.parameters * sizeof(float);
+    }
+
+    // The host updates either network as one array of floats. Every step
+    // trains on the full batch, so the schedule counts steps
+    optimizer = mnist_optimizer_create(&optimizer_config, checkpoint_bytes / sizeof(float), arena);
+
+    if (NULL == optimizer) {
+        exit(EXIT_FAILURE);
+    }
+
+    optimizer->config.total = steps;
+
+    // Read the datasets from the files, with the loaders of the other
+    // implementations, into the arena unless they are mapped
+    if (use_chunked) {
+        train_dataset = mnist_get_chunked_dataset(TRAIN_CHUNKED_FILE, 0, 1, arena);
+        test_dataset = mnist_get_chunked_dataset(TEST_CHUNKED_FILE, 0, 1, arena);
+    } else if (map_flags) {
+        // --mmap maps the dataset files instead of reading them into private
+        // memory, --mmap-populate also prefaults every page before training
+        train_dataset = mnist_map_dataset(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, map_flags);
+        test_dataset = mnist_map_dataset(TEST_IMAGES_FILE, TEST_LABELS_FILE, map_flags);
+    } else {
+        train_dataset = mnist_get_dataset(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, arena);
+        test_dataset = mnist_get_dataset(TEST_IMAGES_FILE, TEST_LABELS_FILE, arena);
+    }
+
+    if (NULL == train_dataset || NULL == test_dataset) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (train_dataset->size > MNIST_DATASET_SIZE) {
+        train_dataset->size = MNIST_DATASET_SIZE;
+    }
+
+    // --train-images trains on the first images only
+    if (train_images > 0 && train_images < train_dataset->size) {
+        train_dataset->size = train_images;
+    }
     
-    // Read the datasets from the files
-    train_dataset = mnist_get_dataset(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, MNIST_DATASET_SIZE);
-    test_dataset = mnist_get_dataset(TEST_IMAGES_FILE, TEST_LABELS_FILE, 0);
-    
-    // Initialize weights and biases with random values
-    neural_network_random_weights(&network);
+    // --eval only evaluates the network saved in a checkpoint
+    if (NULL != eval_path) {
+        if (0 != mnist_checkpoint_load(eval_path, &checkpoint, checkpoint_parameters, checkpoint_bytes, NULL, 0) ||
+            checkpoint.model_hash != (NULL != parameters ? mnist_mlp_hash(&mlp) : 0)) {
+            fprintf(stderr, "Could not evaluate a network of this shape from %s\n", eval_path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (NULL != weights) {
+            mnist_mlp_round_bf16(parameters, weights, mlp.parameters, 1);
+        }
+
+        start_time = omp_get_wtime();
+        accuracy = calculate_accuracy(test_dataset, &network, &mlp, parameters, weights, workspace);
+        printf("Checkpoint Step: %lu\n", (unsigned long) checkpoint.step);
+        printf("Final Accuracy: %.6f\n", accuracy);
+        printf("Total Duration: %.6f seconds\n", omp_get_wtime() - start_time);
+
+        return 0;
+    }
+
+    // --resume continues from a checkpoint of a run on the same data,
+    // otherwise initialize weights and biases with random values
+    if (NULL != resume_path) {
+        if (0 != mnist_checkpoint_load(resume_path, &checkpoint, checkpoint_parameters, checkpoint_bytes, optimizer->state, optimizer->state_bytes) ||
+            checkpoint.model_hash != (NULL != parameters ? mnist_mlp_hash(&mlp) : 0)) {
+            fprintf(stderr, "Could not resume a network of this shape and optimizer from %s\n", resume_path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (checkpoint.data_hash != mnist_checkpoint_hash(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, train_dataset->size, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT)) {
+            fprintf(stderr, "Checkpoint %s was trained on different data\n", resume_path);
+            exit(EXIT_FAILURE);
+        }
+
+        first_step = checkpoint.step;
+        optimizer->updates = first_step;
+        printf("Resuming from step %d of %s\n", first_step, resume_path);
+    } else if (NULL != parameters) {
+        mnist_mlp_random_parameters(&mlp, parameters, 0, 1);
+    } else {
+        neural_network_random_weights(&network);
+    }
+
+    // The devices compute with a bf16 working copy of the parameters
+    if (NULL != weights) {
+        mnist_mlp_round_bf16(parameters, weights, mlp.parameters, 1);
+    }
+
+    // --checkpoint writes the network every few steps from a background thread
+    if (NULL != checkpoint_path) {
+        checkpointer = mnist_checkpointer_create(checkpoint_path, checkpoint_bytes, optimizer->state_bytes);
+
+        if (NULL == checkpointer) {
+            exit(EXIT_FAILURE);
+        }
+
+        checkpoint.model_hash = NULL != parameters ? mnist_mlp_hash(&mlp) : 0;
+        checkpoint.data_hash = mnist_checkpoint_hash(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE, train_dataset->size, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT);
+        checkpoint.width = MNIST_IMAGE_WIDTH;
+        checkpoint.height = MNIST_IMAGE_HEIGHT;
+        checkpoint.learning_rate = optimizer->config.learning_rate;
+    }
+
+    // --target-accuracy and --time-budget train until the network reaches the
+    // accuracy on a random subset of the test set, validated on the host every
+    // few steps instead of on the whole test set every step, or until the
+    // time is up, for at most --steps steps
+    if (mnist_convergence_enabled(&convergence_config)) {
+        validation.size = mnist_convergence_subset(&convergence_config, (uint8_t *) test_dataset->images, test_dataset->labels, test_dataset->size,
+            sizeof(mnist_image_t), (uint8_t **) &validation.images, &validation.labels, arena);
+        convergence = mnist_convergence_create(&convergence_config, steps - first_step, arena);
+
+        if (0 == validation.size || NULL == convergence) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Get the number of devices
     nworkers = omp_get_num_devices();
     printf("Number of devices: %d\n", nworkers);
 
+    if (0 != neural_network_buffers_create(&buffers, NULL != parameters ? &mlp : NULL, nworkers, arena)) {
+        exit(EXIT_FAILURE);
+    }
+
     int nimages = train_dataset->size;
     int nchunks = nimages / nworkers;
     // Send data to all devices
 
     for (i = 0; i < nworkers; i++) {
-        #pragma omp target enter data map(to: train_dataset->images[i*nchunks*MNIST_IMAGE_SIZE:nchunks*MNIST_IMAGE_SIZE], \
+        #pragma omp target enter data map(to: train_dataset->images[i*nchunks:nchunks], \
                                             train_dataset->labels[i*nchunks:nchunks]) \
-                                            depend(out: train_dataset->images[i*nchunks*MNIST_IMAGE_SIZE:nchunks*MNIST_IMAGE_SIZE],\
+                                            depend(out: train_dataset->images[i*nchunks:nchunks],\
                                             train_dataset->labels[i*nchunks:nchunks]) \
                                             device(i) nowait
         printf("Sending %d images to device %d\n", nchunks, i);
     }
 
+    // --records also writes the configuration, every step and the results as
+    // JSON lines, to a file or to the standard output for "-"
+    if (NULL != records_path) {
+        records = mnist_records_open(records_path);
+
+        if (NULL == records) {
+            exit(EXIT_FAILURE);
+        }
+
+        mnist_records_begin(records, "run");
+        mnist_records_int(records, "version", MNIST_RECORDS_VERSION);
+        mnist_records_string(records, "backend", "ompcluster");
+        mnist_records_int(records, "processes", nworkers);
+        mnist_records_int(records, "threads", omp_get_max_threads());
+        mnist_records_int(records, "width", MNIST_IMAGE_WIDTH);
+        mnist_records_int(records, "height", MNIST_IMAGE_HEIGHT);
+        mnist_records_string(records, "input", use_chunked ? "chunked" : map_flags ? "mmap" : "memory");
+        mnist_records_int(records, "train_images", train_dataset->size);
+        mnist_records_string(records, "model", NULL != hidden ? hidden : "softmax");
+        mnist_records_string(records, "precision", NULL != weights ? "bf16" : "fp32");
+        mnist_records_string(records, "optimizer", mnist_optimizer_name(&optimizer->config));
+        mnist_records_int(records, "batch_size", 0);
+        mnist_records_int(records, "first_step", first_step);
+        mnist_records_int(records, "steps", steps);
+        mnist_records_end(records);
+    }
+
     start_time = omp_get_wtime(); // Start timer for the whole training process
     
     printf("Step\tIteration Time (s)\tAverage Loss\n");
+    mnist_convergence_start(convergence);
 
-    for (i = 0; i < STEPS; i++) {
+    for (i = first_step; i < steps; i++) {
         start_time = omp_get_wtime(); // Start timer for this iteration
 
-        // Run one step of gradient descent and calculate the loss
-        loss = neural_network_training_step(train_dataset, &network, 0.5);
+        // Run one step of training and calculate the loss
+        if (NULL != parameters) {
+            loss = neural_network_mlp_training_step(train_dataset, &mlp, parameters, weights, optimizer, &buffers);
+        } else {
+            loss = neural_network_training_step(train_dataset, &network, optimizer, &buffers);
+        }
+
+        if (NULL != checkpointer && ((i + 1) % checkpoint_every == 0 || i + 1 == steps)) {
+            checkpoint.step = i + 1;
+            mnist_checkpointer_save(checkpointer, &checkpoint, checkpoint_parameters, optimizer->state, i + 1 == steps);
+        }
 
         end_time = omp_get_wtime(); // End timer for this iteration
         iteration_time = end_time - start_time; // Time for this iteration
         total_time += iteration_time; // Accumulate total time
 
-        accuracy = calculate_accuracy(test_dataset, &network);
+        if (NULL == convergence) {
+            accuracy = calculate_accuracy(test_dataset, &network, &mlp, parameters, weights, workspace);
+        }
 
         printf("%04d\t%.6f\t\t%.2f\t\n", i, iteration_time, loss / train_dataset->size);
+
+        mnist_records_begin(records, "step");
+        mnist_records_int(records, "step", i);
+        mnist_records_double(records, "time", iteration_time);
+        mnist_records_double(records, "loss", loss / train_dataset->size);
+        mnist_records_end(records);
+
+        if (mnist_convergence_due(convergence, i)) {
+            elapsed = mnist_convergence_elapsed(convergence);
+            mnist_convergence_update(convergence, i, elapsed, calculate_accuracy(&validation, &network, &mlp, parameters, weights, workspace), records);
+        }
+
+        // A run that stops early still ends with a checkpoint of its network
+        if (mnist_convergence_done(convergence)) {
+            if (NULL != checkpointer && i + 1 != steps) {
+                checkpoint.step = i + 1;
+                mnist_checkpointer_save(checkpointer, &checkpoint, checkpoint_parameters, optimizer->state, 1);
+            }
+
+            steps = i + 1;
+            break;
+        }
     }
 
+    train_time = total_time;
     start_time = omp_get_wtime();
-    accuracy = calculate_accuracy(test_dataset, &network);
+    accuracy = calculate_accuracy(test_dataset, &network, &mlp, parameters, weights, workspace);
     end_time = omp_get_wtime();
     iteration_time = end_time - start_time;
     total_time += iteration_time;
     printf("\nFinal Accuracy: %.6f\n", accuracy);
+
+    // Compare the bf16 kernels with fp32 inference on the same master
+    // parameters
+    if (NULL != weights) {
+        master_accuracy = calculate_accuracy(test_dataset, &network, &mlp, parameters, NULL, workspace);
+        printf("FP32 Master Accuracy: %.6f\n", master_accuracy);
+    }
+
     printf("Total Duration: %.6f seconds\n", total_time);
-    printf("Mean Iteration Time: %.6f seconds\n", total_time / STEPS);
+    printf("Mean Iteration Time: %.6f seconds\n", total_time / (steps > first_step ? steps - first_step : 1));
+    mnist_convergence_print(convergence, validation.size);
+
+    mnist_records_begin(records, "summary");
+    mnist_records_double(records, "accuracy", accuracy);
+
+    if (NULL != weights) {
+        mnist_records_double(records, "fp32_accuracy", master_accuracy);
+    }
+
+    mnist_records_double(records, "total_duration", total_time);
+    mnist_records_double(records, "mean_iteration_time", total_time / (steps > first_step ? steps - first_step : 1));
+    mnist_records_double(records, "train_time", train_time);
+    mnist_records_double(records, "images_per_second", train_time > 0.0 ? (double) train_dataset->size * (steps - first_step) / train_time : 0.0);
+    mnist_convergence_record(convergence, records);
+    mnist_records_end(records);
+    mnist_records_close(records);
+
+    mnist_arena_stats(arena, &arena_stats);
+    printf("Arena: %.1f MB in %lu buffers, %.1f MB on huge pages\n", arena_stats.used / 1048576.0, (unsigned long) arena_stats.buffers, arena_stats.huge / 1048576.0);
+
+    if (NULL != checkpointer) {
+        mnist_checkpointer_stats(checkpointer, &checkpoint_stats);
+        printf("Checkpoints Written: %lu to %s (%lu skipped while writing, %lu failed)\n", (unsigned long) checkpoint_stats.written, checkpoint_path,
+            (unsigned long) checkpoint_stats.skipped, (unsigned long) checkpoint_stats.failed);
+        mnist_checkpointer_free(checkpointer);
+    }
 
     // Retrieve data from all devices
     for (i = 0; i < nworkers; i++) {
         retrieve_data_from_device(i, train_dataset);
     }
 
+    neural_network_buffers_release(&buffers);
+
     printf("Cleaning...\n");
     // Cleanup
+    mnist_optimizer_free(optimizer);
+    mnist_arena_free(arena);
     printf("Done.\n");
     return 0;
 }
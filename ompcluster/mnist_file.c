@@ -1,223 +0,0 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-
-#include "../include/mnist_file_ompc.h"
-
-/**
- * Convert from the big endian format in the dataset if we're on a little endian
- * machine.
- */
-uint32_t map_uint32(uint32_t in)
-{
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return (
-        ((in & 0xFF000000) >> 24) |
-        ((in & 0x00FF0000) >>  8) |
-        ((in & 0x0000FF00) <<  8) |
-        ((in & 0x000000FF) << 24)
-    );
-#else
-    return in;
-#endif
-}
-
-/**
- * Read labels from file.
- * 
- * File format: http://yann.lecun.com/exdb/mnist/
- */
-uint8_t * get_labels(const char * path, uint32_t * number_of_labels)
-{
-    FILE * stream;
-    mnist_label_file_header_t header;
-    uint8_t * labels;
-
-    stream = fopen(path, "rb");
-
-    if (NULL == stream) {
-        fprintf(stderr, "Could not open file: %s\n", path);
-        return NULL;
-    }
-
-    if (1 != fread(&header, sizeof(mnist_label_file_header_t), 1, stream)) {
-        fprintf(stderr, "Could not read label file header from: %s\n", path);
-        fclose(stream);
-        return NULL;
-    }
-
-    header.magic_number = map_uint32(header.magic_number);
-    header.number_of_labels = map_uint32(header.number_of_labels);
-
-    if (MNIST_LABEL_MAGIC != header.magic_number) {
-        fprintf(stderr, "Invalid header read from label file: %s (%08X not %08X)\n", path, header.magic_number, MNIST_LABEL_MAGIC);
-        fclose(stream);
-        return NULL;
-    }
-
-    *number_of_labels = header.number_of_labels;
-
-    labels = malloc(*number_of_labels * sizeof(uint8_t));
-
-    if (labels == NULL) {
-        fprintf(stderr, "Could not allocated memory for %d labels\n", *number_of_labels);
-        fclose(stream);
-        return NULL;
-    }
-
-    if (*number_of_labels != fread(labels, 1, *number_of_labels, stream)) {
-        fprintf(stderr, "Could not read %d labels from: %s\n", *number_of_labels, path);
-        free(labels);
-        fclose(stream);
-        return NULL;
-    }
-
-    fclose(stream);
-
-    return labels;
-}
-
-/**
- * Read images from file.
- * 
- * File format: http://yann.lecun.com/exdb/mnist/
- */
-mnist_image_t * get_images(const char * path, uint32_t * number_of_images)
-{
-    FILE * stream;
-    mnist_image_file_header_t header;
-    mnist_image_t * images;
-
-    stream = fopen(path, "rb");
-
-    if (NULL == stream) {
-        fprintf(stderr, "Could not open file: %s\n", path);
-        return NULL;
-    }
-
-    if (1 != fread(&header, sizeof(mnist_image_file_header_t), 1, stream)) {
-        fprintf(stderr, "Could not read image file header from: %s\n", path);
-        fclose(stream);
-        return NULL;
-    }
-
-    header.magic_number = map_uint32(header.magic_number);
-    header.number_of_images = map_uint32(header.number_of_images);
-    header.number_of_rows = map_uint32(header.number_of_rows);
-    header.number_of_columns = map_uint32(header.number_of_columns);
-
-    if (MNIST_IMAGE_MAGIC != header.magic_number) {
-        fprintf(stderr, "Invalid header read from image file: %s (%08X not %08X)\n", path, header.magic_number, MNIST_IMAGE_MAGIC);
-        fclose(stream);
-        return NULL;
-    }
-
-    if (MNIST_IMAGE_WIDTH != header.number_of_rows) {
-        fprintf(stderr, "Invalid number of image rows in image file %s (%d not %d)\n", path, header.number_of_rows, MNIST_IMAGE_WIDTH);
-    }
-
-    if (MNIST_IMAGE_HEIGHT != header.number_of_columns) {
-        fprintf(stderr, "Invalid number of image columns in image file %s (%d not %d)\n", path, header.number_of_columns, MNIST_IMAGE_HEIGHT);
-    }
-
-    *number_of_images = header.number_of_images;
-    images = malloc(*number_of_images * sizeof(mnist_image_t));
-
-    if (images == NULL) {
-        fprintf(stderr, "Could not allocated memory for %d images\n", *number_of_images);
-        fclose(stream);
-        return NULL;
-    }
-
-    if (*number_of_images != fread(images, sizeof(mnist_image_t), *number_of_images, stream)) {
-        fprintf(stderr, "Could not read %d images from: %s\n", *number_of_images, path);
-        free(images);
-        fclose(stream);
-        return NULL;
-    }
-
-    fclose(stream);
-
-    return images;
-}
-
-mnist_dataset_t * mnist_get_dataset(const char * image_path, const char * label_path, int size)
-{
-    mnist_dataset_t * dataset;
-    mnist_image_t * temp;
-    uint32_t number_of_images, number_of_labels;
-
-    dataset = calloc(1, sizeof(mnist_dataset_t));
-
-    if (NULL == dataset) {
-        return NULL;
-    }
-
-    temp =  get_images(image_path, &number_of_images);
-    dataset -> images = (uint8_t*)malloc(MNIST_DATASET_SIZE*MNIST_IMAGE_SIZE*sizeof(uint8_t));
-    for (int i = 0; i < MNIST_DATASET_SIZE; i++)
-        for (int j = 0; j < MNIST_IMAGE_SIZE; j++)
-            dataset -> images[i*MNIST_IMAGE_SIZE+j]= temp[i].pixels[j];
-
-    if (NULL == dataset->images) {
-        mnist_free_dataset(dataset);
-        return NULL;
-    }
-
-    dataset->labels = get_labels(label_path, &number_of_labels);
-
-    if (NULL == dataset->labels) {
-        mnist_free_dataset(dataset);
-        return NULL;
-    }
-
-    if (number_of_images != number_of_labels) {
-        fprintf(stderr, "Number of images does not match number of labels (%d != %d)\n", number_of_images, number_of_labels);
-        mnist_free_dataset(dataset);
-        return NULL;
-    }
-
-    if (size){
-        dataset->size = size;
-    }
-    else{
-        dataset->size = number_of_images;
-    }
-
-    return dataset;
-}
-
-/**
- * Free all the memory allocated in a dataset. This should not be used on a
- * batched dataset as the memory is allocated to the parent.
- */
-void mnist_free_dataset(mnist_dataset_t * dataset)
-{
-    free(dataset->images);
-    free(dataset->labels);
-    free(dataset);
-}
-
-/**
- * Fills the batch dataset with a subset of the parent dataset.
- */
-int mnist_batch(mnist_dataset_t * dataset, mnist_dataset_t * batch, int size, int number)
-{
-    int start_offset;
-
-    start_offset = size * number;
-
-    if (start_offset >= dataset->size) {
-        return 0;
-    }
-
-    batch->images = &dataset->images[start_offset*MNIST_IMAGE_SIZE];
-    batch->labels = &dataset->labels[start_offset];
-    batch->size = size;
-
-    if (start_offset + batch->size > dataset->size) {
-        batch->size = dataset->size - start_offset;
-    }
-
-    return 1;
-}
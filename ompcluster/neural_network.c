@@ -4,7 +4,12 @@
 #include <omp.h>
 #include <stdio.h>
 
-#include "../include/mnist_file_ompc.h"
+#include "../include/mnist_file.h"
+
+// The multi-layer perceptron kernels are compiled for the devices too
+#pragma omp declare target
+#include "../include/mnist_mlp.h"
+#pragma omp end declare target
 #include "../include/neural_network_ompc.h"
 
  #define min(a,b) \
@@ -115,21 +120,110 @@ float neural_network_gradient_update(uint8_t * image, float * b, float W[MNIST_L
 }
 
 /**
- * Run one step of gradient descent and update the neural network.
+ * Carve the buffers of the training steps of either network (mlp is NULL for
+ * the softmax network) from arena, and map them on every device until
+ * neural_network_buffers_release. Returns 0 on success.
+ */
+int neural_network_buffers_create(neural_network_buffers_t * buffers, const mnist_mlp_t * mlp, int devices, mnist_arena_t * arena)
+{
+    float * gradients, * losses, * workspaces;
+    size_t nparameters, workspace_size;
+    int i;
+
+    buffers->devices = devices;
+    buffers->parameters = NULL != mlp ? mlp->parameters : sizeof(neural_network_gradient_t) / sizeof(float);
+    buffers->workspace_size = NULL != mlp ? mnist_mlp_workspace_size(mlp) : 0;
+    buffers->gradients = (float*)mnist_arena_alloc(arena, (size_t) devices * buffers->parameters * sizeof(float));
+    buffers->losses = (float*)mnist_arena_alloc(arena, devices * sizeof(float));
+    buffers->workspaces = NULL != mlp ? (float*)mnist_arena_alloc(arena, (size_t) devices * buffers->workspace_size * sizeof(float)) : NULL;
+
+    if (NULL == buffers->gradients || NULL == buffers->losses || (NULL != mlp && NULL == buffers->workspaces)) {
+        fprintf(stderr, "Could not allocate memory for %d gradients of %lu parameters\n", devices, (unsigned long) buffers->parameters);
+        return -1;
+    }
+
+    gradients = buffers->gradients;
+    losses = buffers->losses;
+    workspaces = buffers->workspaces;
+    nparameters = buffers->parameters;
+    workspace_size = buffers->workspace_size;
+
+    for (i = 0; i < devices; i++) {
+        #pragma omp target enter data map(alloc: gradients[i*nparameters:nparameters], losses[i:1]) device(i)
+
+        if (NULL != workspaces) {
+            #pragma omp target enter data map(alloc: workspaces[i*workspace_size:workspace_size]) device(i)
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Unmap the buffers of the training steps from the devices. Their memory
+ * belongs to the arena.
+ */
+void neural_network_buffers_release(neural_network_buffers_t * buffers)
+{
+    float * gradients, * losses, * workspaces;
+    size_t nparameters, workspace_size;
+    int i;
+
+    gradients = buffers->gradients;
+    losses = buffers->losses;
+    workspaces = buffers->workspaces;
+    nparameters = buffers->parameters;
+    workspace_size = buffers->workspace_size;
+
+    for (i = 0; i < buffers->devices; i++) {
+        #pragma omp target exit data map(release: gradients[i*nparameters:nparameters], losses[i:1]) device(i)
+
+        if (NULL != workspaces) {
+            #pragma omp target exit data map(release: workspaces[i*workspace_size:workspace_size]) device(i)
+        }
+    }
+}
+
+/**
+ * Sum the gradients and losses of all devices into the first ones, and
+ * return the total loss.
+ */
+static float sum_device_gradients(neural_network_buffers_t * buffers)
+{
+    float total_loss = 0.0f;
+    size_t j;
+    int i;
+
+    for (i = 0; i < buffers->devices; i++) {
+        total_loss += buffers->losses[i];
+
+        for (j = 0; i > 0 && j < buffers->parameters; j++) {
+            buffers->gradients[j] += buffers->gradients[i * buffers->parameters + j];
+        }
+    }
+
+    return total_loss;
+}
+
+/**
+ * Run one step of training and update the neural network with the optimizer.
+ * Every device accumulates its chunk of the training set into its own
+ * gradient, laid out like the network, biases first, so the optimizer
+ * updates both as one array.
  */
-float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t * network, float learning_rate)
+float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t * network, mnist_optimizer_t * optimizer, neural_network_buffers_t * buffers)
 {
-    neural_network_gradient_t gradient;
-    float *total_loss_array, total_loss, b[MNIST_LABELS], W[MNIST_LABELS][MNIST_IMAGE_SIZE];
-    int nworkers = omp_get_num_devices();
+    float b[MNIST_LABELS], W[MNIST_LABELS][MNIST_IMAGE_SIZE];
+    int nworkers = buffers->devices;
     int nimages = dataset->size;
     int nchunks = nimages / nworkers;
-    int i, j, h;
-    float * b_grad = (float*)calloc(MNIST_LABELS, sizeof(float));
-    float * W_grad = (float*)calloc(MNIST_LABELS*MNIST_IMAGE_SIZE, sizeof(float));
+    size_t nparameters = buffers->parameters;
+    float * gradients = buffers->gradients, * losses = buffers->losses;
+    float total_loss;
+    int i, j;
 
-    // Zero initialise gradient for weights and bias vector
-    memset(&gradient, 0, sizeof(neural_network_gradient_t));
+    memset(gradients, 0, nworkers * nparameters * sizeof(float));
+    memset(losses, 0, nworkers * sizeof(float));
 
     for (i = 0; i < MNIST_LABELS; i++){
         b[i] = network->b[i];
@@ -137,33 +231,89 @@ float neural_network_training_step(mnist_dataset_t * dataset, neural_network_t *
             W[i][j] = network->W[i][j];
     }
 
-    // Calculate the gradient and the loss by looping through the training set
-    for (i = 0, total_loss=0; i < nworkers; i++) {
+    // Calculate the gradient and the loss by looping through the training
+    // set. The gradients stay mapped, so only their contents travel
+    for (i = 0; i < nworkers; i++) {
         #pragma omp target \
-            depend(in: dataset->labels[i*nchunks:nchunks], dataset->images[i*nchunks*MNIST_IMAGE_SIZE:nchunks*MNIST_IMAGE_SIZE]) \
+            depend(in: dataset->labels[i*nchunks:nchunks], dataset->images[i*nchunks:nchunks]) \
             map(to: b[0:MNIST_LABELS], W[0:MNIST_LABELS][0:MNIST_IMAGE_SIZE]) \
-            map(tofrom: b_grad[0:MNIST_LABELS], W_grad[0:MNIST_LABELS*MNIST_IMAGE_SIZE]) \
-            map(tofrom: total_loss) \
+            map(always, tofrom: gradients[i*nparameters:nparameters], losses[i:1]) \
             device(i) nowait
         {
             #pragma omp teams distribute parallel for
             for (j = i*nchunks; j < min((i+1)*nchunks, nimages); j++) {
-                total_loss += neural_network_gradient_update(dataset->images + j * MNIST_IMAGE_SIZE, b, W, b_grad, W_grad, dataset->labels[j], i);
+                losses[i] += neural_network_gradient_update(dataset->images[j].pixels, b, W, gradients + i * nparameters,
+                    gradients + i * nparameters + MNIST_LABELS, dataset->labels[j], i);
             }
         }
     }
 
     #pragma omp taskwait
 
-    // Apply gradient descent to the network
-    for (i = 0; i < MNIST_LABELS; i++) {
-        network->b[i] -= learning_rate * b_grad[i] / ((float) nimages);
-        for (j = 0; j < MNIST_IMAGE_SIZE; j++) {
-            network->W[i][j] -= learning_rate * W_grad[i*MNIST_IMAGE_SIZE+j] / ((float) nimages);
+    total_loss = sum_device_gradients(buffers);
+
+    mnist_optimizer_step(optimizer, (float *) network, gradients, nimages, 1);
+
+    return total_loss;
+}
+
+/**
+ * Run one step of training on a multi-layer perceptron. Every device
+ * accumulates its chunk of the training set into its own slice of the
+ * gradients using all its threads; the slices are summed on the host, which
+ * updates the parameters with the optimizer. With a bf16 working copy of the parameters, the
+ * devices receive and compute with it instead, and the host rounds the
+ * updated parameters into it.
+ */
+float neural_network_mlp_training_step(mnist_dataset_t * dataset, const mnist_mlp_t * mlp, float * parameters, uint16_t * weights, mnist_optimizer_t * optimizer, neural_network_buffers_t * buffers)
+{
+    int nworkers = buffers->devices;
+    int nimages = dataset->size;
+    int nchunks = nimages / nworkers;
+    size_t nparameters = mlp->parameters, workspace_size = buffers->workspace_size;
+    float * gradients = buffers->gradients, * losses = buffers->losses, * workspaces = buffers->workspaces;
+    float total_loss;
+    int i;
+
+    memset(gradients, 0, nworkers * nparameters * sizeof(float));
+
+    for (i = 0; i < nworkers; i++) {
+        if (NULL != weights) {
+            #pragma omp target \
+                depend(in: dataset->labels[i*nchunks:nchunks], dataset->images[i*nchunks:nchunks]) \
+                map(to: mlp[0:1], weights[0:nparameters]) \
+                map(always, tofrom: gradients[i*nparameters:nparameters]) \
+                map(always, from: losses[i:1]) \
+                map(alloc: workspaces[i*workspace_size:workspace_size]) \
+                device(i) nowait
+            {
+                losses[i] = mnist_mlp_accumulate_bf16_parallel(mlp, weights, (uint8_t *) (dataset->images + i * nchunks),
+                    dataset->labels + i * nchunks, nchunks, gradients + i * nparameters, workspaces + i * workspace_size);
+            }
+        } else {
+            #pragma omp target \
+                depend(in: dataset->labels[i*nchunks:nchunks], dataset->images[i*nchunks:nchunks]) \
+                map(to: mlp[0:1], parameters[0:nparameters]) \
+                map(always, tofrom: gradients[i*nparameters:nparameters]) \
+                map(always, from: losses[i:1]) \
+                map(alloc: workspaces[i*workspace_size:workspace_size]) \
+                device(i) nowait
+            {
+                losses[i] = mnist_mlp_accumulate_parallel(mlp, parameters, (uint8_t *) (dataset->images + i * nchunks),
+                    dataset->labels + i * nchunks, nchunks, gradients + i * nparameters, workspaces + i * workspace_size);
+            }
         }
     }
 
-    free(W_grad);
-    free(b_grad);
+    #pragma omp taskwait
+
+    total_loss = sum_device_gradients(buffers);
+
+    mnist_optimizer_step(optimizer, parameters, gradients, nimages, 1);
+
+    if (NULL != weights) {
+        mnist_mlp_round_bf16(parameters, weights, nparameters, 1);
+    }
+
     return total_loss;
-}
\ No newline at end of file
+}
@@ -0,0 +1,947 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "../include/mnist_file.h"
+#include "../include/neural_network.h"
+#include "../include/mnist_mlp.h"
+#include "../include/mnist_optimizer.h"
+#include "../include/mnist_steal.h"
+#include "../include/mnist_model.h"
+
+/**
+ * Microbenchmarks of the training kernels in isolation, on synthetic images
+ * held in memory, for the image size the binary is built for (mnist-bench-1x,
+ * -2x and -4x, like the trainers). Every kernel is run until one sample takes
+ * at least --min-time, then sampled repeatedly after some warmup samples; the
+ * median and interquartile range of the time per repetition are reported
+ * with the images and (estimated) bytes per second, as CSV or JSON lines.
+ *
+ * With --roofline the machine's sustainable memory bandwidth and peak fused
+ * multiply-add throughput are probed first, and every kernel is placed on the
+ * roofline they span from its counted floating point operations and modelled
+ * bytes: a table says how far each is from the ceiling that bounds it, and a
+ * CSV file holds the same for plotting.
+ */
+
+#define BENCH_IMAGES 256
+#define BENCH_SAMPLES 15
+#define BENCH_WARMUP 3
+#define BENCH_MIN_TIME 0.02
+#define BENCH_MAX_SAMPLES 1000
+#define BENCH_HIDDEN "128"
+#define BENCH_LEARNING_RATE 1e-6f
+#define BENCH_PROBE_MB 256
+#define BENCH_PROBE_REPEATS 10
+#define BENCH_ROOFLINE_OUTPUT "roofline.csv"
+
+// Optimizers benchmarked on the multi-layer perceptron's parameters
+#define BENCH_OPTIMIZERS 4
+
+typedef struct bench_t_ {
+    uint32_t count;                  // Images per repetition
+    mnist_dataset_t dataset;
+    float * logits;                  // MNIST_LABELS per image, for the softmax
+    float * scratch;                 // MNIST_LABELS floats per thread
+    mnist_arena_t * arena;
+    mnist_backend_t * backend;       // Serial, as the trainers' default
+    mnist_model_t * model;           // The softmax network, as the trainers update it
+    neural_network_t * network;      // Of the model
+    neural_network_gradient_t * gradient;
+    mnist_steal_t * steal;           // Adaptive work-stealing scheduler
+    mnist_mlp_t mlp;
+    float * parameters;
+    float * mlp_gradient;
+    float * workspace;
+    float * probabilities;
+    uint16_t * weights;
+    float * received;                // Gradient of another process, for the reductions
+    uint16_t * received_bf16;
+    mnist_optimizer_t * optimizers[BENCH_OPTIMIZERS];
+    volatile float sink;             // Keeps results alive
+} bench_t;
+
+typedef void (* bench_run_t)(bench_t * bench, const void * argument, uint64_t repetitions);
+
+typedef struct bench_case_t_ {
+    const char * kernel;
+    const char * variant;
+    bench_run_t run;
+    const void * argument;
+    double images;                   // Per repetition, zero for the updates
+    double bytes;                    // Per repetition, from a model of the traffic
+    double flops;                    // Per repetition, multiply-adds counting two
+    int parallel;                    // Runs on all OpenMP threads
+} bench_case_t;
+
+typedef struct bench_config_t_ {
+    int samples;
+    int warmup;
+    double min_time;
+    int json;
+    int header;
+    const char * filter;
+    int roofline;
+    const char * output;             // CSV of the roofline
+    size_t probe_bytes;              // Of the bandwidth probe's three arrays
+} bench_config_t;
+
+typedef struct bench_result_t_ {
+    uint64_t repetitions;            // Per sample
+    double median;                   // Seconds per repetition
+    double q1;
+    double q3;
+} bench_result_t;
+
+static uint64_t xorshift(uint64_t * state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+static void * bench_alloc(size_t bytes)
+{
+    void * memory = NULL;
+
+    if (0 != posix_memalign(&memory, 64, bytes > 0 ? bytes : 1)) {
+        fprintf(stderr, "Could not allocate %lu bytes\n", (unsigned long) bytes);
+        exit(EXIT_FAILURE);
+    }
+
+    return memory;
+}
+
+/**
+ * Random images, labels, logits and networks of the size the kernels run on.
+ */
+static void bench_init(bench_t * bench, uint32_t count, const char * hidden)
+{
+    const mnist_optimizer_type_t types[BENCH_OPTIMIZERS] = { MNIST_OPTIMIZER_SGD, MNIST_OPTIMIZER_MOMENTUM, MNIST_OPTIMIZER_NESTEROV, MNIST_OPTIMIZER_ADAM };
+    mnist_optimizer_config_t config;
+    char * no_arguments[] = { NULL };
+    char ** argv = no_arguments;
+    int argc = 0;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t i;
+    int j;
+
+    memset(bench, 0, sizeof(bench_t));
+    bench->count = count;
+    bench->dataset.size = count;
+    bench->dataset.images = bench_alloc((size_t) count * sizeof(mnist_image_t));
+    bench->dataset.labels = bench_alloc(count);
+    bench->logits = bench_alloc((size_t) count * MNIST_LABELS * sizeof(float));
+    bench->scratch = bench_alloc((size_t) omp_get_max_threads() * MNIST_LABELS * sizeof(float));
+
+    for (i = 0; i < (size_t) count * MNIST_IMAGE_SIZE; i++) {
+        ((uint8_t *) bench->dataset.images)[i] = xorshift(&state) & 0xff;
+    }
+
+    for (i = 0; i < count; i++) {
+        bench->dataset.labels[i] = xorshift(&state) % MNIST_LABELS;
+    }
+
+    for (i = 0; i < (size_t) count * MNIST_LABELS; i++) {
+        bench->logits[i] = (float) (xorshift(&state) % 2000) / 100.0f - 10.0f;
+    }
+
+    bench->steal = mnist_steal_create(0);
+    bench->arena = mnist_arena_create(0);
+    bench->backend = mnist_backend_create("serial", &argc, &argv);
+
+    if (NULL == bench->steal || NULL == bench->arena || NULL == bench->backend) {
+        exit(EXIT_FAILURE);
+    }
+
+    mnist_optimizer_config_init(&config);
+    config.learning_rate = BENCH_LEARNING_RATE;
+    bench->model = mnist_model_create(NULL, 0, &config, bench->backend, bench->arena);
+
+    if (NULL == bench->model) {
+        exit(EXIT_FAILURE);
+    }
+
+    bench->network = &bench->model->network;
+    bench->gradient = &bench->model->gradient;
+
+    srand(0);
+    mnist_model_random_weights(bench->model, 0);
+    mnist_model_zero_gradient(bench->model);
+
+    if (0 != mnist_mlp_init(&bench->mlp, MNIST_IMAGE_SIZE, hidden, MNIST_LABELS)) {
+        exit(EXIT_FAILURE);
+    }
+
+    bench->parameters = bench_alloc(bench->mlp.parameters * sizeof(float));
+    bench->mlp_gradient = bench_alloc(bench->mlp.parameters * sizeof(float));
+    bench->workspace = bench_alloc(mnist_mlp_workspace_size(&bench->mlp) * sizeof(float));
+    bench->probabilities = bench_alloc((size_t) count * MNIST_LABELS * sizeof(float));
+    bench->weights = bench_alloc(bench->mlp.parameters * sizeof(uint16_t));
+    bench->received = bench_alloc(bench->mlp.parameters * sizeof(float));
+    bench->received_bf16 = bench_alloc(bench->mlp.parameters * sizeof(uint16_t));
+
+    mnist_mlp_random_parameters(&bench->mlp, bench->parameters, 0, 1);
+    mnist_mlp_round_bf16(bench->parameters, bench->weights, bench->mlp.parameters, 1);
+    memset(bench->mlp_gradient, 0, bench->mlp.parameters * sizeof(float));
+
+    // Adding zeros leaves the gradient and weights as they are, however often
+    memset(bench->received, 0, bench->mlp.parameters * sizeof(float));
+    memset(bench->received_bf16, 0, bench->mlp.parameters * sizeof(uint16_t));
+
+    for (j = 0; j < BENCH_OPTIMIZERS; j++) {
+        mnist_optimizer_config_init(&config);
+        config.type = types[j];
+        config.learning_rate = BENCH_LEARNING_RATE;
+        bench->optimizers[j] = mnist_optimizer_create(&config, bench->mlp.parameters, NULL);
+
+        if (NULL == bench->optimizers[j]) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void bench_free(bench_t * bench)
+{
+    int j;
+
+    free(bench->dataset.images);
+    free(bench->dataset.labels);
+    free(bench->logits);
+    free(bench->scratch);
+    mnist_steal_free(bench->steal);
+    free(bench->parameters);
+    free(bench->mlp_gradient);
+    free(bench->workspace);
+    free(bench->probabilities);
+    free(bench->weights);
+    free(bench->received);
+    free(bench->received_bf16);
+
+    for (j = 0; j < BENCH_OPTIMIZERS; j++) {
+        mnist_optimizer_free(bench->optimizers[j]);
+    }
+
+    mnist_model_free(bench->model);
+    mnist_arena_free(bench->arena);
+    mnist_backend_free(bench->backend);
+}
+
+/**
+ * The kernels of the softmax network, one image at a time.
+ */
+static void run_hypothesis(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    float * activations = bench->scratch;
+    float sum = 0.0f;
+    uint64_t r;
+    uint32_t i;
+
+    (void) argument;
+
+    for (r = 0; r < repetitions; r++) {
+        for (i = 0; i < bench->count; i++) {
+            neural_network_hypothesis(&bench->dataset.images[i], bench->network, activations);
+            sum += activations[bench->dataset.labels[i]];
+        }
+    }
+
+    bench->sink = sum;
+}
+
+static void run_gradient_update(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    float loss = 0.0f;
+    uint64_t r;
+    uint32_t i;
+
+    (void) argument;
+
+    for (r = 0; r < repetitions; r++) {
+        for (i = 0; i < bench->count; i++) {
+            loss += neural_network_gradient_update(&bench->dataset.images[i], bench->network, bench->gradient, bench->dataset.labels[i]);
+        }
+    }
+
+    bench->sink = loss;
+}
+
+/**
+ * The gradient of the softmax network on all OpenMP threads; argument selects
+ * static slices (0) or the work-stealing scheduler (1).
+ */
+static const int schedules[2] = { 0, 1 };
+
+static void run_accumulate_parallel(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    mnist_steal_t * steal = *(const int *) argument ? bench->steal : NULL;
+    float loss = 0.0f;
+    uint64_t r;
+
+    for (r = 0; r < repetitions; r++) {
+        loss += neural_network_accumulate_parallel(&bench->dataset, bench->network, bench->gradient, steal);
+    }
+
+    bench->sink = loss;
+}
+
+static void run_softmax(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    float * activations = bench->scratch;
+    float sum = 0.0f;
+    uint64_t r;
+    uint32_t i;
+
+    (void) argument;
+
+    for (r = 0; r < repetitions; r++) {
+        for (i = 0; i < bench->count; i++) {
+            memcpy(activations, bench->logits + (size_t) i * MNIST_LABELS, MNIST_LABELS * sizeof(float));
+            neural_network_softmax(activations, MNIST_LABELS);
+            sum += activations[0];
+        }
+    }
+
+    bench->sink = sum;
+}
+
+/**
+ * The update and whole training step of the softmax network as the trainers
+ * run them on the serial backend: the optimizer's update of the model's
+ * parameters, and the model's step of zeroing, accumulating and updating.
+ */
+static void run_model_update(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    mnist_model_t * model = bench->model;
+    uint64_t r;
+
+    (void) argument;
+
+    for (r = 0; r < repetitions; r++) {
+        mnist_optimizer_step(model->optimizer, mnist_model_parameters(model), mnist_model_gradient(model), bench->count, model->backend->parallel);
+    }
+
+    bench->sink = bench->network->b[0];
+}
+
+static void run_model_training_step(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    float loss = 0.0f;
+    uint64_t r;
+
+    (void) argument;
+
+    for (r = 0; r < repetitions; r++) {
+        loss += mnist_model_training_step(bench->model, &bench->dataset);
+    }
+
+    bench->sink = loss;
+}
+
+/**
+ * The batched kernels of the multi-layer perceptron; argument selects the
+ * variant: bit 0 for bf16, bit 1 for all OpenMP threads.
+ */
+#define VARIANT_BF16 1
+#define VARIANT_PARALLEL 2
+
+static const int variants[4] = { 0, VARIANT_BF16, VARIANT_PARALLEL, VARIANT_BF16 | VARIANT_PARALLEL };
+static const char * variant_names[4] = { "mlp-fp32", "mlp-bf16", "mlp-fp32-parallel", "mlp-bf16-parallel" };
+
+static float mlp_accumulate(bench_t * bench, int variant)
+{
+    const uint8_t * images = (const uint8_t *) bench->dataset.images;
+
+    switch (variant) {
+    case VARIANT_BF16:
+        return mnist_mlp_accumulate_bf16(&bench->mlp, bench->weights, images, bench->dataset.labels, bench->count, bench->mlp_gradient, bench->workspace);
+    case VARIANT_PARALLEL:
+        return mnist_mlp_accumulate_parallel(&bench->mlp, bench->parameters, images, bench->dataset.labels, bench->count, bench->mlp_gradient, bench->workspace);
+    case VARIANT_BF16 | VARIANT_PARALLEL:
+        return mnist_mlp_accumulate_bf16_parallel(&bench->mlp, bench->weights, images, bench->dataset.labels, bench->count, bench->mlp_gradient, bench->workspace);
+    default:
+        return mnist_mlp_accumulate(&bench->mlp, bench->parameters, images, bench->dataset.labels, bench->count, bench->mlp_gradient, bench->workspace);
+    }
+}
+
+static void run_mlp_probabilities(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    const int variant = *(const int *) argument;
+    uint64_t r;
+
+    for (r = 0; r < repetitions; r++) {
+        if (variant & VARIANT_BF16) {
+            mnist_mlp_probabilities_bf16(&bench->mlp, bench->weights, (const uint8_t *) bench->dataset.images, bench->count, bench->probabilities, bench->workspace);
+        } else {
+            mnist_mlp_probabilities(&bench->mlp, bench->parameters, (const uint8_t *) bench->dataset.images, bench->count, bench->probabilities, bench->workspace);
+        }
+    }
+
+    bench->sink = bench->probabilities[0];
+}
+
+static void run_mlp_accumulate(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    const int variant = *(const int *) argument;
+    float loss = 0.0f;
+    uint64_t r;
+
+    for (r = 0; r < repetitions; r++) {
+        loss += mlp_accumulate(bench, variant);
+    }
+
+    bench->sink = loss;
+}
+
+static void run_mlp_training_step(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    const int variant = *(const int *) argument;
+    float loss = 0.0f;
+    uint64_t r;
+
+    for (r = 0; r < repetitions; r++) {
+        #pragma omp parallel if (variant & VARIANT_PARALLEL)
+        mnist_mlp_zero_gradient(&bench->mlp, bench->mlp_gradient);
+
+        loss += mlp_accumulate(bench, variant);
+        mnist_optimizer_step(bench->optimizers[0], bench->parameters, bench->mlp_gradient, bench->count, variant & VARIANT_PARALLEL);
+
+        if (variant & VARIANT_BF16) {
+            mnist_mlp_round_bf16(bench->parameters, bench->weights, bench->mlp.parameters, variant & VARIANT_PARALLEL);
+        }
+    }
+
+    bench->sink = loss;
+}
+
+static void run_optimizer_step(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    mnist_optimizer_t * optimizer = bench->optimizers[*(const int *) argument];
+    uint64_t r;
+
+    for (r = 0; r < repetitions; r++) {
+        mnist_optimizer_step(optimizer, bench->parameters, bench->mlp_gradient, bench->count, 1);
+    }
+
+    bench->sink = bench->parameters[0];
+}
+
+/**
+ * The combining step of the gradient allreduce: one received gradient added
+ * into the local one, as MPI's reduction operation does for every message, in
+ * fp32 or (argument set) in bf16. The messages themselves are measured by
+ * the communication benchmarks, not here.
+ */
+static void run_reduce(bench_t * bench, const void * argument, uint64_t repetitions)
+{
+    const size_t count = bench->mlp.parameters;
+    uint64_t r;
+    size_t i;
+
+    for (r = 0; r < repetitions; r++) {
+        if (*(const int *) argument) {
+            mnist_mlp_add_bf16(bench->received_bf16, bench->weights, count);
+        } else {
+            for (i = 0; i < count; i++) {
+                bench->mlp_gradient[i] += bench->received[i];
+            }
+        }
+    }
+
+    bench->sink = bench->mlp_gradient[0];
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Quantile q of n sorted values, interpolated between the nearest two.
+ */
+static double quantile(const double * sorted, int n, double q)
+{
+    const double position = q * (n - 1);
+    const int below = (int) position;
+
+    return below + 1 < n ? sorted[below] + (position - below) * (sorted[below + 1] - sorted[below]) : sorted[n - 1];
+}
+
+/**
+ * Time a benchmark: grow the repetitions per sample until one sample takes
+ * min_time, run the warmup samples, then the measured ones.
+ */
+static void measure(bench_t * bench, const bench_case_t * benchmark, const bench_config_t * config, bench_result_t * result)
+{
+    double times[BENCH_MAX_SAMPLES], start, elapsed;
+    uint64_t repetitions = 1;
+    int i;
+
+    for (;;) {
+        start = omp_get_wtime();
+        benchmark->run(bench, benchmark->argument, repetitions);
+        elapsed = omp_get_wtime() - start;
+
+        if (elapsed >= config->min_time || repetitions >= (1ULL << 40)) {
+            break;
+        }
+
+        // Aim a little past the target, at most 16 times more at once
+        repetitions = elapsed > 0.0 && config->min_time / elapsed < 8.0 ? (uint64_t) ceil(repetitions * 1.25 * config->min_time / elapsed) : repetitions * 16;
+    }
+
+    for (i = 0; i < config->warmup; i++) {
+        benchmark->run(bench, benchmark->argument, repetitions);
+    }
+
+    for (i = 0; i < config->samples; i++) {
+        start = omp_get_wtime();
+        benchmark->run(bench, benchmark->argument, repetitions);
+        times[i] = (omp_get_wtime() - start) / repetitions;
+    }
+
+    qsort(times, config->samples, sizeof(double), compare_doubles);
+
+    result->repetitions = repetitions;
+    result->median = quantile(times, config->samples, 0.5);
+    result->q1 = quantile(times, config->samples, 0.25);
+    result->q3 = quantile(times, config->samples, 0.75);
+}
+
+static void report(const bench_case_t * benchmark, const bench_config_t * config, const bench_result_t * result, uint32_t count)
+{
+    const double images_per_second = result->median > 0.0 ? benchmark->images / result->median : 0.0;
+    const double gb_per_second = result->median > 0.0 ? benchmark->bytes / result->median / 1e9 : 0.0;
+
+    if (config->json) {
+        printf("{\"kernel\": \"%s\", \"variant\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, \"batch\": %u, \"repetitions\": %lu, \"samples\": %d, "
+            "\"median_us\": %.4f, \"iqr_us\": %.4f, \"images_per_s\": %.1f, \"gb_per_s\": %.3f}\n",
+            benchmark->kernel, benchmark->variant, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT, omp_get_max_threads(), count, (unsigned long) result->repetitions,
+            config->samples, result->median * 1e6, (result->q3 - result->q1) * 1e6, images_per_second, gb_per_second);
+    } else {
+        printf("%s,%s,%d,%d,%d,%u,%lu,%d,%.4f,%.4f,%.1f,%.3f\n", benchmark->kernel, benchmark->variant, MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT,
+            omp_get_max_threads(), count, (unsigned long) result->repetitions, config->samples, result->median * 1e6, (result->q3 - result->q1) * 1e6,
+            images_per_second, gb_per_second);
+    }
+
+    fflush(stdout);
+}
+
+/**
+ * Probes of the roofline's two ceilings. The trainers are built without
+ * optimization, but the ceilings are the hardware's, so the probes are
+ * compiled as a tuned benchmark would be.
+ */
+#pragma GCC push_options
+#pragma GCC optimize("O3")
+
+typedef struct bench_machine_t_ {
+    const char * isa;                // Widest fused multiply-add the probe used
+    double peak[2];                  // FLOP/s on one thread and on all threads
+    double bandwidth[2];             // Bytes/s of the triad, likewise
+} bench_machine_t;
+
+typedef float probe_v4_t __attribute__((vector_size(16)));
+typedef float probe_v8_t __attribute__((vector_size(32)));
+typedef float probe_v16_t __attribute__((vector_size(64)));
+
+// Independent chains, enough to cover the latency of two FMA units
+#define PROBE_CHAINS 10
+
+/**
+ * A probe multiply-adding PROBE_CHAINS vectors in registers, iterations
+ * times; returns a value that depends on all of them.
+ */
+#define PROBE_FMA(name, target, vector_t) \
+    static target __attribute__((noinline)) float name(uint64_t iterations) \
+    { \
+        const vector_t zero = { 0 }; \
+        const vector_t x = zero + 0.999999f, y = zero + 1e-7f; \
+        vector_t chains[PROBE_CHAINS], total = zero; \
+        uint64_t i; \
+        int k; \
+        \
+        for (k = 0; k < PROBE_CHAINS; k++) { \
+            chains[k] = zero + 0.001f * k; \
+        } \
+        \
+        for (i = 0; i < iterations; i++) { \
+            for (k = 0; k < PROBE_CHAINS; k++) { \
+                chains[k] = chains[k] * x + y; \
+            } \
+        } \
+        \
+        for (k = 0; k < PROBE_CHAINS; k++) { \
+            total += chains[k]; \
+        } \
+        \
+        for (k = 1; k < (int) (sizeof(vector_t) / sizeof(float)); k++) { \
+            total[0] += total[k]; \
+        } \
+        \
+        return total[0]; \
+    }
+
+#if defined(__x86_64__)
+PROBE_FMA(probe_fma_avx512, __attribute__((target("avx512f"))), probe_v16_t)
+PROBE_FMA(probe_fma_avx2, __attribute__((target("avx2,fma"))), probe_v8_t)
+#endif
+PROBE_FMA(probe_fma_baseline, , probe_v4_t)
+
+typedef float (* probe_fma_t)(uint64_t iterations);
+
+/**
+ * The widest probe the CPU runs, with its lanes.
+ */
+static probe_fma_t probe_select(const char ** isa, int * lanes)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) {
+        *isa = "avx512";
+        *lanes = 16;
+        return probe_fma_avx512;
+    }
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *isa = "avx2";
+        *lanes = 8;
+        return probe_fma_avx2;
+    }
+#endif
+
+    *isa = "baseline";
+    *lanes = 4;
+    return probe_fma_baseline;
+}
+
+/**
+ * Best floating point operations per second of the FMA probe on threads
+ * threads, each running the same number of iterations.
+ */
+static double probe_peak(bench_t * bench, probe_fma_t probe, int lanes, uint64_t iterations, int threads)
+{
+    double best = 0.0, start, elapsed;
+    int r;
+
+    for (r = 0; r < BENCH_PROBE_REPEATS; r++) {
+        start = omp_get_wtime();
+
+        #pragma omp parallel num_threads(threads)
+        {
+            float result = probe(iterations);
+
+            #pragma omp single nowait
+            bench->sink = result;
+        }
+
+        elapsed = omp_get_wtime() - start;
+
+        if (elapsed > 0.0 && threads * 2.0 * PROBE_CHAINS * lanes * iterations / elapsed > best) {
+            best = threads * 2.0 * PROBE_CHAINS * lanes * iterations / elapsed;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Best bytes per second of the STREAM triad a = b + s * c on threads threads,
+ * counting the two arrays read and the one written (not the write-allocate
+ * reads of a, as STREAM does not).
+ */
+static double probe_triad(float * a, const float * b, const float * c, size_t n, int threads)
+{
+    const float scalar = 3.0f;
+    double best = 0.0, start, elapsed;
+    size_t i;
+    int r;
+
+    for (r = 0; r < BENCH_PROBE_REPEATS; r++) {
+        start = omp_get_wtime();
+
+        #pragma omp parallel for simd schedule(static) num_threads(threads)
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] + scalar * c[i];
+        }
+
+        elapsed = omp_get_wtime() - start;
+
+        if (elapsed > 0.0 && 3.0 * n * sizeof(float) / elapsed > best) {
+            best = 3.0 * n * sizeof(float) / elapsed;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Measure both ceilings on one thread and on every OpenMP thread.
+ */
+static void probe_machine(bench_t * bench, const bench_config_t * config, bench_machine_t * machine)
+{
+    const int threads[2] = { 1, omp_get_max_threads() };
+    const size_t n = config->probe_bytes / (3 * sizeof(float));
+    float * a = bench_alloc(n * sizeof(float));
+    float * b = bench_alloc(n * sizeof(float));
+    float * c = bench_alloc(n * sizeof(float));
+    uint64_t iterations = 1 << 16;
+    probe_fma_t probe;
+    double start;
+    size_t i;
+    int lanes, t;
+
+    probe = probe_select(&machine->isa, &lanes);
+
+    // Long enough that starting the threads does not count
+    for (;;) {
+        start = omp_get_wtime();
+        bench->sink = probe(iterations);
+
+        if (omp_get_wtime() - start >= config->min_time || iterations >= (1ULL << 40)) {
+            break;
+        }
+
+        iterations *= 2;
+    }
+
+    // Placed by the threads that stream them, as the triad splits them
+    #pragma omp parallel for simd schedule(static)
+    for (i = 0; i < n; i++) {
+        a[i] = 0.0f;
+        b[i] = 1.0f;
+        c[i] = 2.0f;
+    }
+
+    for (t = 0; t < 2; t++) {
+        machine->peak[t] = probe_peak(bench, probe, lanes, iterations, threads[t]);
+        machine->bandwidth[t] = probe_triad(a, b, c, n, threads[t]);
+    }
+
+    bench->sink = a[n / 2];
+
+    free(a);
+    free(b);
+    free(c);
+}
+
+#pragma GCC pop_options
+
+/**
+ * Place a measured kernel under the ceilings of the threads it runs on: the
+ * attainable rate is the lower of the peak and the bandwidth times the
+ * kernel's operations per byte, and the kernel is bound by whichever that is.
+ */
+static void roofline_report(const bench_case_t * benchmark, const bench_result_t * result, const bench_machine_t * machine,
+    uint32_t count, FILE * csv)
+{
+    const int ceiling = benchmark->parallel ? 1 : 0;
+    const int threads = benchmark->parallel ? omp_get_max_threads() : 1;
+    const double intensity = benchmark->bytes > 0.0 ? benchmark->flops / benchmark->bytes : 0.0;
+    const double flops = result->median > 0.0 ? benchmark->flops / result->median : 0.0;
+    const double bytes = result->median > 0.0 ? benchmark->bytes / result->median : 0.0;
+    const double memory_roof = intensity * machine->bandwidth[ceiling];
+    const double attainable = memory_roof < machine->peak[ceiling] ? memory_roof : machine->peak[ceiling];
+    const char * bound = memory_roof < machine->peak[ceiling] ? "memory" : "compute";
+    char name[128];
+
+    snprintf(name, sizeof(name), "%s/%s", benchmark->kernel, benchmark->variant);
+    printf("%-34s%8d%10.3f%10.2f%10.2f%12.2f%9.1f%%  %s\n", name, threads, intensity, flops / 1e9, bytes / 1e9, attainable / 1e9,
+        attainable > 0.0 ? 100.0 * flops / attainable : 0.0, bound);
+    fflush(stdout);
+
+    if (NULL != csv) {
+        fprintf(csv, "%s,%s,%d,%d,%d,%u,%.6g,%.6g,%.6g,%.4f,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%s\n", benchmark->kernel, benchmark->variant,
+            MNIST_IMAGE_WIDTH, MNIST_IMAGE_HEIGHT, threads, count, benchmark->flops, benchmark->bytes, intensity, result->median * 1e6,
+            flops / 1e9, bytes / 1e9, machine->peak[ceiling] / 1e9, machine->bandwidth[ceiling] / 1e9, attainable / 1e9,
+            attainable > 0.0 ? flops / attainable : 0.0, bound);
+        fflush(csv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const int optimizer_indices[BENCH_OPTIMIZERS] = { 0, 1, 2, 3 };
+    static const char * optimizer_names[BENCH_OPTIMIZERS] = { "sgd", "momentum", "nesterov", "adam" };
+    // Operations per parameter of every optimizer's update
+    static const double optimizer_flops[BENCH_OPTIMIZERS] = { 2, 5, 7, 14 };
+    static const int reduce_variants[2] = { 0, 1 };
+    bench_config_t config = {
+        .samples = BENCH_SAMPLES,
+        .warmup = BENCH_WARMUP,
+        .min_time = BENCH_MIN_TIME,
+        .json = 0,
+        .header = 1,
+        .filter = NULL,
+        .roofline = 0,
+        .output = BENCH_ROOFLINE_OUTPUT,
+        .probe_bytes = (size_t) BENCH_PROBE_MB << 20
+    };
+    bench_case_t benchmarks[32];
+    bench_result_t result;
+    bench_machine_t machine;
+    bench_t bench;
+    FILE * csv = NULL;
+    const char * hidden = BENCH_HIDDEN;
+    uint32_t count = BENCH_IMAGES;
+    double n = MNIST_IMAGE_SIZE, network, parameters, tiles, mlp_images, weights, first, hypothesis, gradient_update, softmax;
+    char name[128];
+    int i, v, benchmark_count = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--images") && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--hidden") && i + 1 < argc) {
+            hidden = argv[++i];
+        } else if (0 == strcmp(argv[i], "--samples") && i + 1 < argc) {
+            config.samples = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            config.warmup = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            config.min_time = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--filter") && i + 1 < argc) {
+            config.filter = argv[++i];
+        } else if (0 == strcmp(argv[i], "--json")) {
+            config.json = 1;
+        } else if (0 == strcmp(argv[i], "--no-header")) {
+            config.header = 0;
+        } else if (0 == strcmp(argv[i], "--roofline")) {
+            config.roofline = 1;
+        } else if (0 == strcmp(argv[i], "--output") && i + 1 < argc) {
+            config.output = argv[++i];
+        } else if (0 == strcmp(argv[i], "--probe-mb") && i + 1 < argc) {
+            config.probe_bytes = (size_t) atoi(argv[++i]) << 20;
+        } else {
+            fprintf(stderr, "Usage: %s [--images N] [--hidden SIZES] [--samples N] [--warmup N] [--min-time SECONDS] [--filter TEXT] [--json] [--no-header] "
+                "[--roofline [--output CSV] [--probe-mb N]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (count < 1 || config.samples < 1 || config.samples > BENCH_MAX_SAMPLES || config.warmup < 0) {
+        fprintf(stderr, "--images and --samples must be positive, --samples at most %d\n", BENCH_MAX_SAMPLES);
+        return EXIT_FAILURE;
+    }
+
+    if (config.probe_bytes < 3 * sizeof(float)) {
+        fprintf(stderr, "--probe-mb must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_init(&bench, count, hidden);
+
+    // Bytes every kernel reads and writes, counting the network once per
+    // image for the softmax kernels and once per tile of MNIST_MLP_TILE
+    // images for the batched ones, as if nothing stayed in cache
+    network = (n * MNIST_LABELS + MNIST_LABELS) * sizeof(float);
+    parameters = bench.mlp.parameters * sizeof(float);
+    tiles = ceil((double) count / MNIST_MLP_TILE);
+    mlp_images = (double) count * n;
+
+    // Operations, counting multiply-adds as two and the softmax's subtraction,
+    // exponential, sum and division as one each; the pixel scaling, biases
+    // and activations are left out. Back propagation forms the gradient of
+    // every layer's weights and the deltas of every layer but the first
+    weights = 0.0;
+
+    for (i = 0; i < bench.mlp.layers; i++) {
+        weights += (double) bench.mlp.sizes[i] * bench.mlp.sizes[i + 1];
+    }
+
+    first = (double) bench.mlp.sizes[0] * bench.mlp.sizes[1];
+    softmax = 4.0 * MNIST_LABELS;
+    hypothesis = 2.0 * n * MNIST_LABELS + softmax;
+    gradient_update = hypothesis + 2.0 * n * MNIST_LABELS;
+
+    benchmarks[benchmark_count++] = (bench_case_t) { "hypothesis", "softmax", run_hypothesis, NULL, count, count * (n + network), count * hypothesis, 0 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "gradient_update", "softmax", run_gradient_update, NULL, count, count * (n + 3 * network), count * gradient_update, 0 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "gradient_update", "softmax-parallel", run_accumulate_parallel, &schedules[0], count, count * (n + 3 * network),
+        count * gradient_update, 1 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "gradient_update", "softmax-steal", run_accumulate_parallel, &schedules[1], count, count * (n + 3 * network),
+        count * gradient_update, 1 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "softmax", "softmax", run_softmax, NULL, count, count * 2.0 * MNIST_LABELS * sizeof(float), count * softmax, 0 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "update", "softmax-sgd", run_model_update, NULL, 0, 3 * network, 3.0 * (n + 1) * MNIST_LABELS, 0 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "training_step", "softmax", run_model_training_step, NULL, count, count * (n + 3 * network) + 4 * network,
+        count * gradient_update + 3.0 * (n + 1) * MNIST_LABELS, 0 };
+
+    for (v = 0; v < 4; v++) {
+        const double weights = (variants[v] & VARIANT_BF16) ? parameters / 2 : parameters;
+        const double round = (variants[v] & VARIANT_BF16) ? parameters * 1.5 : 0.0;
+        const double working = (variants[v] & VARIANT_BF16) ? parameters / 2 : parameters;
+        const int parallel = (variants[v] & VARIANT_PARALLEL) ? 1 : 0;
+
+        // Inference has no parallel variant of its own
+        if (!parallel) {
+            benchmarks[benchmark_count++] = (bench_case_t) { "hypothesis", variant_names[v], run_mlp_probabilities, &variants[v], count,
+                mlp_images + tiles * working + count * MNIST_LABELS * sizeof(float), count * (2.0 * weights + softmax), 0 };
+        }
+
+        benchmarks[benchmark_count++] = (bench_case_t) { "gradient_update", variant_names[v], run_mlp_accumulate, &variants[v], count,
+            mlp_images + tiles * (working + 2 * parameters), count * (6.0 * weights - 2.0 * first + softmax), parallel };
+        benchmarks[benchmark_count++] = (bench_case_t) { "training_step", variant_names[v], run_mlp_training_step, &variants[v], count,
+            mlp_images + tiles * (working + 2 * parameters) + 4 * parameters + round,
+            count * (6.0 * weights - 2.0 * first + softmax) + optimizer_flops[0] * bench.mlp.parameters, parallel };
+    }
+
+    for (v = 0; v < BENCH_OPTIMIZERS; v++) {
+        const double moments = MNIST_OPTIMIZER_ADAM == bench.optimizers[v]->config.type ? 2 : (MNIST_OPTIMIZER_SGD == bench.optimizers[v]->config.type ? 0 : 1);
+
+        benchmarks[benchmark_count++] = (bench_case_t) { "update", optimizer_names[v], run_optimizer_step, &optimizer_indices[v], 0, (3 + 2 * moments) * parameters,
+            optimizer_flops[v] * bench.mlp.parameters, 1 };
+    }
+
+    benchmarks[benchmark_count++] = (bench_case_t) { "reduce", "fp32", run_reduce, &reduce_variants[0], 0, 3 * parameters, bench.mlp.parameters, 0 };
+    benchmarks[benchmark_count++] = (bench_case_t) { "reduce", "bf16", run_reduce, &reduce_variants[1], 0, 1.5 * parameters, bench.mlp.parameters, 0 };
+
+    if (config.roofline) {
+        csv = fopen(config.output, "w");
+
+        if (NULL == csv) {
+            fprintf(stderr, "Could not open %s for the roofline\n", config.output);
+            bench_free(&bench);
+            return EXIT_FAILURE;
+        }
+
+        probe_machine(&bench, &config, &machine);
+
+        printf("Peak (%s FMA): %.2f GFLOP/s on 1 thread, %.2f on %d\n", machine.isa, machine.peak[0] / 1e9, machine.peak[1] / 1e9, omp_get_max_threads());
+        printf("Triad bandwidth: %.2f GB/s on 1 thread, %.2f on %d\n", machine.bandwidth[0] / 1e9, machine.bandwidth[1] / 1e9, omp_get_max_threads());
+        printf("Ridge point: %.2f flop/byte on 1 thread, %.2f on %d\n\n", machine.peak[0] / machine.bandwidth[0], machine.peak[1] / machine.bandwidth[1],
+            omp_get_max_threads());
+        printf("%-34s%8s%10s%10s%10s%12s%10s  %s\n", "kernel", "threads", "flop/B", "GFLOP/s", "GB/s", "attainable", "of roof", "bound");
+        fprintf(csv, "kernel,variant,width,height,threads,batch,flops,bytes,intensity,median_us,gflops,gb_per_s,peak_gflops,bandwidth_gb_per_s,attainable_gflops,"
+            "efficiency,bound\n");
+    } else if (config.header && !config.json) {
+        printf("kernel,variant,width,height,threads,batch,repetitions,samples,median_us,iqr_us,images_per_s,gb_per_s\n");
+    }
+
+    for (i = 0; i < benchmark_count; i++) {
+        snprintf(name, sizeof(name), "%s/%s", benchmarks[i].kernel, benchmarks[i].variant);
+
+        if (NULL != config.filter && NULL == strstr(name, config.filter)) {
+            continue;
+        }
+
+        measure(&bench, &benchmarks[i], &config, &result);
+
+        if (config.roofline) {
+            roofline_report(&benchmarks[i], &result, &machine, count, csv);
+        } else {
+            report(&benchmarks[i], &config, &result, count);
+        }
+    }
+
+    if (NULL != csv) {
+        fclose(csv);
+    }
+
+    bench_free(&bench);
+
+    return 0;
+}
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/mnist_serve.h"
+
+/**
+ * Load generator for the --serve mode of the trainers: opens connections to
+ * the server's socket and sends images, either keeping a fixed number of
+ * requests in flight on every connection (closed loop) or at a fixed rate
+ * whatever the replies (open loop), and reports the latency the clients see.
+ * The images are those of an IDX file, or random pixels; with the labels the
+ * replies are also checked against them.
+ */
+
+typedef struct loadgen_t_ {
+    const char * socket_path;
+    uint8_t * images;        // NULL for random pixels
+    uint8_t * labels;
+    uint32_t image_count;
+    uint32_t image_size;
+    uint32_t requests;       // Over all connections
+    int connections;
+    int depth;               // Requests in flight per connection, closed loop
+    double rate;             // Requests per second over all connections, open loop
+    double start;
+    double * sent;           // Time every request was (due to be) sent
+    double * latencies;
+    uint64_t correct;
+    pthread_mutex_t lock;
+} loadgen_t;
+
+typedef struct client_t_ {
+    loadgen_t * loadgen;
+    int index;
+    int fd;
+    uint32_t first;          // Requests [first, first + count) are this client's
+    uint32_t count;
+    uint32_t labels;
+    uint32_t received;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t replied;
+    pthread_t thread;
+} client_t;
+
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static int io_all(int fd, void * data, size_t bytes, int writing)
+{
+    uint8_t * next = data;
+    ssize_t done;
+
+    while (bytes > 0) {
+        done = writing ? write(fd, next, bytes) : read(fd, next, bytes);
+
+        if (done < 0 && EINTR == errno) {
+            continue;
+        } else if (done <= 0) {
+            return -1;
+        }
+
+        next += done;
+        bytes -= done;
+    }
+
+    return 0;
+}
+
+static uint32_t read_be32(FILE * file)
+{
+    uint8_t bytes[4] = { 0 };
+
+    if (1 != fread(bytes, 4, 1, file)) {
+        return 0;
+    }
+
+    return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+/**
+ * Read an IDX image file, and its labels if a path is given.
+ */
+static int read_idx(loadgen_t * loadgen, const char * image_path, const char * label_path)
+{
+    FILE * images = fopen(image_path, "rb"), * labels = NULL;
+    uint32_t rows, columns;
+
+    if (NULL == images || 0x00000803 != read_be32(images)) {
+        fprintf(stderr, "Could not read IDX images from %s\n", image_path);
+        return -1;
+    }
+
+    loadgen->image_count = read_be32(images);
+    rows = read_be32(images);
+    columns = read_be32(images);
+    loadgen->image_size = rows * columns;
+    loadgen->images = malloc((size_t) loadgen->image_count * loadgen->image_size);
+
+    if (NULL == loadgen->images || 1 != fread(loadgen->images, (size_t) loadgen->image_count * loadgen->image_size, 1, images)) {
+        fprintf(stderr, "Could not read %u images from %s\n", loadgen->image_count, image_path);
+        fclose(images);
+        return -1;
+    }
+
+    fclose(images);
+
+    if (NULL == label_path) {
+        return 0;
+    }
+
+    labels = fopen(label_path, "rb");
+
+    if (NULL == labels || 0x00000801 != read_be32(labels) || read_be32(labels) < loadgen->image_count) {
+        fprintf(stderr, "Could not read IDX labels from %s\n", label_path);
+        return -1;
+    }
+
+    loadgen->labels = malloc(loadgen->image_count);
+
+    if (NULL == loadgen->labels || 1 != fread(loadgen->labels, loadgen->image_count, 1, labels)) {
+        fprintf(stderr, "Could not read %u labels from %s\n", loadgen->image_count, label_path);
+        fclose(labels);
+        return -1;
+    }
+
+    fclose(labels);
+
+    return 0;
+}
+
+/**
+ * Send this client's requests, paced by the rate or by the replies.
+ */
+static void * sender_main(void * arg)
+{
+    client_t * client = arg;
+    loadgen_t * loadgen = client->loadgen;
+    const size_t request_bytes = sizeof(uint32_t) + loadgen->image_size;
+    uint8_t * request = malloc(request_bytes);
+    uint64_t random = 0x9E3779B97F4A7C15ULL * (client->index + 1);
+    struct timespec pause;
+    double due, wait;
+    uint32_t k, id, i;
+
+    if (NULL == request) {
+        client->failed = 1;
+        return NULL;
+    }
+
+    for (k = 0; k < client->count; k++) {
+        id = client->first + k;
+
+        if (loadgen->rate > 0.0) {
+            // Interleave the connections' schedules at the total rate
+            due = loadgen->start + ((double) k * loadgen->connections + client->index) / loadgen->rate;
+            wait = due - now();
+
+            if (wait > 0.0) {
+                pause.tv_sec = (time_t) wait;
+                pause.tv_nsec = (long) ((wait - (double) pause.tv_sec) * 1e9);
+                nanosleep(&pause, NULL);
+            }
+
+            // Latency counts from when the request was due, so a server that
+            // falls behind is charged for the queueing it causes
+            loadgen->sent[id] = due;
+        } else {
+            pthread_mutex_lock(&client->lock);
+
+            while (k - client->received >= (uint32_t) loadgen->depth && !client->failed) {
+                pthread_cond_wait(&client->replied, &client->lock);
+            }
+
+            pthread_mutex_unlock(&client->lock);
+            loadgen->sent[id] = now();
+        }
+
+        memcpy(request, &id, sizeof(uint32_t));
+
+        if (NULL != loadgen->images) {
+            memcpy(request + sizeof(uint32_t), loadgen->images + (size_t) (id % loadgen->image_count) * loadgen->image_size, loadgen->image_size);
+        } else {
+            for (i = 0; i < loadgen->image_size; i++) {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                request[sizeof(uint32_t) + i] = (uint8_t) random;
+            }
+        }
+
+        if (client->failed || 0 != io_all(client->fd, request, request_bytes, 1)) {
+            client->failed = 1;
+            break;
+        }
+    }
+
+    free(request);
+
+    return NULL;
+}
+
+/**
+ * Connect, then receive the replies while the sender runs.
+ */
+static void * client_main(void * arg)
+{
+    client_t * client = arg;
+    loadgen_t * loadgen = client->loadgen;
+    struct sockaddr_un address;
+    mnist_serve_hello_t hello;
+    pthread_t sender;
+    float * probabilities = NULL;
+    uint32_t id, o, predict, correct = 0;
+    double received_at;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, loadgen->socket_path, sizeof(address.sun_path) - 1);
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (client->fd < 0 || 0 != connect(client->fd, (struct sockaddr *) &address, sizeof(address)) || 0 != io_all(client->fd, &hello, sizeof(hello), 0)) {
+        fprintf(stderr, "Could not connect to %s: %s\n", loadgen->socket_path, strerror(errno));
+        client->failed = 1;
+    } else if (hello.image_size != loadgen->image_size) {
+        fprintf(stderr, "The server takes images of %u pixels, not %u\n", hello.image_size, loadgen->image_size);
+        client->failed = 1;
+    }
+
+    if (client->failed) {
+        if (client->fd >= 0) {
+            close(client->fd);
+        }
+
+        return NULL;
+    }
+
+    client->labels = hello.labels;
+    probabilities = malloc(hello.labels * sizeof(float));
+
+    if (NULL == probabilities || 0 != pthread_create(&sender, NULL, sender_main, client)) {
+        client->failed = 1;
+        free(probabilities);
+        return NULL;
+    }
+
+    while (client->received < client->count) {
+        if (0 != io_all(client->fd, &id, sizeof(uint32_t), 0) || 0 != io_all(client->fd, probabilities, hello.labels * sizeof(float), 0) ||
+            id < client->first || id >= client->first + client->count) {
+            fprintf(stderr, "Connection %d lost after %u replies\n", client->index, client->received);
+            break;
+        }
+
+        received_at = now();
+        loadgen->latencies[id] = received_at - loadgen->sent[id];
+
+        for (o = 1, predict = 0; o < hello.labels; o++) {
+            predict = probabilities[o] > probabilities[predict] ? o : predict;
+        }
+
+        correct += NULL != loadgen->labels && predict == loadgen->labels[id % loadgen->image_count];
+
+        pthread_mutex_lock(&client->lock);
+        client->received++;
+        pthread_cond_signal(&client->replied);
+        pthread_mutex_unlock(&client->lock);
+    }
+
+    // Unblock a sender still waiting for replies that will not come
+    pthread_mutex_lock(&client->lock);
+    client->failed |= client->received < client->count;
+    pthread_cond_signal(&client->replied);
+    pthread_mutex_unlock(&client->lock);
+
+    shutdown(client->fd, SHUT_RDWR);
+    pthread_join(sender, NULL);
+    close(client->fd);
+    free(probabilities);
+
+    pthread_mutex_lock(&loadgen->lock);
+    loadgen->correct += correct;
+    pthread_mutex_unlock(&loadgen->lock);
+
+    return NULL;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char * argv[])
+{
+    loadgen_t loadgen = {
+        .image_size = 28 * 28,
+        .requests = 10000,
+        .connections = 1,
+        .depth = 1
+    };
+    const char * image_path = NULL, * label_path = NULL;
+    client_t * clients;
+    uint64_t received = 0;
+    double elapsed, sum = 0.0;
+    int i, failed = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--socket") && i + 1 < argc) {
+            loadgen.socket_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--images") && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--labels") && i + 1 < argc) {
+            label_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--image-size") && i + 1 < argc) {
+            loadgen.image_size = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--requests") && i + 1 < argc) {
+            loadgen.requests = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--connections") && i + 1 < argc) {
+            loadgen.connections = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--depth") && i + 1 < argc) {
+            loadgen.depth = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--rate") && i + 1 < argc) {
+            loadgen.rate = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s --socket PATH [--images FILE [--labels FILE] | --image-size PIXELS] [--requests N] [--connections C] [--depth D | --rate R]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (NULL == loadgen.socket_path || loadgen.connections <= 0 || loadgen.connections > MNIST_SERVE_MAX_CLIENTS || loadgen.depth <= 0 || 0 == loadgen.requests) {
+        fprintf(stderr, "Need --socket, 1 to %d connections, a positive depth and requests\n", MNIST_SERVE_MAX_CLIENTS);
+        return EXIT_FAILURE;
+    }
+
+    if (NULL != image_path && 0 != read_idx(&loadgen, image_path, label_path)) {
+        return EXIT_FAILURE;
+    }
+
+    loadgen.sent = calloc(loadgen.requests, sizeof(double));
+    loadgen.latencies = calloc(loadgen.requests, sizeof(double));
+    clients = calloc(loadgen.connections, sizeof(client_t));
+
+    if (NULL == loadgen.sent || NULL == loadgen.latencies || NULL == clients) {
+        fprintf(stderr, "Could not allocate memory for %u requests\n", loadgen.requests);
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&loadgen.lock, NULL);
+    loadgen.start = now();
+
+    for (i = 0; i < loadgen.connections; i++) {
+        clients[i].loadgen = &loadgen;
+        clients[i].index = i;
+        clients[i].first = (uint64_t) loadgen.requests * i / loadgen.connections;
+        clients[i].count = (uint64_t) loadgen.requests * (i + 1) / loadgen.connections - clients[i].first;
+        pthread_mutex_init(&clients[i].lock, NULL);
+        pthread_cond_init(&clients[i].replied, NULL);
+
+        if (0 != pthread_create(&clients[i].thread, NULL, client_main, &clients[i])) {
+            fprintf(stderr, "Could not start connection %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < loadgen.connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        failed |= clients[i].failed;
+    }
+
+    elapsed = now() - loadgen.start;
+
+    // Keep the latencies of the answered requests only
+    for (i = 0; i < loadgen.connections; i++) {
+        memmove(loadgen.latencies + received, loadgen.latencies + clients[i].first, clients[i].received * sizeof(double));
+        received += clients[i].received;
+    }
+
+    qsort(loadgen.latencies, received, sizeof(double), compare_doubles);
+
+    for (i = 0; (uint64_t) i < received; i++) {
+        sum += loadgen.latencies[i];
+    }
+
+    printf("Requests: %lu of %u over %d connections in %.3f seconds\n", (unsigned long) received, loadgen.requests, loadgen.connections, elapsed);
+    printf("Throughput: %.1f requests/second\n", received / elapsed);
+
+    if (received > 0) {
+        printf("Latency p50: %.1f us, p90: %.1f us, p99: %.1f us, max: %.1f us, mean: %.1f us\n",
+            loadgen.latencies[(received - 1) / 2] * 1e6, loadgen.latencies[(received - 1) * 90 / 100] * 1e6,
+            loadgen.latencies[(received - 1) * 99 / 100] * 1e6, loadgen.latencies[received - 1] * 1e6, sum / received * 1e6);
+    }
+
+    if (NULL != loadgen.labels && received > 0) {
+        printf("Accuracy: %.6f\n", (double) loadgen.correct / received);
+    }
+
+    free(loadgen.images);
+    free(loadgen.labels);
+    free(loadgen.sent);
+    free(loadgen.latencies);
+    free(clients);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+import argparse
+import csv
+import json
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+
+REPOSITORY = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# How every backend is started; {ranks} is replaced by the processes of a run
+LAUNCHERS = {
+    "serial": "",
+    "threads": "",
+    "mpi_openmp": "mpirun -np {ranks}",
+    "ompcluster": "mpirun -np {ranks} remote-proxy-device : -np 1",
+}
+
+# Backends that the driver of another build runs when --backend selects them
+DIRECTORIES = {
+    "threads": "serial",
+}
+
+# Backends that run on a single process
+SINGLE_PROCESS = ["serial", "threads"]
+
+FIELDS = ["mode", "backend", "size", "ranks", "threads", "workers", "train_images", "steps",
+          "step_time", "step_time_iqr", "images_per_second", "accuracy", "total_duration", "mean_iteration_time",
+          "time_to_accuracy", "steps_to_accuracy", "speedup", "efficiency"]
+
+# Columns of the stats.csv files the job scripts used to scrape together
+LEGACY_FIELDS = ["Binary", "Nodes", "Final Accuracy", "Total Duration", "Mean Iteration Time"]
+
+
+def parse_list(text, kind=str):
+    """Split a comma separated command line value."""
+    return [kind(item) for item in text.split(",") if item]
+
+
+def read_records(path):
+    """Read the JSON lines a training binary wrote with --records."""
+    run, steps, summary = None, [], None
+    with open(path) as f:
+        for line in f:
+            record = json.loads(line)
+            if record["record"] == "run":
+                run = record
+            elif record["record"] == "step":
+                steps.append(record)
+            elif record["record"] == "summary":
+                summary = record
+    if run is None or summary is None:
+        raise ValueError(f"{path} holds no complete run")
+    return run, steps, summary
+
+
+def step_times(steps, skip):
+    """Step times after the first few, which pay for warming up caches."""
+    times = [step["time"] for step in steps]
+    return times[skip:] if len(times) > skip else times
+
+
+def run_once(args, backend, size, ranks, threads, train_images, path):
+    """Run one configuration and return its records."""
+    directory = os.path.join(REPOSITORY, DIRECTORIES.get(backend, backend))
+    binary = os.path.abspath(os.path.join(args.bin_dir or os.path.join(directory, "bin"), f"mnist-{size}"))
+    launcher = args.launcher if args.launcher is not None else LAUNCHERS[backend]
+    command = shlex.split(launcher.format(ranks=ranks, threads=threads)) + [binary,
+        "--steps", str(args.steps), "--records", path] + shlex.split(args.args)
+    if backend in DIRECTORIES:
+        command += ["--backend", backend]
+    if train_images > 0:
+        command += ["--train-images", str(train_images)]
+
+    environment = dict(os.environ, OMP_NUM_THREADS=str(threads))
+    with open(path + ".log", "w") as log:
+        result = subprocess.run(command, stdout=log, stderr=subprocess.STDOUT, env=environment,
+                                cwd=args.workdir or directory)
+    if result.returncode != 0:
+        raise RuntimeError(f"{' '.join(command)} failed with status {result.returncode}, see {path}.log")
+    return read_records(path)
+
+
+def measure(args, backend, size, ranks, threads, train_images):
+    """Run a configuration --repeats times and keep the fastest repetition."""
+    best = None
+    for repeat in range(args.repeats):
+        path = os.path.join(args.records_dir, f"{args.mode}-{backend}-{size}-r{ranks}-t{threads}-{repeat}.jsonl")
+        run, steps, summary = run_once(args, backend, size, ranks, threads, train_images, path)
+        times = sorted(step_times(steps, args.skip))
+        quartiles = statistics.quantiles(times, n=4) if len(times) > 1 else [times[0]] * 3
+        row = {
+            "mode": args.mode,
+            "backend": backend,
+            "size": size,
+            "ranks": run["processes"],
+            "threads": run["threads"],
+            "workers": run["processes"] * run["threads"],
+            "train_images": run["train_images"],
+            "steps": len(steps),
+            "step_time": statistics.median(times),
+            "step_time_iqr": quartiles[2] - quartiles[0],
+            "images_per_second": run["train_images"] / statistics.median(times),
+            "accuracy": summary["accuracy"],
+            "total_duration": summary["total_duration"],
+            "mean_iteration_time": summary["mean_iteration_time"],
+            # Only runs with --target-accuracy that reached it
+            "time_to_accuracy": summary.get("time_to_accuracy", ""),
+            "steps_to_accuracy": summary.get("steps_to_accuracy", ""),
+        }
+        if best is None or row["step_time"] < best["step_time"]:
+            best = row
+    return best
+
+
+def add_scaling(rows, mode):
+    """
+    Speedup and parallel efficiency of every row against the row of the same
+    backend and image size with the fewest workers. Strong scaling keeps the
+    problem fixed, so the speedup is the ratio of step times; weak scaling
+    grows it with the workers, so the efficiency is that ratio and the speedup
+    is the scaled one.
+    """
+    for row in rows:
+        peers = [other for other in rows if (other["backend"], other["size"]) == (row["backend"], row["size"])]
+        base = min(peers, key=lambda other: (other["workers"], other["step_time"]))
+        scale = row["workers"] / base["workers"]
+        ratio = base["step_time"] / row["step_time"]
+        if mode == "strong":
+            row["speedup"], row["efficiency"] = ratio, ratio / scale
+        else:
+            row["speedup"], row["efficiency"] = ratio * scale, ratio
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Strong and weak scaling sweeps of the MNIST training binaries.")
+    parser.add_argument("--mode", choices=["strong", "weak"], default="strong",
+                        help="Keep the training set fixed (strong) or grow it with the workers (weak).")
+    parser.add_argument("--backends", default="serial,mpi_openmp", help="Comma separated backends to sweep.")
+    parser.add_argument("--sizes", default="1x", help="Comma separated image sizes: 1x, 2x, 4x.")
+    parser.add_argument("--ranks", default="1,2,4", help="Comma separated process counts; serial and threads run one.")
+    parser.add_argument("--threads", default="1", help="Comma separated OpenMP thread counts.")
+    parser.add_argument("--train-images", type=int, default=0,
+                        help="Training images of strong scaling runs, 0 for the whole training set.")
+    parser.add_argument("--images-per-worker", type=int, default=5000,
+                        help="Training images per process and thread of weak scaling runs.")
+    parser.add_argument("--steps", type=int, default=10, help="Training steps of every run.")
+    parser.add_argument("--skip", type=int, default=1, help="Steps left out of the step time.")
+    parser.add_argument("--repeats", type=int, default=1, help="Runs of every configuration, the fastest is kept.")
+    parser.add_argument("--launcher", default=None,
+                        help="Command prefix starting a binary, with {ranks} and {threads}, instead of the backend's own.")
+    parser.add_argument("--args", default="", help="Further arguments for the training binaries.")
+    parser.add_argument("--bin-dir", default=None, help="Directory of the binaries instead of <backend>/bin.")
+    parser.add_argument("--workdir", default=None,
+                        help="Directory the binaries run in, which their dataset paths are relative to, instead of <backend>.")
+    parser.add_argument("--records-dir", default="scaling", help="Directory for the records and logs of every run.")
+    parser.add_argument("--output", default="scaling.csv", help="CSV file of the results.")
+    parser.add_argument("--legacy-output", default=None,
+                        help="Also write the results in the columns of the old output/stats.csv files.")
+    args = parser.parse_args()
+
+    os.makedirs(args.records_dir, exist_ok=True)
+    args.records_dir = os.path.abspath(args.records_dir)
+    rows = []
+
+    for backend in parse_list(args.backends):
+        for size in parse_list(args.sizes):
+            for ranks in [1] if backend in SINGLE_PROCESS else parse_list(args.ranks, int):
+                for threads in parse_list(args.threads, int):
+                    workers = ranks * threads
+                    train_images = args.train_images if args.mode == "strong" else args.images_per_worker * workers
+                    row = measure(args, backend, size, ranks, threads, train_images)
+                    rows.append(row)
+                    print(f"{backend} {size} ranks={row['ranks']} threads={row['threads']} images={row['train_images']}: "
+                          f"{row['step_time']:.6f} s/step, {row['images_per_second']:.0f} images/s", file=sys.stderr)
+
+    add_scaling(rows, args.mode)
+
+    with open(args.output, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+
+    if args.legacy_output:
+        with open(args.legacy_output, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(LEGACY_FIELDS)
+            for row in rows:
+                writer.writerow([f"mnist-{row['size']}", row["ranks"], f"{row['accuracy']:.6f}",
+                                 f"{row['total_duration']:.6f}", f"{row['mean_iteration_time']:.6f}"])
+
+    print(f"{'backend':<12}{'size':<6}{'ranks':>6}{'threads':>8}{'images':>8}{'s/step':>11}{'speedup':>9}{'efficiency':>11}")
+    for row in rows:
+        print(f"{row['backend']:<12}{row['size']:<6}{row['ranks']:>6}{row['threads']:>8}{row['train_images']:>8}"
+              f"{row['step_time']:>11.6f}{row['speedup']:>9.2f}{row['efficiency']:>11.2f}")
+
+
+if __name__ == "__main__":
+    main()